@@ -38,6 +38,11 @@
 
 #define AR0134_I2C_ADDR		0x20
 
+/* Pixel clock, and line length and fine integration time of tight timings */
+#define AR0134_PIXEL_CLOCK	74250000
+#define AR0134_TIGHT_LLPCK	1388
+#define AR0134_TIGHT_FINE_IT	646
+
 static inline int ar0134_read_reg(libusb_device_handle *devh, uint16_t reg,
 				  uint16_t *val)
 {
@@ -106,6 +111,28 @@ int ar0134_set_gain(libusb_device_handle *devh, uint16_t gain)
 	return ar0134_write_reg(devh, AR0134_GLOBAL_GAIN, gain);
 }
 
+/*
+ * Sets the coarse integration time in lines and the global gain using a
+ * single batch of asynchronous I2C writes. This does not block and can be
+ * called from transfer callbacks. The new values take effect with the next
+ * frame started after the writes completed.
+ */
+int ar0134_set_exposure_gain_async(libusb_device_handle *devh,
+				   esp770u_submit_fn submit, void *owner,
+				   uint16_t coarse_integration_time,
+				   uint16_t gain,
+				   void (*done)(void *user_data, int status),
+				   void *user_data)
+{
+	const uint16_t regs[] = {
+		AR0134_COARSE_INTEGRATION_TIME, coarse_integration_time,
+		AR0134_GLOBAL_GAIN, gain,
+	};
+
+	return esp770u_i2c_write_batch(devh, submit, owner, AR0134_I2C_ADDR,
+				       regs, 2, done, user_data);
+}
+
 static int ar0134_set_window(libusb_device_handle *devh, uint16_t x_start,
 			     uint16_t y_start, uint16_t x_end, uint16_t y_end)
 {
@@ -142,7 +169,7 @@ int ar0134_set_timings(libusb_device_handle *devh, bool tight)
 
 	/* Set minimum supported pixel clocks per line */
 	ret = ar0134_write_reg(devh, AR0134_LINE_LENGTH_PCK,
-			       tight ? 1388 : 1498);
+			       tight ? AR0134_TIGHT_LLPCK : 1498);
 	if (ret < 0)
 		return ret;
 	ret = ar0134_read_reg(devh, AR0134_DIGITAL_TEST, &val);
@@ -174,7 +201,17 @@ int ar0134_set_timings(libusb_device_handle *devh, bool tight)
 	if (ret < 0)
 		return ret;
 	return ar0134_write_reg(devh, AR0134_FINE_INTEGRATION_TIME,
-				tight ? 646 : 0);
+				tight ? AR0134_TIGHT_FINE_IT : 0);
+}
+
+/*
+ * Returns the exposure time in ns for the given coarse integration time,
+ * with the tight timings set by ar0134_set_timings().
+ */
+uint64_t ar0134_exposure_time_ns(uint16_t coarse_integration_time)
+{
+	return (AR0134_TIGHT_LLPCK * coarse_integration_time +
+		AR0134_TIGHT_FINE_IT) * 1000000000ULL / AR0134_PIXEL_CLOCK;
 }
 
 /*
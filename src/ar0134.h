@@ -10,10 +10,19 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "esp770u.h"
+
 int ar0134_init(libusb_device_handle *devh);
 int ar0134_set_gain(libusb_device_handle *devh, uint16_t gain);
+int ar0134_set_exposure_gain_async(libusb_device_handle *devh,
+				   esp770u_submit_fn submit, void *owner,
+				   uint16_t coarse_integration_time,
+				   uint16_t gain,
+				   void (*done)(void *user_data, int status),
+				   void *user_data);
 int ar0134_set_ae(libusb_device_handle *devh, bool enabled);
 int ar0134_set_timings(libusb_device_handle *devh, bool tight);
 int ar0134_set_sync(libusb_device_handle *devh, bool enabled);
+uint64_t ar0134_exposure_time_ns(uint16_t coarse_integration_time);
 
 #endif /* __AR0134_H__ */
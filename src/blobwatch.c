@@ -12,13 +12,12 @@
 #include "blobwatch.h"
 #include "debug.h"
 #include "flicker.h"
+#include "kernels.h"
 
 struct leds;
 
 #include <stdio.h>
 
-#define THRESHOLD 0x9f
-
 #define NUM_FRAMES_HISTORY	2
 #define MAX_EXTENTS_PER_LINE	11
 
@@ -26,23 +25,39 @@ struct leds;
 #define min(x, y) ((x) < (y) ? (x) : (y))
 #define max(x, y) ((x) > (y) ? (x) : (y))
 
+/*
+ * Contiguous range of pixels above the threshold in a single scanline.
+ * index refers to the accumulator of the blob the extent is part of.
+ */
 struct extent {
 	uint16_t start;
 	uint16_t end;
-	/* inherited parameters */
+	uint16_t index;
+};
+
+struct extent_row {
+	uint16_t num;
+	struct extent extents[MAX_EXTENTS_PER_LINE];
+};
+
+/*
+ * Bounding box and area of a blob, accumulated over its extents.
+ */
+struct blob_accumulator {
 	uint16_t top;
 	uint16_t left;
 	uint16_t right;
-	uint8_t index;
 	uint32_t area;
 };
 
-struct extent_line {
-	struct extent extents[MAX_EXTENTS_PER_LINE];
-	uint16_t num;
-	uint16_t padding[3];
-};
+typedef void (*process_frame_fn)(const uint8_t *lines, int width, int top,
+				 int bottom, uint8_t threshold,
+				 struct extent_row rows[2],
+				 struct blob_accumulator *acc,
+				 const struct kernels *kernels,
+				 struct blobservation *ob);
 
+static process_frame_fn process_frame_select(int width);
 
 /*
  * Blob detector internal state
@@ -50,9 +65,19 @@ struct extent_line {
 struct blobwatch {
 	int width;
 	int height;
+	const struct kernels *kernels;
+	process_frame_fn process_frame;
 	int last_observation;
+	int roi_top;
+	int roi_bottom;
+	unsigned int skipped_frames;
+	uint8_t threshold;
+	int max_aspect;
+	int flicker_hysteresis;
 	struct blobservation history[NUM_FRAMES_HISTORY];
-	struct extent_line *el;
+	/* Only the current and the previous scanline are kept */
+	struct extent_row rows[2];
+	struct blob_accumulator acc[MAX_BLOBS_PER_FRAME];
 	bool debug;
 };
 
@@ -79,69 +104,133 @@ struct blobwatch *blobwatch_new(int width, int height)
 	memset(bw, 0, sizeof(*bw));
 	bw->width = width;
 	bw->height = height;
+	bw->kernels = kernels_get();
+	bw->process_frame = process_frame_select(width);
 	bw->last_observation = -1;
+	bw->roi_bottom = height;
+	bw->threshold = BLOBWATCH_THRESHOLD;
+	bw->max_aspect = BLOBWATCH_MAX_ASPECT;
+	bw->flicker_hysteresis = BLOBWATCH_FLICKER_HYSTERESIS;
 	bw->debug = true;
-	bw->el = calloc(height, sizeof(*bw->el));
 
 	return bw;
 }
 
 /*
- * Stores blob information collected in the last extent e into the blob
- * array b at index e->index.
+ * Sets the brightness threshold, the maximum aspect ratio of tracked blobs,
+ * and the flicker detection hysteresis in percent, to be used starting with
+ * the next frame.
+ */
+void blobwatch_set_params(struct blobwatch *bw, uint8_t threshold,
+			  int max_aspect, int flicker_hysteresis)
+{
+	bw->threshold = threshold;
+	bw->max_aspect = max_aspect;
+	bw->flicker_hysteresis = flicker_hysteresis;
+}
+
+/*
+ * Returns the brightness threshold currently used for blob detection.
+ */
+uint8_t blobwatch_get_threshold(struct blobwatch *bw)
+{
+	return bw->threshold;
+}
+
+/*
+ * Restricts blob detection to the scanlines from top to bottom, exclusive.
+ * An empty range selects the whole frame.
  */
-static inline void store_blob(struct extent *e, int y, struct blob *b)
+void blobwatch_set_roi(struct blobwatch *bw, int top, int bottom)
 {
-	b += e->index;
-	b->x = (e->left + e->right) / 2;
-	b->y = (e->top + y) / 2;
+	if (top < 0)
+		top = 0;
+	if (bottom > bw->height)
+		bottom = bw->height;
+	if (top >= bottom) {
+		top = 0;
+		bottom = bw->height;
+	}
+
+	bw->roi_top = top;
+	bw->roi_bottom = bottom;
+}
+
+/*
+ * Notifies the blob tracker that num_frames frames were dropped before the
+ * next processed frame.
+ */
+void blobwatch_skip_frames(struct blobwatch *bw, unsigned int num_frames)
+{
+	bw->skipped_frames += num_frames;
+}
+
+/*
+ * Frees the blobwatch structure.
+ */
+void blobwatch_free(struct blobwatch *bw)
+{
+	if (!bw)
+		return;
+
+	free(bw);
+}
+
+/*
+ * Stores blob information collected in the accumulator a into the blob b.
+ */
+static inline void store_blob(const struct blob_accumulator *a, int y,
+			      struct blob *b)
+{
+	b->x = (a->left + a->right) / 2;
+	b->y = (a->top + y) / 2;
 	b->vx = 0;
 	b->vy = 0;
-	b->width = e->right - e->left + 1;
-	b->height = y - e->top + 1;
-	b->area = e->area;
+	b->width = a->right - a->left + 1;
+	b->height = y - a->top + 1;
+	b->area = a->area;
 	b->age = 0;
 	b->track_index = -1;
 	b->pattern = 0;
+	b->pattern_valid = 0;
 	b->led_id = -1;
 }
 
 /*
- * Collects contiguous ranges of pixels with values larger than a threshold of
- * 0x9f in a given scanline and stores them in extents. Processing stops after
- * num_extents.
- * Extents are marked with the same index as overlapping extents of the previous
- * scanline, and properties of the formed blobs are accumulated.
+ * Collects contiguous ranges of pixels with values larger than the threshold
+ * in a given scanline and stores them in row. Processing stops after
+ * MAX_EXTENTS_PER_LINE extents.
+ * Extents overlapping an extent of the previous scanline are added to the
+ * same blob accumulator, other extents start a new blob, unless the maximum
+ * number of blobs is reached. Blobs that are not continued in this scanline
+ * are finished and stored into the blob array.
  *
- * Returns the number of extents found.
+ * Returns the number of blobs started so far.
  */
-static int process_scanline(uint8_t *line, int width, int height, int y,
-			    struct extent_line *el, struct extent_line *prev_el,
-			    int index, struct blobservation *ob)
+static inline __attribute__((always_inline))
+int process_scanline(const uint8_t *line, int width, int y, uint8_t threshold,
+		     struct extent_row *row, const struct extent_row *prev,
+		     struct blob_accumulator *acc, int index,
+		     struct blob *blobs, const struct kernels *kernels)
 {
-	struct extent *le_end = prev_el->extents;
-	struct extent *le = prev_el->extents;
-	struct extent *extent = el->extents;
-	struct blob *blobs = ob->blobs;
-	int num_extents = MAX_EXTENTS_PER_LINE;
-	int num_blobs = MAX_BLOBS_PER_FRAME;
-	int center;
-	int x, e = 0;
-
-	if (prev_el)
-		le_end += prev_el->num;
-
-	for (x = 0; x < width; x++) {
-		int start, end;
-
-		/* Loop until pixel value exceeds threshold */
-		if (line[x] <= THRESHOLD)
-			continue;
+	const struct extent *le = prev->extents;
+	const struct extent *le_end = le + prev->num;
+	struct extent *extent = row->extents;
+	int x = 0, e = 0;
+
+	while (x < width) {
+		struct blob_accumulator *a;
+		int start, end, center;
+
+		/* Skip ahead until pixel value exceeds threshold */
+		x += kernels->find_bright(line + x, width - x, threshold);
+		if (x == width)
+			break;
 
 		start = x++;
 
 		/* Loop until pixel value falls below threshold */
-		while (x < width && line[x] > THRESHOLD)
+		while (x < width && line[x] > threshold)
 			x++;
 
 		end = x - 1;
@@ -151,97 +240,160 @@ static int process_scanline(uint8_t *line, int width, int height, int y,
 
 		center = (start + end) / 2;
 
-		extent->start = start;
-		extent->end = end;
-		extent->index = index;
-		extent->area = x - start;
-
-		if (prev_el && index < num_blobs) {
-			/*
-			 * Previous extents without significant overlap are the
-			 * bottom of finished blobs. Store them into an array.
-			 */
-			while (le < le_end && le->end < center &&
-			       le->index < num_blobs)
-				store_blob(le++, y, blobs);
+		/*
+		 * Previous extents without significant overlap are the
+		 * bottom of finished blobs. Store them into an array.
+		 */
+		while (le < le_end && le->end < center) {
+			store_blob(&acc[le->index], y, &blobs[le->index]);
+			le++;
+		}
 
+		if (le < le_end && le->start <= center && le->end > center) {
 			/*
 			 * A previous extent with significant overlap is
 			 * considered to be part of the same blob.
 			 */
-			if (le < le_end &&
-			    le->start <= center && le->end > center) {
-				extent->top = le->top;
-				extent->left = min(extent->start, le->left);
-				extent->right = max(extent->end, le->right);
-				extent->area += le->area;
-				extent->index = le->index;
-				le++;
-			}
+			extent->index = le->index;
+			a = &acc[le->index];
+			a->left = min(start, a->left);
+			a->right = max(end, a->right);
+			a->area += x - start;
+			le++;
+		} else {
+			/* Otherwise start a new blob, if there is space */
+			if (index == MAX_BLOBS_PER_FRAME)
+				continue;
+			extent->index = index;
+			a = &acc[index++];
+			a->top = y;
+			a->left = start;
+			a->right = end;
+			a->area = x - start;
 		}
 
-		/*
-		 * If this extent is not part of a previous blob, increment the
-		 * blob index.
-		 */
-		if (extent->index == index) {
-			extent->top = y;
-			extent->left = extent->start;
-			extent->right = extent->end;
-			index++;
-		}
+		extent->start = start;
+		extent->end = end;
 
-		if (++e == num_extents)
+		if (++e == MAX_EXTENTS_PER_LINE)
 			break;
 		extent++;
 	}
 
-	if (prev_el) {
-		/*
-		 * If there are no more extents on this line, all remaining
-		 * extents in the previous line are finished blobs. Store them.
-		 */
-		while (le < le_end && le->index < num_blobs)
-			store_blob(le++, y, blobs);
+	/*
+	 * If there are no more extents on this line, all remaining extents in
+	 * the previous line are finished blobs. Store them.
+	 */
+	for (; le < le_end; le++)
+		store_blob(&acc[le->index], y, &blobs[le->index]);
+
+	row->num = e;
+
+	return index;
+}
+
+/*
+ * Collects extents from the scanlines from top to bottom in a frame,
+ * alternating between the two extent rows, and stores the finished blobs
+ * in the observation ob.
+ */
+static inline __attribute__((always_inline))
+void process_frame(const uint8_t *lines, int width, int top, int bottom,
+		   uint8_t threshold, struct extent_row rows[2],
+		   struct blob_accumulator *acc, const struct kernels *kernels,
+		   struct blobservation *ob)
+{
+	struct extent_row *row = &rows[0];
+	struct extent_row *prev = &rows[1];
+	struct extent_row *tmp;
+	int index = 0;
+	int i, y;
+
+	prev->num = 0;
+	lines += top * width;
+
+	for (y = top; y < bottom; y++) {
+		index = process_scanline(lines, width, y, threshold, row, prev,
+					 acc, index, ob->blobs, kernels);
+		tmp = prev;
+		prev = row;
+		row = tmp;
+		lines += width;
 	}
 
-	el->num = e;
+	/* All extents of the last line are finished blobs, too. */
+	for (i = 0; i < prev->num; i++) {
+		const struct extent *extent = &prev->extents[i];
 
-	if (y == height - 1) {
-		/* All extents of the last line are finished blobs, too. */
-		for (extent = el->extents; extent < el->extents + el->num;
-		     extent++) {
-			if (extent->index < num_blobs)
-				store_blob(extent, y, blobs);
-		}
+		store_blob(&acc[extent->index], bottom - 1,
+			   &ob->blobs[extent->index]);
 	}
 
-	return index;
+	ob->num_blobs = index;
 }
 
 /*
- * Collects extents from all scanlines in a frame and stores them in
- * the extent_line array el.
+ * Detector instances specialized for the widths of the supported cameras:
+ * HoloLens camera2 (640 per eye), DK2 (752), and CV1 Sensor or HoloLens
+ * (1280). Dark runs are still skipped by the dispatched find_bright kernel;
+ * the compile-time width lets the compiler fold the line and frame address
+ * arithmetic and the end of line checks around it.
  */
-static void process_frame(uint8_t *lines, int width, int height,
-			  struct extent_line *el, struct blobservation *ob)
+#define DEFINE_PROCESS_FRAME(w)						\
+static void process_frame_##w(const uint8_t *lines, int width, int top,\
+			      int bottom, uint8_t threshold,		\
+			      struct extent_row rows[2],		\
+			      struct blob_accumulator *acc,		\
+			      const struct kernels *kernels,		\
+			      struct blobservation *ob)			\
+{									\
+	(void)width;							\
+	process_frame(lines, w, top, bottom, threshold, rows, acc,	\
+		      kernels, ob);					\
+}
+
+DEFINE_PROCESS_FRAME(640)
+DEFINE_PROCESS_FRAME(752)
+DEFINE_PROCESS_FRAME(1280)
+
+/*
+ * Generic detector instance for all other widths.
+ */
+static void process_frame_any(const uint8_t *lines, int width, int top,
+			      int bottom, uint8_t threshold,
+			      struct extent_row rows[2],
+			      struct blob_accumulator *acc,
+			      const struct kernels *kernels,
+			      struct blobservation *ob)
 {
-	struct extent_line *last_el;
-	int index = 0;
-	int y;
+	process_frame(lines, width, top, bottom, threshold, rows, acc, kernels,
+		      ob);
+}
 
-	ob->num_blobs = 0;
+static const struct {
+	int width;
+	process_frame_fn process_frame;
+} process_frame_variants[] = {
+	{ 640, process_frame_640 },
+	{ 752, process_frame_752 },
+	{ 1280, process_frame_1280 },
+};
 
-	index = process_scanline(lines, width, height, 0, el, NULL, 0, ob);
+/*
+ * Returns the detector instance specialized for the given width, or the
+ * generic one.
+ */
+static process_frame_fn process_frame_select(int width)
+{
+	unsigned int i;
 
-	for (y = 1; y < height; y++) {
-		last_el = el++;
-		lines += width;
-		index = process_scanline(lines, width, height, y, el, last_el,
-					 index, ob);
+	for (i = 0; i < sizeof(process_frame_variants) /
+			sizeof(process_frame_variants[0]); i++) {
+		if (process_frame_variants[i].width == width)
+			return process_frame_variants[i].process_frame;
 	}
 
-	ob->num_blobs = min(MAX_BLOBS_PER_FRAME, index);
+	return process_frame_any;
 }
 
 /*
@@ -271,14 +423,21 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 	int current = (last + 1) % NUM_FRAMES_HISTORY;
 	struct blobservation *ob = &bw->history[current];
 	struct blobservation *last_ob = &bw->history[last];
-	struct extent_line *el = bw->el;
+	process_frame_fn process = bw->process_frame;
+	int steps = bw->skipped_frames + 1;
 	int i, j;
 
-	process_frame(frame, width, height, el, ob);
+	/* Fall back to the generic detector if the frame size changed */
+	if (width != bw->width)
+		process = process_frame_any;
+
+	process(frame, width, bw->roi_top, bw->roi_bottom, bw->threshold,
+		bw->rows, bw->acc, bw->kernels, ob);
 
 	/* If there is no previous observation, our work is done here */
 	if (bw->last_observation == -1) {
 		bw->last_observation = current;
+		bw->skipped_frames = 0;
 		if (output)
 			*output = NULL;
 		return;
@@ -294,9 +453,9 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 	for (i = 0; i < ob->num_blobs; i++) {
 		struct blob *b2 = &ob->blobs[i];
 
-		/* Filter out tall and wide (<= 1:2, >= 2:1) blobs */
-		if (2 * b2->width <= b2->height ||
-		    b2->width >= 2 * b2->height)
+		/* Filter out tall and wide (<= 1:2, >= 2:1 by default) blobs */
+		if (bw->max_aspect * b2->width <= b2->height ||
+		    b2->width >= bw->max_aspect * b2->height)
 			continue;
 
 		for (j = 0; j < last_ob->num_blobs; j++) {
@@ -304,8 +463,8 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 			int x, y, dx, dy;
 
 			/* Estimate b1's next position */
-			x = b1->x + b1->vx;
-			y = b1->y + b1->vy;
+			x = b1->x + b1->vx * steps;
+			y = b1->y + b1->vy * steps;
 
 			/* Absolute distance */
 			dx = abs(x - b2->x);
@@ -326,10 +485,11 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 				b2->track_index = b1->track_index;
 				ob->tracked[b2->track_index] = i + 1;
 				b2->pattern = b1->pattern;
+				b2->pattern_valid = b1->pattern_valid;
 				b2->led_id = b1->led_id;
 			}
-			b2->vx = b2->x - b1->x;
-			b2->vy = b2->y - b1->y;
+			b2->vx = (b2->x - b1->x) / steps;
+			b2->vy = (b2->y - b1->y) / steps;
 			b2->last_area = b1->area;
 			break;
 		}
@@ -362,6 +522,7 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 	if (rift_flicker) {
 		/* Identify blobs by their blinking pattern */
 		flicker_process(ob->blobs, ob->num_blobs, led_pattern_phase,
+				bw->skipped_frames, bw->flicker_hysteresis,
 				leds);
 	}
 
@@ -370,4 +531,5 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 		*output = ob;
 
 	bw->last_observation = current;
+	bw->skipped_frames = 0;
 }
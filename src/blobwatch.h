@@ -13,6 +13,13 @@ struct leds;
 
 #define MAX_BLOBS_PER_FRAME  42
 
+/* Pixels brighter than this are considered part of a blob */
+#define BLOBWATCH_THRESHOLD	0x9f
+/* Blobs at least this much wider than tall, or vice versa, are not tracked */
+#define BLOBWATCH_MAX_ASPECT	2
+/* Blob area change in percent interpreted as LED blinking edge */
+#define BLOBWATCH_FLICKER_HYSTERESIS	10
+
 struct blob {
 	/* center of bounding box */
 	uint16_t x;
@@ -27,6 +34,7 @@ struct blob {
 	uint32_t age;
 	int16_t track_index;
 	uint16_t pattern;
+	uint16_t pattern_valid;
 	int8_t led_id;
 };
 
@@ -43,6 +51,12 @@ struct blobservation {
 struct blobwatch;
 
 struct blobwatch *blobwatch_new(int width, int height);
+void blobwatch_free(struct blobwatch *bw);
+void blobwatch_set_roi(struct blobwatch *bw, int top, int bottom);
+void blobwatch_skip_frames(struct blobwatch *bw, unsigned int num_frames);
+void blobwatch_set_params(struct blobwatch *bw, uint8_t threshold,
+			  int max_aspect, int flicker_hysteresis);
+uint8_t blobwatch_get_threshold(struct blobwatch *bw);
 void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 		       int width, int height, uint8_t led_pattern_phase,
 		       struct leds *leds, struct blobservation **output);
@@ -0,0 +1,212 @@
+/*
+ * Per-camera tracking latency budget
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blobwatch.h"
+#include "budget.h"
+
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+
+/* Weight of the newest measurement in the smoothed costs */
+#define COST_ALPHA		0.1
+/* Scan the whole frame at least this often to pick up new objects */
+#define FULL_SCAN_INTERVAL	30
+/* Region of interest margin around predicted blob positions in pixels */
+#define ROI_MARGIN		32
+
+double tracking_latency_target;
+
+static double budget_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static double budget_smooth(double avg, double value)
+{
+	if (avg == 0.0)
+		return value;
+
+	return avg + COST_ALPHA * (value - avg);
+}
+
+void tracking_budget_init(struct tracking_budget *budget,
+			  double frame_interval, int height)
+{
+	memset(budget, 0, sizeof(*budget));
+	budget->frame_interval = frame_interval;
+	tracking_budget_set_target(budget, 0.0);
+	tracking_budget_set_solver(budget, TRACKING_SOLVER_MIN_ITERATIONS,
+				   TRACKING_SOLVER_MAX_ITERATIONS,
+				   TRACKING_SOLVER_CONFIDENCE);
+	budget->inlier_ratio = 0.5;
+	budget->height = height;
+	budget->roi_bottom = height;
+}
+
+/*
+ * Sets the latency target per frame in seconds. If target is 0, the
+ * tracking_latency_target override or the frame interval is used.
+ */
+void tracking_budget_set_target(struct tracking_budget *budget, double target)
+{
+	if (target <= 0.0)
+		target = tracking_latency_target;
+	if (target <= 0.0)
+		target = budget->frame_interval;
+	budget->target = target;
+}
+
+/*
+ * Sets the RANSAC iteration limits and the confidence used to derive the
+ * number of iterations from the inlier ratio.
+ */
+void tracking_budget_set_solver(struct tracking_budget *budget,
+				int min_iterations, int max_iterations,
+				double confidence)
+{
+	budget->min_iterations = min_iterations;
+	budget->max_iterations = max(max_iterations, min_iterations);
+	budget->confidence = confidence;
+}
+
+/*
+ * Accounts the previous frame and chooses the blob detection mode for the
+ * current frame. The whole frame is scanned as long as that fits into the
+ * latency target together with a minimal solver run. Otherwise only the
+ * rows around the blobs predicted from the previous frame are scanned,
+ * with a periodic full scan to find objects entering the view.
+ */
+void tracking_budget_begin_frame(struct tracking_budget *budget)
+{
+	double full_cost = budget->detect_cost * budget->height;
+	double min_solve = budget->solve_cost * budget->min_iterations;
+
+	if (budget->frames++ && budget->elapsed > budget->target)
+		budget->overruns++;
+
+	budget->frame_start = budget_now();
+	budget->elapsed = 0.0;
+
+	if (full_cost + min_solve <= budget->target ||
+	    budget->next_bottom <= budget->next_top ||
+	    budget->frames_since_full >= FULL_SCAN_INTERVAL) {
+		budget->mode = DETECTION_FULL;
+		budget->roi_top = 0;
+		budget->roi_bottom = budget->height;
+		budget->frames_since_full = 0;
+	} else {
+		budget->mode = DETECTION_ROI;
+		budget->roi_top = budget->next_top;
+		budget->roi_bottom = budget->next_bottom;
+		budget->frames_since_full++;
+	}
+}
+
+/*
+ * Updates the scanline cost and predicts the rows containing blobs in the
+ * next frame from their current positions and velocities.
+ */
+void tracking_budget_end_detection(struct tracking_budget *budget,
+				   const struct blobservation *ob)
+{
+	int rows = budget->roi_bottom - budget->roi_top;
+	int top = budget->height;
+	int bottom = 0;
+	int i;
+
+	budget->elapsed = budget_now() - budget->frame_start;
+	if (rows > 0) {
+		budget->detect_cost = budget_smooth(budget->detect_cost,
+						    budget->elapsed / rows);
+	}
+
+	for (i = 0; ob && i < ob->num_blobs; i++) {
+		const struct blob *b = &ob->blobs[i];
+		int y = b->y + b->vy;
+		int margin = ROI_MARGIN + abs(b->vy) + b->height / 2;
+
+		top = min(top, y - margin);
+		bottom = max(bottom, y + margin + 1);
+	}
+
+	budget->next_top = max(top, 0);
+	budget->next_bottom = min(bottom, budget->height);
+}
+
+/*
+ * Returns the number of RANSAC iterations each of num_objects pose
+ * estimations may use in the current frame, or 0 if there is not enough
+ * time left to run the solver at all. The number of iterations is chosen
+ * to reach the solver confidence given the recently observed inlier ratio,
+ * and reduced to fit into the remaining time.
+ */
+int tracking_budget_solver_iterations(struct tracking_budget *budget,
+				      int num_objects)
+{
+	double w = budget->inlier_ratio;
+	double remaining;
+	int iterations;
+
+	if (num_objects <= 0)
+		return 0;
+
+	w = w < 0.1 ? 0.1 : w > 0.99 ? 0.99 : w;
+	iterations = ceil(log(1.0 - budget->confidence) /
+			  log(1.0 - w * w * w * w));
+	iterations = min(max(iterations, budget->min_iterations),
+			 budget->max_iterations);
+
+	budget->solver_start = budget_now();
+
+	if (budget->solve_cost > 0.0) {
+		remaining = budget->target - (budget->solver_start -
+					      budget->frame_start);
+		remaining /= budget->solve_cost * num_objects;
+		if (remaining < budget->min_iterations) {
+			/*
+			 * Keep the previous pose instead of queueing frames.
+			 * Let the cost estimate decay, so the solver is tried
+			 * again once the load goes down.
+			 */
+			budget->solve_cost *= 1.0 - COST_ALPHA;
+			budget->skipped_solves++;
+			return 0;
+		}
+		if (iterations > remaining)
+			iterations = remaining;
+	}
+
+	return iterations;
+}
+
+/*
+ * Updates the per-iteration solver cost and the inlier ratio after a total
+ * of iterations RANSAC iterations. An inlier ratio of 0 means that no pose
+ * could be estimated.
+ */
+void tracking_budget_end_solver(struct tracking_budget *budget,
+				int iterations, double inlier_ratio)
+{
+	double now = budget_now();
+
+	budget->elapsed = now - budget->frame_start;
+	if (iterations > 0) {
+		budget->solve_cost = budget_smooth(budget->solve_cost,
+				(now - budget->solver_start) / iterations);
+	}
+	if (inlier_ratio > 0.0) {
+		budget->inlier_ratio = budget_smooth(budget->inlier_ratio,
+						     inlier_ratio);
+	}
+}
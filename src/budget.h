@@ -0,0 +1,76 @@
+/*
+ * Per-camera tracking latency budget
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __BUDGET_H__
+#define __BUDGET_H__
+
+struct blobservation;
+
+/* Default RANSAC iteration limits and target confidence, see solvePnPRansac */
+#define TRACKING_SOLVER_MIN_ITERATIONS	8
+#define TRACKING_SOLVER_MAX_ITERATIONS	100
+#define TRACKING_SOLVER_CONFIDENCE	0.95
+
+enum detection_mode {
+	DETECTION_FULL,
+	DETECTION_ROI,
+};
+
+/*
+ * Measured per-stage processing cost and pose confidence of a single camera,
+ * and the blob detection mode, region of interest, and solver iteration count
+ * derived from them for the current frame.
+ */
+struct tracking_budget {
+	/* Latency target per frame in seconds */
+	double target;
+	double frame_interval;
+
+	/* RANSAC iteration limits and target confidence */
+	int min_iterations;
+	int max_iterations;
+	double confidence;
+
+	/* Smoothed cost per scanline and per RANSAC iteration in seconds */
+	double detect_cost;
+	double solve_cost;
+	/* Smoothed fraction of RANSAC inliers */
+	double inlier_ratio;
+
+	double frame_start;
+	double solver_start;
+	double elapsed;
+
+	enum detection_mode mode;
+	int height;
+	int roi_top;
+	int roi_bottom;
+	int next_top;
+	int next_bottom;
+	int frames_since_full;
+
+	unsigned int frames;
+	unsigned int overruns;
+	unsigned int skipped_solves;
+};
+
+/* Latency target override in seconds, 0 to use the frame interval */
+extern double tracking_latency_target;
+
+void tracking_budget_init(struct tracking_budget *budget,
+			  double frame_interval, int height);
+void tracking_budget_set_target(struct tracking_budget *budget, double target);
+void tracking_budget_set_solver(struct tracking_budget *budget,
+				int min_iterations, int max_iterations,
+				double confidence);
+void tracking_budget_begin_frame(struct tracking_budget *budget);
+void tracking_budget_end_detection(struct tracking_budget *budget,
+				   const struct blobservation *ob);
+int tracking_budget_solver_iterations(struct tracking_budget *budget,
+				      int num_objects);
+void tracking_budget_end_solver(struct tracking_budget *budget,
+				int iterations, double inlier_ratio);
+
+#endif /* __BUDGET_H__ */
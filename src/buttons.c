@@ -33,3 +33,21 @@ void ouvrt_handle_buttons(uint32_t dev_id, uint32_t buttons,
 
 	telemetry_send_buttons(dev_id, btn_codes, num_buttons);
 }
+
+/*
+ * Returns the mapped button state as a bitmask indexed by OUVRT_BUTTON_*
+ * codes.
+ */
+uint32_t ouvrt_button_state(uint32_t buttons, uint8_t map_length,
+			    const struct button_map *map)
+{
+	uint32_t state = 0;
+	int i;
+
+	for (i = 0; i < map_length; i++) {
+		if (buttons & map[i].bit)
+			state |= 1 << map[i].code;
+	}
+
+	return state;
+}
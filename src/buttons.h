@@ -31,6 +31,18 @@
 #define OUVRT_BUTTON_BACK		22
 #define OUVRT_TOUCH_THUMB		23
 
+#define OUVRT_AXIS_STICK_X		0
+#define OUVRT_AXIS_STICK_Y		1
+#define OUVRT_AXIS_TRIGGER		2
+#define OUVRT_AXIS_GRIP			3
+#define OUVRT_AXIS_CAP_STICK		4
+#define OUVRT_AXIS_CAP_B_Y		5
+#define OUVRT_AXIS_CAP_TRIGGER		6
+#define OUVRT_AXIS_CAP_A_X		7
+#define OUVRT_AXIS_CAP_REST		8
+#define OUVRT_AXIS_TOUCHPAD_X		9
+#define OUVRT_AXIS_TOUCHPAD_Y		10
+
 struct button_map {
 	uint32_t bit;
 	uint8_t code;
@@ -39,5 +51,7 @@ struct button_map {
 void ouvrt_handle_buttons(uint32_t dev_id, uint32_t buttons,
 			  uint32_t last_buttons, uint8_t map_length,
 			  const struct button_map *map);
+uint32_t ouvrt_button_state(uint32_t buttons, uint8_t map_length,
+			    const struct button_map *map);
 
 #endif /* __BUTTON_H__ */
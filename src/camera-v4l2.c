@@ -9,22 +9,39 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
-#include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "blobwatch.h"
+#include "budget.h"
 #include "camera-v4l2.h"
 #include "debug.h"
+#include "frame-pool.h"
+#include "kernels.h"
+#include "params.h"
+#include "recorder.h"
 #include "tracker.h"
 
+/* Spare frames that can be held by recorder and debug stream */
+#define CAMERA_V4L2_SPARE_FRAMES	4
+
 struct _OuvrtCameraV4L2Private {
-	uint32_t offset[3];
-	void *buf[3];
+	struct frame_pool *pool;
+	/* Frames currently queued to the driver, by buffer index */
+	struct frame *frames[3];
+	unsigned int num_buffers;
+	uint64_t exposure_time;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(OuvrtCameraV4L2, ouvrt_camera_v4l2,
 			   OUVRT_TYPE_CAMERA)
 
+/*
+ * If set, only the newest of all ready buffers is processed, and stale
+ * buffers are requeued immediately instead of adding latency.
+ */
+bool camera_v4l2_drop_stale_frames;
+
 /*
  * Opens the V4L2 device and checks that it supports video streaming.
  */
@@ -62,6 +79,43 @@ static int ouvrt_camera_v4l2_open(OuvrtDevice *dev)
 	return 0;
 }
 
+/*
+ * Queues free pool frames into all driver buffers that are not queued, as
+ * their previous frames are handed off to the processing pipeline after
+ * dequeueing. If the pool is exhausted, the buffer stays empty until one of
+ * the consumers releases a frame.
+ */
+static void ouvrt_camera_v4l2_queue_frames(OuvrtDevice *dev)
+{
+	OuvrtCameraV4L2Private *priv = OUVRT_CAMERA_V4L2(dev)->priv;
+	struct frame *frame;
+	unsigned int i;
+
+	for (i = 0; i < priv->num_buffers; i++) {
+		struct v4l2_buffer buf = {
+			.index = i,
+			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			.memory = V4L2_MEMORY_USERPTR,
+		};
+
+		if (priv->frames[i])
+			continue;
+
+		frame = frame_pool_alloc(priv->pool);
+		if (!frame)
+			break;
+
+		buf.m.userptr = (unsigned long)frame->data;
+		buf.length = frame->size;
+		if (ioctl(dev->fd, VIDIOC_QBUF, &buf) < 0) {
+			g_print("v4l2: QBUF error: %d\n", errno);
+			frame_unref(frame);
+			break;
+		}
+		priv->frames[i] = frame;
+	}
+}
+
 /*
  * Requests buffers and starts streaming.
  *
@@ -95,12 +149,14 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 	struct v4l2_requestbuffers reqbufs = {
 		.count = 3,
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-		.memory = V4L2_MEMORY_MMAP,
+		.memory = V4L2_MEMORY_USERPTR,
+	};
+	struct v4l2_control ctrl = {
+		.id = V4L2_CID_EXPOSURE_ABSOLUTE,
 	};
 	__u32 prio = V4L2_PRIORITY_RECORD;
 	int fd = dev->fd;
 	int ret;
-	unsigned int i;
 
 	if (v4l2->pixelformat == V4L2_PIX_FMT_GREY)
 		format.fmt.pix.bytesperline = width;
@@ -119,10 +175,15 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 	if (ret < 0)
 		g_print("v4l2: S_PARM error: %d\n", errno);
 
-	if (1 /* DEBUG */) {
-		reqbufs.memory = V4L2_MEMORY_USERPTR;
-		camera->sizeimage += sizeof(struct ouvrt_debug_attachment);
-	}
+	/* Exposure time in units of 100 µs, if the driver reports it */
+	ret = ioctl(fd, VIDIOC_G_CTRL, &ctrl);
+	priv->exposure_time = (ret == 0) ? ctrl.value * 100000ULL : 0;
+
+	/*
+	 * Frames are captured directly into pool buffers, with space for the
+	 * debug attachment behind the image.
+	 */
+	camera->sizeimage += sizeof(struct ouvrt_debug_attachment);
 
 	ret = ioctl(fd, VIDIOC_REQBUFS, &reqbufs);
 	if (ret < 0)
@@ -139,30 +200,14 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 		parm.parm.capture.timeperframe.numerator,
 		reqbufs.count, format.fmt.pix.sizeimage);
 
-	for (i = 0; i < reqbufs.count; i++) {
-		struct v4l2_buffer buf;
-
-		buf.index = i;
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		ret = ioctl(fd, VIDIOC_QUERYBUF, &buf);
-		if (ret < 0)
-			g_print("v4l2: QUERYBUF error\n");
-
-		if (reqbufs.memory == V4L2_MEMORY_MMAP) {
-			priv->buf[i] = mmap(NULL, camera->sizeimage,
-					    PROT_READ | PROT_WRITE,
-					    MAP_SHARED, dev->fd,
-					    buf.m.offset);
-			priv->offset[i] = buf.m.offset;
-		} else if (reqbufs.memory == V4L2_MEMORY_USERPTR) {
-			priv->buf[i] = malloc(camera->sizeimage);
-			buf.m.userptr = (unsigned long)priv->buf[i];
-		}
+	priv->num_buffers = reqbufs.count;
+	priv->pool = frame_pool_new(dev->name, camera->sizeimage,
+				    reqbufs.count + CAMERA_V4L2_SPARE_FRAMES,
+				    frame_pool_flags);
+	if (!priv->pool)
+		return -ENOMEM;
 
-		ret = ioctl(fd, VIDIOC_QBUF, &buf);
-		if (ret < 0)
-			g_print("v4l2: QBUF error\n");
-	}
+	ouvrt_camera_v4l2_queue_frames(dev);
 
 	ret = ioctl(fd, VIDIOC_STREAMON, &format.type);
 	if (ret < 0) {
@@ -194,20 +239,56 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
  */
 static void convert_yuyv_to_grayscale(uint8_t *frame, int width, int height)
 {
-	uint8_t *src, *dst;
-	int x, y;
-
-	for (y = 0, src = frame, dst = frame; y < height; y++) {
-		for (x = 0; x < width; x++)
-			dst[x] = src[2 * x];
+	kernels_get()->yuyv_to_gray(frame, frame, width * height);
+}
 
-		src += 2 * width;
-		dst += width;
+/*
+ * Returns the exposure midpoint of a dequeued buffer in CLOCK_MONOTONIC ns.
+ * Drivers that do not provide monotonic timestamps are treated as if they
+ * had stamped the buffer at end of frame on dequeue. End of frame
+ * timestamps are moved back by one frame interval to approximate the start
+ * of exposure.
+ */
+static uint64_t ouvrt_camera_v4l2_frame_time(OuvrtCameraV4L2 *v4l2,
+					     const struct v4l2_buffer *buf,
+					     const struct timespec *dequeued)
+{
+	OuvrtCamera *camera = OUVRT_CAMERA(v4l2);
+	uint64_t time = buf->timestamp.tv_sec * 1000000000ULL +
+			buf->timestamp.tv_usec * 1000;
+	bool eof = (buf->flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) ==
+		   V4L2_BUF_FLAG_TSTAMP_SRC_EOF;
+
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) !=
+	    V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+		time = dequeued->tv_sec * 1000000000ULL + dequeued->tv_nsec;
+		eof = true;
 	}
+
+	if (eof)
+		time -= 1000000000ULL / camera->framerate;
+
+	return time + v4l2->priv->exposure_time / 2;
 }
 
-static dquat rot;
-static dvec3 trans;
+/*
+ * Dequeues all further ready buffers, keeping only the newest one in buf.
+ * Older buffers are requeued immediately.
+ */
+static void ouvrt_camera_v4l2_dequeue_latest(OuvrtDevice *dev,
+					     struct v4l2_buffer *buf)
+{
+	struct v4l2_buffer next = {
+		.type = buf->type,
+		.memory = buf->memory,
+	};
+
+	while (ioctl(dev->fd, VIDIOC_DQBUF, &next) == 0) {
+		if (ioctl(dev->fd, VIDIOC_QBUF, buf) < 0)
+			g_print("v4l2: QBUF error: %d\n", errno);
+		*buf = next;
+	}
+}
 
 /*
  * Receives frames from the camera and processes them.
@@ -217,22 +298,37 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 	OuvrtCameraV4L2 *v4l2 = OUVRT_CAMERA_V4L2(dev);
 	OuvrtCameraV4L2Private *priv = v4l2->priv;
 	OuvrtCamera *camera = OUVRT_CAMERA(dev);
+	const struct tracking_param_block *params = NULL;
+	struct blobwatch *bw = NULL;
+	struct tracker_pose poses[MAX_TRACKED_OBJECTS];
+	struct recorder *rec;
+	struct tracking_budget budget;
 	struct v4l2_buffer buf;
 	int width = camera->width;
 	int height = camera->height;
 	double timestamps[4];
 	struct timespec tp;
+	struct frame *frame;
 	struct pollfd pfd;
-	void *raw;
+	bool first = true;
+	uint8_t threshold = BLOBWATCH_THRESHOLD;
+	int32_t skipped;
+	uint8_t *raw;
 	int ret;
 
 	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = priv->offset[1] ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+	buf.memory = V4L2_MEMORY_USERPTR;
 
 	pfd.fd = dev->fd;
 	pfd.events = POLLIN;
 
+	tracking_budget_init(&budget, 1.0 / camera->framerate, height);
+	tracker_poses_reset(poses);
+	rec = recorder_new(dev->name, width, height);
+
 	while (dev->active) {
+		ouvrt_camera_v4l2_queue_frames(dev);
+
 		ret = poll(&pfd, 1, 1000);
 		if (ret == -1 || ret == 0) {
 			if (ret == -1)
@@ -253,33 +349,57 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 			break;
 		}
 
+		if (camera_v4l2_drop_stale_frames)
+			ouvrt_camera_v4l2_dequeue_latest(dev, &buf);
+
+		/*
+		 * Count frames dropped by us or by the driver and tell the
+		 * blob tracker, so that it can keep LED patterns consistent.
+		 */
+		skipped = first ? 0 : buf.sequence - camera->sequence - 1;
+		first = false;
+		if (skipped > 0) {
+			camera->skipped_frames += skipped;
+			if (bw)
+				blobwatch_skip_frames(bw, skipped);
+		}
+
 		clock_gettime(CLOCK_MONOTONIC, &tp);
 		timestamps[0] = buf.timestamp.tv_sec + 1e-6 * buf.timestamp.tv_usec;
 		timestamps[1] = tp.tv_sec + 1e-9 * tp.tv_nsec;
 
-		if (buf.memory == V4L2_MEMORY_MMAP) {
-			raw = priv->buf[buf.index];
-			if (buf.m.offset != priv->offset[buf.index])
-				raw = NULL;
-		} else if (buf.memory == V4L2_MEMORY_USERPTR) {
-			raw = (void *)buf.m.userptr;
-			if (raw != priv->buf[buf.index])
-				raw = NULL;
-		} else {
-			raw = NULL;
-		}
-		if (!raw) {
-			g_print("v4l2: DQBUF error: %d, disabling camera\n",
-				errno);
+		/*
+		 * Take the frame out of its buffer slot, the slot is refilled
+		 * from the pool before the next poll.
+		 */
+		frame = buf.index < priv->num_buffers ?
+			priv->frames[buf.index] : NULL;
+		if (!frame || buf.m.userptr != (unsigned long)frame->data) {
+			g_print("v4l2: Dequeued unknown buffer %u, disabling camera\n",
+				buf.index);
 			dev->active = FALSE;
 			break;
 		}
+		priv->frames[buf.index] = NULL;
+		raw = frame->data;
+		frame->timestamp = ouvrt_camera_v4l2_frame_time(v4l2, &buf, &tp);
 
 		if (v4l2->pixelformat == V4L2_PIX_FMT_YUYV)
 			convert_yuyv_to_grayscale(raw, width, height);
 
 		camera->sequence = buf.sequence;
 
+		/*
+		 * Pick up parameter changes first, so that the recording uses
+		 * the same blob detection threshold as the tracker.
+		 */
+		if (dev->config) {
+			params = tracking_config_acquire(dev->config);
+			threshold = params->value[PARAM_BLOB_THRESHOLD];
+		}
+
+		recorder_push(rec, frame, threshold);
+
 		/*
 		 * Find bright blobs in the camera image and identify individual LEDs
 		 * using the estimated pose at time of exposure or, if that is not
@@ -287,12 +407,15 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 		 */
 		struct blobservation *ob = NULL;
 		if (camera->tracker) {
-			uint64_t sof_time = buf.timestamp.tv_sec * 1000000000 +
-					    buf.timestamp.tv_usec * 1000;
-
-			ouvrt_tracker_process_frame(camera->tracker,
-						    raw, width, height,
-						    sof_time, &ob);
+			if (!bw)
+				bw = blobwatch_new(width, height);
+			if (params)
+				tracking_params_apply(params, bw, &budget);
+
+			ouvrt_tracker_process_frame(camera->tracker, dev->id,
+						    bw, &budget, raw, width,
+						    height, frame->timestamp,
+						    &ob);
 		}
 
 		clock_gettime(CLOCK_MONOTONIC, &tp);
@@ -304,11 +427,11 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 			 * blob detector output, intrinsic camera parameters,
 			 * and the known LED positions.
 			 */
-			ouvrt_tracker_process_blobs(camera->tracker, ob->blobs,
-						    ob->num_blobs,
+			ouvrt_tracker_process_blobs(camera->tracker, &budget,
+						    ob->blobs, ob->num_blobs,
 						    &camera->camera_matrix,
 						    camera->dist_coeffs,
-						    &rot, &trans);
+						    poses);
 		}
 
 		clock_gettime(CLOCK_MONOTONIC, &tp);
@@ -316,19 +439,17 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 
 		ret = OUVRT_CAMERA_GET_CLASS(dev)->process_frame(camera, raw);
 		if (ret == 0) {
-			debug_stream_frame_push(camera->debug, raw,
+			debug_stream_frame_push(camera->debug, frame,
 						camera->sizeimage, width * height,
-						ob, &rot, &trans, timestamps);
+						threshold, ob, &poses[0].rot,
+						&poses[0].trans, timestamps);
 		}
 
-		ret = ioctl(dev->fd, VIDIOC_QBUF, &buf);
-		if (ret < 0) {
-			g_print("v4l2: QBUF error: %d, disabling camera\n",
-				errno);
-			dev->active = FALSE;
-			break;
-		}
+		frame_unref(frame);
 	}
+
+	blobwatch_free(bw);
+	recorder_free(rec);
 }
 
 /*
@@ -342,37 +463,36 @@ static void ouvrt_camera_v4l2_stop(OuvrtDevice *dev)
 	struct v4l2_requestbuffers reqbufs = {
 		.count = 0,
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-		.memory = V4L2_MEMORY_MMAP,
+		.memory = V4L2_MEMORY_USERPTR,
 	};
 	__u32 prio = V4L2_PRIORITY_BACKGROUND;
+	unsigned int i;
 	int ret;
-	int i;
 
 	ret = ioctl(dev->fd, VIDIOC_S_PRIORITY, &prio);
 	if (ret < 0)
 		g_print("v4l2: S_PRIORITY error\n");
 
-	if (priv->offset[1]) {
-		for (i = 0; i < 3; i++) {
-			munmap(priv->buf[i], camera->sizeimage);
-			priv->buf[i] = NULL;
-		}
-	} else {
-		reqbufs.memory = V4L2_MEMORY_USERPTR;
-		for (i = 0; i < 3; i++) {
-			free(priv->buf[i]);
-			priv->buf[i] = NULL;
-		}
-	}
+	if (camera->skipped_frames)
+		g_print("v4l2: Skipped %u frames\n", camera->skipped_frames);
 
+	/* The driver must not write into the frames after they are released */
 	ret = ioctl(dev->fd, VIDIOC_STREAMOFF, &reqbufs.type);
 	if (ret < 0 && errno != ENODEV)
 		g_print("v4l2: STREAMOFF error: %d\n", errno);
 
+	for (i = 0; i < priv->num_buffers; i++) {
+		frame_unref(priv->frames[i]);
+		priv->frames[i] = NULL;
+	}
+
 	ret = ioctl(dev->fd, VIDIOC_REQBUFS, &reqbufs);
 	if (ret < 0 && errno != ENODEV)
 		g_print("v4l2: REQBUFS error: %d\n", errno);
 
+	frame_pool_unref(priv->pool);
+	priv->pool = NULL;
+
 	g_print("v4l2: Stopped streaming\n");
 
 	/* TODO: move up to camera */
@@ -7,6 +7,7 @@
 #define __CAMERA_V4L2_H__
 
 #include <glib-object.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "camera.h"
@@ -48,4 +49,6 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC(OuvrtCameraV4L2, g_object_unref)
 
 GType ouvrt_camera_v4l2_get_type(void);
 
+extern bool camera_v4l2_drop_stale_frames;
+
 #endif /* __CAMERA_V4L2_H__ */
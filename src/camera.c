@@ -6,6 +6,7 @@
 #include <glib.h>
 
 #include "camera.h"
+#include "params.h"
 
 G_DEFINE_TYPE(OuvrtCamera, ouvrt_camera, OUVRT_TYPE_DEVICE)
 
@@ -21,4 +22,7 @@ static void ouvrt_camera_class_init(G_GNUC_UNUSED OuvrtCameraClass *klass)
 static void ouvrt_camera_init(OuvrtCamera *camera)
 {
 	camera->dev.type = DEVICE_TYPE_CAMERA;
+	camera->dev.config = tracking_config_new();
+	if (!camera->dev.config)
+		g_print("Camera: Failed to allocate tracking parameters, using defaults\n");
 }
@@ -40,6 +40,7 @@ struct _OuvrtCamera {
 	double dist_coeffs[5];
 	int sizeimage;
 	int sequence;
+	unsigned int skipped_frames;
 	struct debug_stream *debug;
 };
 
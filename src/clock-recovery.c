@@ -0,0 +1,165 @@
+/*
+ * Device to host clock recovery
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock-recovery.h"
+
+/* Maximum deviation of the fitted device clock rate from the nominal rate */
+#define CLOCK_RECOVERY_MAX_PPM		500
+/* Samples further off the fit indicate a device clock reset */
+#define CLOCK_RECOVERY_RESET_NS		50000000
+
+/*
+ * Initializes clock recovery for a device clock running at the nominal
+ * frequency in Hz. One sample is kept per interval in ns.
+ */
+void clock_recovery_init(struct clock_recovery *clock, uint32_t frequency,
+			 uint64_t interval)
+{
+	memset(clock, 0, sizeof(*clock));
+	clock->frequency = frequency;
+	clock->interval = interval;
+	clock->ns_per_tick = 1e9 / frequency;
+}
+
+/*
+ * Extends a 32-bit device timestamp close to the last sample to 64 bits.
+ * Timestamps may lie before or after the last sample.
+ */
+static uint64_t clock_recovery_extend(struct clock_recovery *clock,
+				      uint32_t ticks)
+{
+	return clock->ticks + (int32_t)(ticks - (uint32_t)clock->ticks);
+}
+
+/*
+ * Fits the device clock rate to the filtered samples with a least squares
+ * regression and moves the line down onto the earliest sample.
+ */
+static void clock_recovery_fit(struct clock_recovery *clock)
+{
+	const double nominal = 1e9 / clock->frequency;
+	unsigned int n = clock->num_samples;
+	unsigned int first = (clock->next_sample + CLOCK_RECOVERY_SAMPLES - n) %
+			     CLOCK_RECOVERY_SAMPLES;
+	struct clock_sample ref = clock->samples[first];
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	double slope = nominal;
+	double offset = INFINITY;
+	double x, y;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		const struct clock_sample *s =
+			&clock->samples[(first + i) % CLOCK_RECOVERY_SAMPLES];
+
+		x = (int64_t)(s->ticks - ref.ticks);
+		y = (int64_t)(s->host - ref.host);
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	/* Only trust the rate after the samples span half a second */
+	if (n >= 4 && x >= 0.5 * clock->frequency) {
+		double d = n * sxx - sx * sx;
+
+		if (d > 0)
+			slope = (n * sxy - sx * sy) / d;
+		if (fabs(slope / nominal - 1.0) > CLOCK_RECOVERY_MAX_PPM * 1e-6)
+			slope = nominal;
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct clock_sample *s =
+			&clock->samples[(first + i) % CLOCK_RECOVERY_SAMPLES];
+
+		x = (int64_t)(s->ticks - ref.ticks);
+		y = (int64_t)(s->host - ref.host);
+		if (y - slope * x < offset)
+			offset = y - slope * x;
+	}
+
+	clock->ref.ticks = ref.ticks;
+	clock->ref.host = ref.host + llround(offset);
+	clock->ns_per_tick = slope;
+	clock->valid = true;
+}
+
+/*
+ * Adds a pair of device clock ticks and the host time in ns at which they
+ * were received.
+ */
+void clock_recovery_add_sample(struct clock_recovery *clock, uint32_t ticks,
+			       uint64_t host)
+{
+	struct clock_sample sample = { .host = host };
+	uint64_t predicted;
+
+	if (clock->started) {
+		sample.ticks = clock_recovery_extend(clock, ticks);
+
+		if (clock->valid &&
+		    clock_recovery_to_host(clock, ticks, &predicted) == 0 &&
+		    llabs((int64_t)(host - predicted)) >
+		    CLOCK_RECOVERY_RESET_NS) {
+			clock_recovery_init(clock, clock->frequency,
+					    clock->interval);
+		}
+	}
+
+	if (!clock->started) {
+		sample.ticks = ticks;
+		clock->started = true;
+		clock->ticks = sample.ticks;
+		clock->best = sample;
+		clock->interval_start = host;
+		return;
+	}
+
+	clock->ticks = sample.ticks;
+
+	if ((int64_t)(host - clock->interval_start) < (int64_t)clock->interval) {
+		/* Keep the sample that was delayed the least */
+		if ((int64_t)(host - clock->best.host) <
+		    (int64_t)(sample.ticks - clock->best.ticks) *
+		    clock->ns_per_tick)
+			clock->best = sample;
+		return;
+	}
+
+	clock->samples[clock->next_sample] = clock->best;
+	clock->next_sample = (clock->next_sample + 1) % CLOCK_RECOVERY_SAMPLES;
+	if (clock->num_samples < CLOCK_RECOVERY_SAMPLES)
+		clock->num_samples++;
+	clock_recovery_fit(clock);
+
+	clock->best = sample;
+	clock->interval_start = host;
+}
+
+/*
+ * Converts a device timestamp close to the last sample to host time in ns.
+ *
+ * Returns 0 on success, or -EAGAIN if there are not enough samples yet.
+ */
+int clock_recovery_to_host(struct clock_recovery *clock, uint32_t ticks,
+			   uint64_t *host)
+{
+	int64_t dt;
+
+	if (!clock->valid)
+		return -EAGAIN;
+
+	dt = clock_recovery_extend(clock, ticks) - clock->ref.ticks;
+	*host = clock->ref.host + llround(dt * clock->ns_per_tick);
+
+	return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Device to host clock recovery
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __CLOCK_RECOVERY_H__
+#define __CLOCK_RECOVERY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Number of filtered samples the clock fit is calculated from */
+#define CLOCK_RECOVERY_SAMPLES	32
+
+struct clock_sample {
+	uint64_t ticks;
+	uint64_t host;
+};
+
+/*
+ * Maps a free running 32-bit device clock, such as the UVC source time
+ * clock, to host time in nanoseconds. Timestamp pairs are taken whenever a
+ * device timestamp arrives at the host. Since transport delays only ever
+ * make samples late, each interval contributes its earliest sample, and the
+ * fitted line is placed on the lower envelope of these.
+ */
+struct clock_recovery {
+	uint32_t frequency;
+	uint64_t interval;
+	/* Device clock extended to 64 bits at the last sample */
+	uint64_t ticks;
+	bool started;
+	/* Earliest sample of the current interval */
+	struct clock_sample best;
+	uint64_t interval_start;
+	struct clock_sample samples[CLOCK_RECOVERY_SAMPLES];
+	unsigned int num_samples;
+	unsigned int next_sample;
+	/* host = ref.host + (ticks - ref.ticks) * ns_per_tick */
+	struct clock_sample ref;
+	double ns_per_tick;
+	bool valid;
+};
+
+void clock_recovery_init(struct clock_recovery *clock, uint32_t frequency,
+			 uint64_t interval);
+void clock_recovery_add_sample(struct clock_recovery *clock, uint32_t ticks,
+			       uint64_t host);
+int clock_recovery_to_host(struct clock_recovery *clock, uint32_t ticks,
+			   uint64_t *host);
+
+#endif /* __CLOCK_RECOVERY_H__ */
@@ -0,0 +1,86 @@
+/*
+ * CPU feature detection
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__arm__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include "cpu.h"
+
+static const struct {
+	const char *name;
+	unsigned int features;
+} cpu_levels[] = {
+	{ "scalar", 0 },
+	{ "sse2", CPU_FEATURE_SSE2 },
+	{ "avx2", CPU_FEATURE_SSE2 | CPU_FEATURE_AVX2 },
+	{ "avx512", CPU_FEATURE_SSE2 | CPU_FEATURE_AVX2 |
+		    CPU_FEATURE_AVX512BW },
+	{ "neon", CPU_FEATURE_NEON },
+};
+
+static pthread_once_t cpu_once = PTHREAD_ONCE_INIT;
+static unsigned int cpu_feature_mask;
+
+/*
+ * Returns the vector extensions supported by the CPU.
+ */
+static unsigned int cpu_detect(void)
+{
+	unsigned int features = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		features |= CPU_FEATURE_SSE2;
+	if (__builtin_cpu_supports("avx2"))
+		features |= CPU_FEATURE_AVX2;
+	if (__builtin_cpu_supports("avx512bw"))
+		features |= CPU_FEATURE_AVX512BW;
+#elif defined(__aarch64__)
+	features |= CPU_FEATURE_NEON;
+#elif defined(__arm__)
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+		features |= CPU_FEATURE_NEON;
+#endif
+
+	return features;
+}
+
+static void cpu_init(void)
+{
+	const char *level = getenv(CPU_OVERRIDE_ENV);
+	unsigned int i;
+
+	cpu_feature_mask = cpu_detect();
+	if (!level)
+		return;
+
+	for (i = 0; i < sizeof(cpu_levels) / sizeof(cpu_levels[0]); i++) {
+		if (strcmp(level, cpu_levels[i].name) == 0) {
+			cpu_feature_mask &= cpu_levels[i].features;
+			return;
+		}
+	}
+
+	fprintf(stderr, "%s: unknown level \"%s\", ignored\n",
+		CPU_OVERRIDE_ENV, level);
+}
+
+/*
+ * Returns the detected CPU features, restricted to the level requested via
+ * the override environment variable, if set.
+ */
+unsigned int cpu_features(void)
+{
+	pthread_once(&cpu_once, cpu_init);
+
+	return cpu_feature_mask;
+}
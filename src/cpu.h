@@ -0,0 +1,22 @@
+/*
+ * CPU feature detection
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __CPU_H__
+#define __CPU_H__
+
+#define CPU_FEATURE_SSE2	(1 << 0)
+#define CPU_FEATURE_AVX2	(1 << 1)
+#define CPU_FEATURE_AVX512BW	(1 << 2)
+#define CPU_FEATURE_NEON	(1 << 3)
+
+/*
+ * The OUVRT_CPU environment variable limits the features used by the vector
+ * kernels to the given level, one of scalar, sse2, avx2, avx512, or neon.
+ */
+#define CPU_OVERRIDE_ENV	"OUVRT_CPU"
+
+unsigned int cpu_features(void);
+
+#endif /* __CPU_H__ */
@@ -12,6 +12,7 @@
 #include "device.h"
 #include "gdbus-generated.h"
 #include "ouvrtd.h"
+#include "params.h"
 #include "rift.h"
 
 static GDBusObjectManagerServer *manager = NULL;
@@ -248,6 +249,83 @@ static void ouvrt_dbus_export_camera1_interface(OuvrtObjectSkeleton *object,
 	g_object_unref(camera1);
 }
 
+/*
+ * Returns the current values of all tracking parameters as a{sd} dictionary.
+ */
+static GVariant *ouvrt_config1_parameters(struct tracking_config *config)
+{
+	GVariantBuilder builder;
+	int i;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sd}"));
+	for (i = 0; i < NUM_TRACKING_PARAMS; i++) {
+		g_variant_builder_add(&builder, "{sd}", tracking_params[i].name,
+				      tracking_config_get(config, i));
+	}
+
+	return g_variant_builder_end(&builder);
+}
+
+/*
+ * Publishes a changed tracking parameter to the device's frame processing
+ * thread.
+ */
+static gboolean ouvrt_config1_on_handle_set(OuvrtConfig1 *object,
+					    GDBusMethodInvocation *invocation,
+					    const gchar *name, gdouble value,
+					    gpointer user_data)
+{
+	OuvrtDevice *dev = OUVRT_DEVICE(user_data);
+	int ret;
+
+	ret = tracking_config_set(dev->config, name, value);
+	if (ret < 0) {
+		g_dbus_method_invocation_return_error(invocation,
+			G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+			"Invalid parameter %s = %g", name, value);
+		return TRUE;
+	}
+
+	g_print("%s: Set %s to %g\n", dev->name, name, value);
+	ouvrt_config1_set_parameters(object,
+				     ouvrt_config1_parameters(dev->config));
+	ouvrt_config1_complete_set(object, invocation);
+
+	return TRUE;
+}
+
+/*
+ * Exports a Config1 interface via D-Bus.
+ */
+static void ouvrt_dbus_export_config1_interface(OuvrtObjectSkeleton *object,
+						OuvrtDevice *dev)
+{
+	GVariantBuilder builder;
+	OuvrtConfig1 *config1;
+	int i;
+
+	g_print("Exporting Config1 interface for device %s\n", dev->name);
+
+	config1 = ouvrt_config1_skeleton_new();
+
+	ouvrt_config1_set_parameters(config1,
+				     ouvrt_config1_parameters(dev->config));
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{s(dd)}"));
+	for (i = 0; i < NUM_TRACKING_PARAMS; i++) {
+		g_variant_builder_add(&builder, "{s(dd)}",
+				      tracking_params[i].name,
+				      tracking_params[i].min,
+				      tracking_params[i].max);
+	}
+	ouvrt_config1_set_ranges(config1, g_variant_builder_end(&builder));
+
+	g_signal_connect(config1, "handle-set",
+			 G_CALLBACK(ouvrt_config1_on_handle_set), dev);
+
+	ouvrt_object_skeleton_set_config1(object, config1);
+	g_object_unref(config1);
+}
+
 void ouvrt_dbus_export_device(OuvrtDevice *dev)
 {
 	gchar *object_path;
@@ -271,6 +349,11 @@ void ouvrt_dbus_export_device(OuvrtDevice *dev)
 		ouvrt_dbus_export_camera1_interface(object, dev);
 	}
 
+	if (dev->config) {
+		/* Export a Config1 interface */
+		ouvrt_dbus_export_config1_interface(object, dev);
+	}
+
 	g_dbus_object_manager_server_export(manager,
 					    G_DBUS_OBJECT_SKELETON(object));
 	g_object_unref(object);
@@ -10,12 +10,44 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "blobwatch.h"
 #include "debug.h"
+#include "frame-pool.h"
+#include "sparse.h"
+
+/* Frames queued for sparse encoding before new frames are dropped */
+#define DEBUG_GST_NUM_JOBS	4
+/* Sparse encoded frames in flight in the GStreamer pipeline */
+#define DEBUG_GST_NUM_FRAMES	8
+
+/*
+ * A frame queued for sparse encoding, with the location of its debug
+ * attachment, its timestamp, and the blob detection threshold.
+ */
+struct debug_gst_job {
+	struct frame *frame;
+	size_t size;
+	size_t attach_offset;
+	uint64_t timestamp;
+	uint8_t threshold;
+};
 
 struct debug_stream {
 	GstElement *pipeline;
 	GstElement *appsrc;
 	gboolean connected;
+	unsigned int width;
+	unsigned int height;
+	unsigned int format;
+	/* Sparse encoder thread, job queues, and output buffers */
+	GThread *thread;
+	GAsyncQueue *free_jobs;
+	GAsyncQueue *queued_jobs;
+	struct debug_gst_job jobs[DEBUG_GST_NUM_JOBS];
+	struct debug_gst_job stop;
+	struct frame_pool *pool;
+	size_t bound;
+	gint num_dropped;
 };
 
 /*
@@ -47,14 +79,114 @@ static void debug_gst_client_disconnected(G_GNUC_UNUSED GstElement *sink,
 }
 
 /*
- * Enables GStreamer debug output of GRAY8 frames into a shmsink.
+ * Sparse encodes the frame into a buffer from the output pool, followed by
+ * the debug attachment, and returns a GstBuffer that holds the pool frame.
+ * An attach_offset of 0 means the frame has no debug attachment.
+ */
+static GstBuffer *debug_gst_sparse_buffer_new(struct debug_stream *gst,
+					      struct debug_gst_job *job)
+{
+	size_t attach_size = job->attach_offset ?
+			     job->size - job->attach_offset : 0;
+	uint8_t *src = job->frame->data;
+	struct frame *out;
+	int ret;
+
+	if (attach_size > sizeof(struct ouvrt_debug_attachment))
+		return NULL;
+
+	out = frame_pool_alloc(gst->pool);
+	if (!out)
+		return NULL;
+
+	ret = sparse_encode(src, gst->width, gst->height, job->threshold,
+			    job->timestamp, out->data, gst->bound);
+	if (ret < 0) {
+		frame_unref(out);
+		return NULL;
+	}
+	memcpy(out->data + ret, src + job->attach_offset, attach_size);
+
+	return gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, out->data,
+					   ret + attach_size, 0,
+					   ret + attach_size, out,
+					   (GDestroyNotify)frame_unref);
+}
+
+/*
+ * Sparse encodes queued frames and pushes them into the GStreamer pipeline
+ * until the stop sentinel is received.
+ */
+static gpointer debug_gst_sparse_thread(gpointer data)
+{
+	struct debug_stream *gst = data;
+	struct debug_gst_job *job;
+	GstBuffer *buf;
+	int ret;
+
+	for (;;) {
+		job = g_async_queue_pop(gst->queued_jobs);
+		if (job == &gst->stop)
+			break;
+
+		buf = debug_gst_sparse_buffer_new(gst, job);
+		frame_unref(job->frame);
+		g_async_queue_push(gst->free_jobs, job);
+		if (!buf) {
+			g_atomic_int_inc(&gst->num_dropped);
+			continue;
+		}
+
+		g_signal_emit_by_name(gst->appsrc, "push-buffer", buf, &ret);
+		gst_buffer_unref(buf);
+	}
+
+	return NULL;
+}
+
+/*
+ * Queues a reference to the frame for sparse encoding on the encoder thread.
+ * If the encoder can not keep up, the frame is dropped instead of stalling
+ * the capture thread. The timestamp is the exposure time if known, or the
+ * frame reception time otherwise.
+ */
+static void debug_gst_sparse_push(struct debug_stream *gst,
+				  struct frame *frame, size_t size,
+				  size_t attach_offset, uint8_t threshold,
+				  double timestamps[3])
+{
+	struct debug_gst_job *job;
+
+	job = g_async_queue_try_pop(gst->free_jobs);
+	if (!job) {
+		g_atomic_int_inc(&gst->num_dropped);
+		return;
+	}
+
+	job->frame = frame_ref(frame);
+	job->size = size;
+	job->attach_offset = attach_offset;
+	job->threshold = threshold;
+	job->timestamp = 0;
+	if (timestamps)
+		job->timestamp = 1e9 * (timestamps[0] ? timestamps[0] :
+							timestamps[1]);
+
+	g_async_queue_push(gst->queued_jobs, job);
+}
+
+/*
+ * Enables GStreamer debug output of GRAY8 frames into a shmsink. If sparse
+ * debug streams are enabled, GRAY8 frames are sparse encoded instead.
  */
 struct debug_stream *debug_stream_new(const struct debug_stream_desc *desc)
 {
 	struct debug_stream *gst;
 	GstElement *pipeline, *src, *sink;
 	gchar *filename;
+	unsigned int format = desc->format;
 	GstCaps *caps;
+	size_t size;
 	guint i;
 
 	for (i = 0; i < 10; i++) {
@@ -76,17 +208,26 @@ struct debug_stream *debug_stream_new(const struct debug_stream_desc *desc)
 	if (sink == NULL)
 		g_error("Could not create shmsink GStreamer element");
 
-	caps = gst_caps_new_simple("video/x-raw",
-				   "format", G_TYPE_STRING,
-					     (desc->format == FORMAT_GRAY) ?
-					     "GRAY8" : "YUY2",
+	if (debug_stream_sparse && format == FORMAT_GRAY)
+		format = FORMAT_SPARSE;
+
+	caps = gst_caps_new_simple((format == FORMAT_SPARSE) ?
+				   "application/x-ouvrt-sparse" : "video/x-raw",
 				   "framerate", GST_TYPE_FRACTION,
 						desc->framerate.numerator,
 						desc->framerate.denominator,
-				   "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
 				   "width", G_TYPE_INT, desc->width,
 				   "height", G_TYPE_INT, desc->height,
 				   NULL);
+	if (format != FORMAT_SPARSE) {
+		gst_caps_set_simple(caps,
+				    "format", G_TYPE_STRING,
+					      (format == FORMAT_GRAY) ?
+					      "GRAY8" : "YUY2",
+				    "pixel-aspect-ratio", GST_TYPE_FRACTION,
+							  1, 1,
+				    NULL);
+	}
 
 	g_object_set(src, "caps", caps, NULL);
 	g_object_set(src, "stream-type", 0, NULL);
@@ -104,6 +245,31 @@ struct debug_stream *debug_stream_new(const struct debug_stream_desc *desc)
 	gst->pipeline = pipeline;
 	gst->appsrc = src;
 	gst->connected = FALSE;
+	gst->width = desc->width;
+	gst->height = desc->height;
+	gst->format = format;
+	gst->thread = NULL;
+	gst->pool = NULL;
+	gst->num_dropped = 0;
+
+	/*
+	 * Sparse encoding runs on its own thread, into preallocated output
+	 * buffers large enough for the worst case and the debug attachment.
+	 */
+	if (format == FORMAT_SPARSE) {
+		gst->bound = sparse_encode_bound(desc->width, desc->height);
+		size = gst->bound + sizeof(struct ouvrt_debug_attachment);
+		gst->pool = frame_pool_new("debug", size, DEBUG_GST_NUM_FRAMES,
+					   0);
+		if (!gst->pool)
+			g_error("Could not allocate sparse debug frames");
+		gst->free_jobs = g_async_queue_new();
+		gst->queued_jobs = g_async_queue_new();
+		for (i = 0; i < DEBUG_GST_NUM_JOBS; i++)
+			g_async_queue_push(gst->free_jobs, &gst->jobs[i]);
+		gst->thread = g_thread_new("debug-sparse",
+					   debug_gst_sparse_thread, gst);
+	}
 
 	g_signal_connect(G_OBJECT(sink), "client-connected",
 			 G_CALLBACK(debug_gst_client_connected), gst);
@@ -115,24 +281,42 @@ struct debug_stream *debug_stream_new(const struct debug_stream_desc *desc)
 	return gst;
 }
 
+/*
+ * Stops the sparse encoder thread, if any, and the pipeline. Frames still
+ * queued for encoding are encoded and pushed before.
+ */
 struct debug_stream *debug_stream_unref(struct debug_stream *gst)
 {
+	if (gst->thread) {
+		g_async_queue_push(gst->queued_jobs, &gst->stop);
+		g_thread_join(gst->thread);
+		g_async_queue_unref(gst->queued_jobs);
+		g_async_queue_unref(gst->free_jobs);
+		if (gst->num_dropped)
+			printf("debug: dropped %d sparse frames\n",
+			       gst->num_dropped);
+	}
+
 	gst_element_set_state(gst->pipeline, GST_STATE_NULL);
 	gst_object_unref(gst->pipeline);
+	frame_pool_unref(gst->pool);
 	free(gst);
 
 	return NULL;
 }
 
 /*
- * Allocates a GstBuffer that wraps the frame and pushes it into the
- * GStreamer pipeline.
+ * Pushes the frame into the debug pipeline. Unless sparse encoded, the frame
+ * is not copied. The GStreamer buffer holds a frame reference instead.
+ * Sparse encoding keeps all pixels above the given blob detection threshold.
  */
-void debug_stream_frame_push(struct debug_stream *gst, void *src, size_t size,
-			     size_t attach_offset, struct blobservation *ob,
+void debug_stream_frame_push(struct debug_stream *gst, struct frame *frame,
+			     size_t size, size_t attach_offset,
+			     uint8_t threshold, struct blobservation *ob,
 			     dquat *rot, dvec3 *trans, double timestamps[3])
 {
 	struct ouvrt_debug_attachment *attach;
+	uint8_t *src = frame->data;
 	unsigned int num;
 	GstBuffer *buf;
 	int ret;
@@ -161,10 +345,15 @@ void debug_stream_frame_push(struct debug_stream *gst, void *src, size_t size,
 		}
 	}
 
-	buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, src,
-					  size, 0, size, NULL, NULL);
-	if (!buf)
+	if (gst->format == FORMAT_SPARSE) {
+		debug_gst_sparse_push(gst, frame, size, attach_offset,
+				      threshold, timestamps);
 		return;
+	}
+
+	buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, src, size,
+					  0, size, frame_ref(frame),
+					  (GDestroyNotify)frame_unref);
 
 //	GST_BUFFER_TIMESTAMP(buffer) = ...
 //	GST_BUFFER_DURATION(buffer) = ...
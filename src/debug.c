@@ -3,6 +3,7 @@
  * Copyright 2015 Philipp Zabel
  * SPDX-License-Identifier:	GPL-2.0+
  */
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -12,6 +13,7 @@
 #include "leds.h"
 
 int debug_mode = 0;
+bool debug_stream_sparse = false;
 
 #define IMU_FIFO_LEN 32
 static struct imu_state imu_fifo[IMU_FIFO_LEN];
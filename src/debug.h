@@ -6,6 +6,7 @@
 #ifndef __DEBUG_H__
 #define __DEBUG_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -18,8 +19,10 @@
 #include "maths.h"
 
 extern int debug_mode;
+extern bool debug_stream_sparse;
 
 struct debug_stream;
+struct frame;
 
 struct fraction {
 	unsigned int numerator;
@@ -29,6 +32,8 @@ struct fraction {
 #define FORMAT_GRAY	0x56595559
 #define FORMAT_YUYV	0x59415247
 #define FORMAT_RGBX	0x58424752
+/* Sparse encoded GRAY frames, see sparse.h */
+#define FORMAT_SPARSE	0x4650534f
 
 struct debug_stream_desc {
 	unsigned int width;
@@ -56,7 +61,8 @@ void debug_stream_init(int *argc, char **argv[]);
 struct debug_stream *debug_stream_new(const struct debug_stream_desc *desc);
 struct debug_stream *debug_stream_unref(struct debug_stream *stream);
 void debug_stream_frame_push(struct debug_stream *stream,
-			     void *frame, size_t size, size_t attach_offset,
+			     struct frame *frame, size_t size,
+			     size_t attach_offset, uint8_t threshold,
 			     struct blobservation *ob, dquat *rot,
 			     dvec3 *trans, double timestamps[3]);
 void debug_stream_deinit(void);
@@ -76,8 +82,9 @@ static inline struct debug_stream *debug_stream_unref(struct debug_stream *s)
 }
 
 static inline void debug_stream_frame_push(struct debug_stream *stream,
-					   void *frame, size_t size,
+					   struct frame *frame, size_t size,
 					   size_t attach_offset,
+					   uint8_t threshold,
 					   struct blobservation *ob, dquat *rot,
 					   dvec3 *trans, double timestamps[3])
 {
@@ -11,6 +11,7 @@
 #include <unistd.h>
 
 #include "device.h"
+#include "params.h"
 
 struct _OuvrtDevicePrivate {
 	GThread *thread;
@@ -43,6 +44,7 @@ static void ouvrt_device_finalize(GObject *object)
 	free(dev->devnode);
 	free(dev->name);
 	free(dev->serial);
+	tracking_config_free(dev->config);
 	G_OBJECT_CLASS(ouvrt_device_parent_class)->finalize(object);
 }
 
@@ -106,6 +108,7 @@ static void ouvrt_device_init(OuvrtDevice *self)
 	self->fds[0] = -1;
 	self->fds[1] = -1;
 	self->fds[2] = -1;
+	self->config = NULL;
 	self->priv = ouvrt_device_get_instance_private(self);
 	self->priv->thread = NULL;
 }
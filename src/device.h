@@ -31,6 +31,8 @@ typedef struct _OuvrtDevice		OuvrtDevice;
 typedef struct _OuvrtDeviceClass	OuvrtDeviceClass;
 typedef struct _OuvrtDevicePrivate	OuvrtDevicePrivate;
 
+struct tracking_config;
+
 struct _OuvrtDevice {
 	GObject parent_instance;
 
@@ -48,6 +50,7 @@ struct _OuvrtDevice {
 		int fds[3];
 	};
 	char *parent_devpath;
+	struct tracking_config *config;
 
 	OuvrtDevicePrivate *priv;
 };
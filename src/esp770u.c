@@ -5,11 +5,14 @@
  */
 #include <errno.h>
 #include <libusb.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "esp770u.h"
 #include "uvc.h"
 
 #define ESP770U_EXTENSION_UNIT		4
@@ -393,6 +396,147 @@ int esp770u_i2c_write(libusb_device_handle *devh, uint8_t addr, uint16_t reg,
 	return 0;
 }
 
+/*
+ * A sequence of I2C register writes, each performed as an asynchronous
+ * SET_CUR and GET_CUR control transfer pair on the I2C selector.
+ */
+struct esp770u_i2c_batch {
+	struct libusb_transfer *transfer;
+	esp770u_submit_fn submit;
+	void *owner;
+	uint8_t addr;
+	int num_writes;
+	int index;
+	bool get;
+	uint16_t regs[2 * ESP770U_I2C_BATCH_MAX];
+	void (*done)(void *user_data, int status);
+	void *user_data;
+	uint8_t buf[LIBUSB_CONTROL_SETUP_SIZE + 6];
+};
+
+static void esp770u_i2c_batch_finish(struct esp770u_i2c_batch *batch,
+				     int status)
+{
+	if (batch->done)
+		batch->done(batch->user_data, status);
+	libusb_free_transfer(batch->transfer);
+	free(batch);
+}
+
+/*
+ * Submits the next SET_CUR or GET_CUR stage of the current write.
+ */
+static int esp770u_i2c_batch_submit(struct esp770u_i2c_batch *batch)
+{
+	uint8_t *data = libusb_control_transfer_get_data(batch->transfer);
+	uint16_t reg = batch->regs[2 * batch->index];
+	uint16_t val = batch->regs[2 * batch->index + 1];
+
+	uvc_fill_cur_setup(batch->buf, batch->get, 0, ESP770U_EXTENSION_UNIT,
+			   ESP770U_SELECTOR_I2C, 6);
+	batch->transfer->length = sizeof(batch->buf);
+	if (!batch->get) {
+		data[0] = 0x06;
+		data[1] = batch->addr;
+		data[2] = reg >> 8;
+		data[3] = reg & 0xff;
+		data[4] = val >> 8;
+		data[5] = val & 0xff;
+	}
+
+	return batch->submit(batch->owner, batch->transfer);
+}
+
+static void esp770u_i2c_batch_callback(struct libusb_transfer *transfer)
+{
+	struct esp770u_i2c_batch *batch = transfer->user_data;
+	uint8_t *data = libusb_control_transfer_get_data(transfer);
+	uint16_t reg = batch->regs[2 * batch->index];
+	int ret;
+
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		esp770u_i2c_batch_finish(batch, -ECANCELED);
+		return;
+	}
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		printf("%s(%04x): transfer status %d\n", __func__, reg,
+		       transfer->status);
+		esp770u_i2c_batch_finish(batch, -EIO);
+		return;
+	}
+
+	if (batch->get) {
+		if (data[0] != 0x06 || data[1] != batch->addr ||
+		    data[2] != (reg >> 8) || data[3] != (reg & 0xff)) {
+			printf("%s(%04x): %02x %02x %02x %02x %02x %02x\n",
+			       __func__, reg, data[0], data[1], data[2],
+			       data[3], data[4], data[5]);
+			esp770u_i2c_batch_finish(batch, -EIO);
+			return;
+		}
+		if (++batch->index == batch->num_writes) {
+			esp770u_i2c_batch_finish(batch, 0);
+			return;
+		}
+	}
+	batch->get = !batch->get;
+
+	ret = esp770u_i2c_batch_submit(batch);
+	if (ret < 0)
+		esp770u_i2c_batch_finish(batch, ret);
+}
+
+/*
+ * Performs a sequence of 16-bit write operations on the I2C bus without
+ * blocking, so that it can be called from transfer callbacks. The regs
+ * array contains num_writes register and value pairs. All transfers are
+ * submitted through the owner's submit function. The done callback, if
+ * given, is called with 0 or a negative error code after the last write
+ * has completed or any write has failed.
+ */
+int esp770u_i2c_write_batch(libusb_device_handle *devh,
+			    esp770u_submit_fn submit, void *owner,
+			    uint8_t addr, const uint16_t *regs, int num_writes,
+			    void (*done)(void *user_data, int status),
+			    void *user_data)
+{
+	struct esp770u_i2c_batch *batch;
+	int ret;
+
+	if (num_writes <= 0 || num_writes > ESP770U_I2C_BATCH_MAX)
+		return -EINVAL;
+
+	batch = calloc(1, sizeof(*batch));
+	if (!batch)
+		return -ENOMEM;
+
+	batch->transfer = libusb_alloc_transfer(0);
+	if (!batch->transfer) {
+		free(batch);
+		return -ENOMEM;
+	}
+
+	batch->submit = submit;
+	batch->owner = owner;
+	batch->addr = addr;
+	batch->num_writes = num_writes;
+	memcpy(batch->regs, regs, 2 * num_writes * sizeof(uint16_t));
+	batch->done = done;
+	batch->user_data = user_data;
+
+	libusb_fill_control_transfer(batch->transfer, devh, batch->buf,
+				     esp770u_i2c_batch_callback, batch, 1000);
+
+	ret = esp770u_i2c_batch_submit(batch);
+	if (ret < 0) {
+		libusb_free_transfer(batch->transfer);
+		free(batch);
+	}
+
+	return ret;
+}
+
 /*
  * Calls SET_CUR and GET_CUR on the extension unit's selector 3 with values
  * captured from the Oculus Windows drivers. This could be some kind of reset
@@ -16,6 +16,21 @@ int esp770u_i2c_read(libusb_device_handle *devh, uint8_t addr, uint16_t reg,
 int esp770u_i2c_write(libusb_device_handle *devh, uint8_t addr, uint16_t reg,
 		      uint16_t val);
 
+/* Maximum number of register writes per batch */
+#define ESP770U_I2C_BATCH_MAX		8
+
+/*
+ * Submits a transfer on behalf of the device handle's owner, which calls the
+ * transfer's completion callback from its own thread.
+ */
+typedef int (*esp770u_submit_fn)(void *owner, struct libusb_transfer *transfer);
+
+int esp770u_i2c_write_batch(libusb_device_handle *devh,
+			    esp770u_submit_fn submit, void *owner,
+			    uint8_t addr, const uint16_t *regs, int num_writes,
+			    void (*done)(void *user_data, int status),
+			    void *user_data);
+
 int esp770u_query_firmware_version(libusb_device_handle *devh, uint8_t *val);
 int esp770u_init_radio(libusb_device_handle *devh);
 int esp770u_setup_radio(libusb_device_handle *devh, uint8_t radio_id[5]);
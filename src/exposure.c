@@ -0,0 +1,167 @@
+/*
+ * Tracking-aware exposure and gain control
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <string.h>
+
+#include "blobwatch.h"
+#include "exposure.h"
+
+/* Subsampling step in both directions, smaller than the smallest blob */
+#define STATS_STEP		2
+/* Number of brightest samples ignored as hot pixels when finding the peak */
+#define PEAK_OUTLIERS		4
+
+/*
+ * LED blobs should peak clearly above the blob detection threshold, but well
+ * below saturation, so that they are compact and their area still reflects
+ * the LED brightness used for blink pattern decoding.
+ */
+#define TARGET_PEAK		0xd0
+/* Ignore deviations from the target peak smaller than 1/DEADBAND */
+#define DEADBAND		12
+/* Blobs with an area below this are considered noise */
+#define NOISE_AREA		9
+
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#define clamp(x, lo, hi) min(max((x), (lo)), (hi))
+
+/*
+ * Collects a brightness histogram over a subsampled frame, and derives the
+ * peak brightness, ignoring a few hot pixels, and the number of samples above
+ * the given blob detection threshold and in saturation.
+ */
+void exposure_stats_from_frame(struct exposure_stats *stats,
+			       const uint8_t *frame, int width, int height,
+			       int stride, uint8_t threshold)
+{
+	unsigned int histogram[256] = { 0 };
+	unsigned int count = 0;
+	int x, y, v;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->threshold = threshold;
+
+	for (y = 0; y < height; y += STATS_STEP) {
+		const uint8_t *line = frame + y * stride;
+
+		for (x = 0; x < width; x += STATS_STEP)
+			histogram[line[x]]++;
+	}
+
+	stats->samples = ((width + STATS_STEP - 1) / STATS_STEP) *
+			 ((height + STATS_STEP - 1) / STATS_STEP);
+
+	for (v = 255; v > 0; v--) {
+		count += histogram[v];
+		if (v > threshold)
+			stats->bright += histogram[v];
+		if (!stats->peak && count > PEAK_OUTLIERS)
+			stats->peak = v;
+	}
+	stats->saturated = histogram[255];
+}
+
+/*
+ * Counts the detected blobs and those small enough to be noise.
+ */
+void exposure_stats_from_blobs(struct exposure_stats *stats,
+			       const struct blobservation *ob)
+{
+	int i;
+
+	stats->num_blobs = 0;
+	stats->noise_blobs = 0;
+
+	if (!ob)
+		return;
+
+	stats->num_blobs = ob->num_blobs;
+	for (i = 0; i < ob->num_blobs; i++) {
+		if (ob->blobs[i].area < NOISE_AREA)
+			stats->noise_blobs++;
+	}
+}
+
+void exposure_control_init(struct exposure_control *ctrl,
+			   unsigned int exposure, unsigned int exposure_min,
+			   unsigned int exposure_max, unsigned int gain,
+			   unsigned int gain_min, unsigned int gain_max,
+			   unsigned int interval)
+{
+	ctrl->exposure = exposure;
+	ctrl->exposure_min = max(exposure_min, 1u);
+	ctrl->exposure_max = exposure_max;
+	ctrl->gain = gain;
+	ctrl->gain_min = max(gain_min, 1u);
+	ctrl->gain_max = gain_max;
+	ctrl->gain_limit = gain_max;
+	ctrl->interval = interval;
+	ctrl->frame = 0;
+}
+
+/*
+ * Returns true once every interval frames, when statistics should be
+ * collected and the control loop should run.
+ */
+bool exposure_control_due(struct exposure_control *ctrl)
+{
+	if (++ctrl->frame < ctrl->interval)
+		return false;
+
+	ctrl->frame = 0;
+	return true;
+}
+
+/*
+ * Scales the product of exposure and gain to move the peak brightness
+ * towards the target, by at most 30% down or 40% up per step, and backs off
+ * faster if many samples are saturated. The exposure is kept as short as
+ * possible to reduce motion blur, increasing gain first. If many of the
+ * detected blobs are tiny, the gain limit is lowered to suppress noise.
+ *
+ * Returns true if exposure or gain changed.
+ */
+bool exposure_control_update(struct exposure_control *ctrl,
+			     const struct exposure_stats *stats)
+{
+	unsigned int old_exposure = ctrl->exposure;
+	unsigned int old_gain = ctrl->gain;
+	unsigned int peak = max(stats->peak, 1u);
+	unsigned int total, exposure, gain;
+	double ratio;
+
+	/* Nothing above threshold, LEDs may be out of view or too dark */
+	if (peak <= stats->threshold && !stats->num_blobs)
+		ratio = 1.4;
+	else
+		ratio = (double)TARGET_PEAK / peak;
+
+	if (stats->saturated * 4 > stats->bright)
+		ratio = min(ratio, 0.7);
+	ratio = clamp(ratio, 0.7, 1.4);
+
+	if (stats->noise_blobs > 4 && 2 * stats->noise_blobs > stats->num_blobs)
+		ctrl->gain_limit = max(ctrl->gain_limit * 9 / 10,
+				       ctrl->gain_min);
+	else if (ctrl->gain_limit < ctrl->gain_max)
+		ctrl->gain_limit++;
+
+	if (ratio > 1.0 - 1.0 / DEADBAND && ratio < 1.0 + 1.0 / DEADBAND &&
+	    ctrl->gain <= ctrl->gain_limit)
+		return false;
+
+	total = ctrl->exposure * ctrl->gain * ratio + 0.5;
+
+	gain = clamp(total / ctrl->exposure_min, ctrl->gain_min,
+		     ctrl->gain_limit);
+	exposure = clamp(total / gain, ctrl->exposure_min, ctrl->exposure_max);
+	gain = clamp(total / exposure, ctrl->gain_min, ctrl->gain_limit);
+
+	ctrl->exposure = exposure;
+	ctrl->gain = gain;
+
+	return exposure != old_exposure || gain != old_gain;
+}
@@ -0,0 +1,59 @@
+/*
+ * Tracking-aware exposure and gain control
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __EXPOSURE_H__
+#define __EXPOSURE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct blobservation;
+
+/*
+ * Brightness statistics collected from a subsampled frame and the blobs
+ * detected in it.
+ */
+struct exposure_stats {
+	unsigned int threshold;
+	unsigned int samples;
+	unsigned int peak;
+	unsigned int bright;
+	unsigned int saturated;
+	int num_blobs;
+	int noise_blobs;
+};
+
+/*
+ * Exposure and gain in sensor specific linear units, their limits, and the
+ * current gain limit lowered in the presence of noise.
+ */
+struct exposure_control {
+	unsigned int exposure;
+	unsigned int exposure_min;
+	unsigned int exposure_max;
+	unsigned int gain;
+	unsigned int gain_min;
+	unsigned int gain_max;
+	unsigned int gain_limit;
+	unsigned int interval;
+	unsigned int frame;
+};
+
+void exposure_stats_from_frame(struct exposure_stats *stats,
+			       const uint8_t *frame, int width, int height,
+			       int stride, uint8_t threshold);
+void exposure_stats_from_blobs(struct exposure_stats *stats,
+			       const struct blobservation *ob);
+
+void exposure_control_init(struct exposure_control *ctrl,
+			   unsigned int exposure, unsigned int exposure_min,
+			   unsigned int exposure_max, unsigned int gain,
+			   unsigned int gain_min, unsigned int gain_max,
+			   unsigned int interval);
+bool exposure_control_due(struct exposure_control *ctrl);
+bool exposure_control_update(struct exposure_control *ctrl,
+			     const struct exposure_stats *stats);
+
+#endif /* __EXPOSURE_H__ */
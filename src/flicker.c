@@ -15,6 +15,9 @@
 
 #include <stdio.h>
 
+/* Minimum number of known bits required to identify a pattern */
+#define FLICKER_MIN_VALID_BITS	8
+
 static int hamming_distance(uint16_t a, uint16_t b)
 {
 	uint16_t tmp = a ^ b;
@@ -34,6 +37,9 @@ static int pattern_find_id(uint16_t *patterns, int num_patterns,
 	int i;
 
 	for (i = 0; i < num_patterns; i++) {
+		/* Skip LEDs with unknown pattern */
+		if (!patterns[i])
+			continue;
 		if (pattern == patterns[i]) {
 			*id = i;
 			return 2;
@@ -47,51 +53,110 @@ static int pattern_find_id(uint16_t *patterns, int num_patterns,
 	return -2;
 }
 
+/*
+ * Looks up a pattern with unknown bits. Without the known bits to spare,
+ * only an exact match of the known bits is accepted, and only if it is the
+ * only one.
+ */
+static int pattern_find_id_masked(uint16_t *patterns, int num_patterns,
+				  uint16_t pattern, uint16_t valid,
+				  int8_t *id)
+{
+	int match = -1;
+	int i;
+
+	for (i = 0; i < num_patterns; i++) {
+		if (!patterns[i])
+			continue;
+		if ((patterns[i] & valid) != (pattern & valid))
+			continue;
+		if (match >= 0)
+			return -2;
+		match = i;
+	}
+
+	if (match < 0)
+		return -2;
+
+	*id = match;
+	return 1;
+}
+
 /*
  * Records blob blinking patterns and compares against the blinking patterns
  * stored in the Rift DK2 to determine the corresponding LED IDs.
+ * If frames were skipped since the previous call, the recorded patterns are
+ * shifted past the missing frames, whose bits are marked as unknown in the
+ * pattern_valid mask. Patterns with a few unknown bits are only identified
+ * if their known bits match a single LED pattern exactly.
+ * Blob area changes of more than hysteresis percent are interpreted as
+ * rising or falling edges.
  */
 void flicker_process(struct blob *blobs, int num_blobs,
-		     uint8_t led_pattern_phase, struct leds *leds)
+		     uint8_t led_pattern_phase, unsigned int skipped_frames,
+		     int hysteresis, struct leds *leds)
 {
 	struct blob *b;
 	int success = 0;
 	int phase = (led_pattern_phase + 1) % 10;
+	unsigned int shift = skipped_frames + 1;
+	int num_leds = leds->model.num_points;
 
 	for (b = blobs; b < blobs + num_blobs; b++) {
-		uint16_t pattern;
+		uint16_t pattern, valid;
 
 		/* Update pattern only if blob was observed previously */
 		if (b->age < 1)
 			continue;
 
 		/*
-		 * Interpret brightness change of more than 10% as rising
-		 * or falling edge. Right shift the pattern and add the
-		 * new brightness level as MSB.
+		 * Interpret brightness change of more than hysteresis as
+		 * rising or falling edge. Right shift the pattern by the number
+		 * of frames since the last observation and add the new
+		 * brightness level as MSB. Without an edge, the new level is
+		 * only known if the previous level is.
 		 */
-		pattern = (b->pattern >> 1) & 0x1ff;
-		if (b->area * 10 > b->last_area * 11)
+		if (shift < 10) {
+			pattern = (b->pattern >> shift) & 0x1ff;
+			valid = (b->pattern_valid >> shift) & 0x1ff;
+		} else {
+			pattern = 0;
+			valid = 0;
+		}
+		if (b->area * 100 > b->last_area * (100 + hysteresis)) {
 			pattern |= (1 << 9);
-		else if (b->area * 11 < b->last_area * 10)
+			valid |= (1 << 9);
+		} else if (b->area * (100 + hysteresis) < b->last_area * 100) {
 			pattern |= (0 << 9);
-		else
+			valid |= (1 << 9);
+		} else {
 			pattern |= b->pattern & (1 << 9);
+			valid |= b->pattern_valid & (1 << 9);
+		}
 		b->pattern = pattern;
+		b->pattern_valid = valid;
 
 		/*
-		 * Determine LED ID only if a full pattern was recorded and
-		 * consensus about the blinking phase is established
+		 * Determine LED ID only if enough of the pattern was recorded
+		 * and consensus about the blinking phase is established
 		 */
-		if (b->age < 9 || phase < 0)
+		if (hamming_distance(valid, 0) < FLICKER_MIN_VALID_BITS ||
+		    phase < 0)
 			continue;
 
 		/* Rotate the pattern bits according to the phase */
 		pattern = ((pattern >> (10 - phase)) | (pattern << phase)) &
 			  0x3ff;
 
-		success += pattern_find_id(leds->patterns,
-					   leds->model.num_points, pattern,
-					   &b->led_id);
+		if (valid == 0x3ff) {
+			success += pattern_find_id(leds->patterns, num_leds,
+						   pattern, &b->led_id);
+		} else {
+			valid = ((valid >> (10 - phase)) |
+				 (valid << phase)) & 0x3ff;
+			success += pattern_find_id_masked(leds->patterns,
+							  num_leds, pattern,
+							  valid, &b->led_id);
+		}
 	}
 }
@@ -0,0 +1,236 @@
+/*
+ * Reference counted camera frame buffer pool
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#include <errno.h>
+#include <glib.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "frame-pool.h"
+
+/* Frame buffers start on cache line boundaries */
+#define FRAME_POOL_ALIGN	64
+#define HUGE_PAGE_SIZE		(2 * 1024 * 1024)
+
+unsigned int frame_pool_flags;
+
+struct frame_pool {
+	char *name;
+	GMutex mutex;
+	/* One reference held by the owner, one per frame in use */
+	unsigned int refcount;
+	void *mem;
+	size_t mem_size;
+	bool locked;
+	struct frame *frames;
+	struct frame **free_frames;
+	unsigned int num_free;
+	struct frame_pool_stats stats;
+};
+
+static size_t align_up(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+/*
+ * Maps the backing memory for all frames of the pool. Explicit huge pages
+ * have to be reserved by the administrator, so if that fails, transparent
+ * huge pages are requested for a normal mapping instead.
+ */
+static void *frame_pool_map(struct frame_pool *pool, unsigned int flags)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	void *mem;
+
+	if (flags & FRAME_POOL_HUGEPAGES) {
+		pool->mem_size = align_up(pool->mem_size, HUGE_PAGE_SIZE);
+#ifdef MAP_HUGETLB
+		mem = mmap(NULL, pool->mem_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED)
+			return mem;
+#endif
+	} else {
+		pool->mem_size = align_up(pool->mem_size, page_size);
+	}
+
+	mem = mmap(NULL, pool->mem_size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	if (flags & FRAME_POOL_HUGEPAGES)
+		madvise(mem, pool->mem_size, MADV_HUGEPAGE);
+#endif
+
+	return mem;
+}
+
+/*
+ * Allocates a pool of num_frames frame buffers of the given size each.
+ *
+ * Returns the new pool, or NULL on error.
+ */
+struct frame_pool *frame_pool_new(const char *name, size_t size,
+				  unsigned int num_frames, unsigned int flags)
+{
+	struct frame_pool *pool;
+	size_t stride = align_up(size, FRAME_POOL_ALIGN);
+	unsigned int i;
+
+	if (!size || !num_frames)
+		return NULL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->frames = calloc(num_frames, sizeof(*pool->frames));
+	pool->free_frames = calloc(num_frames, sizeof(*pool->free_frames));
+	pool->mem_size = stride * num_frames;
+	if (pool->frames && pool->free_frames)
+		pool->mem = frame_pool_map(pool, flags);
+	if (!pool->mem) {
+		free(pool->free_frames);
+		free(pool->frames);
+		free(pool);
+		return NULL;
+	}
+
+	if (flags & FRAME_POOL_LOCKED) {
+		if (mlock(pool->mem, pool->mem_size) == 0)
+			pool->locked = true;
+		else
+			g_print("%s: Failed to lock frame pool: %d\n", name,
+				errno);
+	}
+
+	pool->name = g_strdup(name);
+	g_mutex_init(&pool->mutex);
+	pool->refcount = 1;
+	for (i = 0; i < num_frames; i++) {
+		struct frame *frame = &pool->frames[i];
+
+		frame->pool = pool;
+		frame->data = (uint8_t *)pool->mem + i * stride;
+		frame->size = size;
+		/* Hand out the lowest frames first */
+		pool->free_frames[num_frames - 1 - i] = frame;
+	}
+	pool->num_free = num_frames;
+	pool->stats.num_frames = num_frames;
+
+	return pool;
+}
+
+static void frame_pool_free(struct frame_pool *pool)
+{
+	struct frame_pool_stats *stats = &pool->stats;
+
+	g_print("%s: Frame pool: %u frames, max. %u in use, %" G_GUINT64_FORMAT
+		" allocations, %" G_GUINT64_FORMAT " exhausted\n", pool->name,
+		stats->num_frames, stats->max_in_use, stats->allocations,
+		stats->exhausted);
+
+	if (pool->locked)
+		munlock(pool->mem, pool->mem_size);
+	munmap(pool->mem, pool->mem_size);
+	g_mutex_clear(&pool->mutex);
+	g_free(pool->name);
+	free(pool->free_frames);
+	free(pool->frames);
+	free(pool);
+}
+
+/*
+ * Drops the owner reference. The pool is freed as soon as the last frame
+ * handed out is returned.
+ */
+void frame_pool_unref(struct frame_pool *pool)
+{
+	unsigned int refcount;
+
+	if (!pool)
+		return;
+
+	g_mutex_lock(&pool->mutex);
+	refcount = --pool->refcount;
+	g_mutex_unlock(&pool->mutex);
+
+	if (refcount == 0)
+		frame_pool_free(pool);
+}
+
+/*
+ * Takes a frame from the pool without blocking.
+ *
+ * Returns a frame with a single reference, or NULL if all frames are in use.
+ */
+struct frame *frame_pool_alloc(struct frame_pool *pool)
+{
+	struct frame *frame = NULL;
+
+	g_mutex_lock(&pool->mutex);
+	if (pool->num_free) {
+		frame = pool->free_frames[--pool->num_free];
+		frame->refcount = 1;
+		frame->timestamp = 0;
+		pool->refcount++;
+		pool->stats.allocations++;
+		pool->stats.in_use++;
+		if (pool->stats.in_use > pool->stats.max_in_use)
+			pool->stats.max_in_use = pool->stats.in_use;
+	} else {
+		pool->stats.exhausted++;
+	}
+	g_mutex_unlock(&pool->mutex);
+
+	return frame;
+}
+
+/*
+ * Returns a snapshot of the pool occupancy statistics.
+ */
+void frame_pool_get_stats(struct frame_pool *pool,
+			  struct frame_pool_stats *stats)
+{
+	g_mutex_lock(&pool->mutex);
+	*stats = pool->stats;
+	g_mutex_unlock(&pool->mutex);
+}
+
+struct frame *frame_ref(struct frame *frame)
+{
+	g_atomic_int_inc(&frame->refcount);
+
+	return frame;
+}
+
+/*
+ * Drops a frame reference and returns the frame to its pool after the last
+ * one.
+ */
+void frame_unref(struct frame *frame)
+{
+	struct frame_pool *pool;
+	unsigned int refcount;
+
+	if (!frame || !g_atomic_int_dec_and_test(&frame->refcount))
+		return;
+
+	pool = frame->pool;
+	g_mutex_lock(&pool->mutex);
+	pool->free_frames[pool->num_free++] = frame;
+	pool->stats.in_use--;
+	refcount = --pool->refcount;
+	g_mutex_unlock(&pool->mutex);
+
+	if (refcount == 0)
+		frame_pool_free(pool);
+}
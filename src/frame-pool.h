@@ -0,0 +1,54 @@
+/*
+ * Reference counted camera frame buffer pool
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#ifndef __FRAME_POOL_H__
+#define __FRAME_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Back the pool with huge pages, if available */
+#define FRAME_POOL_HUGEPAGES	(1 << 0)
+/* Lock the pool into memory to avoid page faults in the frame path */
+#define FRAME_POOL_LOCKED	(1 << 1)
+
+/* Flags used by the camera drivers, set from the command line */
+extern unsigned int frame_pool_flags;
+
+struct frame_pool;
+
+/*
+ * A frame buffer handed out by the pool. Producers fill data and timestamp
+ * before passing the frame on. Consumers that need the frame beyond the
+ * duration of a call take their own reference with frame_ref() and must
+ * treat the data as read-only.
+ */
+struct frame {
+	struct frame_pool *pool;
+	uint8_t *data;
+	size_t size;
+	uint64_t timestamp;
+	int refcount;
+};
+
+struct frame_pool_stats {
+	unsigned int num_frames;
+	unsigned int in_use;
+	unsigned int max_in_use;
+	uint64_t allocations;
+	uint64_t exhausted;
+};
+
+struct frame_pool *frame_pool_new(const char *name, size_t size,
+				  unsigned int num_frames, unsigned int flags);
+void frame_pool_unref(struct frame_pool *pool);
+struct frame *frame_pool_alloc(struct frame_pool *pool);
+void frame_pool_get_stats(struct frame_pool *pool,
+			  struct frame_pool_stats *stats);
+
+struct frame *frame_ref(struct frame *frame);
+void frame_unref(struct frame *frame);
+
+#endif /* __FRAME_POOL_H__ */
@@ -11,8 +11,11 @@
 #include <string.h>
 
 #include "hololens-camera2.h"
+#include "blobwatch.h"
 #include "debug.h"
 #include "device.h"
+#include "exposure.h"
+#include "frame-pool.h"
 #include "hidraw.h"
 #include "usb-ids.h"
 
@@ -24,6 +27,9 @@
 #define HOLOLENS_ENDPOINT_VIDEO		5
 
 #define BULK_TRANSFER_SIZE		616538
+/* Metadata line and two 640x480 images side by side, plus 26 bytes */
+#define HOLOLENS_CAMERA2_FRAME_SIZE	615706
+#define HOLOLENS_CAMERA2_NUM_FRAMES	4
 
 struct _OuvrtHoloLensCamera2 {
 	OuvrtDevice dev;
@@ -34,7 +40,9 @@ struct _OuvrtHoloLensCamera2 {
 	uint8_t endpoint;
 
 	uint8_t last_seq;
-	__u8 *frame;
+	struct frame_pool *pool;
+
+	struct exposure_control gain[2];
 
 	struct debug_stream *debug1;
 	struct debug_stream *debug2;
@@ -48,27 +56,81 @@ static int hololens_camera2_send(OuvrtHoloLensCamera2 *self, void *buf,
 {
 	struct libusb_transfer *transfer;
 	uint8_t bEndpointAddress;
+	int transferred;
 	void *data;
+	int ret;
 
 	transfer = libusb_alloc_transfer(0);
 	if (!transfer)
 		return -ENOMEM;
 
 	data = g_memdup(buf, len);
-	if (!data)
+	if (!data) {
+		libusb_free_transfer(transfer);
 		return -ENOMEM;
+	}
 
 	bEndpointAddress = self->endpoint | LIBUSB_ENDPOINT_OUT;
 	libusb_fill_bulk_transfer(transfer, self->devh, bEndpointAddress,
 				  data, len, NULL, NULL, 0);
 	transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER |
 			   LIBUSB_TRANSFER_FREE_TRANSFER;
-	return libusb_submit_transfer(transfer);
+	ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(self),
+					       transfer);
+	if (ret == 0)
+		return 0;
+
+	/*
+	 * Completions are not dispatched anymore after the device thread
+	 * stopped, send the final messages synchronously.
+	 */
+	if (ret == LIBUSB_ERROR_INTERRUPTED) {
+		ret = libusb_bulk_transfer(self->devh, bEndpointAddress,
+					   data, len, &transferred, 1000);
+	}
+	libusb_free_transfer(transfer);
+
+	return ret;
+}
+
+static inline void hololens_camera2_set_gain(OuvrtHoloLensCamera2 *self,
+					     uint8_t camera, uint8_t gain);
+
+/*
+ * Runs the gain control loops of the left and right camera at a low rate,
+ * offset so that they alternate like on Windows. The left and right images
+ * of headset tracking frames are stored side by side below the metadata line.
+ * There is no blob detection on these frames, so the default threshold is
+ * used.
+ */
+static void hololens_camera2_update_gain(OuvrtHoloLensCamera2 *self,
+					 struct frame *frame)
+{
+	const int width = HOLOLENS_CAMERA2_WIDTH / 2;
+	const int height = HOLOLENS_CAMERA2_HEIGHT - 1;
+	struct exposure_stats stats;
+	int camera;
+
+	for (camera = 0; camera < 2; camera++) {
+		struct exposure_control *ctrl = &self->gain[camera];
+
+		if (!exposure_control_due(ctrl))
+			continue;
+
+		exposure_stats_from_frame(&stats, frame->data +
+					  HOLOLENS_CAMERA2_WIDTH +
+					  camera * width, width, height,
+					  HOLOLENS_CAMERA2_WIDTH,
+					  BLOBWATCH_THRESHOLD);
+		if (exposure_control_update(ctrl, &stats))
+			hololens_camera2_set_gain(self, camera, ctrl->gain);
+	}
 }
 
 static void hololens_camera2_handle_frame(OuvrtHoloLensCamera2 *self,
 					  __u8 *buf, size_t len)
 {
+	struct frame *frame;
 	uint16_t exposure;
 	uint8_t seq;
 
@@ -77,6 +139,11 @@ static void hololens_camera2_handle_frame(OuvrtHoloLensCamera2 *self,
 		return;
 	}
 
+	/* Drop the frame if all buffers are still held by the debug streams */
+	frame = frame_pool_alloc(self->pool);
+	if (!frame)
+		return;
+
 	/* Strip out packet headers */
 	int j = 0;
 	int n;
@@ -87,14 +154,14 @@ static void hololens_camera2_handle_frame(OuvrtHoloLensCamera2 *self,
 			n = len - i - 0x20;
 		else
 			n = 0x5fe0;
-		memcpy(self->frame + j, buf + i + 0x20, n);
+		memcpy(frame->data + j, buf + i + 0x20, n);
 		j += n;
 	}
 
         /* The first line contains metadata, possibly register values */
-        exposure = __be16_to_cpup((__be16 *)(self->frame + 6));
+        exposure = __be16_to_cpup((__be16 *)(frame->data + 6));
 
-	seq = self->frame[89];
+	seq = frame->data[89];
 	if ((int8_t)(seq - self->last_seq) != 1) {
 		g_print("%s: Missing frame: %u -> %u\n", self->dev.name,
 			self->last_seq, seq);
@@ -103,18 +170,23 @@ static void hololens_camera2_handle_frame(OuvrtHoloLensCamera2 *self,
 
 	if (exposure == 300) {
 		/* Bright frame, headset tracking */
-		debug_stream_frame_push(self->debug1, self->frame,
-					2 * 640 * 481 + 26,
-					0, NULL, NULL, NULL, NULL);
+		hololens_camera2_update_gain(self, frame);
+		debug_stream_frame_push(self->debug1, frame,
+					HOLOLENS_CAMERA2_FRAME_SIZE, 0,
+					BLOBWATCH_THRESHOLD, NULL, NULL, NULL,
+					NULL);
 	} else if (exposure == 0) {
 		/* Dark frame, controller tracking */
-		debug_stream_frame_push(self->debug2, self->frame,
-					2 * 640 * 481 + 26,
-					0, NULL, NULL, NULL, NULL);
+		debug_stream_frame_push(self->debug2, frame,
+					HOLOLENS_CAMERA2_FRAME_SIZE, 0,
+					BLOBWATCH_THRESHOLD, NULL, NULL, NULL,
+					NULL);
 	} else {
 		g_print("%s: Unexpected exposure: %u\n", self->dev.name,
 			exposure);
 	}
+
+	frame_unref(frame);
 }
 
 static void hololens_camera2_transfer_callback(struct libusb_transfer *transfer)
@@ -126,7 +198,7 @@ static void hololens_camera2_transfer_callback(struct libusb_transfer *transfer)
 		if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
 			g_print("%s: Device vanished\n", self->dev.name);
 			self->dev.active = false;
-		} else {
+		} else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
 			g_print("%s: Sensor transfer error: %d (%s)\n",
 				self->dev.name,
 				transfer->status,
@@ -143,7 +215,8 @@ static void hololens_camera2_transfer_callback(struct libusb_transfer *transfer)
 				      transfer->actual_length);
 
 	/* Resubmit transfer */
-	ret = libusb_submit_transfer(transfer);
+	ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(self),
+					       transfer);
 	if (ret < 0) {
 		g_print("%s: Failed to resubmit bulk transfer: %d\n",
 			self->dev.name, ret);
@@ -237,9 +310,26 @@ static int hololens_camera2_start(OuvrtDevice *dev)
 	hololens_camera2_set_active(self, false);
 	hololens_camera2_set_active(self, true);
 
+	/*
+	 * Start with the previously fixed gain and adjust each camera about
+	 * twice per second. There is no known exposure control, so only the
+	 * gain is changed.
+	 */
+	for (i = 0; i < 2; i++) {
+		exposure_control_init(&self->gain[i], 1, 1, 1, 0x20, 0x10,
+				      0xff, 15);
+		/* Offset the loops, so that left and right alternate */
+		self->gain[i].frame = i * 7;
+	}
 	hololens_camera2_set_gain(self, 0, 0x20); /* left */
 	hololens_camera2_set_gain(self, 1, 0x20); /* right */
 
+	self->pool = frame_pool_new(dev->name, HOLOLENS_CAMERA2_FRAME_SIZE,
+				    HOLOLENS_CAMERA2_NUM_FRAMES,
+				    frame_pool_flags);
+	if (!self->pool)
+		return -ENOMEM;
+
 	/* Submit two video frame transfers */
 	self->num_transfers = 2;
 	self->transfer = calloc(self->num_transfers, sizeof(*self->transfer));
@@ -255,7 +345,8 @@ static int hololens_camera2_start(OuvrtDevice *dev)
 					  hololens_camera2_transfer_callback,
 					  self, 0);
 
-		ret = libusb_submit_transfer(self->transfer[i]);
+		ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(self),
+						       self->transfer[i]);
 		if (ret < 0) {
 			g_print("%s: Failed to submit bulk transfer %d\n",
 				dev->name, i);
@@ -292,23 +383,13 @@ static void hololens_camera2_stop(OuvrtDevice *dev)
 	hololens_camera2_set_active(self, false);
 	debug_stream_unref(self->debug2);
 	debug_stream_unref(self->debug1);
+	frame_pool_unref(self->pool);
+	self->pool = NULL;
 	libusb_release_interface(self->devh, HOLOLENS_INTERFACE_VIDEO);
 }
 
-/*
- * Frees the device structure and its contents.
- */
-static void ouvrt_hololens_camera2_finalize(GObject *object)
-{
-	OuvrtHoloLensCamera2 *self = OUVRT_HOLOLENS_CAMERA2(object);
-
-	free(self->frame);
-	G_OBJECT_CLASS(ouvrt_hololens_camera2_parent_class)->finalize(object);
-}
-
 static void ouvrt_hololens_camera2_class_init(OuvrtHoloLensCamera2Class *klass)
 {
-	G_OBJECT_CLASS(klass)->finalize = ouvrt_hololens_camera2_finalize;
 	OUVRT_DEVICE_CLASS(klass)->start = hololens_camera2_start;
 	OUVRT_DEVICE_CLASS(klass)->stop = hololens_camera2_stop;
 }
@@ -319,7 +400,6 @@ static void ouvrt_hololens_camera2_init(OuvrtHoloLensCamera2 *self)
 				     PID_HOLOLENS_SENSORS);
 
 	self->dev.type = DEVICE_TYPE_CAMERA;
-	self->frame = malloc(615706); /* 2*640*481 + 26 */
 }
 
 /*
@@ -17,7 +17,9 @@
 #include "device.h"
 #include "hidraw.h"
 #include "imu.h"
+#include "shm.h"
 #include "telemetry.h"
+#include "unpack.h"
 
 struct _OuvrtHoloLensIMU {
 	OuvrtDevice dev;
@@ -28,6 +30,8 @@ struct _OuvrtHoloLensIMU {
 
 G_DEFINE_TYPE(OuvrtHoloLensIMU, ouvrt_hololens_imu, OUVRT_TYPE_DEVICE)
 
+bool hololens_imu_high_rate = false;
+
 /*
  * Sends a command to the HoloLens Sensors HID device
  */
@@ -41,6 +45,41 @@ static int hololens_imu_send_command(OuvrtDevice *dev, uint8_t command)
 	return ret < 0 ? ret : 0;
 }
 
+/*
+ * Integrates the eight 8 kHz gyro sub-samples that make up the i-th 1 kHz
+ * sample individually, with timestamps interpolated between the previous and
+ * current sample time, and publishes them on the shared memory output.
+ */
+static void hololens_imu_integrate_high_rate(OuvrtHoloLensIMU *self,
+					     struct hololens_imu_report *report,
+					     int i, int64_t dt)
+{
+	struct ouvrt_shm_gyro_sample samples[8];
+	vec3 gyro[8];
+	int k;
+
+	/* Same coordinate system transform as for the 1 kHz samples */
+	for (k = 0; k < 8; k++) {
+		gyro[k].x = -1e-3f *
+			(int16_t)__le16_to_cpu(report->gyro[1][8 * i + k]);
+		gyro[k].y = -1e-3f *
+			(int16_t)__le16_to_cpu(report->gyro[0][8 * i + k]);
+		gyro[k].z = -1e-3f *
+			(int16_t)__le16_to_cpu(report->gyro[2][8 * i + k]);
+	}
+
+	pose_update_gyro(1e-7 * dt / 8, &self->imu.pose, gyro, 8);
+
+	for (k = 0; k < 8; k++) {
+		samples[k].time = 1e-7 * (self->last_timestamp +
+					  dt * (k + 1) / 8);
+		samples[k].angular_velocity = gyro[k];
+		samples[k].reserved = 0;
+	}
+
+	shm_push_gyro_samples(self->dev.id, 8000, samples, 8);
+}
+
 static int hololens_imu_handle_imu_report(OuvrtHoloLensIMU *self,
 					  struct hololens_imu_report *report)
 {
@@ -66,30 +105,9 @@ static int hololens_imu_handle_imu_report(OuvrtHoloLensIMU *self,
 		raw.acc[1] = (int32_t)__le32_to_cpu(report->accel[1][i]);
 		raw.acc[2] = (int32_t)__le32_to_cpu(report->accel[2][i]);
 		/* Angular velocity in 10⁻³ rad/s @ 8 kHz */
-		raw.gyro[0] = (int16_t)__le16_to_cpu(report->gyro[0][8 * i + 0]) +
-			      (int16_t)__le16_to_cpu(report->gyro[0][8 * i + 1]) +
-			      (int16_t)__le16_to_cpu(report->gyro[0][8 * i + 2]) +
-			      (int16_t)__le16_to_cpu(report->gyro[0][8 * i + 3]) +
-			      (int16_t)__le16_to_cpu(report->gyro[0][8 * i + 4]) +
-			      (int16_t)__le16_to_cpu(report->gyro[0][8 * i + 5]) +
-			      (int16_t)__le16_to_cpu(report->gyro[0][8 * i + 6]) +
-			      (int16_t)__le16_to_cpu(report->gyro[0][8 * i + 7]),
-		raw.gyro[1] = (int16_t)__le16_to_cpu(report->gyro[1][8 * i + 0]) +
-			      (int16_t)__le16_to_cpu(report->gyro[1][8 * i + 1]) +
-			      (int16_t)__le16_to_cpu(report->gyro[1][8 * i + 2]) +
-			      (int16_t)__le16_to_cpu(report->gyro[1][8 * i + 3]) +
-			      (int16_t)__le16_to_cpu(report->gyro[1][8 * i + 4]) +
-			      (int16_t)__le16_to_cpu(report->gyro[1][8 * i + 5]) +
-			      (int16_t)__le16_to_cpu(report->gyro[1][8 * i + 6]) +
-			      (int16_t)__le16_to_cpu(report->gyro[1][8 * i + 7]);
-		raw.gyro[2] = (int16_t)__le16_to_cpu(report->gyro[2][8 * i + 0]) +
-			      (int16_t)__le16_to_cpu(report->gyro[2][8 * i + 1]) +
-			      (int16_t)__le16_to_cpu(report->gyro[2][8 * i + 2]) +
-			      (int16_t)__le16_to_cpu(report->gyro[2][8 * i + 3]) +
-			      (int16_t)__le16_to_cpu(report->gyro[2][8 * i + 4]) +
-			      (int16_t)__le16_to_cpu(report->gyro[2][8 * i + 5]) +
-			      (int16_t)__le16_to_cpu(report->gyro[2][8 * i + 6]) +
-			      (int16_t)__le16_to_cpu(report->gyro[2][8 * i + 7]);
+		raw.gyro[0] = unpack_sum_8x16bit_le(&report->gyro[0][8 * i]);
+		raw.gyro[1] = unpack_sum_8x16bit_le(&report->gyro[1][8 * i]);
+		raw.gyro[2] = unpack_sum_8x16bit_le(&report->gyro[2][8 * i]);
 
 		telemetry_send_raw_imu_sample(self->dev.id, &raw);
 
@@ -117,9 +135,14 @@ static int hololens_imu_handle_imu_report(OuvrtHoloLensIMU *self,
 
 		telemetry_send_imu_sample(self->dev.id, &imu);
 
-		pose_update(1e-7 * dt, &self->imu.pose, &imu);
+		if (hololens_imu_high_rate && self->last_timestamp)
+			hololens_imu_integrate_high_rate(self, report, i, dt);
+		else
+			pose_update(1e-7 * dt, &self->imu.pose, &imu);
 
 		telemetry_send_pose(self->dev.id, &self->imu.pose);
+		shm_publish_pose(self->dev.id, imu.time, &self->imu.pose,
+				 &imu.angular_velocity);
 
 		self->last_timestamp = raw.time;
 	}
@@ -8,6 +8,7 @@
 
 #include <glib.h>
 #include <glib-object.h>
+#include <stdbool.h>
 
 #include "device.h"
 
@@ -15,6 +16,8 @@
 G_DECLARE_FINAL_TYPE(OuvrtHoloLensIMU, ouvrt_hololens_imu, \
 		     OUVRT, HOLOLENS_IMU, OuvrtDevice)
 
+extern bool hololens_imu_high_rate;
+
 OuvrtDevice *hololens_imu_new(const char *devnode);
 
 #endif /* __HOLOLENS_IMU_H__ */
@@ -49,3 +49,37 @@ void pose_update(double dt, struct dpose *pose, struct imu_sample *sample)
 
 	pose->rotation = q;
 }
+
+/*
+ * Updates the rotational part of the pose from num consecutive angular
+ * velocity measurements, each covering a time interval of dt. The per-sample
+ * delta rotations are computed in a separate pass over the whole batch, and
+ * the pose is only renormalized once at the end.
+ */
+void pose_update_gyro(double dt, struct dpose *pose, const vec3 *gyro,
+		      unsigned int num)
+{
+	unsigned int i, j, n;
+	dquat q, dq[8];
+
+	if (mode != GYRO_ONLY)
+		return;
+
+	q = pose->rotation;
+	for (j = 0; j < num; j += n) {
+		n = num - j < 8 ? num - j : 8;
+
+		for (i = 0; i < n; i++)
+			dquat_from_gyro(&dq[i], &gyro[j + i], dt);
+
+		for (i = 0; i < n; i++) {
+			dquat r;
+
+			dquat_mult(&r, &q, &dq[i]);
+			q = r;
+		}
+	}
+	dquat_normalize(&q);
+
+	pose->rotation = q;
+}
@@ -58,5 +58,7 @@ struct imu_state {
 };
 
 void pose_update(double dt, struct dpose *pose, struct imu_sample *sample);
+void pose_update_gyro(double dt, struct dpose *pose, const vec3 *gyro,
+		      unsigned int num);
 
 #endif /* __IMU_H__ */
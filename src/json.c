@@ -8,6 +8,62 @@
 #include "json.h"
 #include "tracking-model.h"
 
+/*
+ * Returns the named object member, or NULL if object is NULL or the member
+ * does not exist or is not an object.
+ */
+JsonObject *json_object_find_object_member(JsonObject *object,
+					   const char *member_name)
+{
+	JsonNode *node = object ? json_object_get_member(object, member_name) :
+				  NULL;
+
+	return node && JSON_NODE_HOLDS_OBJECT(node) ?
+	       json_node_get_object(node) : NULL;
+}
+
+/*
+ * Returns the named array member, or NULL if object is NULL or the member
+ * does not exist or is not an array.
+ */
+JsonArray *json_object_find_array_member(JsonObject *object,
+					 const char *member_name)
+{
+	JsonNode *node = object ? json_object_get_member(object, member_name) :
+				  NULL;
+
+	return node && JSON_NODE_HOLDS_ARRAY(node) ?
+	       json_node_get_array(node) : NULL;
+}
+
+/*
+ * Returns the named string member, or NULL if object is NULL or the member
+ * does not exist or is not a string.
+ */
+const char *json_object_find_string_member(JsonObject *object,
+					   const char *member_name)
+{
+	JsonNode *node = object ? json_object_get_member(object, member_name) :
+				  NULL;
+
+	return node && JSON_NODE_HOLDS_VALUE(node) &&
+	       json_node_get_value_type(node) == G_TYPE_STRING ?
+	       json_node_get_string(node) : NULL;
+}
+
+/*
+ * Returns the array element at index, or NULL if array is NULL or the
+ * element does not exist or is not an object.
+ */
+JsonObject *json_array_find_object_element(JsonArray *array, guint index)
+{
+	JsonNode *node = array && index < json_array_get_length(array) ?
+			 json_array_get_element(array, index) : NULL;
+
+	return node && JSON_NODE_HOLDS_OBJECT(node) ?
+	       json_node_get_object(node) : NULL;
+}
+
 void json_object_get_vec3_member(JsonObject *object,
 				 const char *member_name,
 				 vec3 *out)
@@ -12,6 +12,17 @@
 
 struct tracking_model;
 
+JsonObject *json_object_find_object_member(JsonObject *object,
+					   const char *member_name);
+
+JsonArray *json_object_find_array_member(JsonObject *object,
+					 const char *member_name);
+
+const char *json_object_find_string_member(JsonObject *object,
+					   const char *member_name);
+
+JsonObject *json_array_find_object_element(JsonArray *array, guint index);
+
 void json_object_get_vec3_member(JsonObject *object, const char *member,
 				 vec3 *out);
 
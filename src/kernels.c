@@ -0,0 +1,227 @@
+/*
+ * Vector kernels with runtime CPU feature dispatch
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <pthread.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86
+#elif defined(__ARM_NEON) && defined(HAVE_NEON_KERNELS)
+/* The NEON variants have not been build-tested yet, see meson_options.txt */
+#include <arm_neon.h>
+#define KERNELS_NEON
+#endif
+
+#include "cpu.h"
+#include "kernels.h"
+
+/*
+ * Scalar reference implementations
+ */
+static int find_bright_scalar(const uint8_t *p, int n, uint8_t threshold)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (p[i] > threshold)
+			break;
+	}
+
+	return i;
+}
+
+static void yuyv_to_gray_scalar(uint8_t *dst, const uint8_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = src[2 * i];
+}
+
+#ifdef KERNELS_X86
+/*
+ * Unsigned byte comparisons are done as signed comparisons with the sign
+ * bits flipped.
+ */
+__attribute__((target("sse2")))
+static int find_bright_sse2(const uint8_t *p, int n, uint8_t threshold)
+{
+	const __m128i bias = _mm_set1_epi8(0x80);
+	const __m128i t = _mm_set1_epi8(threshold ^ 0x80);
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		unsigned int mask;
+
+		v = _mm_xor_si128(v, bias);
+		mask = _mm_movemask_epi8(_mm_cmpgt_epi8(v, t));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + find_bright_scalar(p + i, n - i, threshold);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_gray_sse2(uint8_t *dst, const uint8_t *src, int n)
+{
+	const __m128i luma = _mm_set1_epi16(0x00ff);
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * i +
+							      16));
+
+		a = _mm_and_si128(a, luma);
+		b = _mm_and_si128(b, luma);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+	}
+
+	yuyv_to_gray_scalar(dst + i, src + 2 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int find_bright_avx2(const uint8_t *p, int n, uint8_t threshold)
+{
+	const __m256i bias = _mm256_set1_epi8(0x80);
+	const __m256i t = _mm256_set1_epi8(threshold ^ 0x80);
+	int i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		unsigned int mask;
+
+		v = _mm256_xor_si256(v, bias);
+		mask = _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, t));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	/* Avoid AVX to SSE transition penalties in the tail */
+	_mm256_zeroupper();
+
+	return i + find_bright_sse2(p + i, n - i, threshold);
+}
+
+/*
+ * The 256-bit pack instruction interleaves the 128-bit lanes of its two
+ * operands, which is undone by a cross-lane permutation.
+ */
+__attribute__((target("avx2")))
+static void yuyv_to_gray_avx2(uint8_t *dst, const uint8_t *src, int n)
+{
+	const __m256i luma = _mm256_set1_epi16(0x00ff);
+	int i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + 2 * i +
+								 32));
+		__m256i v;
+
+		a = _mm256_and_si256(a, luma);
+		b = _mm256_and_si256(b, luma);
+		v = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b),
+					     _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i *)(dst + i), v);
+	}
+
+	_mm256_zeroupper();
+	yuyv_to_gray_sse2(dst + i, src + 2 * i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int find_bright_avx512(const uint8_t *p, int n, uint8_t threshold)
+{
+	const __m512i t = _mm512_set1_epi8(threshold);
+	int i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		__m512i v = _mm512_loadu_si512((const void *)(p + i));
+		__mmask64 mask = _mm512_cmpgt_epu8_mask(v, t);
+
+		if (mask)
+			return i + __builtin_ctzll(mask);
+	}
+
+	_mm256_zeroupper();
+
+	return i + find_bright_avx2(p + i, n - i, threshold);
+}
+#endif /* KERNELS_X86 */
+
+#ifdef KERNELS_NEON
+static int find_bright_neon(const uint8_t *p, int n, uint8_t threshold)
+{
+	const uint8x16_t t = vdupq_n_u8(threshold);
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint64x2_t m = vreinterpretq_u64_u8(vcgtq_u8(vld1q_u8(p + i),
+							     t));
+
+		if (vgetq_lane_u64(m, 0) | vgetq_lane_u64(m, 1))
+			break;
+	}
+
+	return i + find_bright_scalar(p + i, n - i, threshold);
+}
+
+static void yuyv_to_gray_neon(uint8_t *dst, const uint8_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+		vst1q_u8(dst + i, vld2q_u8(src + 2 * i).val[0]);
+
+	yuyv_to_gray_scalar(dst + i, src + 2 * i, n - i);
+}
+#endif /* KERNELS_NEON */
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static struct kernels kernels;
+
+/*
+ * Fills the kernel table with the best variants for the CPU features.
+ */
+static void kernels_init(void)
+{
+	unsigned int features = cpu_features();
+
+	kernels.find_bright = find_bright_scalar;
+	kernels.yuyv_to_gray = yuyv_to_gray_scalar;
+
+#ifdef KERNELS_X86
+	if (features & CPU_FEATURE_SSE2) {
+		kernels.find_bright = find_bright_sse2;
+		kernels.yuyv_to_gray = yuyv_to_gray_sse2;
+	}
+	if (features & CPU_FEATURE_AVX2) {
+		kernels.find_bright = find_bright_avx2;
+		kernels.yuyv_to_gray = yuyv_to_gray_avx2;
+	}
+	if (features & CPU_FEATURE_AVX512BW)
+		kernels.find_bright = find_bright_avx512;
+#endif
+#ifdef KERNELS_NEON
+	if (features & CPU_FEATURE_NEON) {
+		kernels.find_bright = find_bright_neon;
+		kernels.yuyv_to_gray = yuyv_to_gray_neon;
+	}
+#endif
+	(void)features;
+}
+
+/*
+ * Returns the kernel table, initializing it on first use.
+ */
+const struct kernels *kernels_get(void)
+{
+	pthread_once(&kernels_once, kernels_init);
+
+	return &kernels;
+}
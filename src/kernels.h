@@ -0,0 +1,26 @@
+/*
+ * Vector kernels with runtime CPU feature dispatch
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+#include <stdint.h>
+
+struct kernels {
+	/*
+	 * Returns the index of the first of n pixels that is brighter than
+	 * threshold, or n if there is none.
+	 */
+	int (*find_bright)(const uint8_t *p, int n, uint8_t threshold);
+	/*
+	 * Extracts the luma channel of n YUYV pixels from src into dst.
+	 * Works in place, with dst == src.
+	 */
+	void (*yuyv_to_gray)(uint8_t *dst, const uint8_t *src, int n);
+};
+
+const struct kernels *kernels_get(void);
+
+#endif /* __KERNELS_H__ */
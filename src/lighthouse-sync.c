@@ -0,0 +1,404 @@
+/*
+ * Lighthouse sync based clock alignment between watchmen
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#include <errno.h>
+#include <glib.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "lighthouse.h"
+#include "lighthouse-sync.h"
+
+#define LIGHTHOUSE_SYNC_MAX_WATCHMEN	16
+#define LIGHTHOUSE_SYNC_NS_PER_TICK	(1e9 / LIGHTHOUSE_CLOCK_HZ)
+/*
+ * Sync events of the same base station are 8.33 ms apart, so before the
+ * clocks are aligned, events are matched by their host time if they are
+ * less than half of that apart.
+ */
+#define LIGHTHOUSE_SYNC_WINDOW_NS	4000000
+/* Keep one matched pair per 100 ms, so that the fit spans a few seconds */
+#define LIGHTHOUSE_SYNC_PAIR_TICKS	4800000
+#define LIGHTHOUSE_SYNC_MIN_PAIRS	8
+/* Matched events more than 100 µs off the fit are outliers */
+#define LIGHTHOUSE_SYNC_MAX_ERROR	4800
+#define LIGHTHOUSE_SYNC_MAX_OUTLIERS	8
+/* Choose a new reference if the current one did not see a sync for 1 s */
+#define LIGHTHOUSE_SYNC_TIMEOUT_NS	1000000000
+
+static GMutex lighthouse_sync_mutex;
+static struct lighthouse_watchman *watchmen[LIGHTHOUSE_SYNC_MAX_WATCHMEN];
+static struct lighthouse_watchman *reference;
+/* Common ticks and host time of the last sync event seen by the reference */
+static uint64_t reference_common;
+static uint64_t reference_host;
+
+static void lighthouse_sync_reset(struct lighthouse_sync *sync)
+{
+	sync->num_pairs = 0;
+	sync->next_pair = 0;
+	sync->outliers = 0;
+	sync->valid = false;
+}
+
+/*
+ * Extends a 32-bit receiver timestamp close to the last sync event to
+ * 64 bits.
+ */
+static uint64_t lighthouse_sync_extend(struct lighthouse_sync *sync,
+				       uint32_t ticks)
+{
+	return sync->ticks + (int32_t)(ticks - (uint32_t)sync->ticks);
+}
+
+static uint64_t lighthouse_sync_predict(struct lighthouse_sync *sync,
+					uint64_t ticks)
+{
+	int64_t dt = ticks - sync->ref_ticks;
+
+	return sync->ref_common + dt + llround(dt * sync->drift);
+}
+
+/*
+ * Makes the given watchman's receiver clock the common timebase, at its
+ * current sync event with the given host time. All other watchmen have to
+ * be aligned to it again.
+ *
+ * The common timebase continues across a handover: a watchman that was
+ * aligned to the previous reference keeps its alignment. Otherwise, the
+ * common ticks are carried over from the last sync event of the previous
+ * reference via the host time, which is only accurate to the transport
+ * delays.
+ */
+static void lighthouse_sync_set_reference(struct lighthouse_watchman *watchman,
+					  uint64_t host)
+{
+	struct lighthouse_sync *sync = &watchman->sync;
+	bool aligned = sync->valid;
+	uint64_t ref_ticks = sync->ref_ticks;
+	uint64_t ref_common = sync->ref_common;
+	double drift = sync->drift;
+	unsigned int i;
+
+	for (i = 0; i < LIGHTHOUSE_SYNC_MAX_WATCHMEN; i++) {
+		if (watchmen[i])
+			lighthouse_sync_reset(&watchmen[i]->sync);
+	}
+
+	if (aligned) {
+		sync->ref_ticks = ref_ticks;
+		sync->ref_common = ref_common;
+		sync->drift = drift;
+	} else if (reference_host) {
+		sync->ref_ticks = sync->ticks;
+		sync->ref_common = reference_common +
+				   llround((int64_t)(host - reference_host) /
+					   LIGHTHOUSE_SYNC_NS_PER_TICK);
+		sync->drift = 0.0;
+	} else {
+		sync->ref_ticks = 0;
+		sync->ref_common = 0;
+		sync->drift = 0.0;
+	}
+	reference = watchman;
+	sync->jitter = 0.0;
+	sync->valid = true;
+
+	g_print("%s: Using receiver clock as Lighthouse timebase%s\n",
+		watchman->name, aligned ? ", keeping alignment" : "");
+}
+
+/*
+ * Fits the common ticks over the receiver ticks of the stored pairs with a
+ * least squares regression. Only the deviation from the nominal rate is
+ * fitted, relative to the oldest pair, to keep the sums well conditioned.
+ */
+static void lighthouse_sync_fit(struct lighthouse_watchman *watchman)
+{
+	struct lighthouse_sync *sync = &watchman->sync;
+	unsigned int n = sync->num_pairs;
+	unsigned int first = (sync->next_pair + LIGHTHOUSE_SYNC_PAIRS - n) %
+			     LIGHTHOUSE_SYNC_PAIRS;
+	uint64_t ticks0 = sync->pair_ticks[first];
+	uint64_t common0 = sync->pair_common[first];
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	double slope, intercept, d, x, y, r, sum = 0;
+	bool was_valid = sync->valid;
+	unsigned int i, j;
+
+	for (i = 0; i < n; i++) {
+		j = (first + i) % LIGHTHOUSE_SYNC_PAIRS;
+		x = (int64_t)(sync->pair_ticks[j] - ticks0);
+		y = (int64_t)(sync->pair_common[j] - common0) - x;
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	d = n * sxx - sx * sx;
+	if (n < LIGHTHOUSE_SYNC_MIN_PAIRS || d <= 0)
+		return;
+
+	slope = (n * sxy - sx * sy) / d;
+	intercept = (sy - slope * sx) / n;
+
+	for (i = 0; i < n; i++) {
+		j = (first + i) % LIGHTHOUSE_SYNC_PAIRS;
+		x = (int64_t)(sync->pair_ticks[j] - ticks0);
+		r = (int64_t)(sync->pair_common[j] - common0) - x -
+		    (intercept + slope * x);
+		sum += r * r;
+	}
+
+	/* Mismatched sync events in the initial pairs spoil the fit */
+	if (sqrt(sum / n) > LIGHTHOUSE_SYNC_MAX_ERROR) {
+		lighthouse_sync_reset(sync);
+		return;
+	}
+
+	sync->ref_ticks = ticks0;
+	sync->ref_common = common0 + llround(intercept);
+	sync->drift = slope;
+	sync->jitter = sqrt(sum / n) * LIGHTHOUSE_SYNC_NS_PER_TICK;
+	sync->valid = true;
+
+	if (!was_valid) {
+		g_print("%s: Aligned to %s, drift %+.2f ppm, jitter %.0f ns\n",
+			watchman->name, reference->name, slope * 1e6,
+			sync->jitter);
+	}
+}
+
+/*
+ * Adds a pair of receiver ticks and the common ticks of the same sync event
+ * to the clock alignment, unless it is too far off the current fit.
+ */
+static void lighthouse_sync_add_pair(struct lighthouse_watchman *watchman,
+				     uint64_t ticks, uint64_t common)
+{
+	struct lighthouse_sync *sync = &watchman->sync;
+	unsigned int last;
+	int64_t error;
+
+	if (sync->valid) {
+		error = common - lighthouse_sync_predict(sync, ticks);
+		if (llabs(error) > LIGHTHOUSE_SYNC_MAX_ERROR) {
+			if (++sync->outliers > LIGHTHOUSE_SYNC_MAX_OUTLIERS) {
+				g_print("%s: Lost Lighthouse clock alignment\n",
+					watchman->name);
+				lighthouse_sync_reset(sync);
+			}
+			return;
+		}
+	}
+	sync->outliers = 0;
+
+	if (sync->num_pairs) {
+		last = (sync->next_pair + LIGHTHOUSE_SYNC_PAIRS - 1) %
+		       LIGHTHOUSE_SYNC_PAIRS;
+		if ((int64_t)(ticks - sync->pair_ticks[last]) <
+		    LIGHTHOUSE_SYNC_PAIR_TICKS)
+			return;
+	}
+
+	sync->pair_ticks[sync->next_pair] = ticks;
+	sync->pair_common[sync->next_pair] = common;
+	sync->next_pair = (sync->next_pair + 1) % LIGHTHOUSE_SYNC_PAIRS;
+	if (sync->num_pairs < LIGHTHOUSE_SYNC_PAIRS)
+		sync->num_pairs++;
+
+	lighthouse_sync_fit(watchman);
+}
+
+/*
+ * Base stations are told apart by their serial number once it has been
+ * received from both sides, and by their channel before that.
+ */
+static bool lighthouse_sync_same_base(const struct lighthouse_sync_event *a,
+				      const struct lighthouse_sync_event *b)
+{
+	if (a->serial && b->serial)
+		return a->serial == b->serial;
+	return a->base == b->base;
+}
+
+/*
+ * Returns the time in ns between a sync event of a watchman and a sync event
+ * of the reference. The clock alignment is used once available, since the
+ * host times are skewed by the different transport delays.
+ */
+static int64_t lighthouse_sync_distance(struct lighthouse_sync *sync,
+					const struct lighthouse_sync_event *event,
+					const struct lighthouse_sync_event *ref)
+{
+	int64_t dt;
+
+	if (sync->valid) {
+		dt = lighthouse_sync_predict(&reference->sync, ref->ticks) -
+		     lighthouse_sync_predict(sync, event->ticks);
+		return dt * LIGHTHOUSE_SYNC_NS_PER_TICK;
+	}
+
+	return ref->host - event->host;
+}
+
+/*
+ * Looks for the reference sync event that corresponds to a pending sync
+ * event of the given watchman and adds the pair to its clock alignment.
+ */
+static void lighthouse_sync_match(struct lighthouse_watchman *watchman,
+				  struct lighthouse_sync_event *event)
+{
+	struct lighthouse_sync_event *best = NULL;
+	int64_t dt, best_dt = LIGHTHOUSE_SYNC_WINDOW_NS;
+	unsigned int i;
+
+	for (i = 0; i < LIGHTHOUSE_SYNC_EVENTS; i++) {
+		struct lighthouse_sync_event *ref = &reference->sync.events[i];
+
+		if (!ref->host || !lighthouse_sync_same_base(event, ref))
+			continue;
+
+		dt = llabs(lighthouse_sync_distance(&watchman->sync, event,
+						    ref));
+		if (dt < best_dt) {
+			best = ref;
+			best_dt = dt;
+		}
+	}
+
+	if (!best)
+		return;
+
+	event->pending = false;
+	lighthouse_sync_add_pair(watchman, event->ticks,
+				 lighthouse_sync_predict(&reference->sync,
+							 best->ticks));
+}
+
+static bool lighthouse_sync_register(struct lighthouse_watchman *watchman)
+{
+	unsigned int i;
+
+	for (i = 0; i < LIGHTHOUSE_SYNC_MAX_WATCHMEN; i++) {
+		if (!watchmen[i]) {
+			watchmen[i] = watchman;
+			watchman->sync.registered = true;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Adds a sync event received by the given watchman from the given base
+ * station. Events of the reference watchman are matched with the pending
+ * events of all others, and vice versa, as the receivers report them with
+ * different delays.
+ */
+void lighthouse_sync_add(struct lighthouse_watchman *watchman,
+			 struct lighthouse_base *base, uint32_t timestamp)
+{
+	struct lighthouse_sync *sync = &watchman->sync;
+	struct lighthouse_sync_event *event;
+	uint64_t host;
+	unsigned int i, j;
+
+	/* The host time is needed to match events before alignment */
+	if (clock_recovery_to_host(&watchman->clock, timestamp, &host) < 0)
+		return;
+
+	g_mutex_lock(&lighthouse_sync_mutex);
+
+	if (!sync->registered && !lighthouse_sync_register(watchman)) {
+		g_mutex_unlock(&lighthouse_sync_mutex);
+		return;
+	}
+
+	sync->ticks = sync->started ? lighthouse_sync_extend(sync, timestamp) :
+				      timestamp;
+	sync->started = true;
+	sync->last_host = host;
+
+	if (!reference ||
+	    (reference != watchman &&
+	     (int64_t)(host - reference->sync.last_host) >
+	     LIGHTHOUSE_SYNC_TIMEOUT_NS))
+		lighthouse_sync_set_reference(watchman, host);
+
+	event = &sync->events[sync->next_event];
+	sync->next_event = (sync->next_event + 1) % LIGHTHOUSE_SYNC_EVENTS;
+	event->ticks = sync->ticks;
+	event->host = host;
+	event->serial = base->serial;
+	event->base = base - watchman->base;
+	event->pending = true;
+
+	if (watchman != reference) {
+		lighthouse_sync_match(watchman, event);
+		g_mutex_unlock(&lighthouse_sync_mutex);
+		return;
+	}
+
+	event->pending = false;
+	reference_common = lighthouse_sync_predict(sync, sync->ticks);
+	reference_host = host;
+	for (i = 0; i < LIGHTHOUSE_SYNC_MAX_WATCHMEN; i++) {
+		if (!watchmen[i] || watchmen[i] == reference)
+			continue;
+		for (j = 0; j < LIGHTHOUSE_SYNC_EVENTS; j++) {
+			if (watchmen[i]->sync.events[j].pending)
+				lighthouse_sync_match(watchmen[i],
+						&watchmen[i]->sync.events[j]);
+		}
+	}
+
+	g_mutex_unlock(&lighthouse_sync_mutex);
+}
+
+/*
+ * Converts a receiver timestamp of the given watchman close to its last sync
+ * event into common Lighthouse timebase ticks.
+ *
+ * Returns 0 on success, or -EAGAIN if the watchman is not aligned yet.
+ */
+int lighthouse_sync_to_common(struct lighthouse_watchman *watchman,
+			      uint32_t timestamp, uint64_t *common)
+{
+	struct lighthouse_sync *sync = &watchman->sync;
+	int ret = -EAGAIN;
+
+	g_mutex_lock(&lighthouse_sync_mutex);
+	if (sync->valid) {
+		*common = lighthouse_sync_predict(sync,
+				lighthouse_sync_extend(sync, timestamp));
+		ret = 0;
+	}
+	g_mutex_unlock(&lighthouse_sync_mutex);
+
+	return ret;
+}
+
+/*
+ * Removes the watchman from clock alignment. If it was the reference, the
+ * next watchman to see a sync event takes over.
+ */
+void lighthouse_sync_unregister(struct lighthouse_watchman *watchman)
+{
+	unsigned int i;
+
+	g_mutex_lock(&lighthouse_sync_mutex);
+	for (i = 0; i < LIGHTHOUSE_SYNC_MAX_WATCHMEN; i++) {
+		if (watchmen[i] == watchman)
+			watchmen[i] = NULL;
+	}
+	if (reference == watchman)
+		reference = NULL;
+	watchman->sync.registered = false;
+	lighthouse_sync_reset(&watchman->sync);
+	g_mutex_unlock(&lighthouse_sync_mutex);
+}
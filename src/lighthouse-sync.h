@@ -0,0 +1,64 @@
+/*
+ * Lighthouse sync based clock alignment between watchmen
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#ifndef __LIGHTHOUSE_SYNC_H__
+#define __LIGHTHOUSE_SYNC_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Number of recent sync events kept for matching */
+#define LIGHTHOUSE_SYNC_EVENTS	16
+/* Number of matched sync events the clock alignment is fitted to */
+#define LIGHTHOUSE_SYNC_PAIRS	64
+
+struct lighthouse_base;
+struct lighthouse_watchman;
+
+struct lighthouse_sync_event {
+	uint64_t ticks;
+	uint64_t host;
+	uint32_t serial;
+	uint8_t base;
+	bool pending;
+};
+
+/*
+ * All watchmen see the same base station sync flashes. Matching the sync
+ * events of each watchman to those of a reference watchman relates their
+ * 48 MHz receiver clocks directly, without going through the USB arrival
+ * times. The reference receiver clock is used as the common Lighthouse
+ * timebase.
+ */
+struct lighthouse_sync {
+	bool registered;
+	/* Receiver clock extended to 64 bits at the last sync event */
+	uint64_t ticks;
+	bool started;
+	uint64_t last_host;
+	struct lighthouse_sync_event events[LIGHTHOUSE_SYNC_EVENTS];
+	unsigned int next_event;
+	/* Matched receiver and common ticks */
+	uint64_t pair_ticks[LIGHTHOUSE_SYNC_PAIRS];
+	uint64_t pair_common[LIGHTHOUSE_SYNC_PAIRS];
+	unsigned int num_pairs;
+	unsigned int next_pair;
+	unsigned int outliers;
+	/* common = ref_common + (ticks - ref_ticks) * (1 + drift) */
+	uint64_t ref_ticks;
+	uint64_t ref_common;
+	double drift;
+	/* RMS deviation of the matched sync events from the fit, in ns */
+	double jitter;
+	bool valid;
+};
+
+void lighthouse_sync_add(struct lighthouse_watchman *watchman,
+			 struct lighthouse_base *base, uint32_t timestamp);
+int lighthouse_sync_to_common(struct lighthouse_watchman *watchman,
+			      uint32_t timestamp, uint64_t *common);
+void lighthouse_sync_unregister(struct lighthouse_watchman *watchman);
+
+#endif /* __LIGHTHOUSE_SYNC_H__ */
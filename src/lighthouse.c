@@ -242,8 +242,6 @@ static void lighthouse_base_handle_frame(struct lighthouse_watchman *watchman,
 {
 	struct lighthouse_frame *frame = &base->frame[base->active_rotor];
 
-	(void)watchman;
-
 	if (!frame->sweep_ids)
 		return;
 
@@ -256,6 +254,10 @@ static void lighthouse_base_handle_frame(struct lighthouse_watchman *watchman,
 	if (frame->frame_duration > 1000000)
 		return;
 
+	frame->sync_aligned = lighthouse_sync_to_common(watchman,
+						frame->sync_timestamp,
+						&frame->sync_common) == 0;
+
 	telemetry_send_lighthouse_frame(watchman->id, frame);
 }
 
@@ -327,6 +329,7 @@ static void lighthouse_handle_sync_pulse(struct lighthouse_watchman *watchman,
 	base = &watchman->base[channel == 'C'];
 	base->channel = channel;
 	base->last_sync_timestamp = sync->timestamp;
+	lighthouse_sync_add(watchman, base, sync->timestamp);
 	lighthouse_base_handle_ootx_data_bit(watchman, base, (code & DATA_BIT));
 	lighthouse_base_handle_frame(watchman, base, sync->timestamp);
 
@@ -479,4 +482,7 @@ void lighthouse_watchman_init(struct lighthouse_watchman *watchman)
 	watchman->last_timestamp = 0;
 	watchman->last_sync.timestamp = 0;
 	watchman->last_sync.duration = 0;
+	clock_recovery_init(&watchman->clock, LIGHTHOUSE_CLOCK_HZ,
+			    LIGHTHOUSE_CLOCK_INTERVAL_NS);
+	memset(&watchman->sync, 0, sizeof(watchman->sync));
 }
@@ -13,9 +13,15 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "clock-recovery.h"
+#include "lighthouse-sync.h"
 #include "maths.h"
 #include "tracking-model.h"
 
+/* The Lighthouse receivers timestamp pulses with a 48 MHz clock */
+#define LIGHTHOUSE_CLOCK_HZ		48000000
+#define LIGHTHOUSE_CLOCK_INTERVAL_NS	100000000
+
 struct lighthouse_rotor_calibration {
 	float tilt;
 	float phase;
@@ -36,6 +42,9 @@ struct lighthouse_frame {
 	uint32_t sweep_offset[32];
 	uint16_t sweep_duration[32];
 	uint32_t frame_duration;
+	/* Sync timestamp in common Lighthouse timebase ticks, if aligned */
+	bool sync_aligned;
+	uint64_t sync_common;
 };
 
 struct lighthouse_base {
@@ -81,6 +90,9 @@ struct lighthouse_watchman {
 	struct lighthouse_sensor sensor[32];
 	struct lighthouse_pulse last_sync;
 	bool sync_lock;
+	/* Receiver clock to host time, fed by the device drivers */
+	struct clock_recovery clock;
+	struct lighthouse_sync sync;
 };
 
 void lighthouse_watchman_handle_pulse(struct lighthouse_watchman *watchman,
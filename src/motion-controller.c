@@ -5,9 +5,11 @@
  */
 #include <asm/byteorder.h>
 #include <errno.h>
+#include <json-glib/json-glib.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "motion-controller.h"
@@ -15,7 +17,21 @@
 #include "device.h"
 #include "hidraw.h"
 #include "imu.h"
+#include "json.h"
+#include "shm.h"
 #include "telemetry.h"
+#include "unpack.h"
+
+/*
+ * Inertial sensor calibration: the measurement in SI units minus bias is
+ * multiplied by the mixing matrix to correct for scale and misalignment.
+ */
+struct motion_controller_calibration {
+	vec3 acc_bias;
+	float acc_mix[9];
+	vec3 gyro_bias;
+	float gyro_mix[9];
+};
 
 struct _OuvrtMotionController {
 	OuvrtDevice dev;
@@ -25,7 +41,10 @@ struct _OuvrtMotionController {
 	uint8_t buttons;
 	uint8_t battery;
 	uint8_t touchpad[2];
+	float stick[2];
+	float trigger;
 
+	struct motion_controller_calibration calibration;
 	struct imu_state imu;
 };
 
@@ -47,25 +66,54 @@ static const struct button_map motion_controller_button_map[6] = {
 	{ MOTION_CONTROLLER_BUTTON_PAD_TOUCH, OUVRT_TOUCH_THUMB },
 };
 
+/*
+ * Applies bias and mixing matrix to a three-axis measurement in SI units.
+ */
+static void motion_controller_calibrate(const vec3 *bias, const float mix[9],
+					const double in[3], double out[3])
+{
+	const double v[3] = {
+		in[0] - bias->x,
+		in[1] - bias->y,
+		in[2] - bias->z,
+	};
+	int i;
+
+	for (i = 0; i < 3; i++)
+		out[i] = mix[3 * i] * v[0] + mix[3 * i + 1] * v[1] +
+			 mix[3 * i + 2] * v[2];
+}
+
 static void motion_controller_decode_message(OuvrtMotionController *self,
 					     const unsigned char *buf,
 					     G_GNUC_UNUSED const struct timespec *ts)
 {
+	struct motion_controller_calibration *c = &self->calibration;
 	uint8_t buttons = buf[1];
-	uint16_t stick[2] = {
-		buf[2] | ((buf[3] & 0xf) << 8),
-		((buf[3] & 0xf0) >> 4) | (buf[4] << 4),
-	};
+	uint16_t stick[2];
+	int32_t accel[3];
+	int32_t gyro[3];
+	double a[3], g[3];
+
+	unpack_le_bitfields(buf + 2, 12, 2, stick);
+
 	float joy[2] = {
 		stick[0] * 2.0 / 4095 - 1.0,
 		stick[1] * 2.0 / 4095 - 1.0,
 	};
 
-	telemetry_send_axis(self->dev.id, 0, joy, 2);
+	if (joy[0] != self->stick[0] || joy[1] != self->stick[1]) {
+		self->stick[0] = joy[0];
+		self->stick[1] = joy[1];
+		telemetry_send_axis(self->dev.id, 0, self->stick, 2);
+	}
 
 	float trigger = buf[5] / 255.0;
 
-	telemetry_send_axis(self->dev.id, 1, &trigger, 1);
+	if (trigger != self->trigger) {
+		self->trigger = trigger;
+		telemetry_send_axis(self->dev.id, 1, &self->trigger, 1);
+	}
 
 	if (self->touchpad[0] != buf[6] || self->touchpad[1] != buf[7]) {
 		self->touchpad[0] = buf[6];
@@ -76,19 +124,10 @@ static void motion_controller_decode_message(OuvrtMotionController *self,
 		self->battery = buf[8];
 	}
 
-	int32_t accel[3] = {
-		buf[9] | (buf[10] << 8) | ((int8_t)buf[11] << 16),
-		buf[12] | (buf[13] << 8) | ((int8_t)buf[14] << 16),
-		buf[15] | (buf[16] << 8) | ((int8_t)buf[17] << 16),
-	};
-
-	int32_t gyro[3] = {
-		buf[20] | (buf[21] << 8) | ((int8_t)buf[22] << 16),
-		buf[23] | (buf[24] << 8) | ((int8_t)buf[25] << 16),
-		buf[26] | (buf[27] << 8) | ((int8_t)buf[28] << 16),
-	};
+	unpack_3x24bit_le(buf + 9, accel);
+	unpack_3x24bit_le(buf + 20, gyro);
 
-	uint32_t time = buf[29] | (buf[30] << 8) | (buf[31] << 16) | (buf[32] << 24);
+	uint32_t time = unpack_le_bytes(buf + 29, 4);
 	int32_t dt = time - self->last_timestamp;
 	self->last_timestamp += dt;
 
@@ -98,6 +137,23 @@ static void motion_controller_decode_message(OuvrtMotionController *self,
 		.gyro = { gyro[0], gyro[1], gyro[2] },
 	};
 
+	telemetry_send_raw_imu_sample(self->dev.id, &raw);
+
+	/* Apply accelerometer and gyro bias and scale from the calibration */
+	const double acc_si[3] = {
+		accel[0] * STANDARD_GRAVITY / 506200.,
+		accel[1] * STANDARD_GRAVITY / 506200.,
+		accel[2] * STANDARD_GRAVITY / 506200.,
+	};
+	const double gyro_si[3] = {
+		gyro[0] * 1e-5,
+		gyro[1] * 1e-5,
+		gyro[2] * 1e-5,
+	};
+
+	motion_controller_calibrate(&c->acc_bias, c->acc_mix, acc_si, a);
+	motion_controller_calibrate(&c->gyro_bias, c->gyro_mix, gyro_si, g);
+
 	/*
 	 * Transform from IMU coordinate system into common coordinate system:
 	 *
@@ -106,20 +162,18 @@ static void motion_controller_decode_message(OuvrtMotionController *self,
 	 *    +-- x  ->  ⎢ 0  1  0 ⎥ ⎢y⎥  ->   +-- x
 	 *   /           ⎣ 0  0 -1 ⎦ ⎣z⎦      /
 	 * -z                                z
-	 *
-	 * TODO: Apply accelerometer scale and bias from the calibration data.
 	 */
 	struct imu_sample sample = {
 		.time = raw.time * 1e-7,
 		.acceleration = {
-			.x = accel[0] * STANDARD_GRAVITY / 506200.,
-			.y = accel[2] * STANDARD_GRAVITY / 506200.,
-			.z = -accel[1] * STANDARD_GRAVITY / 506200.,
+			.x = a[0],
+			.y = a[2],
+			.z = -a[1],
 		},
 		.angular_velocity = {
-			.x = gyro[0] * 1e-5,
-			.y = gyro[2] * 1e-5,
-			.z = -gyro[1] * 1e-5,
+			.x = g[0],
+			.y = g[2],
+			.z = -g[1],
 		},
 	};
 
@@ -131,19 +185,168 @@ static void motion_controller_decode_message(OuvrtMotionController *self,
 	self->imu.pose.translation.y = 0.0;
 	self->imu.pose.translation.z = 0.0;
 	telemetry_send_pose(self->dev.id, &self->imu.pose);
+	shm_publish_pose(self->dev.id, sample.time, &self->imu.pose,
+			 &sample.angular_velocity);
 
 	if (buttons != self->buttons) {
 		ouvrt_handle_buttons(self->dev.id, buttons, self->buttons,
 				     6, motion_controller_button_map);
 		self->buttons = buttons;
 	}
+
+	const float axes[] = {
+		[OUVRT_AXIS_STICK_X] = self->stick[0],
+		[OUVRT_AXIS_STICK_Y] = self->stick[1],
+		[OUVRT_AXIS_TRIGGER] = self->trigger,
+	};
+
+	shm_update_input(self->dev.id,
+			 ouvrt_button_state(buttons, 6,
+					    motion_controller_button_map),
+			 axes, G_N_ELEMENTS(axes));
 }
 
+#define SENSOR_TYPE_ACCELEROMETER "CALIBRATION_InertialSensorType_Accelerometer"
+#define SENSOR_TYPE_GYRO "CALIBRATION_InertialSensorType_Gyro"
+
 /*
- * Nothing to do here.
+ * Reads the constant terms of a temperature model array into out.
+ */
+static void motion_controller_get_temperature_model(JsonObject *object,
+						    const char *member_name,
+						    float *out, int num)
+{
+	JsonArray *array;
+	JsonNode *node;
+	int i;
+
+	array = json_object_find_array_member(object, member_name);
+	if (!array || json_array_get_length(array) != 4 * (guint)num)
+		return;
+
+	for (i = 0; i < num; i++) {
+		node = json_array_get_element(array, 4 * i);
+		if (!JSON_NODE_HOLDS_VALUE(node))
+			return;
+	}
+
+	for (i = 0; i < num; i++)
+		out[i] = json_array_get_double_element(array, 4 * i);
+}
+
+/*
+ * Parses the inertial sensor calibration from the controller's JSON
+ * configuration data. Missing or mistyped members are skipped.
+ */
+static int motion_controller_parse_calibration(OuvrtMotionController *self,
+					       const char *json)
+{
+	struct motion_controller_calibration *c = &self->calibration;
+	JsonObject *object, *sensor;
+	JsonArray *sensors;
+	JsonNode *node;
+	guint i;
+
+	node = json_from_string(json, NULL);
+	if (!node)
+		return -EINVAL;
+	if (!JSON_NODE_HOLDS_OBJECT(node)) {
+		json_node_unref(node);
+		return -EINVAL;
+	}
+
+	object = json_node_get_object(node);
+	object = json_object_find_object_member(object,
+						"CalibrationInformation");
+	sensors = json_object_find_array_member(object, "InertialSensors");
+	if (!sensors) {
+		json_node_unref(node);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < json_array_get_length(sensors); i++) {
+		const char *type;
+		float bias[3] = { 0.0f, 0.0f, 0.0f };
+		float *mix;
+		vec3 *b;
+
+		sensor = json_array_find_object_element(sensors, i);
+		type = json_object_find_string_member(sensor, "SensorType");
+		if (g_strcmp0(type, SENSOR_TYPE_ACCELEROMETER) == 0) {
+			b = &c->acc_bias;
+			mix = c->acc_mix;
+		} else if (g_strcmp0(type, SENSOR_TYPE_GYRO) == 0) {
+			b = &c->gyro_bias;
+			mix = c->gyro_mix;
+		} else {
+			continue;
+		}
+
+		motion_controller_get_temperature_model(sensor,
+			"BiasTemperatureModel", bias, 3);
+		motion_controller_get_temperature_model(sensor,
+			"MixingMatrixTemperatureModel", mix, 9);
+		b->x = bias[0];
+		b->y = bias[1];
+		b->z = bias[2];
+	}
+
+	json_node_unref(node);
+
+	return 0;
+}
+
+/*
+ * Loads the calibration data provided as <serial>.wmrcontroller in the user
+ * configuration directory. The controller firmware stores this JSON in an
+ * obfuscated configuration block that can not be read back yet, so it has to
+ * be exported from another driver. Without calibration data, the nominal
+ * sensor scale is used.
  */
-static int motion_controller_start(G_GNUC_UNUSED OuvrtDevice *dev)
+static void motion_controller_load_calibration(OuvrtMotionController *self)
 {
+	struct motion_controller_calibration *c = &self->calibration;
+	char *filename;
+	char *json;
+	int ret;
+
+	memset(c, 0, sizeof(*c));
+	c->acc_mix[0] = c->acc_mix[4] = c->acc_mix[8] = 1.0f;
+	c->gyro_mix[0] = c->gyro_mix[4] = c->gyro_mix[8] = 1.0f;
+
+	if (!self->dev.serial)
+		return;
+
+	filename = g_strdup_printf("%s/ouvrt/%s.wmrcontroller",
+				   g_get_user_config_dir(), self->dev.serial);
+	if (!g_file_get_contents(filename, &json, NULL, NULL)) {
+		g_print("%s: No calibration data in %s, using defaults\n",
+			self->dev.name, filename);
+		g_free(filename);
+		return;
+	}
+	g_free(filename);
+
+	ret = motion_controller_parse_calibration(self, json);
+	if (ret < 0) {
+		g_print("%s: Failed to parse calibration data\n",
+			self->dev.name);
+	} else {
+		g_print("%s: Read calibration data\n", self->dev.name);
+	}
+
+	g_free(json);
+}
+
+/*
+ * Loads the calibration data.
+ */
+static int motion_controller_start(OuvrtDevice *dev)
+{
+	OuvrtMotionController *self = OUVRT_MOTION_CONTROLLER(dev);
+
+	motion_controller_load_calibration(self);
+
 	return 0;
 }
 
@@ -13,69 +13,353 @@ extern "C" {
 #include "maths.h"
 }
 
+/* Hypotheses evaluated in parallel between termination checks */
+#define ACQUISITION_BATCH		32
+/* Maximum reprojection error of inliers, in pixels */
+#define ACQUISITION_INLIER_ERROR	2.0
+/* Probability of having drawn at least one outlier free sample */
+#define ACQUISITION_CONFIDENCE		0.99
 
-extern "C" void estimate_initial_pose(struct blob *blobs, int num_blobs,
-				      vec3 *leds, int num_pos,
-				      dmat3 *camera_matrix, double *dist_coeffs,
-				      dquat &rot, dvec3 &trans,
-				      bool use_extrinsic_guess)
+/*
+ * Collects the model points and blob positions of all identified LEDs,
+ * using the first blob for each LED.
+ *
+ * Returns the number of correspondences.
+ */
+static int collect_points(struct blob *blobs, int num_blobs, vec3 *leds,
+			  int num_pos, std::vector<cv::Point3f> &points3d,
+			  std::vector<cv::Point2f> &points2d)
 {
-	int i, j;
-	int num_leds = 0;
 	uint64_t taken = 0;
-	int flags = CV_ITERATIVE;
-	cv::Mat inliers;
-	int iterationsCount = 50;
-	float reprojectionError = 1.0;
-	float confidence = 0.95;
-	cv::Mat A = cv::Mat(3, 3, CV_64FC1, camera_matrix->m);
-	cv::Mat distCoeffs = cv::Mat(5, 1, CV_64FC1, dist_coeffs);
-	cv::Mat rvec = cv::Mat::zeros(3, 1, CV_64FC1);
-	cv::Mat tvec = cv::Mat(3, 1, CV_64FC1, (double *)&trans);
-	cv::Mat R = cv::Mat(3, 3, CV_64FC1, (double *)&rot);
-	cv::Rodrigues(R, rvec);
+	int i;
+
+	points3d.clear();
+	points2d.clear();
 
-	/* count identified leds */
 	for (i = 0; i < num_blobs; i++) {
 		if (blobs[i].led_id < 0 || blobs[i].led_id >= num_pos)
 			continue;
 		if (taken & (1ULL << blobs[i].led_id))
 			continue;
 		taken |= (1ULL << blobs[i].led_id);
-		num_leds++;
+		points3d.push_back(cv::Point3f(leds[blobs[i].led_id].x,
+					       leds[blobs[i].led_id].y,
+					       leds[blobs[i].led_id].z));
+		points2d.push_back(cv::Point2f(blobs[i].x, blobs[i].y));
 	}
 
-	if (num_leds < 4)
-		return;
+	return points3d.size();
+}
 
-	std::vector<cv::Point3f> list_points3d(num_leds);
-	std::vector<cv::Point2f> list_points2d(num_leds);
+static void rvec_to_dquat(const cv::Mat &rvec, dquat *rot)
+{
+	dvec3 v;
+	double angle = sqrt(rvec.dot(rvec));
+	double inorm = 1.0f / angle;
 
-	taken = 0;
-	for (i = 0, j = 0; i < num_blobs && j < num_leds; i++) {
-		if (blobs[i].led_id < 0)
-			continue;
-		if (taken & (1ULL << blobs[i].led_id))
-			continue;
-		taken |= (1ULL << blobs[i].led_id);
-		list_points3d[j].x = leds[blobs[i].led_id].x;
-		list_points3d[j].y = leds[blobs[i].led_id].y;
-		list_points3d[j].z = leds[blobs[i].led_id].z;
-		list_points2d[j].x = blobs[i].x;
-		list_points2d[j].y = blobs[i].y;
-		j++;
+	if (angle == 0.0) {
+		rot->x = rot->y = rot->z = 0.0;
+		rot->w = 1.0;
+		return;
 	}
 
+	v.x = rvec.at<double>(0) * inorm;
+	v.y = rvec.at<double>(1) * inorm;
+	v.z = rvec.at<double>(2) * inorm;
+	dquat_from_axis_angle(rot, &v, angle);
+}
+
+/*
+ * Converts the unit quaternion into a rotation vector, the rotation axis
+ * scaled by the rotation angle.
+ */
+static void dquat_to_rvec(const dquat *rot, cv::Mat &rvec)
+{
+	double s = sqrt(rot->x * rot->x + rot->y * rot->y + rot->z * rot->z);
+	double scale = s > 0.0 ? 2.0 * atan2(s, rot->w) / s : 2.0;
+
+	rvec.at<double>(0) = rot->x * scale;
+	rvec.at<double>(1) = rot->y * scale;
+	rvec.at<double>(2) = rot->z * scale;
+}
+
+/*
+ * Estimates the pose from identified blobs using at most the given number of
+ * RANSAC iterations.
+ *
+ * Returns the fraction of identified LEDs that are RANSAC inliers, or 0 if
+ * the pose could not be estimated.
+ */
+extern "C" double estimate_initial_pose(struct blob *blobs, int num_blobs,
+					vec3 *leds, int num_pos,
+					dmat3 *camera_matrix,
+					double *dist_coeffs,
+					dquat &rot, dvec3 &trans,
+					bool use_extrinsic_guess,
+					int iterationsCount)
+{
+	int num_leds;
+	int flags = cv::SOLVEPNP_ITERATIVE;
+	cv::Mat inliers;
+	float reprojectionError = 1.0;
+	float confidence = 0.95;
+	cv::Mat A = cv::Mat(3, 3, CV_64FC1, camera_matrix->m);
+	cv::Mat distCoeffs = cv::Mat(5, 1, CV_64FC1, dist_coeffs);
+	cv::Mat rvec = cv::Mat::zeros(3, 1, CV_64FC1);
+	cv::Mat tvec = cv::Mat(3, 1, CV_64FC1, (double *)&trans);
+
+	dquat_to_rvec(&rot, rvec);
+
+	std::vector<cv::Point3f> list_points3d;
+	std::vector<cv::Point2f> list_points2d;
+
+	num_leds = collect_points(blobs, num_blobs, leds, num_pos,
+				  list_points3d, list_points2d);
+	if (num_leds < 4 || iterationsCount <= 0)
+		return 0.0;
+
 	cv::solvePnPRansac(list_points3d, list_points2d, A, distCoeffs, rvec, tvec,
 			   use_extrinsic_guess, iterationsCount, reprojectionError,
 			   confidence, inliers, flags);
 
-	dvec3 v;
-	double angle = sqrt(rvec.dot(rvec));
-	double inorm = 1.0f / angle;
+	rvec_to_dquat(rvec, &rot);
 
-	v.x = rvec.at<double>(0) * inorm;
-	v.y = rvec.at<double>(1) * inorm;
-	v.z = rvec.at<double>(2) * inorm;
-	dquat_from_axis_angle(&rot, &v, angle);
+	return (double)inliers.rows / num_leds;
+}
+
+struct pose_hypothesis {
+	cv::Mat rvec;
+	cv::Mat tvec;
+	int inliers;
+	double error;
+};
+
+/*
+ * Returns true if hypothesis a explains more correspondences than b, or the
+ * same number with a lower reprojection error.
+ */
+static bool hypothesis_better(const struct pose_hypothesis &a,
+			      const struct pose_hypothesis &b)
+{
+	return a.inliers > b.inliers ||
+	       (a.inliers == b.inliers && a.error < b.error);
+}
+
+/*
+ * Counts the correspondences that the given pose reprojects to within the
+ * inlier error, and sums their squared reprojection errors.
+ */
+static int count_inliers(const std::vector<cv::Point3f> &points3d,
+			 const std::vector<cv::Point2f> &points2d,
+			 const cv::Mat &A, const cv::Mat &distCoeffs,
+			 const cv::Mat &rvec, const cv::Mat &tvec,
+			 double *error, std::vector<bool> *mask)
+{
+	const double max_error2 = ACQUISITION_INLIER_ERROR *
+				  ACQUISITION_INLIER_ERROR;
+	std::vector<cv::Point2f> projected;
+	int inliers = 0;
+	size_t i;
+
+	cv::projectPoints(points3d, rvec, tvec, A, distCoeffs, projected);
+
+	*error = 0.0;
+	for (i = 0; i < points2d.size(); i++) {
+		double dx = projected[i].x - points2d[i].x;
+		double dy = projected[i].y - points2d[i].y;
+		bool inlier = dx * dx + dy * dy < max_error2;
+
+		if (inlier) {
+			inliers++;
+			*error += dx * dx + dy * dy;
+		}
+		if (mask)
+			(*mask)[i] = inlier;
+	}
+
+	return inliers;
+}
+
+/*
+ * Generates and scores pose hypotheses from minimal samples of four
+ * correspondences. Hypothesis k always draws its sample from a random number
+ * generator seeded with seed and k, so that the results do not depend on the
+ * number of threads or on how the hypotheses are distributed among them.
+ */
+class HypothesisBody : public cv::ParallelLoopBody {
+public:
+	HypothesisBody(const std::vector<cv::Point3f> &points3d,
+		       const std::vector<cv::Point2f> &points2d,
+		       const cv::Mat &A, const cv::Mat &distCoeffs,
+		       uint64_t seed, int first,
+		       std::vector<struct pose_hypothesis> &results) :
+		points3d(points3d), points2d(points2d), A(A),
+		distCoeffs(distCoeffs), seed(seed), first(first),
+		results(results)
+	{
+	}
+
+	void operator()(const cv::Range &range) const
+	{
+		for (int i = range.start; i < range.end; i++)
+			evaluate(first + i, results[i]);
+	}
+
+private:
+	void evaluate(int k, struct pose_hypothesis &h) const
+	{
+		cv::RNG rng(seed + (uint64_t)k * 0x9e3779b97f4a7c15ULL);
+		std::vector<cv::Point3f> sample3d(4);
+		std::vector<cv::Point2f> sample2d(4);
+		int n = points3d.size();
+		int idx[4];
+		int i, j;
+
+		for (i = 0; i < 4; i++) {
+			do {
+				idx[i] = rng.uniform(0, n);
+				for (j = 0; j < i && idx[j] != idx[i]; j++);
+			} while (j < i);
+			sample3d[i] = points3d[idx[i]];
+			sample2d[i] = points2d[idx[i]];
+		}
+
+		h.inliers = 0;
+		h.error = 0.0;
+		h.rvec = cv::Mat::zeros(3, 1, CV_64FC1);
+		h.tvec = cv::Mat::zeros(3, 1, CV_64FC1);
+		cv::solvePnP(sample3d, sample2d, A, distCoeffs, h.rvec, h.tvec,
+			     false, cv::SOLVEPNP_P3P);
+
+		/* Reject failed solutions and poses behind the camera */
+		if (!cv::checkRange(h.rvec) || !cv::checkRange(h.tvec) ||
+		    h.tvec.at<double>(2) <= 0.0)
+			return;
+
+		h.inliers = count_inliers(points3d, points2d, A, distCoeffs,
+					  h.rvec, h.tvec, &h.error, NULL);
+	}
+
+	const std::vector<cv::Point3f> &points3d;
+	const std::vector<cv::Point2f> &points2d;
+	const cv::Mat &A;
+	const cv::Mat &distCoeffs;
+	uint64_t seed;
+	int first;
+	std::vector<struct pose_hypothesis> &results;
+};
+
+/*
+ * Acquires the pose from identified blobs without a prior pose, evaluating
+ * batches of hypotheses on all OpenCV worker threads. The search terminates
+ * early as soon as enough hypotheses were tried to find an outlier free
+ * sample with the desired confidence, given the best inlier ratio so far.
+ * The best hypothesis is refined on its inliers. For a given seed, the
+ * result is reproducible.
+ *
+ * Returns the fraction of identified LEDs that are inliers, or 0 if the
+ * pose could not be estimated. The number of hypotheses evaluated is
+ * returned in num_hypotheses.
+ */
+extern "C" double acquire_initial_pose(struct blob *blobs, int num_blobs,
+				       vec3 *leds, int num_pos,
+				       dmat3 *camera_matrix,
+				       double *dist_coeffs,
+				       dquat *rot, dvec3 *trans,
+				       int max_hypotheses, uint64_t seed,
+				       int *num_hypotheses)
+{
+	cv::Mat A = cv::Mat(3, 3, CV_64FC1, camera_matrix->m);
+	cv::Mat distCoeffs = cv::Mat(5, 1, CV_64FC1, dist_coeffs);
+	std::vector<cv::Point3f> points3d;
+	std::vector<cv::Point2f> points2d;
+	std::vector<struct pose_hypothesis> results(ACQUISITION_BATCH);
+	struct pose_hypothesis best;
+	double w, needed;
+	int num_leds;
+	int done = 0;
+	int i, batch;
+
+	*num_hypotheses = 0;
+
+	num_leds = collect_points(blobs, num_blobs, leds, num_pos,
+				  points3d, points2d);
+	if (num_leds < 4 || max_hypotheses <= 0)
+		return 0.0;
+
+	best.inliers = 0;
+	best.error = 0.0;
+
+	while (done < max_hypotheses) {
+		batch = std::min(ACQUISITION_BATCH, max_hypotheses - done);
+		cv::parallel_for_(cv::Range(0, batch),
+				  HypothesisBody(points3d, points2d, A,
+						 distCoeffs, seed, done,
+						 results));
+		done += batch;
+
+		/*
+		 * Scan in order, so that ties go to the lowest index. The
+		 * result matrices are reused by the next batch, so the best
+		 * pose has to be copied out.
+		 */
+		for (i = 0; i < batch; i++) {
+			if (!hypothesis_better(results[i], best))
+				continue;
+			best.rvec = results[i].rvec.clone();
+			best.tvec = results[i].tvec.clone();
+			best.inliers = results[i].inliers;
+			best.error = results[i].error;
+		}
+
+		if (best.inliers < 4)
+			continue;
+		if (best.inliers == num_leds)
+			break;
+		w = (double)best.inliers / num_leds;
+		needed = log(1.0 - ACQUISITION_CONFIDENCE) /
+			 log(1.0 - w * w * w * w);
+		if (done >= needed)
+			break;
+	}
+
+	*num_hypotheses = done;
+
+	if (best.inliers < 4)
+		return 0.0;
+
+	/* Refine the best hypothesis using all of its inliers */
+	std::vector<bool> mask(num_leds);
+	std::vector<cv::Point3f> inliers3d;
+	std::vector<cv::Point2f> inliers2d;
+	cv::Mat rvec = best.rvec.clone();
+	cv::Mat tvec = best.tvec.clone();
+	double error;
+	int inliers;
+
+	count_inliers(points3d, points2d, A, distCoeffs, best.rvec, best.tvec,
+		      &error, &mask);
+	for (i = 0; i < num_leds; i++) {
+		if (!mask[i])
+			continue;
+		inliers3d.push_back(points3d[i]);
+		inliers2d.push_back(points2d[i]);
+	}
+	cv::solvePnP(inliers3d, inliers2d, A, distCoeffs, rvec, tvec, true,
+		     cv::SOLVEPNP_ITERATIVE);
+
+	inliers = count_inliers(points3d, points2d, A, distCoeffs, rvec, tvec,
+				&error, NULL);
+	if (inliers < best.inliers) {
+		rvec = best.rvec;
+		tvec = best.tvec;
+		inliers = best.inliers;
+	}
+
+	rvec_to_dquat(rvec, rot);
+	trans->x = tvec.at<double>(0);
+	trans->y = tvec.at<double>(1);
+	trans->z = tvec.at<double>(2);
+
+	return (double)inliers / num_leds;
 }
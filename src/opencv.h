@@ -6,19 +6,28 @@
 #ifndef __OPENCV_H__
 #define __OPENCV_H__
 
+#include <stdint.h>
+
 #include "maths.h"
 
 #if HAVE_OPENCV
-void estimate_initial_pose(struct blob *blobs, int num_blobs,
-			   vec3 *leds, int num_leds,
-			   dmat3 *camera_matrix, double dist_coeffs[5],
-			   dquat *rot, dvec3 *trans, bool use_extrinsic_guess);
+double estimate_initial_pose(struct blob *blobs, int num_blobs,
+			     vec3 *leds, int num_leds,
+			     dmat3 *camera_matrix, double dist_coeffs[5],
+			     dquat *rot, dvec3 *trans, bool use_extrinsic_guess,
+			     int iterations);
+double acquire_initial_pose(struct blob *blobs, int num_blobs,
+			    vec3 *leds, int num_leds,
+			    dmat3 *camera_matrix, double dist_coeffs[5],
+			    dquat *rot, dvec3 *trans, int max_hypotheses,
+			    uint64_t seed, int *num_hypotheses);
 #else
 static inline
-void estimate_initial_pose(struct blob *blobs, int num_blobs,
-			   vec3 *leds, int num_leds,
-			   dmat3 *camera_matrix, double dist_coeffs[5],
-			   dquat *rot, dvec3 *trans, bool use_extrinsic_guess)
+double estimate_initial_pose(struct blob *blobs, int num_blobs,
+			     vec3 *leds, int num_leds,
+			     dmat3 *camera_matrix, double dist_coeffs[5],
+			     dquat *rot, dvec3 *trans, bool use_extrinsic_guess,
+			     int iterations)
 {
 	(void)blobs;
 	(void)num_blobs;
@@ -29,6 +38,32 @@ void estimate_initial_pose(struct blob *blobs, int num_blobs,
 	(void)rot;
 	(void)trans;
 	(void)use_extrinsic_guess;
+	(void)iterations;
+
+	return 0.0;
+}
+
+static inline
+double acquire_initial_pose(struct blob *blobs, int num_blobs,
+			    vec3 *leds, int num_leds,
+			    dmat3 *camera_matrix, double dist_coeffs[5],
+			    dquat *rot, dvec3 *trans, int max_hypotheses,
+			    uint64_t seed, int *num_hypotheses)
+{
+	(void)blobs;
+	(void)num_blobs;
+	(void)leds;
+	(void)num_leds;
+	(void)camera_matrix;
+	(void)dist_coeffs;
+	(void)rot;
+	(void)trans;
+	(void)max_hypotheses;
+	(void)seed;
+
+	*num_hypotheses = 0;
+
+	return 0.0;
 }
 #endif /* HAVE_OPENCV */
 
@@ -8,6 +8,7 @@
 #include <glib.h>
 #include <gio/gio.h>
 #include <libudev.h>
+#include <limits.h>
 #include <locale.h>
 #include <poll.h>
 #include <signal.h>
@@ -15,21 +16,28 @@
 #include <stdlib.h>
 #include <sys/fcntl.h>
 
+#include "budget.h"
 #include "dbus.h"
 #include "debug.h"
 #include "device.h"
+#include "frame-pool.h"
 #include "usb-ids.h"
 #include "psvr.h"
 #include "rift.h"
 #include "rift-sensor.h"
 #include "camera-dk2.h"
+#include "camera-v4l2.h"
 #include "hololens-camera.h"
 #include "hololens-camera2.h"
 #include "hololens-imu.h"
 #include "motion-controller.h"
 #include "lenovo-explorer.h"
 #include "pipewire.h"
+#include "pose-stream.h"
+#include "recorder.h"
+#include "shm.h"
 #include "telemetry.h"
+#include "usb-device.h"
 #include "vive-headset.h"
 #include "vive-headset-mainboard.h"
 #include "vive-controller.h"
@@ -163,6 +171,9 @@ GMainLoop *loop = NULL;
 GList *device_list = NULL;
 static int num_devices;
 
+/* Explicit Rift Sensor serial to Rift CV1 HMD serial assignments */
+static GHashTable *sensor_groups;
+
 /*
  * Compares the device's parent against a given parent.
  */
@@ -214,21 +225,92 @@ static void ouvrt_link_rift_dk2(OuvrtDevice *dev)
 	ouvrt_camera_dk2_set_tracker(camera, ouvrt_rift_get_tracker(rift));
 }
 
-static void ouvrt_link_rift_sensor_to_rift(gpointer data, gpointer user_data)
+/*
+ * Returns the number of Rift Sensors currently linked to the given HMD.
+ */
+static int ouvrt_rift_count_sensors(OuvrtRift *rift)
 {
-	OuvrtRift *rift = OUVRT_RIFT(user_data);
-	OuvrtRiftSensor *camera;
+	OuvrtTracker *tracker = ouvrt_rift_get_tracker(rift);
+	GList *link;
+	int count = 0;
 
-	if (!OUVRT_IS_RIFT_SENSOR(data))
-		return;
+	for (link = device_list; link != NULL; link = link->next) {
+		if (OUVRT_IS_RIFT_SENSOR(link->data) &&
+		    ouvrt_rift_sensor_get_tracker(link->data) == tracker)
+			count++;
+	}
+
+	return count;
+}
+
+/*
+ * Chooses the Rift CV1 HMD a Rift Sensor should be grouped with. A sensor
+ * explicitly assigned to an HMD serial on the command line is only grouped
+ * with that HMD. Otherwise the HMD whose radio the sensor was last
+ * synchronised to is preferred, falling back to the HMD with the fewest
+ * sensors. HMDs whose radio address is not known yet are not considered.
+ */
+static OuvrtRift *ouvrt_rift_sensor_find_group(OuvrtRiftSensor *camera)
+{
+	static const uint8_t zero[5] = { 0 };
+	OuvrtDevice *dev = OUVRT_DEVICE(camera);
+	uint8_t last_address[5], address[5];
+	const char *hmd_serial = NULL;
+	OuvrtRift *best = NULL;
+	int best_count = INT_MAX;
+	gboolean have_last;
+	GList *link;
+
+	if (sensor_groups && dev->serial)
+		hmd_serial = g_hash_table_lookup(sensor_groups, dev->serial);
+	have_last = ouvrt_rift_sensor_get_last_radio_address(camera,
+							      last_address);
+
+	for (link = device_list; link != NULL; link = link->next) {
+		OuvrtRift *rift;
+		int count;
+
+		if (!OUVRT_IS_RIFT(link->data))
+			continue;
+		rift = OUVRT_RIFT(link->data);
+
+		ouvrt_tracker_get_radio_address(ouvrt_rift_get_tracker(rift),
+						address);
+		if (memcmp(address, zero, 5) == 0)
+			continue;
 
-	camera = OUVRT_RIFT_SENSOR(data);
+		if (hmd_serial) {
+			if (g_strcmp0(OUVRT_DEVICE(rift)->serial,
+				      hmd_serial) == 0)
+				return rift;
+			continue;
+		}
 
-	if (!rift || !camera) {
-		rift = OUVRT_RIFT(data);
-		camera = OUVRT_RIFT_SENSOR(user_data);
+		if (have_last && memcmp(address, last_address, 5) == 0)
+			return rift;
+
+		count = ouvrt_rift_count_sensors(rift);
+		if (count < best_count) {
+			best = rift;
+			best_count = count;
+		}
 	}
-	if (!rift || !camera)
+
+	return best;
+}
+
+/*
+ * Links an unassigned Rift Sensor to the HMD chosen for it, if any.
+ */
+static void ouvrt_link_rift_sensor(OuvrtRiftSensor *camera)
+{
+	OuvrtRift *rift;
+
+	if (ouvrt_rift_sensor_get_tracker(camera))
+		return;
+
+	rift = ouvrt_rift_sensor_find_group(camera);
+	if (!rift)
 		return;
 
 	g_print("Associate %s and %s\n", OUVRT_DEVICE(rift)->devnode,
@@ -238,25 +320,40 @@ static void ouvrt_link_rift_sensor_to_rift(gpointer data, gpointer user_data)
 }
 
 /*
- * Links Rift CV1 HMD and Sensor CV1 cameras.
+ * Links Rift CV1 HMDs and Sensor CV1 cameras. Each HMD forms a group with
+ * its own tracker, so that multiple HMDs can be tracked independently by
+ * the same daemon. Sensors are never moved from one group to another while
+ * both devices are present.
+ * This is rerun for all unassigned sensors whenever an HMD or a sensor
+ * appears or an HMD disappears, so the grouping does not depend on the
+ * order in which the devices are discovered and started.
  */
-static void ouvrt_link_rift_cv1(OuvrtDevice *dev)
+static void ouvrt_link_rift_cv1(void)
 {
-	if (OUVRT_IS_RIFT(dev)) {
-		g_list_foreach(device_list, ouvrt_link_rift_sensor_to_rift, dev);
-		return;
+	GList *link;
+
+	for (link = device_list; link != NULL; link = link->next) {
+		if (OUVRT_IS_RIFT_SENSOR(link->data))
+			ouvrt_link_rift_sensor(link->data);
 	}
+}
 
-	if (OUVRT_IS_RIFT_SENSOR(dev)) {
-		GList *link;
+/*
+ * Unlinks all Rift Sensors from a removed HMD and tries to regroup them with
+ * the remaining HMDs.
+ */
+static void ouvrt_unlink_rift_cv1(OuvrtRift *rift)
+{
+	OuvrtTracker *tracker = ouvrt_rift_get_tracker(rift);
+	GList *link;
 
-		for (link = device_list; link != NULL; link = link->next) {
-			if (OUVRT_IS_RIFT(link->data)) {
-				ouvrt_link_rift_sensor_to_rift(dev, link->data);
-				return;
-			}
-		}
+	for (link = device_list; link != NULL; link = link->next) {
+		if (OUVRT_IS_RIFT_SENSOR(link->data) &&
+		    ouvrt_rift_sensor_get_tracker(link->data) == tracker)
+			ouvrt_rift_sensor_set_tracker(link->data, NULL);
 	}
+
+	ouvrt_link_rift_cv1();
 }
 
 /*
@@ -447,10 +544,15 @@ static void ouvrtd_device_add(struct udev_device *dev)
 		ouvrt_link_rift_dk2(d);
 	}
 
-	ouvrt_link_rift_cv1(d);
-
 	device_list = g_list_append(device_list, d);
 
+	/*
+	 * Sensors can be linked before they are started, HMDs only after
+	 * start, when their radio address is known.
+	 */
+	if (OUVRT_IS_RIFT_SENSOR(d))
+		ouvrt_link_rift_cv1();
+
 	for (j = 0; j < device_matches[i].num_interfaces; j++) {
 		if (d->devnodes[j] == NULL)
 			return;
@@ -458,6 +560,8 @@ static void ouvrtd_device_add(struct udev_device *dev)
 
 start:
 	ouvrt_device_start(d);
+	if (OUVRT_IS_RIFT(d) || OUVRT_IS_RIFT_SENSOR(d))
+		ouvrt_link_rift_cv1();
 	ouvrt_dbus_export_device(d);
 }
 
@@ -491,6 +595,8 @@ static int ouvrtd_device_remove(struct udev_device *dev)
 
 	g_print("Removing device: %s\n", devnode);
 	device_list = g_list_remove_link(device_list, link);
+	if (OUVRT_IS_RIFT(d))
+		ouvrt_unlink_rift_cv1(OUVRT_RIFT(d));
 	g_object_unref(d);
 	g_list_free_1(link);
 	num_devices--;
@@ -644,14 +750,69 @@ static void ouvrtd_usage(void)
 {
 	g_print("ouvrtd [OPTIONS...] ...\n\n"
 		"Positional tracking daemon for Oculus VR Rift DK2.\n\n"
-		"  -h --help          Show this help\n");
+		"  -h --help          Show this help\n"
+		"  -b --pose-stream-bind ADDR\n"
+		"                     Bind the pose stream to the IPv4 address\n"
+		"                     ADDR, default: 127.0.0.1\n"
+		"  -d --drop-stale-frames\n"
+		"                     Only process the newest V4L2 camera frame\n"
+		"  -g --high-rate-gyro\n"
+		"                     Publish 8 kHz WMR gyro samples to shared memory\n"
+		"  -G --haptics-group GROUP\n"
+		"                     Let members of GROUP send haptics commands\n"
+		"                     via shared memory\n"
+		"  -H --hugepages     Back camera frame buffers with huge pages\n"
+		"  -l --latency-target MS\n"
+		"                     Tracking latency target per frame,\n"
+		"                     default: frame interval\n"
+		"  -m --mlock         Lock camera frame buffers into memory\n"
+		"  -p --pose-stream PORT\n"
+		"                     Stream poses to UDP clients on PORT\n"
+		"  -r --record DIR    Record sparse encoded camera frames\n"
+		"  -s --sensor-group SENSOR=HMD\n"
+		"                     Group Rift Sensor and Rift CV1 by\n"
+		"                     serial, can be repeated\n"
+		"  -u --usb-threads N Number of USB event handling threads,\n"
+		"                     default: 1\n"
+		"  -z --sparse-debug  Sparse encode grayscale debug streams\n");
 }
 
 static const struct option ouvrtd_options[] = {
 	{ "help", no_argument, NULL, 'h' },
+	{ "pose-stream-bind", required_argument, NULL, 'b' },
+	{ "drop-stale-frames", no_argument, NULL, 'd' },
+	{ "high-rate-gyro", no_argument, NULL, 'g' },
+	{ "haptics-group", required_argument, NULL, 'G' },
+	{ "hugepages", no_argument, NULL, 'H' },
+	{ "latency-target", required_argument, NULL, 'l' },
+	{ "mlock", no_argument, NULL, 'm' },
+	{ "pose-stream", required_argument, NULL, 'p' },
+	{ "record", required_argument, NULL, 'r' },
+	{ "sensor-group", required_argument, NULL, 's' },
+	{ "usb-threads", required_argument, NULL, 'u' },
+	{ "sparse-debug", no_argument, NULL, 'z' },
 	{ NULL }
 };
 
+/*
+ * Parses a SENSOR=HMD serial pair and stores the explicit assignment.
+ */
+static int ouvrtd_add_sensor_group(const char *arg)
+{
+	const char *sep = strchr(arg, '=');
+
+	if (!sep || sep == arg || !sep[1])
+		return -EINVAL;
+
+	if (!sensor_groups)
+		sensor_groups = g_hash_table_new_full(g_str_hash, g_str_equal,
+						      g_free, g_free);
+	g_hash_table_insert(sensor_groups, g_strndup(arg, sep - arg),
+			    g_strdup(sep + 1));
+
+	return 0;
+}
+
 /*
  * Main function. Initialize GStreamer for debugging purposes and udev for
  * device detection.
@@ -670,10 +831,51 @@ int main(int argc, char *argv[])
 	telemetry_init(&argc, &argv);
 
 	do {
-		ret = getopt_long(argc, argv, "h", ouvrtd_options, &longind);
+		ret = getopt_long(argc, argv, "hb:dgG:Hl:mp:r:s:u:z",
+				  ouvrtd_options, &longind);
 		switch (ret) {
 		case -1:
 			break;
+		case 'b':
+			pose_stream_address = optarg;
+			break;
+		case 'd':
+			camera_v4l2_drop_stale_frames = true;
+			break;
+		case 'g':
+			hololens_imu_high_rate = true;
+			break;
+		case 'G':
+			shm_haptics_group = optarg;
+			break;
+		case 'H':
+			frame_pool_flags |= FRAME_POOL_HUGEPAGES;
+			break;
+		case 'l':
+			tracking_latency_target = 1e-3 * atof(optarg);
+			break;
+		case 'm':
+			frame_pool_flags |= FRAME_POOL_LOCKED;
+			break;
+		case 'p':
+			pose_stream_port = atoi(optarg);
+			break;
+		case 'r':
+			recorder_directory = optarg;
+			break;
+		case 's':
+			if (ouvrtd_add_sensor_group(optarg) < 0) {
+				g_print("Invalid sensor group: %s\n", optarg);
+				ouvrtd_usage();
+				exit(1);
+			}
+			break;
+		case 'u':
+			usb_event_threads = atoi(optarg);
+			break;
+		case 'z':
+			debug_stream_sparse = true;
+			break;
 		case 'h':
 		default:
 			ouvrtd_usage();
@@ -681,6 +883,14 @@ int main(int argc, char *argv[])
 		}
 	} while (ret != -1);
 
+	ret = shm_init(&argc, &argv);
+	if (ret < 0)
+		g_print("Failed to create shared memory output: %d\n", ret);
+
+	ret = pose_stream_init();
+	if (ret < 0)
+		g_print("Failed to start pose streaming: %d\n", ret);
+
 	signal(SIGINT, ouvrtd_signal_handler);
 
 	udev = udev_new();
@@ -696,6 +906,10 @@ int main(int argc, char *argv[])
 	g_bus_unown_name(owner_id);
 	udev_unref(udev);
 	g_main_loop_unref(loop);
+	if (sensor_groups)
+		g_hash_table_destroy(sensor_groups);
+	pose_stream_deinit();
+	shm_deinit();
 	telemetry_deinit();
 	pipewire_deinit();
 	debug_stream_deinit();
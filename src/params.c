@@ -0,0 +1,202 @@
+/*
+ * Runtime tunable tracking parameters
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blobwatch.h"
+#include "budget.h"
+#include "params.h"
+
+const struct tracking_param_desc tracking_params[NUM_TRACKING_PARAMS] = {
+	[PARAM_BLOB_THRESHOLD] = {
+		"blob-threshold", BLOBWATCH_THRESHOLD, 1, 254,
+	},
+	[PARAM_BLOB_MAX_ASPECT] = {
+		/* Integer ratio, 1 would reject all blobs */
+		"blob-max-aspect", BLOBWATCH_MAX_ASPECT, 2, 16,
+	},
+	[PARAM_FLICKER_HYSTERESIS] = {
+		"flicker-hysteresis", BLOBWATCH_FLICKER_HYSTERESIS, 0, 100,
+	},
+	[PARAM_SOLVER_MIN_ITERATIONS] = {
+		"solver-min-iterations", TRACKING_SOLVER_MIN_ITERATIONS,
+		1, 1000,
+	},
+	[PARAM_SOLVER_MAX_ITERATIONS] = {
+		"solver-max-iterations", TRACKING_SOLVER_MAX_ITERATIONS,
+		1, 1000,
+	},
+	[PARAM_SOLVER_CONFIDENCE] = {
+		"solver-confidence", TRACKING_SOLVER_CONFIDENCE, 0.5, 0.9999,
+	},
+	/* 0 selects the default latency target */
+	[PARAM_LATENCY_TARGET] = {
+		"latency-target", 0.0, 0.0, 1.0,
+	},
+};
+
+/*
+ * Frees all retired parameter blocks the reader has moved past. The reader
+ * announces the generation of the block it uses at each frame boundary, so
+ * any block with an older generation is not referenced anymore.
+ */
+static void tracking_config_reclaim(struct tracking_config *config)
+{
+	uint64_t reader_gen = __atomic_load_n(&config->reader_gen,
+					      __ATOMIC_ACQUIRE);
+	struct tracking_param_block **link = &config->retired;
+	struct tracking_param_block *block;
+
+	while ((block = *link)) {
+		if (block->gen < reader_gen) {
+			*link = block->retired;
+			free(block);
+		} else {
+			link = &block->retired;
+		}
+	}
+}
+
+struct tracking_config *tracking_config_new(void)
+{
+	struct tracking_config *config;
+	struct tracking_param_block *block;
+	int i;
+
+	config = calloc(1, sizeof(*config));
+	block = calloc(1, sizeof(*block));
+	if (!config || !block) {
+		free(config);
+		free(block);
+		return NULL;
+	}
+
+	for (i = 0; i < NUM_TRACKING_PARAMS; i++)
+		block->value[i] = tracking_params[i].def;
+	config->current = block;
+
+	return config;
+}
+
+/*
+ * Frees the configuration. The reader thread must be stopped already.
+ */
+void tracking_config_free(struct tracking_config *config)
+{
+	struct tracking_param_block *block, *next;
+
+	if (!config)
+		return;
+
+	for (block = config->retired; block; block = next) {
+		next = block->retired;
+		free(block);
+	}
+	free(config->current);
+	free(config);
+}
+
+/*
+ * Returns the index of the named parameter, or -EINVAL.
+ */
+int tracking_config_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_TRACKING_PARAMS; i++) {
+		if (strcmp(tracking_params[i].name, name) == 0)
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Publishes a copy of the current parameter block with the named parameter
+ * changed. The reader picks it up at its next frame boundary. Must only be
+ * called from a single writer thread.
+ */
+int tracking_config_set(struct tracking_config *config, const char *name,
+			double value)
+{
+	struct tracking_param_block *old = config->current;
+	struct tracking_param_block *block;
+	int param = tracking_config_find(name);
+
+	if (param < 0)
+		return param;
+	if (isnan(value) || value < tracking_params[param].min ||
+	    value > tracking_params[param].max)
+		return -ERANGE;
+
+	block = malloc(sizeof(*block));
+	if (!block)
+		return -ENOMEM;
+
+	memcpy(block->value, old->value, sizeof(block->value));
+	block->value[param] = value;
+	block->gen = old->gen + 1;
+	block->retired = NULL;
+
+	__atomic_store_n(&config->current, block, __ATOMIC_RELEASE);
+
+	old->retired = config->retired;
+	config->retired = old;
+	tracking_config_reclaim(config);
+
+	return 0;
+}
+
+/*
+ * Returns the current value of a parameter. Must only be called from the
+ * writer thread.
+ */
+double tracking_config_get(struct tracking_config *config,
+			   enum tracking_param param)
+{
+	return config->current->value[param];
+}
+
+/*
+ * Returns the current parameter block, to be used until the next call. This
+ * is called by the single reader thread at frame boundaries and never blocks.
+ */
+const struct tracking_param_block *
+tracking_config_acquire(struct tracking_config *config)
+{
+	struct tracking_param_block *block;
+
+	block = __atomic_load_n(&config->current, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&config->reader_gen, block->gen, __ATOMIC_RELEASE);
+
+	return block;
+}
+
+/*
+ * Configures blob detector and latency budget according to the parameters.
+ */
+void tracking_params_apply(const struct tracking_param_block *params,
+			   struct blobwatch *bw,
+			   struct tracking_budget *budget)
+{
+	const double *v = params->value;
+
+	if (bw) {
+		blobwatch_set_params(bw, v[PARAM_BLOB_THRESHOLD],
+				     v[PARAM_BLOB_MAX_ASPECT],
+				     v[PARAM_FLICKER_HYSTERESIS]);
+	}
+
+	if (budget) {
+		tracking_budget_set_target(budget, v[PARAM_LATENCY_TARGET]);
+		tracking_budget_set_solver(budget,
+					   v[PARAM_SOLVER_MIN_ITERATIONS],
+					   v[PARAM_SOLVER_MAX_ITERATIONS],
+					   v[PARAM_SOLVER_CONFIDENCE]);
+	}
+}
@@ -0,0 +1,67 @@
+/*
+ * Runtime tunable tracking parameters
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __PARAMS_H__
+#define __PARAMS_H__
+
+#include <stdint.h>
+
+struct blobwatch;
+struct tracking_budget;
+
+enum tracking_param {
+	PARAM_BLOB_THRESHOLD,
+	PARAM_BLOB_MAX_ASPECT,
+	PARAM_FLICKER_HYSTERESIS,
+	PARAM_SOLVER_MIN_ITERATIONS,
+	PARAM_SOLVER_MAX_ITERATIONS,
+	PARAM_SOLVER_CONFIDENCE,
+	PARAM_LATENCY_TARGET,
+	NUM_TRACKING_PARAMS
+};
+
+struct tracking_param_desc {
+	const char *name;
+	double def;
+	double min;
+	double max;
+};
+
+extern const struct tracking_param_desc tracking_params[NUM_TRACKING_PARAMS];
+
+/*
+ * Immutable set of parameter values. Updates publish a new block instead of
+ * modifying the current one.
+ */
+struct tracking_param_block {
+	uint64_t gen;
+	struct tracking_param_block *retired;
+	double value[NUM_TRACKING_PARAMS];
+};
+
+/*
+ * Parameters of a single device, read by its frame processing thread and
+ * written from the main thread.
+ */
+struct tracking_config {
+	struct tracking_param_block *current;
+	struct tracking_param_block *retired;
+	uint64_t reader_gen;
+};
+
+struct tracking_config *tracking_config_new(void);
+void tracking_config_free(struct tracking_config *config);
+int tracking_config_find(const char *name);
+int tracking_config_set(struct tracking_config *config, const char *name,
+			double value);
+double tracking_config_get(struct tracking_config *config,
+			   enum tracking_param param);
+const struct tracking_param_block *
+tracking_config_acquire(struct tracking_config *config);
+void tracking_params_apply(const struct tracking_param_block *params,
+			   struct blobwatch *bw,
+			   struct tracking_budget *budget);
+
+#endif /* __PARAMS_H__ */
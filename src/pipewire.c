@@ -18,6 +18,7 @@
 #include <pipewire/pipewire.h>
 
 #include "debug.h"
+#include "frame-pool.h"
 
 struct type {
 	struct spa_type_media_type media_type;
@@ -217,10 +218,10 @@ bool debug_stream_connected(struct debug_stream *stream)
 	return stream && stream->state == PW_STREAM_STATE_STREAMING;
 }
 
-void debug_stream_frame_push(struct debug_stream *stream, void *src,
+void debug_stream_frame_push(struct debug_stream *stream, struct frame *frame,
 			     size_t size, size_t attach_offset,
-			     struct blobservation *ob, dquat *rot, dvec3 *trans,
-			     double timestamps[3])
+			     uint8_t threshold, struct blobservation *ob,
+			     dquat *rot, dvec3 *trans, double timestamps[3])
 {
 	struct spa_meta_header *h;
 	struct pw_buffer *buf;
@@ -228,6 +229,7 @@ void debug_stream_frame_push(struct debug_stream *stream, void *src,
 
 	(void)size;
 	(void)attach_offset;
+	(void)threshold;
 	(void)ob;
 	(void)rot;
 	(void)trans;
@@ -252,7 +254,7 @@ void debug_stream_frame_push(struct debug_stream *stream, void *src,
 		h->dts_offset = 0;
 	}
 
-	memcpy(b->datas[0].data, src,
+	memcpy(b->datas[0].data, frame->data,
 	       stream->stride * stream->format.size.height);
 
 	b->datas[0].chunk->size = b->datas[0].maxsize;
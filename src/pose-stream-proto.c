@@ -0,0 +1,192 @@
+/*
+ * Remote pose streaming protocol
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <errno.h>
+#include <string.h>
+
+#include "pose-stream-proto.h"
+#include "varint.h"
+
+/*
+ * Each encoded state consists of the device presence mask followed by one
+ * record per present device. A record starts with a mask of fields that
+ * differ from the baseline, followed by the zigzag encoded differences of
+ * all components of those fields. Buttons are encoded as the bits that
+ * changed, axes are preceded by a mask of changed axes. All integers are
+ * stored as unsigned LEB128 varints, so small deltas take a single byte.
+ */
+
+static void put_delta(struct varint_cursor *c, int64_t value, int64_t base)
+{
+	varint_put_signed(c, value - base);
+}
+
+static int64_t get_delta(struct varint_cursor *c, int64_t base)
+{
+	return base + varint_get_signed(c);
+}
+
+static unsigned int device_changed_fields(const struct pose_stream_device *d,
+					  const struct pose_stream_device *b)
+{
+	unsigned int fields = 0;
+
+	if (d->time != b->time)
+		fields |= POSE_STREAM_FIELD_TIME;
+	if (memcmp(d->position, b->position, sizeof(d->position)))
+		fields |= POSE_STREAM_FIELD_POSITION;
+	if (memcmp(d->orientation, b->orientation, sizeof(d->orientation)))
+		fields |= POSE_STREAM_FIELD_ORIENTATION;
+	if (memcmp(d->angular_velocity, b->angular_velocity,
+		   sizeof(d->angular_velocity)))
+		fields |= POSE_STREAM_FIELD_ANGULAR_VELOCITY;
+	if (d->buttons != b->buttons)
+		fields |= POSE_STREAM_FIELD_BUTTONS;
+	if (memcmp(d->axes, b->axes, sizeof(d->axes)))
+		fields |= POSE_STREAM_FIELD_AXES;
+
+	return fields;
+}
+
+static void encode_device(struct varint_cursor *c,
+			  const struct pose_stream_device *d,
+			  const struct pose_stream_device *b)
+{
+	unsigned int fields = device_changed_fields(d, b);
+	unsigned int axes = 0;
+	int i;
+
+	varint_put(c, fields);
+	if (fields & POSE_STREAM_FIELD_TIME)
+		put_delta(c, d->time, b->time);
+	if (fields & POSE_STREAM_FIELD_POSITION) {
+		for (i = 0; i < 3; i++)
+			put_delta(c, d->position[i], b->position[i]);
+	}
+	if (fields & POSE_STREAM_FIELD_ORIENTATION) {
+		for (i = 0; i < 4; i++)
+			put_delta(c, d->orientation[i], b->orientation[i]);
+	}
+	if (fields & POSE_STREAM_FIELD_ANGULAR_VELOCITY) {
+		for (i = 0; i < 3; i++) {
+			put_delta(c, d->angular_velocity[i],
+				  b->angular_velocity[i]);
+		}
+	}
+	if (fields & POSE_STREAM_FIELD_BUTTONS)
+		varint_put(c, d->buttons ^ b->buttons);
+	if (fields & POSE_STREAM_FIELD_AXES) {
+		for (i = 0; i < POSE_STREAM_MAX_AXES; i++) {
+			if (d->axes[i] != b->axes[i])
+				axes |= 1 << i;
+		}
+		varint_put(c, axes);
+		for (i = 0; i < POSE_STREAM_MAX_AXES; i++) {
+			if (axes & (1 << i))
+				put_delta(c, d->axes[i], b->axes[i]);
+		}
+	}
+}
+
+static void decode_device(struct varint_cursor *c,
+			  struct pose_stream_device *d,
+			  const struct pose_stream_device *b)
+{
+	unsigned int fields = varint_get(c);
+	unsigned int axes;
+	int i;
+
+	*d = *b;
+	if (fields & POSE_STREAM_FIELD_TIME)
+		d->time = get_delta(c, b->time);
+	if (fields & POSE_STREAM_FIELD_POSITION) {
+		for (i = 0; i < 3; i++)
+			d->position[i] = get_delta(c, b->position[i]);
+	}
+	if (fields & POSE_STREAM_FIELD_ORIENTATION) {
+		for (i = 0; i < 4; i++)
+			d->orientation[i] = get_delta(c, b->orientation[i]);
+	}
+	if (fields & POSE_STREAM_FIELD_ANGULAR_VELOCITY) {
+		for (i = 0; i < 3; i++) {
+			d->angular_velocity[i] =
+				get_delta(c, b->angular_velocity[i]);
+		}
+	}
+	if (fields & POSE_STREAM_FIELD_BUTTONS)
+		d->buttons = b->buttons ^ varint_get(c);
+	if (fields & POSE_STREAM_FIELD_AXES) {
+		axes = varint_get(c);
+		for (i = 0; i < POSE_STREAM_MAX_AXES; i++) {
+			if (axes & (1 << i))
+				d->axes[i] = get_delta(c, b->axes[i]);
+		}
+	}
+}
+
+/*
+ * Encodes state as delta against baseline, or against an all-zero state if
+ * baseline is NULL. Devices not present in the baseline are encoded against
+ * zero as well.
+ *
+ * Returns the encoded size or -ENOSPC if buf is too small.
+ */
+int pose_stream_encode_state(const struct pose_stream_state *state,
+			     const struct pose_stream_state *baseline,
+			     uint8_t *buf, size_t size)
+{
+	static const struct pose_stream_device zero;
+	struct varint_cursor c = { .p = buf, .end = buf + size };
+	int i;
+
+	varint_put(&c, state->present);
+	for (i = 0; i < POSE_STREAM_MAX_DEVICES; i++) {
+		if (!(state->present & (1 << i)))
+			continue;
+		if (baseline && (baseline->present & (1 << i)))
+			encode_device(&c, &state->device[i],
+				      &baseline->device[i]);
+		else
+			encode_device(&c, &state->device[i], &zero);
+	}
+
+	if (c.overflow)
+		return -ENOSPC;
+
+	return c.p - buf;
+}
+
+/*
+ * Decodes a state encoded against baseline, which must be the same state the
+ * encoder used, or NULL.
+ *
+ * Returns the number of bytes consumed or -EINVAL if buf is truncated.
+ */
+int pose_stream_decode_state(const uint8_t *buf, size_t size,
+			     const struct pose_stream_state *baseline,
+			     struct pose_stream_state *state)
+{
+	static const struct pose_stream_device zero;
+	struct varint_cursor c = { .p = (uint8_t *)buf, .end = buf + size };
+	int i;
+
+	memset(state, 0, sizeof(*state));
+	state->present = varint_get(&c) &
+			 ((1ULL << POSE_STREAM_MAX_DEVICES) - 1);
+	for (i = 0; i < POSE_STREAM_MAX_DEVICES; i++) {
+		if (!(state->present & (1 << i)))
+			continue;
+		if (baseline && (baseline->present & (1 << i)))
+			decode_device(&c, &state->device[i],
+				      &baseline->device[i]);
+		else
+			decode_device(&c, &state->device[i], &zero);
+	}
+
+	if (c.overflow)
+		return -EINVAL;
+
+	return c.p - buf;
+}
@@ -0,0 +1,128 @@
+/*
+ * Remote pose streaming protocol
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __POSE_STREAM_PROTO_H__
+#define __POSE_STREAM_PROTO_H__
+
+#include <asm/byteorder.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define POSE_STREAM_DEFAULT_PORT	28533
+#define POSE_STREAM_VERSION		2
+
+#define POSE_STREAM_MAX_DEVICES		16
+#define POSE_STREAM_MAX_AXES		12
+#define POSE_STREAM_MAX_RATE		1000
+#define POSE_STREAM_DEFAULT_RATE	60
+#define POSE_STREAM_MAX_REDUNDANCY	4
+/* Stay well below the typical path MTU to avoid IP fragmentation */
+#define POSE_STREAM_MAX_PACKET		1200
+/* Number of past states kept by sender and receiver for delta decoding */
+#define POSE_STREAM_HISTORY		32
+
+#define POSE_STREAM_SUBSCRIBE		1
+#define POSE_STREAM_UNSUBSCRIBE		2
+#define POSE_STREAM_STATE		3
+#define POSE_STREAM_CHALLENGE		4
+
+/*
+ * Sent by the client to start streaming, and repeated at least once per
+ * second to keep the subscription alive. rate is the requested number of
+ * state packets per second, redundancy the number of previous states
+ * repeated in each packet. ack is the newest state sequence number the
+ * client has decoded, or 0. The server encodes all states as deltas against
+ * the acknowledged state.
+ * cookie is the value of the last challenge received from the server, or 0.
+ * The server only starts streaming to a client that has echoed a challenge
+ * sent to its address, so that spoofed subscriptions can not direct the
+ * stream at a third party. The same message with type UNSUBSCRIBE and the
+ * subscription's cookie ends streaming.
+ */
+struct pose_stream_subscribe {
+	__u8 type;
+	__u8 version;
+	__le16 rate;
+	__u8 redundancy;
+	__u8 reserved;
+	__le16 reserved2;
+	__le32 ack;
+	__le64 cookie;
+} __attribute__((packed));
+
+/*
+ * Sent by the server in reply to a subscription without a valid cookie.
+ * It is smaller than the subscription, so it can not be used to amplify
+ * traffic towards a spoofed source address.
+ */
+struct pose_stream_challenge {
+	__u8 type;
+	__u8 version;
+	__le16 reserved;
+	__le32 reserved2;
+	__le64 cookie;
+} __attribute__((packed));
+
+/*
+ * A state packet contains num_updates encoded states, newest first, with
+ * sequence numbers seq, seq - 1, and so on. All of them are encoded as
+ * deltas against the state with sequence number baseline, or against an
+ * all-zero state if baseline is 0. time is the server's monotonic clock in
+ * microseconds at the time of sending.
+ */
+struct pose_stream_state_header {
+	__u8 type;
+	__u8 version;
+	__u8 num_updates;
+	__u8 reserved;
+	__le32 seq;
+	__le32 baseline;
+	__le32 reserved2;
+	__le64 time;
+} __attribute__((packed));
+
+#define POSE_STREAM_FIELD_TIME			(1 << 0)
+#define POSE_STREAM_FIELD_POSITION		(1 << 1)
+#define POSE_STREAM_FIELD_ORIENTATION		(1 << 2)
+#define POSE_STREAM_FIELD_ANGULAR_VELOCITY	(1 << 3)
+#define POSE_STREAM_FIELD_BUTTONS		(1 << 4)
+#define POSE_STREAM_FIELD_AXES			(1 << 5)
+
+/* 0.1 mm */
+#define POSE_STREAM_POSITION_SCALE		10000.0
+#define POSE_STREAM_ORIENTATION_SCALE		32767.0
+/* 1 mrad/s */
+#define POSE_STREAM_ANGULAR_VELOCITY_SCALE	1000.0
+#define POSE_STREAM_AXIS_SCALE			32767.0
+
+/*
+ * Quantized device state. time is the pose sample time in microseconds on
+ * the server's monotonic clock.
+ */
+struct pose_stream_device {
+	int64_t time;
+	int32_t position[3];
+	int16_t orientation[4];
+	int32_t angular_velocity[3];
+	uint32_t buttons;
+	int16_t axes[POSE_STREAM_MAX_AXES];
+};
+
+/*
+ * Quantized state of all devices, present is a bitmask of device ids.
+ */
+struct pose_stream_state {
+	uint32_t present;
+	struct pose_stream_device device[POSE_STREAM_MAX_DEVICES];
+};
+
+int pose_stream_encode_state(const struct pose_stream_state *state,
+			     const struct pose_stream_state *baseline,
+			     uint8_t *buf, size_t size);
+int pose_stream_decode_state(const uint8_t *buf, size_t size,
+			     const struct pose_stream_state *baseline,
+			     struct pose_stream_state *state);
+
+#endif /* __POSE_STREAM_PROTO_H__ */
@@ -0,0 +1,452 @@
+/*
+ * Remote pose streaming server
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <glib.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pose-stream.h"
+#include "pose-stream-proto.h"
+#include "shm.h"
+
+#define POSE_STREAM_MAX_CLIENTS		8
+/* Outstanding challenges, the oldest is replaced when full */
+#define POSE_STREAM_MAX_CHALLENGES	16
+/* Challenges must be answered within this time, in µs */
+#define POSE_STREAM_CHALLENGE_TIMEOUT	5000000
+/* Clients must resubscribe within this time, in µs */
+#define POSE_STREAM_CLIENT_TIMEOUT	3000000
+/* Longest poll timeout, in µs, so that deinit does not block */
+#define POSE_STREAM_IDLE_TIMEOUT	100000
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+struct pose_stream_client {
+	bool active;
+	struct sockaddr_in addr;
+	uint64_t cookie;
+	unsigned int rate;
+	unsigned int redundancy;
+	uint64_t next_time;
+	uint64_t last_seen;
+	uint32_t seq;
+	uint32_t ack;
+	struct pose_stream_state history[POSE_STREAM_HISTORY];
+};
+
+struct pose_stream_pending {
+	struct sockaddr_in addr;
+	uint64_t cookie;
+	uint64_t time;
+};
+
+int pose_stream_port;
+const char *pose_stream_address = "127.0.0.1";
+
+static int pose_stream_fd = -1;
+static GThread *pose_stream_thread;
+static volatile bool pose_stream_active;
+static struct pose_stream_client clients[POSE_STREAM_MAX_CLIENTS];
+static struct pose_stream_pending pending[POSE_STREAM_MAX_CHALLENGES];
+static unsigned int next_pending;
+
+static uint64_t pose_stream_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static inline int32_t quantize(double v, double scale)
+{
+	return lrint(v * scale);
+}
+
+/*
+ * Takes a consistent snapshot of the pose and input state of all devices
+ * from the shared memory slots and quantizes it for transmission.
+ */
+static void pose_stream_snapshot(struct pose_stream_state *state)
+{
+	unsigned int num = min(OUVRT_SHM_MAX_DEVICES, POSE_STREAM_MAX_DEVICES);
+	unsigned int i, j;
+
+	memset(state, 0, sizeof(*state));
+
+	for (i = 0; i < num; i++) {
+		struct ouvrt_shm_device *dev = shm_get_device(i);
+		struct pose_stream_device *d = &state->device[i];
+		struct ouvrt_shm_input_state input;
+		struct ouvrt_shm_pose pose;
+		uint32_t seq;
+
+		if (!dev)
+			return;
+
+		do {
+			seq = dev->pose.seq;
+			__sync_synchronize();
+			pose = dev->pose;
+			__sync_synchronize();
+		} while ((seq & 1) || seq != dev->pose.seq);
+
+		do {
+			seq = dev->input.seq;
+			__sync_synchronize();
+			input = dev->input;
+			__sync_synchronize();
+		} while ((seq & 1) || seq != dev->input.seq);
+
+		if (pose.time == 0.0 && input.time == 0.0)
+			continue;
+
+		state->present |= 1 << i;
+		d->time = llrint(pose.time * 1e6);
+		d->position[0] = quantize(pose.pose.translation.x,
+					  POSE_STREAM_POSITION_SCALE);
+		d->position[1] = quantize(pose.pose.translation.y,
+					  POSE_STREAM_POSITION_SCALE);
+		d->position[2] = quantize(pose.pose.translation.z,
+					  POSE_STREAM_POSITION_SCALE);
+		d->orientation[0] = quantize(pose.pose.rotation.x,
+					     POSE_STREAM_ORIENTATION_SCALE);
+		d->orientation[1] = quantize(pose.pose.rotation.y,
+					     POSE_STREAM_ORIENTATION_SCALE);
+		d->orientation[2] = quantize(pose.pose.rotation.z,
+					     POSE_STREAM_ORIENTATION_SCALE);
+		d->orientation[3] = quantize(pose.pose.rotation.w,
+					     POSE_STREAM_ORIENTATION_SCALE);
+		d->angular_velocity[0] = quantize(pose.angular_velocity.x,
+					POSE_STREAM_ANGULAR_VELOCITY_SCALE);
+		d->angular_velocity[1] = quantize(pose.angular_velocity.y,
+					POSE_STREAM_ANGULAR_VELOCITY_SCALE);
+		d->angular_velocity[2] = quantize(pose.angular_velocity.z,
+					POSE_STREAM_ANGULAR_VELOCITY_SCALE);
+		d->buttons = input.buttons;
+		for (j = 0; j < POSE_STREAM_MAX_AXES; j++) {
+			d->axes[j] = quantize(input.axes[j],
+					      POSE_STREAM_AXIS_SCALE);
+		}
+	}
+}
+
+/*
+ * Sends the newest state to the client, followed by as many previous states
+ * as requested and fit into a single packet. All states are encoded against
+ * the newest state acknowledged by the client, if it is still in the history.
+ */
+static void pose_stream_send(struct pose_stream_client *client, uint64_t now)
+{
+	uint8_t packet[POSE_STREAM_MAX_PACKET];
+	struct pose_stream_state_header *header = (void *)packet;
+	const struct pose_stream_state *baseline = NULL;
+	uint8_t *p = packet + sizeof(*header);
+	uint32_t seq = client->seq;
+	unsigned int n;
+	int ret;
+
+	if (client->ack && client->ack < seq &&
+	    seq - client->ack < POSE_STREAM_HISTORY)
+		baseline = &client->history[client->ack % POSE_STREAM_HISTORY];
+	else
+		client->ack = 0;
+
+	for (n = 0; n <= client->redundancy; n++) {
+		const struct pose_stream_state *state;
+
+		/* Older states are either known to the client or unusable */
+		if (seq - n == 0 || seq - n <= client->ack ||
+		    n >= POSE_STREAM_HISTORY)
+			break;
+
+		state = &client->history[(seq - n) % POSE_STREAM_HISTORY];
+		ret = pose_stream_encode_state(state, baseline, p,
+					       packet + sizeof(packet) - p);
+		if (ret < 0)
+			break;
+		p += ret;
+	}
+	if (n == 0)
+		return;
+
+	header->type = POSE_STREAM_STATE;
+	header->version = POSE_STREAM_VERSION;
+	header->num_updates = n;
+	header->reserved = 0;
+	header->seq = __cpu_to_le32(seq);
+	header->baseline = __cpu_to_le32(client->ack);
+	header->reserved2 = 0;
+	header->time = __cpu_to_le64(now);
+
+	sendto(pose_stream_fd, packet, p - packet, 0,
+	       (struct sockaddr *)&client->addr, sizeof(client->addr));
+}
+
+static bool pose_stream_addr_equal(const struct sockaddr_in *a,
+				   const struct sockaddr_in *b)
+{
+	return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+	       a->sin_port == b->sin_port;
+}
+
+/*
+ * Sends a challenge with a new random cookie to the given address and
+ * remembers it, replacing the oldest outstanding challenge if necessary.
+ */
+static void pose_stream_send_challenge(const struct sockaddr_in *addr,
+				       uint64_t now)
+{
+	struct pose_stream_pending *p = &pending[next_pending];
+	struct pose_stream_challenge msg = {
+		.type = POSE_STREAM_CHALLENGE,
+		.version = POSE_STREAM_VERSION,
+	};
+	uint64_t cookie = 0;
+
+	while (cookie == 0) {
+		if (getrandom(&cookie, sizeof(cookie), 0) != sizeof(cookie))
+			return;
+	}
+
+	next_pending = (next_pending + 1) % POSE_STREAM_MAX_CHALLENGES;
+	p->addr = *addr;
+	p->cookie = cookie;
+	p->time = now;
+
+	msg.cookie = __cpu_to_le64(cookie);
+	sendto(pose_stream_fd, &msg, sizeof(msg), 0,
+	       (const struct sockaddr *)addr, sizeof(*addr));
+}
+
+/*
+ * Returns true and invalidates the challenge if the cookie matches an
+ * outstanding challenge sent to the given address.
+ */
+static bool pose_stream_check_challenge(const struct sockaddr_in *addr,
+					uint64_t cookie, uint64_t now)
+{
+	int i;
+
+	for (i = 0; i < POSE_STREAM_MAX_CHALLENGES; i++) {
+		struct pose_stream_pending *p = &pending[i];
+
+		if (p->cookie && p->cookie == cookie &&
+		    pose_stream_addr_equal(&p->addr, addr) &&
+		    now - p->time < POSE_STREAM_CHALLENGE_TIMEOUT) {
+			p->cookie = 0;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Handles subscription requests, acknowledgements and unsubscriptions.
+ * Requests without the cookie of an existing subscription are answered
+ * with a challenge, a new subscription is only created once the client
+ * has echoed it.
+ */
+static void pose_stream_receive(uint64_t now)
+{
+	struct pose_stream_client *client = NULL;
+	struct pose_stream_subscribe msg;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	unsigned int rate;
+	uint64_t cookie;
+	uint32_t ack;
+	ssize_t len;
+	int i;
+
+	len = recvfrom(pose_stream_fd, &msg, sizeof(msg), MSG_DONTWAIT,
+		       (struct sockaddr *)&addr, &addrlen);
+	if (len < (ssize_t)sizeof(msg) || addr.sin_family != AF_INET ||
+	    msg.version != POSE_STREAM_VERSION)
+		return;
+
+	for (i = 0; i < POSE_STREAM_MAX_CLIENTS; i++) {
+		if (clients[i].active &&
+		    pose_stream_addr_equal(&clients[i].addr, &addr)) {
+			client = &clients[i];
+			break;
+		}
+	}
+
+	cookie = __le64_to_cpu(msg.cookie);
+
+	if (msg.type == POSE_STREAM_UNSUBSCRIBE) {
+		if (client && cookie == client->cookie)
+			client->active = false;
+		return;
+	}
+
+	if (msg.type != POSE_STREAM_SUBSCRIBE)
+		return;
+
+	if (!client || cookie != client->cookie) {
+		if (!cookie || !pose_stream_check_challenge(&addr, cookie,
+							    now)) {
+			pose_stream_send_challenge(&addr, now);
+			return;
+		}
+
+		/* A restarted client replaces its previous subscription */
+		for (i = 0; !client && i < POSE_STREAM_MAX_CLIENTS; i++) {
+			if (!clients[i].active)
+				client = &clients[i];
+		}
+		if (!client)
+			return;
+
+		memset(client, 0, sizeof(*client));
+		client->active = true;
+		client->addr = addr;
+		client->cookie = cookie;
+		client->next_time = now;
+	}
+
+	rate = __le16_to_cpu(msg.rate);
+	if (rate == 0)
+		rate = POSE_STREAM_DEFAULT_RATE;
+	client->rate = min(rate, POSE_STREAM_MAX_RATE);
+	client->redundancy = min(msg.redundancy, POSE_STREAM_MAX_REDUNDANCY);
+	client->last_seen = now;
+
+	/* Only move the baseline forward to states we have sent */
+	ack = __le32_to_cpu(msg.ack);
+	if (ack > client->ack && ack <= client->seq)
+		client->ack = ack;
+}
+
+static gpointer pose_stream_thread_func(gpointer data)
+{
+	struct pollfd pfd = {
+		.fd = pose_stream_fd,
+		.events = POLLIN,
+	};
+	struct pose_stream_state state;
+	uint64_t now, next;
+	bool snapshot;
+	int i, ret;
+
+	(void)data;
+
+	while (pose_stream_active) {
+		now = pose_stream_now();
+		next = now + POSE_STREAM_IDLE_TIMEOUT;
+		for (i = 0; i < POSE_STREAM_MAX_CLIENTS; i++) {
+			if (clients[i].active)
+				next = min(next, clients[i].next_time);
+		}
+
+		next = max(next, now);
+		ret = poll(&pfd, 1, (next - now + 999) / 1000);
+		if (ret < 0 && errno != EINTR)
+			break;
+
+		now = pose_stream_now();
+		if (ret > 0 && (pfd.revents & POLLIN))
+			pose_stream_receive(now);
+
+		snapshot = false;
+		for (i = 0; i < POSE_STREAM_MAX_CLIENTS; i++) {
+			struct pose_stream_client *client = &clients[i];
+
+			if (!client->active || now < client->next_time)
+				continue;
+
+			if (now - client->last_seen >
+			    POSE_STREAM_CLIENT_TIMEOUT) {
+				client->active = false;
+				continue;
+			}
+
+			if (!snapshot) {
+				pose_stream_snapshot(&state);
+				snapshot = true;
+			}
+
+			client->seq++;
+			client->history[client->seq % POSE_STREAM_HISTORY] =
+				state;
+			pose_stream_send(client, now);
+
+			/* Do not try to catch up after stalls */
+			client->next_time += 1000000 / client->rate;
+			if (client->next_time < now)
+				client->next_time = now;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Opens the pose streaming UDP socket and starts the server thread, if a
+ * port is configured. The socket is bound to the loopback interface unless
+ * a different address is configured.
+ */
+int pose_stream_init(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(pose_stream_port),
+	};
+	int fd, ret;
+
+	if (!pose_stream_port)
+		return 0;
+
+	if (pose_stream_fd >= 0)
+		return -EBUSY;
+
+	if (inet_pton(AF_INET, pose_stream_address, &addr.sin_addr) != 1)
+		return -EINVAL;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	pose_stream_fd = fd;
+	pose_stream_active = true;
+	pose_stream_thread = g_thread_new("pose-stream",
+					  pose_stream_thread_func, NULL);
+
+	return 0;
+}
+
+/*
+ * Stops the server thread and closes the socket.
+ */
+void pose_stream_deinit(void)
+{
+	if (pose_stream_fd < 0)
+		return;
+
+	pose_stream_active = false;
+	g_thread_join(pose_stream_thread);
+	close(pose_stream_fd);
+	pose_stream_fd = -1;
+}
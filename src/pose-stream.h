@@ -0,0 +1,15 @@
+/*
+ * Remote pose streaming server
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#ifndef __POSE_STREAM_H__
+#define __POSE_STREAM_H__
+
+extern int pose_stream_port;
+extern const char *pose_stream_address;
+
+int pose_stream_init(void);
+void pose_stream_deinit(void);
+
+#endif /* __POSE_STREAM_H__ */
@@ -15,6 +15,7 @@
 #include "device.h"
 #include "hidraw.h"
 #include "imu.h"
+#include "shm.h"
 #include "telemetry.h"
 #include "usb-ids.h"
 
@@ -57,22 +58,41 @@ static int psvr_control_send(OuvrtPSVR *psvr, void *buf, size_t len)
 {
 	struct libusb_transfer *transfer;
 	uint8_t bEndpointAddress;
+	int transferred;
 	void *data;
+	int ret;
 
 	transfer = libusb_alloc_transfer(0);
 	if (!transfer)
 		return -ENOMEM;
 
 	data = g_memdup(buf, len);
-	if (!data)
+	if (!data) {
+		libusb_free_transfer(transfer);
 		return -ENOMEM;
+	}
 
 	bEndpointAddress = psvr->control_endpoint | LIBUSB_ENDPOINT_OUT;
 	libusb_fill_bulk_transfer(transfer, psvr->devh, bEndpointAddress,
 				  data, len, NULL, NULL, 0);
 	transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER |
 			   LIBUSB_TRANSFER_FREE_TRANSFER;
-	return libusb_submit_transfer(transfer);
+	ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(psvr),
+					       transfer);
+	if (ret == 0)
+		return 0;
+
+	/*
+	 * Completions are not dispatched anymore after the device thread
+	 * stopped, send the final messages synchronously.
+	 */
+	if (ret == LIBUSB_ERROR_INTERRUPTED) {
+		ret = libusb_bulk_transfer(psvr->devh, bEndpointAddress,
+					   data, len, &transferred, 1000);
+	}
+	libusb_free_transfer(transfer);
+
+	return ret;
 }
 
 static void psvr_set_processing_box_power(OuvrtPSVR *psvr, bool power)
@@ -269,6 +289,8 @@ static void psvr_decode_sensor_message(OuvrtPSVR *self,
 		pose_update(1e-6 * dt, &self->imu.pose, &imu);
 
 		telemetry_send_pose(self->dev.id, &self->imu.pose);
+		shm_publish_pose(self->dev.id, imu.time, &self->imu.pose,
+				 &imu.angular_velocity);
 
 		self->last_timestamp = raw.time;
 	}
@@ -417,7 +439,7 @@ static void psvr_control_transfer_callback(struct libusb_transfer *transfer)
 		if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
 			g_print("PSVR: Device vanished\n");
 			psvr->dev.active = false;
-		} else {
+		} else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
 			g_print("PSVR: Control transfer error: %d (%s)\n",
 				transfer->status,
 				libusb_error_name(transfer->status));
@@ -436,7 +458,8 @@ static void psvr_control_transfer_callback(struct libusb_transfer *transfer)
 				  transfer->actual_length);
 
 	/* Resubmit transfer */
-	ret = libusb_submit_transfer(transfer);
+	ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(psvr),
+					       transfer);
 	if (ret < 0) {
 		g_print("PSVR: Failed to resubmit control transfer: %d\n", ret);
 	}
@@ -451,7 +474,7 @@ static void psvr_sensor_transfer_callback(struct libusb_transfer *transfer)
 		if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
 			g_print("PSVR: Device vanished\n");
 			psvr->dev.active = false;
-		} else {
+		} else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
 			g_print("PSVR: Sensor transfer error: %d (%s)\n",
 				transfer->status,
 				libusb_error_name(transfer->status));
@@ -463,7 +486,8 @@ static void psvr_sensor_transfer_callback(struct libusb_transfer *transfer)
 				   transfer->actual_length);
 
 	/* Resubmit transfer */
-	ret = libusb_submit_transfer(transfer);
+	ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(psvr),
+					       transfer);
 	if (ret < 0) {
 		g_print("PSVR: Failed to resubmit sensor transfer: %d\n", ret);
 	}
@@ -611,7 +635,8 @@ static int psvr_start(OuvrtDevice *dev)
 					       psvr_sensor_transfer_callback),
 					  psvr, 0);
 
-		ret = libusb_submit_transfer(psvr->transfer[i]);
+		ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(psvr),
+						       psvr->transfer[i]);
 		if (ret < 0) {
 			g_print("PSVR: Failed to submit bulk transfer %d\n", i);
 			return ret;
@@ -0,0 +1,187 @@
+/*
+ * Sparse IR frame session recorder
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#include <errno.h>
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "frame-pool.h"
+#include "recorder.h"
+#include "sparse.h"
+
+/* Frames queued for encoding before new frames are dropped */
+#define RECORDER_NUM_FRAMES	4
+
+char *recorder_directory;
+
+/*
+ * A frame queued for encoding, with the blob detection threshold in use
+ * when it was captured.
+ */
+struct recorder_job {
+	struct frame *frame;
+	uint8_t threshold;
+};
+
+struct recorder {
+	char *name;
+	FILE *file;
+	int width;
+	int height;
+	GThread *thread;
+	GAsyncQueue *free_jobs;
+	GAsyncQueue *queued_jobs;
+	struct recorder_job jobs[RECORDER_NUM_FRAMES];
+	struct recorder_job stop;
+	uint8_t *out;
+	size_t out_size;
+	unsigned int num_written;
+	unsigned int num_dropped;
+	uint64_t bytes_written;
+};
+
+/*
+ * Encodes queued frames and appends them to the recording until the stop
+ * sentinel is received.
+ */
+static gpointer recorder_thread(gpointer data)
+{
+	struct recorder *rec = data;
+	struct recorder_job *job;
+	struct frame *frame;
+	int ret;
+
+	for (;;) {
+		job = g_async_queue_pop(rec->queued_jobs);
+		if (job == &rec->stop)
+			break;
+
+		frame = job->frame;
+		ret = sparse_encode(frame->data, rec->width, rec->height,
+				    job->threshold, frame->timestamp,
+				    rec->out, rec->out_size);
+		frame_unref(frame);
+		g_async_queue_push(rec->free_jobs, job);
+		if (ret < 0)
+			continue;
+
+		if (fwrite(rec->out, ret, 1, rec->file) != 1) {
+			g_print("%s: Failed to write recording: %d\n",
+				rec->name, errno);
+			continue;
+		}
+		rec->num_written++;
+		rec->bytes_written += ret;
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts a new recording of width x height grayscale frames named after the
+ * device in the recorder directory. Returns NULL if recording is disabled or
+ * the file could not be created.
+ */
+struct recorder *recorder_new(const char *name, int width, int height)
+{
+	struct recorder *rec;
+	GDateTime *now;
+	char *filename;
+	gchar *date;
+	int i;
+
+	if (!recorder_directory)
+		return NULL;
+
+	now = g_date_time_new_now_local();
+	date = g_date_time_format(now, "%Y%m%d-%H%M%S");
+	g_date_time_unref(now);
+	filename = g_strdup_printf("%s/%s-%s.ospf", recorder_directory, name,
+				   date);
+	g_free(date);
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec) {
+		g_free(filename);
+		return NULL;
+	}
+
+	g_mkdir_with_parents(recorder_directory, 0755);
+	rec->file = fopen(filename, "wb");
+	if (!rec->file) {
+		g_print("%s: Failed to create %s: %d\n", name, filename,
+			errno);
+		g_free(filename);
+		free(rec);
+		return NULL;
+	}
+	g_print("%s: Recording to %s\n", name, filename);
+	g_free(filename);
+
+	rec->name = g_strdup(name);
+	rec->width = width;
+	rec->height = height;
+	rec->out_size = sparse_encode_bound(width, height);
+	rec->out = malloc(rec->out_size);
+	rec->free_jobs = g_async_queue_new();
+	rec->queued_jobs = g_async_queue_new();
+	for (i = 0; i < RECORDER_NUM_FRAMES; i++)
+		g_async_queue_push(rec->free_jobs, &rec->jobs[i]);
+
+	rec->thread = g_thread_new("recorder", recorder_thread, rec);
+
+	return rec;
+}
+
+/*
+ * Takes a reference to the frame and queues it for encoding on the recorder
+ * thread, with the blob detection threshold currently in use, so that blob
+ * detection on the recorded frame finds the same blobs. If the encoder can
+ * not keep up, the frame is dropped instead of stalling the caller or holding
+ * on to more frame buffers.
+ */
+void recorder_push(struct recorder *rec, struct frame *frame,
+		   uint8_t threshold)
+{
+	struct recorder_job *job;
+
+	if (!rec)
+		return;
+
+	job = g_async_queue_try_pop(rec->free_jobs);
+	if (!job) {
+		rec->num_dropped++;
+		return;
+	}
+
+	job->frame = frame_ref(frame);
+	job->threshold = threshold;
+	g_async_queue_push(rec->queued_jobs, job);
+}
+
+/*
+ * Flushes all queued frames, stops the recorder thread, and closes the file.
+ */
+void recorder_free(struct recorder *rec)
+{
+	if (!rec)
+		return;
+
+	g_async_queue_push(rec->queued_jobs, &rec->stop);
+	g_thread_join(rec->thread);
+	fclose(rec->file);
+
+	g_print("%s: Recorded %u frames, %" G_GUINT64_FORMAT
+		" KiB, dropped %u\n", rec->name, rec->num_written,
+		rec->bytes_written / 1024, rec->num_dropped);
+
+	g_async_queue_unref(rec->queued_jobs);
+	g_async_queue_unref(rec->free_jobs);
+	free(rec->out);
+	g_free(rec->name);
+	free(rec);
+}
@@ -0,0 +1,27 @@
+/*
+ * Sparse IR frame session recorder
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <stdint.h>
+
+/*
+ * Recordings are plain concatenations of sparse frames, see sparse.h. Each
+ * frame header contains the total frame size, so files can be read back
+ * sequentially with sparse_decode().
+ */
+
+extern char *recorder_directory;
+
+struct frame;
+struct recorder;
+
+struct recorder *recorder_new(const char *name, int width, int height);
+void recorder_push(struct recorder *rec, struct frame *frame,
+		   uint8_t threshold);
+void recorder_free(struct recorder *rec);
+
+#endif /* __RECORDER_H__ */
@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <glib.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "rift-hid-reports.h"
@@ -15,8 +16,9 @@
 #include "hidraw.h"
 #include "imu.h"
 #include "json.h"
+#include "shm.h"
 #include "telemetry.h"
-#include "tracking-model.h"
+#include "unpack.h"
 
 static void rift_dump_report(const unsigned char *buf, size_t len)
 {
@@ -284,6 +286,10 @@ static void rift_decode_remote_message(struct rift_remote *remote,
 				     remote->buttons, 9, remote_button_map);
 		remote->buttons = buttons;
 	}
+
+	shm_update_input(remote->base.dev_id,
+			 ouvrt_button_state(buttons, 9, remote_button_map),
+			 NULL, 0);
 }
 
 static const struct button_map touch_left_button_map[4] = {
@@ -300,6 +306,77 @@ static const struct button_map touch_right_button_map[4] = {
 	{ RIFT_TOUCH_CONTROLLER_BUTTON_STICK, OUVRT_BUTTON_JOYSTICK },
 };
 
+/*
+ * Reconstructs the continuous sample time from the wrapping 32-bit µs
+ * timestamp of a Touch IMU sample. Duplicate samples and samples older than
+ * the last one, which can happen if the two messages in a radio report are
+ * out of order, are dropped. Gaps of multiple sample periods are counted as
+ * dropped radio packets. Large jumps in either direction, for example after
+ * the controller was power cycled, resynchronize to the new timestamp.
+ *
+ * Returns the time in µs covered by this sample, or 0 if the sample should
+ * not be integrated.
+ */
+static int32_t rift_touch_reconstruct_time(struct rift_touch_controller *touch,
+					   uint32_t timestamp)
+{
+	int32_t dt = timestamp - touch->last_timestamp;
+	int32_t periods;
+
+	if (!touch->time_valid) {
+		touch->time = timestamp;
+		touch->last_timestamp = timestamp;
+		touch->time_valid = true;
+		return 0;
+	}
+
+	if (dt <= 0) {
+		if (dt < -RIFT_TOUCH_IMU_MAX_PERIODS * RIFT_TOUCH_IMU_PERIOD) {
+			g_print("%s: IMU timestamp jumped back %d µs, resynchronizing\n",
+				touch->base.name, -dt);
+			touch->last_timestamp = timestamp;
+		}
+		return 0;
+	}
+
+	periods = (dt + RIFT_TOUCH_IMU_PERIOD / 2) / RIFT_TOUCH_IMU_PERIOD;
+	if (periods > RIFT_TOUCH_IMU_MAX_PERIODS) {
+		g_print("%s: %d µs since last IMU sample, resynchronizing\n",
+			touch->base.name, dt);
+		dt = 0;
+	} else if (periods == 0 ||
+		   abs(dt - periods * RIFT_TOUCH_IMU_PERIOD) > 25) {
+		g_print("%s: %d µs since last IMU sample\n", touch->base.name,
+			dt);
+	} else if (periods > 1) {
+		touch->dropped_samples += periods - 1;
+	}
+
+	touch->time += timestamp - touch->last_timestamp;
+	touch->last_timestamp = timestamp;
+
+	return dt;
+}
+
+/*
+ * Integrates the angular increments collected from a radio report in one
+ * batch and publishes the resulting pose.
+ */
+static void rift_touch_flush_imu(struct rift_touch_controller *touch)
+{
+	if (!touch->num_increments)
+		return;
+
+	/* Increments are already multiplied with their time intervals */
+	pose_update_gyro(1.0, &touch->imu.pose, touch->increments,
+			 touch->num_increments);
+	touch->num_increments = 0;
+
+	telemetry_send_pose(touch->base.dev_id, &touch->imu.pose);
+	shm_publish_pose(touch->base.dev_id, 1e-6 * touch->time,
+			 &touch->imu.pose, &touch->imu.sample.angular_velocity);
+}
+
 static void rift_decode_touch_message(struct rift_touch_controller *touch,
 				      const struct rift_radio_message *message)
 {
@@ -314,28 +391,13 @@ static void rift_decode_touch_message(struct rift_touch_controller *touch,
 		__le16_to_cpu(message->touch.gyro[1]),
 		__le16_to_cpu(message->touch.gyro[2]),
 	};
-	const uint8_t *tgs = message->touch.trigger_grip_stick;
-	uint16_t trigger = tgs[0] | ((tgs[1] & 0x03) << 8);
-	uint16_t grip = ((tgs[1] & 0xfc) >> 2) | ((tgs[2] & 0x0f) << 6);
-	uint16_t stick[2] = {
-		((tgs[2] & 0xf0) >> 4) | ((tgs[3] & 0x3f) << 4),
-		((tgs[3] & 0xc0) >> 6) | ((tgs[4] & 0xff) << 2),
-	};
+	uint16_t tgs[4];
+	unpack_le_bitfields(message->touch.trigger_grip_stick, 10, 4, tgs);
+	uint16_t trigger = tgs[0];
+	uint16_t grip = tgs[1];
+	uint16_t stick[2] = { tgs[2], tgs[3] };
 	uint16_t adc_value = __le16_to_cpu(message->touch.adc_value);
-	int32_t dt = timestamp - touch->last_timestamp;
-
-	if (dt > 1000 - 25 && dt < 1000 + 25) {
-		/* 1 ms */
-	} else if (dt > 2000 - 25 && dt < 2000 + 25) {
-		/* 2 ms */
-	} else if (dt > 3000 - 25 || dt < 3000 + 25) {
-		/* 3 ms */
-	} else {
-		g_print("%s: %d µs since last IMU sample\n", touch->base.name,
-			dt);
-	}
-	touch->last_timestamp = timestamp;
-
+	int32_t dt;
 	if (!(timestamp ||
 	      accel[0] || accel[1] || accel[2] ||
 	      gyro[0] || gyro[1] || gyro[2]))
@@ -372,7 +434,9 @@ static void rift_decode_touch_message(struct rift_touch_controller *touch,
 			  c->gyro_calibration[7] * g[1] +
 			  c->gyro_calibration[8] * g[2];
 
-	sample->time = timestamp;
+	dt = rift_touch_reconstruct_time(touch, timestamp);
+
+	sample->time = 1e-6 * touch->time;
 	sample->acceleration.x = ax;
 	sample->acceleration.y = ay;
 	sample->acceleration.z = az;
@@ -380,13 +444,18 @@ static void rift_decode_touch_message(struct rift_touch_controller *touch,
 	sample->angular_velocity.y = gy;
 	sample->angular_velocity.z = gz;
 
-	telemetry_send_imu_sample(touch->base.dev_id, sample);
+	/* Duplicate and stale samples are neither recorded nor integrated */
+	if (dt > 0) {
+		telemetry_send_imu_sample(touch->base.dev_id, sample);
 
-	const double dt_s = 1e-6 * dt;
+		if (touch->num_increments < RIFT_TOUCH_IMU_BATCH) {
+			vec3 *inc = &touch->increments[touch->num_increments++];
 
-	pose_update(dt_s, &touch->imu.pose, sample);
-
-	telemetry_send_pose(touch->base.dev_id, &touch->imu.pose);
+			inc->x = 1e-6 * dt * gx;
+			inc->y = 1e-6 * dt * gy;
+			inc->z = 1e-6 * dt * gz;
+		}
+	}
 
 	float t;
 	if (trigger < c->trigger_mid_range) {
@@ -465,21 +534,37 @@ static void rift_decode_touch_message(struct rift_touch_controller *touch,
 	case RIFT_TOUCH_CONTROLLER_ADC_REST:
 		touch->cap_rest = ((float)adc_value - c->cap_sense_min[7]) /
 				  (c->cap_sense_touch[7] - c->cap_sense_min[7]);
-		telemetry_send_axis(touch->base.dev_id, 7, &touch->cap_a_x, 1);
+		telemetry_send_axis(touch->base.dev_id, 7, &touch->cap_rest, 1);
 		break;
 	}
 
 	uint8_t buttons = message->touch.buttons;
-	if (buttons != touch->buttons) {
-		const struct button_map *map;
+	const struct button_map *map;
 
-		map = (touch->base.id == RIFT_TOUCH_CONTROLLER_LEFT) ?
-		      touch_left_button_map : touch_right_button_map;
+	map = (touch->base.id == RIFT_TOUCH_CONTROLLER_LEFT) ?
+	      touch_left_button_map : touch_right_button_map;
 
+	if (buttons != touch->buttons) {
 		ouvrt_handle_buttons(touch->base.dev_id, buttons, touch->buttons,
 				     4, map);
 		touch->buttons = buttons;
 	}
+
+	const float axes[] = {
+		[OUVRT_AXIS_STICK_X] = touch->stick[0],
+		[OUVRT_AXIS_STICK_Y] = touch->stick[1],
+		[OUVRT_AXIS_TRIGGER] = touch->trigger,
+		[OUVRT_AXIS_GRIP] = touch->grip,
+		[OUVRT_AXIS_CAP_STICK] = touch->cap_stick,
+		[OUVRT_AXIS_CAP_B_Y] = touch->cap_b_y,
+		[OUVRT_AXIS_CAP_TRIGGER] = touch->cap_trigger,
+		[OUVRT_AXIS_CAP_A_X] = touch->cap_a_x,
+		[OUVRT_AXIS_CAP_REST] = touch->cap_rest,
+	};
+
+	shm_update_input(touch->base.dev_id,
+			 ouvrt_button_state(buttons, 4, map),
+			 axes, G_N_ELEMENTS(axes));
 }
 
 static int rift_touch_parse_calibration(struct rift_touch_controller *touch,
@@ -542,10 +627,12 @@ static int rift_touch_parse_calibration(struct rift_touch_controller *touch,
 		c->cap_sense_touch[i] = json_array_get_int_element(array, i);
 
 	JsonObject *model = json_object_get_object_member(object, "ModelPoints");
+	struct leds *leds = &touch->leds;
 
-	tracking_model_init(&touch->model, json_object_get_size(model));
+	leds_fini(leds);
+	leds_init(leds, json_object_get_size(model));
 
-	for (i = 0; i < touch->model.num_points; i++) {
+	for (i = 0; i < leds->model.num_points; i++) {
 		char name[8];
 
 		g_snprintf(name, 8, "Point%d", i);
@@ -556,12 +643,21 @@ static int rift_touch_parse_calibration(struct rift_touch_controller *touch,
 		for (j = 0; j < 6; j++)
 			point[j] = json_array_get_double_element(array, j);
 
-		touch->model.points[i].x = point[0];
-		touch->model.points[i].y = point[1];
-		touch->model.points[i].z = point[2];
-		touch->model.normals[i].x = point[3];
-		touch->model.normals[i].y = point[4];
-		touch->model.normals[i].z = point[5];
+		leds->model.points[i].x = point[0];
+		leds->model.points[i].y = point[1];
+		leds->model.points[i].z = point[2];
+		leds->model.normals[i].x = point[3];
+		leds->model.normals[i].y = point[4];
+		leds->model.normals[i].z = point[5];
+
+		/*
+		 * The blinking patterns are not part of the calibration data,
+		 * and the patterns the Touch controllers use are not known.
+		 * Mark them as unknown. Since flicker identification skips
+		 * unknown patterns, the model is not registered with the
+		 * tracker until the patterns are filled in.
+		 */
+		leds->patterns[i] = 0;
 	}
 
 	json_node_unref(node);
@@ -786,6 +882,24 @@ int rift_decode_pairing_message(struct rift_radio *radio, int fd,
 	return 0;
 }
 
+/*
+ * Marks a Touch controller as inactive, so that its IMU time is
+ * resynchronized when it is activated again, and reports the number of IMU
+ * samples lost to dropped radio packets while it was active.
+ */
+static void rift_touch_deactivate(struct rift_touch_controller *touch)
+{
+	if (!touch->base.active)
+		return;
+
+	g_print("Rift: %s inactive, %u IMU samples dropped\n",
+		touch->base.name, touch->dropped_samples);
+	touch->base.active = false;
+	touch->time_valid = false;
+	touch->num_increments = 0;
+	touch->dropped_samples = 0;
+}
+
 int rift_decode_radio_message(struct rift_radio *radio, int fd,
 			      const struct rift_radio_message *message)
 {
@@ -808,7 +922,9 @@ int rift_decode_radio_message(struct rift_radio *radio, int fd,
 				message->touch.timestamp ? "" : "in");
 			radio->touch[0].base.present = true;
 		}
-		if (!radio->touch[0].base.active && message->touch.timestamp)
+		if (!message->touch.timestamp)
+			rift_touch_deactivate(&radio->touch[0]);
+		else if (!radio->touch[0].base.active)
 			rift_radio_activate(&radio->touch[0].base, fd);
 		rift_decode_touch_message(&radio->touch[0], message);
 	} else if (message->device_type == RIFT_TOUCH_CONTROLLER_RIGHT) {
@@ -818,7 +934,9 @@ int rift_decode_radio_message(struct rift_radio *radio, int fd,
 				message->touch.timestamp ? "" : "in");
 			radio->touch[1].base.present = true;
 		}
-		if (!radio->touch[1].base.active && message->touch.timestamp)
+		if (!message->touch.timestamp)
+			rift_touch_deactivate(&radio->touch[1]);
+		else if (!radio->touch[1].base.active)
 			rift_radio_activate(&radio->touch[1].base, fd);
 		rift_decode_touch_message(&radio->touch[1], message);
 	} else {
@@ -838,14 +956,31 @@ void rift_decode_radio_report(struct rift_radio *radio, int fd,
 	int i;
 
 	if (report->id == RIFT_RADIO_REPORT_ID) {
+		const struct rift_radio_message *m = report->message;
+		int first = 0;
+
+		/*
+		 * Decode the two messages in chronological order if both
+		 * carry IMU samples from the same Touch controller.
+		 */
+		if (m[0].device_type == m[1].device_type &&
+		    (m[0].device_type == RIFT_TOUCH_CONTROLLER_LEFT ||
+		     m[0].device_type == RIFT_TOUCH_CONTROLLER_RIGHT) &&
+		    (int32_t)(__le32_to_cpu(m[1].touch.timestamp) -
+			      __le32_to_cpu(m[0].touch.timestamp)) < 0)
+			first = 1;
+
 		for (i = 0; i < 2; i++) {
 			ret = rift_decode_radio_message(radio, fd,
-							&report->message[i]);
+							&m[first ^ i]);
 			if (ret < 0) {
 				rift_dump_report(buf, len);
-				return;
+				break;
 			}
 		}
+
+		rift_touch_flush_imu(&radio->touch[0]);
+		rift_touch_flush_imu(&radio->touch[1]);
 	} else {
 		unsigned int i;
 
@@ -857,6 +992,15 @@ void rift_decode_radio_report(struct rift_radio *radio, int fd,
 	}
 }
 
+/*
+ * Deactivates the Touch controllers when the radio stops.
+ */
+void rift_radio_stop(struct rift_radio *radio)
+{
+	rift_touch_deactivate(&radio->touch[0]);
+	rift_touch_deactivate(&radio->touch[1]);
+}
+
 void rift_radio_init(struct rift_radio *radio)
 {
 	radio->remote.base.name = "Remote";
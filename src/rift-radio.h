@@ -10,10 +10,12 @@
 #include <stdbool.h>
 
 #include "imu.h"
-#include "tracking-model.h"
+#include "leds.h"
 
 struct rift_wireless_device {
 	unsigned long dev_id;
+	/* dev_id has been claimed, 0 is a valid id */
+	bool dev_id_valid;
 	const char *name;
 	uint32_t address;
 	uint8_t id;
@@ -52,12 +54,24 @@ struct rift_touch_calibration {
 	uint16_t cap_sense_touch[8];
 };
 
+/* Touch IMU sample period in µs */
+#define RIFT_TOUCH_IMU_PERIOD		1000
+/* Maximum number of IMU samples in a single radio report */
+#define RIFT_TOUCH_IMU_BATCH		2
+/* Gaps longer than this many sample periods, either way, resynchronize */
+#define RIFT_TOUCH_IMU_MAX_PERIODS	100
+
 struct rift_touch_controller {
 	struct rift_wireless_device base;
 	struct rift_touch_calibration calibration;
-	struct tracking_model model;
+	struct leds leds;
 	struct imu_state imu;
 	uint32_t last_timestamp;
+	uint64_t time;
+	bool time_valid;
+	unsigned int dropped_samples;
+	unsigned int num_increments;
+	vec3 increments[RIFT_TOUCH_IMU_BATCH];
 	float trigger;
 	float grip;
 	float stick[2];
@@ -84,5 +98,6 @@ int rift_get_firmware_version(int fd);
 void rift_decode_radio_report(struct rift_radio *radio, int fd,
 			      const unsigned char *buf, size_t len);
 void rift_radio_init(struct rift_radio *radio);
+void rift_radio_stop(struct rift_radio *radio);
 
 #endif /* __RIFT_RADIO_H__ */
@@ -6,8 +6,10 @@
 #include <asm/byteorder.h>
 #include <errno.h>
 #include <libusb.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -15,9 +17,16 @@
 #include <glib-object.h>
 
 #include "rift-sensor.h"
+#include "blobwatch.h"
+#include "budget.h"
+#include "clock-recovery.h"
 #include "device.h"
 #include "esp770u.h"
+#include "exposure.h"
+#include "frame-pool.h"
+#include "params.h"
 #include "ar0134.h"
+#include "recorder.h"
 #include "usb-ids.h"
 #include "uvc.h"
 #include "debug.h"
@@ -25,6 +34,14 @@
 #define RIFT_SENSOR_WIDTH	1280
 #define RIFT_SENSOR_HEIGHT	960
 #define RIFT_SENSOR_FRAME_SIZE	(RIFT_SENSOR_WIDTH * RIFT_SENSOR_HEIGHT)
+/* 19.2 ms per frame */
+#define RIFT_SENSOR_FRAME_INTERVAL	0.0192
+/* One frame being received, the rest held by recorder and debug stream */
+#define RIFT_SENSOR_NUM_FRAMES	8
+/* Isochronous packets are received once per 125 µs microframe */
+#define RIFT_SENSOR_PACKET_INTERVAL_NS	125000
+/* The device clock fit is updated from the earliest sample every 100 ms */
+#define RIFT_SENSOR_CLOCK_INTERVAL_NS	100000000
 
 #define RIFT_SENSOR_VS_PROBE_CONTROL_SIZE	26
 
@@ -43,16 +60,38 @@ struct _OuvrtRiftSensor {
 	uint8_t radio_id[5];
 	bool sync;
 
-	unsigned char *frame;
+	struct frame_pool *pool;
+	struct frame *frame;
 	int frame_size;
 	int payload_size;
 	int frame_id;
+	/* Frames dropped because no buffer was available */
+	unsigned int skipped_frames;
 	uint32_t pts;
 	uint64_t time;
 	int64_t dt;
+	struct clock_recovery clock;
 
+	/* Equidistant fisheye lens model */
+	double fx, fy, cx, cy;
+	double k[4];
+	/* Undistorted pinhole camera given to the pose solver */
+	dmat3 camera_matrix;
+	/* Last poses of the tracked objects estimated from this sensor */
+	struct tracker_pose poses[MAX_TRACKED_OBJECTS];
+
+	/* Replaced from the main thread, protected by tracker_lock */
+	GMutex tracker_lock;
 	OuvrtTracker *tracker;
+	struct blobwatch *bw;
+	struct tracking_budget budget;
+	struct exposure_control exposure;
+	/* Set while an asynchronous exposure update is in flight */
+	GMutex exposure_lock;
+	GCond exposure_cond;
+	bool exposure_pending;
 	struct debug_stream *debug;
+	struct recorder *recorder;
 };
 
 G_DEFINE_TYPE(OuvrtRiftSensor, ouvrt_rift_sensor, OUVRT_TYPE_USB_DEVICE)
@@ -81,9 +120,70 @@ static int rift_sensor_get_calibration(OuvrtRiftSensor *self)
 	g_print(" f = [ %7.3f %7.3f ], c = [ %7.3f %7.3f ]\n", fx, fy, cx, cy);
 	g_print(" k = [ %9.6f %9.6f %9.6f %9.6f ]\n", k1, k2, k3, k4);
 
+	self->fx = fx;
+	self->fy = fy;
+	self->cx = cx;
+	self->cy = cy;
+	self->k[0] = k1;
+	self->k[1] = k2;
+	self->k[2] = k3;
+	self->k[3] = k4;
+
+	/*
+	 * The virtual pinhole camera has half the focal length, so that the
+	 * undistorted field of view still fits into the frame.
+	 */
+	double * const A = self->camera_matrix.m;
+
+	A[0] = fx / 2; A[1] = 0.0;    A[2] = cx;
+	A[3] = 0.0;    A[4] = fy / 2; A[5] = cy;
+	A[6] = 0.0;    A[7] = 0.0;    A[8] = 1.0;
+
 	return 0;
 }
 
+/*
+ * Maps the blob centers from the fisheye camera image into the undistorted
+ * pinhole camera described by camera_matrix, since the pose solver only
+ * supports the polynomial lens distortion model. The blob array itself is
+ * part of the blob tracking history and is not modified.
+ */
+static void rift_sensor_undistort_blobs(OuvrtRiftSensor *self,
+					const struct blob *blobs,
+					int num_blobs, struct blob *out)
+{
+	const double *k = self->k;
+	int i, j;
+
+	for (i = 0; i < num_blobs; i++) {
+		double x = (blobs[i].x - self->cx) / self->fx;
+		double y = (blobs[i].y - self->cy) / self->fy;
+		double theta_d = sqrt(x * x + y * y);
+		double theta = theta_d;
+		double scale = 1.0;
+
+		/*
+		 * Invert theta_d = θ (1 + k1 θ² + k2 θ⁴ + k3 θ⁶ + k4 θ⁸)
+		 * with a few Newton iterations.
+		 */
+		for (j = 0; j < 5 && theta_d > 1e-8; j++) {
+			double t2 = theta * theta;
+			double f = theta * (1 + t2 * (k[0] + t2 * (k[1] +
+				   t2 * (k[2] + t2 * k[3])))) - theta_d;
+			double df = 1 + t2 * (3 * k[0] + t2 * (5 * k[1] +
+				    t2 * (7 * k[2] + t2 * 9 * k[3])));
+
+			theta -= f / df;
+		}
+		if (theta_d > 1e-8)
+			scale = tan(fmin(theta, 1.5)) / theta_d;
+
+		out[i] = blobs[i];
+		out[i].x = CLAMP(x * scale * self->fx / 2 + self->cx, 0, 65535);
+		out[i].y = CLAMP(y * scale * self->fy / 2 + self->cy, 0, 65535);
+	}
+}
+
 /*
  * Opens the USB device.
  */
@@ -146,34 +246,146 @@ static int rift_sensor_open(OuvrtDevice *dev)
 	return 0;
 }
 
+static void rift_sensor_exposure_done(void *user_data, int status)
+{
+	OuvrtRiftSensor *self = user_data;
+
+	if (status < 0 && status != -ECANCELED) {
+		g_print("%s: Failed to set exposure and gain: %d\n",
+			self->dev.name, status);
+	}
+
+	g_mutex_lock(&self->exposure_lock);
+	self->exposure_pending = false;
+	g_cond_broadcast(&self->exposure_cond);
+	g_mutex_unlock(&self->exposure_lock);
+}
+
+static int rift_sensor_submit_transfer(void *owner,
+				       struct libusb_transfer *transfer)
+{
+	return ouvrt_usb_device_submit_transfer(owner, transfer);
+}
+
+/*
+ * Runs the exposure and gain control loop at a low rate, using brightness
+ * statistics of the current frame and its blobs. The new settings are
+ * written asynchronously, as this is called from the transfer callback.
+ */
+static void rift_sensor_update_exposure(OuvrtRiftSensor *self,
+					struct blobservation *ob)
+{
+	struct exposure_control *ctrl = &self->exposure;
+	struct exposure_stats stats;
+	bool pending;
+	int ret;
+
+	if (!exposure_control_due(ctrl))
+		return;
+
+	g_mutex_lock(&self->exposure_lock);
+	pending = self->exposure_pending;
+	g_mutex_unlock(&self->exposure_lock);
+	if (pending)
+		return;
+
+	exposure_stats_from_frame(&stats, self->frame->data, RIFT_SENSOR_WIDTH,
+				  RIFT_SENSOR_HEIGHT, RIFT_SENSOR_WIDTH,
+				  blobwatch_get_threshold(self->bw));
+	exposure_stats_from_blobs(&stats, ob);
+	if (!exposure_control_update(ctrl, &stats))
+		return;
+
+	g_mutex_lock(&self->exposure_lock);
+	self->exposure_pending = true;
+	g_mutex_unlock(&self->exposure_lock);
+
+	ret = ar0134_set_exposure_gain_async(self->devh,
+					     rift_sensor_submit_transfer,
+					     OUVRT_USB_DEVICE(self),
+					     ctrl->exposure, ctrl->gain,
+					     rift_sensor_exposure_done, self);
+	if (ret < 0) {
+		g_mutex_lock(&self->exposure_lock);
+		self->exposure_pending = false;
+		g_cond_broadcast(&self->exposure_cond);
+		g_mutex_unlock(&self->exposure_lock);
+	}
+}
+
+/*
+ * Returns a new reference to the tracker this sensor is linked to, or NULL.
+ * The main thread can replace the tracker at any time, so the USB event
+ * threads and the device thread must only use it through a reference
+ * obtained here.
+ */
+static OuvrtTracker *rift_sensor_ref_tracker(OuvrtRiftSensor *self)
+{
+	OuvrtTracker *tracker;
+
+	g_mutex_lock(&self->tracker_lock);
+	tracker = self->tracker ? g_object_ref(self->tracker) : NULL;
+	g_mutex_unlock(&self->tracker_lock);
+
+	return tracker;
+}
+
 static void default_frame_callback(OuvrtRiftSensor *self)
 {
+	OuvrtTracker *tracker = rift_sensor_ref_tracker(self);
 	struct timespec tp;
 	double timestamps[4] = { 0 };
+	uint8_t threshold;
 
 	clock_gettime(CLOCK_MONOTONIC, &tp);
 	timestamps[1] = tp.tv_sec + 1e-9 * tp.tv_nsec;
 
+	/*
+	 * Pick up parameter changes first, so that the recording uses the
+	 * same blob detection threshold as the tracker.
+	 */
+	if (self->dev.config) {
+		tracking_params_apply(tracking_config_acquire(self->dev.config),
+				      self->bw, &self->budget);
+	}
+	threshold = blobwatch_get_threshold(self->bw);
+
+	recorder_push(self->recorder, self->frame, threshold);
+
 	/*
 	 * Find bright blobs in the camera image and identify individual LEDs
 	 * using the estimated pose at time of exposure or, if that is not
 	 * available, using the LED blinking pattern.
 	 */
 	struct blobservation *ob = NULL;
-	if (self->tracker) {
-		ouvrt_tracker_process_frame(self->tracker,
-					    self->frame, RIFT_SENSOR_WIDTH,
+	if (tracker) {
+		ouvrt_tracker_process_frame(tracker, self->dev.id,
+					    self->bw, &self->budget,
+					    self->frame->data,
+					    RIFT_SENSOR_WIDTH,
 					    RIFT_SENSOR_HEIGHT, self->time,
 					    &ob);
+		rift_sensor_update_exposure(self, ob);
 	}
 
 	clock_gettime(CLOCK_MONOTONIC, &tp);
 	timestamps[2] = tp.tv_sec + 1e-9 * tp.tv_nsec;
 
-	dquat rot = { 0 };
-	dvec3 trans = { 0 };
-
-	/* TODO: calculate pose */
+	if (ob && tracker) {
+		struct blob blobs[MAX_BLOBS_PER_FRAME];
+		double dist_coeffs[5] = { 0 };
+		int num_blobs = MIN(ob->num_blobs, MAX_BLOBS_PER_FRAME);
+
+		/*
+		 * Calculate the poses from undistorted blob positions, the
+		 * undistorted camera intrinsics, and the known LED positions.
+		 */
+		rift_sensor_undistort_blobs(self, ob->blobs, num_blobs, blobs);
+		ouvrt_tracker_process_blobs(tracker, &self->budget,
+					    blobs, num_blobs,
+					    &self->camera_matrix, dist_coeffs,
+					    self->poses);
+	}
 
 	clock_gettime(CLOCK_MONOTONIC, &tp);
 	timestamps[3] = tp.tv_sec + 1e-9 * tp.tv_nsec;
@@ -182,7 +394,10 @@ static void default_frame_callback(OuvrtRiftSensor *self)
 				RIFT_SENSOR_WIDTH * RIFT_SENSOR_HEIGHT +
 				sizeof(struct ouvrt_debug_attachment),
 				RIFT_SENSOR_WIDTH * RIFT_SENSOR_HEIGHT,
-				ob, &rot, &trans, timestamps);
+				threshold, ob, &self->poses[0].rot,
+				&self->poses[0].trans, timestamps);
+
+	g_clear_object(&tracker);
 }
 
 enum process_payload_return {
@@ -193,8 +408,40 @@ enum process_payload_return {
 	PAYLOAD_FRAME_COMPLETE
 };
 
+/*
+ * Returns the exposure midpoint of the frame starting with the given payload
+ * in CLOCK_MONOTONIC ns. The presentation timestamp marks the start of
+ * exposure in device clock ticks, which are converted to host time using
+ * the clock recovered from the source clock references. Until the clock
+ * is recovered, or if the device clock frequency is unknown, the arrival
+ * time of the first payload is used instead.
+ */
+static uint64_t rift_sensor_frame_time(OuvrtRiftSensor *self,
+				       struct uvc_payload_header *h,
+				       uint64_t arrival)
+{
+	uint64_t time;
+
+	if (!(h->bmHeaderInfo & UVC_STREAM_PTS) || !self->clock.frequency ||
+	    clock_recovery_to_host(&self->clock,
+				   __le32_to_cpu(h->dwPresentationTime),
+				   &time) < 0)
+		return arrival;
+
+	/* Exposure times are only known while we control them */
+	if (g_atomic_pointer_get(&self->tracker))
+		time += ar0134_exposure_time_ns(self->exposure.exposure) / 2;
+
+	return time;
+}
+
+/*
+ * Copies the payload into the current frame. The arrival time is the host
+ * time at which the payload was received, in CLOCK_MONOTONIC ns.
+ */
 enum process_payload_return process_payload(OuvrtRiftSensor *self,
-					    unsigned char *payload, size_t len)
+					    unsigned char *payload, size_t len,
+					    uint64_t arrival)
 {
 	struct uvc_payload_header *h = (struct uvc_payload_header *)payload;
 	int payload_len;
@@ -202,7 +449,7 @@ enum process_payload_return process_payload(OuvrtRiftSensor *self,
 	uint32_t pts;
 	bool error;
 
-	if (len == 0 || len == sizeof(struct uvc_payload_header))
+	if (len == 0)
 		return PAYLOAD_EMPTY;
 
 	if (h->bHeaderLength == 0) {
@@ -218,20 +465,30 @@ enum process_payload_return process_payload(OuvrtRiftSensor *self,
 
 	payload += h->bHeaderLength;
 	payload_len = len - h->bHeaderLength;
-	frame_id = h->bmHeaderInfo & 0x01;
-	error = h->bmHeaderInfo & 0x40;
+	frame_id = h->bmHeaderInfo & UVC_STREAM_FID;
+	error = h->bmHeaderInfo & UVC_STREAM_ERR;
 
 	if (error) {
 		g_print("%s: Frame error\n", self->dev.name);
 		return PAYLOAD_INVALID;
 	}
 
+	/* Empty payloads still carry source clock references */
+	if ((h->bmHeaderInfo & UVC_STREAM_SCR) && self->clock.frequency) {
+		clock_recovery_add_sample(&self->clock,
+					  __le32_to_cpup((__le32 *)
+							 h->scrSourceClock),
+					  arrival);
+	}
+
+	if (payload_len == 0)
+		return PAYLOAD_EMPTY;
+
 	pts = __le32_to_cpu(h->dwPresentationTime);
 	if (self->payload_size == 0)
 		self->pts = pts;
 
 	if (frame_id != self->frame_id) {
-		struct timespec ts;
 		uint64_t time;
 
 		if (self->payload_size != self->frame_size) {
@@ -240,14 +497,29 @@ enum process_payload_return process_payload(OuvrtRiftSensor *self,
 		}
 
 		/* Start of new frame */
-		clock_gettime(CLOCK_MONOTONIC, &ts);
-		time = ts.tv_sec * 1000000000 + ts.tv_nsec;
+		time = rift_sensor_frame_time(self, h, arrival);
 		self->dt = time - self->time;
 
 		self->frame_id = frame_id;
 		self->pts = pts;
 		self->time = time;
 		self->payload_size = 0;
+
+		/*
+		 * Reuse the buffer of a dropped frame. If the pool is
+		 * exhausted, because all frames are still held by slow
+		 * consumers, this frame is dropped. Tell the blob tracker,
+		 * so that it can keep LED patterns consistent.
+		 */
+		if (!self->frame)
+			self->frame = frame_pool_alloc(self->pool);
+		if (self->frame) {
+			self->frame->timestamp = time;
+		} else {
+			self->skipped_frames++;
+			if (self->bw)
+				blobwatch_skip_frames(self->bw, 1);
+		}
 	} else {
 		if (pts != self->pts) {
 			g_print("%s: PTS changed in-frame at %u!\n",
@@ -262,10 +534,13 @@ enum process_payload_return process_payload(OuvrtRiftSensor *self,
 		return PAYLOAD_OVERFLOW;
 	}
 
-	memcpy(self->frame + self->payload_size, payload, payload_len);
+	if (self->frame) {
+		memcpy(self->frame->data + self->payload_size, payload,
+		       payload_len);
+	}
 	self->payload_size += payload_len;
 
-	return (self->payload_size == self->frame_size) ?
+	return (self->frame && self->payload_size == self->frame_size) ?
 	       PAYLOAD_FRAME_COMPLETE : PAYLOAD_FRAME_PARTIAL;
 }
 
@@ -273,6 +548,8 @@ static void iso_transfer_cb(struct libusb_transfer *transfer)
 {
 	OuvrtRiftSensor *self = transfer->user_data;
 	OuvrtDevice *dev = OUVRT_DEVICE(self);
+	OuvrtUSBDevice *usb = OUVRT_USB_DEVICE(self);
+	uint64_t completion;
 	int ret;
 	int i;
 
@@ -281,7 +558,7 @@ static void iso_transfer_cb(struct libusb_transfer *transfer)
 			if (dev->active)
 				g_print("%s: Device vanished\n", dev->name);
 			dev->active = false;
-		} else {
+		} else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
 			g_print("%s: Transfer error: %d (%s)\n",
 				dev->name, transfer->status,
 				libusb_error_name(transfer->status));
@@ -289,23 +566,34 @@ static void iso_transfer_cb(struct libusb_transfer *transfer)
 		return;
 	}
 
-	/* Handle contained isochronous packets */
+	/*
+	 * Handle contained isochronous packets. The arrival time of each
+	 * packet is estimated from the transfer completion time, as packets
+	 * are received in consecutive microframes.
+	 */
+	completion = ouvrt_usb_device_get_completion_time(usb, transfer);
 	for (i = 0; i < transfer->num_iso_packets; i++) {
 		enum process_payload_return ret;
 		unsigned char *payload;
 		size_t payload_len;
+		uint64_t arrival;
 
 		payload = libusb_get_iso_packet_buffer_simple(transfer, i);
 		payload_len = transfer->iso_packet_desc[i].actual_length;
-		ret = process_payload(self, payload, payload_len);
+		arrival = completion - RIFT_SENSOR_PACKET_INTERVAL_NS *
+			  (uint64_t)(transfer->num_iso_packets - 1 - i);
+		ret = process_payload(self, payload, payload_len, arrival);
 
-		if (ret == PAYLOAD_FRAME_COMPLETE)
+		if (ret == PAYLOAD_FRAME_COMPLETE) {
 			default_frame_callback(self);
+			frame_unref(self->frame);
+			self->frame = NULL;
+		}
 	}
 
 
 	/* Resubmit transfer */
-	ret = libusb_submit_transfer(transfer);
+	ret = ouvrt_usb_device_submit_transfer(usb, transfer);
 	if (ret < 0) {
 		g_print("%s: Failed to resubmit: %d\n", dev->name, ret);
 		dev->active = false;
@@ -340,6 +628,7 @@ static int rift_sensor_start(OuvrtDevice *dev)
 		.dwMaxPayloadTransferSize = __cpu_to_le16(8192),
 	};
 	struct uvc_probe_commit_control commit;
+	uint32_t frequency;
 	int ret;
 
 	ret = libusb_claim_interface(devh, 1);
@@ -394,12 +683,38 @@ static int rift_sensor_start(OuvrtDevice *dev)
 		return ret;
 	}
 
+	ret = uvc_get_clock_frequency(libusb_get_device(devh),
+				      UVC_INTERFACE_CONTROL, &frequency);
+	if (ret < 0) {
+		g_print("%s: Unknown device clock, using arrival timestamps\n",
+			dev->name);
+		memset(&self->clock, 0, sizeof(self->clock));
+	} else {
+		clock_recovery_init(&self->clock, frequency,
+				    RIFT_SENSOR_CLOCK_INTERVAL_NS);
+	}
+
 	self->frame_size = RIFT_SENSOR_FRAME_SIZE;
-	self->frame = calloc(1, self->frame_size +
-			     sizeof(struct ouvrt_debug_attachment));
-	if (!self->frame)
+	self->skipped_frames = 0;
+	self->pool = frame_pool_new(dev->name, self->frame_size +
+				    sizeof(struct ouvrt_debug_attachment),
+				    RIFT_SENSOR_NUM_FRAMES, frame_pool_flags);
+	if (!self->pool)
 		return -ENOMEM;
 
+	self->bw = blobwatch_new(RIFT_SENSOR_WIDTH, RIFT_SENSOR_HEIGHT);
+	if (!self->bw)
+		return -ENOMEM;
+	tracking_budget_init(&self->budget, RIFT_SENSOR_FRAME_INTERVAL,
+			     RIFT_SENSOR_HEIGHT);
+	tracker_poses_reset(self->poses);
+	/*
+	 * Start from the synchronised exposure timings of ~495 µs and unity
+	 * gain, and adjust about four times per second.
+	 */
+	exposure_control_init(&self->exposure, 26, 8, 60, 0x20, 0x20, 0x7f,
+			      13);
+
 	self->num_transfers = 7; /* enough for a single frame */
 	self->transfer = calloc(self->num_transfers, sizeof(*self->transfer));
 	if (!self->transfer)
@@ -420,7 +735,8 @@ static int rift_sensor_start(OuvrtDevice *dev)
 					 1000);
 		libusb_set_iso_packet_lengths(self->transfer[i], packet_size);
 
-		ret = libusb_submit_transfer(self->transfer[i]);
+		ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(self),
+						       self->transfer[i]);
 		if (ret < 0) {
 			g_print("%s: Failed to submit iso transfer %d\n",
 				dev->name, i);
@@ -435,6 +751,57 @@ static int rift_sensor_start(OuvrtDevice *dev)
 		.framerate = { 625, 12 }, /* 19.2 ms per frame */
 	};
 	self->debug = debug_stream_new(&desc);
+	self->recorder = recorder_new(dev->name, RIFT_SENSOR_WIDTH,
+				      RIFT_SENSOR_HEIGHT);
+
+	return 0;
+}
+
+/*
+ * Returns the path of the file caching the radio address this sensor was
+ * last synchronised to.
+ */
+static char *rift_sensor_radio_cache_filename(OuvrtRiftSensor *self)
+{
+	if (!self->dev.serial)
+		return NULL;
+
+	return g_strdup_printf("%s/ouvrt/%s.radio", g_get_user_cache_dir(),
+			       self->dev.serial);
+}
+
+/*
+ * Synchronises the sensor exposure to the radio of the HMD owning the given
+ * tracker and remembers the radio address for automatic grouping.
+ */
+static int rift_sensor_setup_radio(OuvrtRiftSensor *self,
+				   OuvrtTracker *tracker)
+{
+	static const uint8_t zero[5] = { 0 };
+	char *filename, *path, *contents;
+	uint8_t *a = self->radio_id;
+	int ret;
+
+	ouvrt_tracker_get_radio_address(tracker, self->radio_id);
+	if (memcmp(self->radio_id, zero, 5) == 0)
+		return 0;
+
+	ret = esp770u_setup_radio(self->devh, self->radio_id);
+	if (ret < 0)
+		return ret;
+
+	filename = rift_sensor_radio_cache_filename(self);
+	if (!filename)
+		return 0;
+
+	path = g_path_get_dirname(filename);
+	g_mkdir_with_parents(path, 0755);
+	contents = g_strdup_printf("%02x:%02x:%02x:%02x:%02x\n",
+				   a[0], a[1], a[2], a[3], a[4]);
+	g_file_set_contents(filename, contents, -1, NULL);
+	g_free(contents);
+	g_free(path);
+	g_free(filename);
 
 	return 0;
 }
@@ -445,6 +812,7 @@ static int rift_sensor_start(OuvrtDevice *dev)
 static void rift_sensor_thread(OuvrtDevice *dev)
 {
 	OuvrtRiftSensor *self = OUVRT_RIFT_SENSOR(dev);
+	OuvrtTracker *tracker;
 	int ret;
 
 	usleep(1000000);
@@ -456,20 +824,16 @@ static void rift_sensor_thread(OuvrtDevice *dev)
 	}
 
 	/* Initialize the AR0134 sensor for CV1 tracking */
-	if (self->tracker) {
+	tracker = rift_sensor_ref_tracker(self);
+	if (tracker) {
 		g_print("%s: Synchronised exposure\n", dev->name);
 		/* Enable synchronised exposure by default */
 		ret = ar0134_set_sync(self->devh, true);
+		if (ret >= 0)
+			ret = rift_sensor_setup_radio(self, tracker);
+		g_object_unref(tracker);
 		if (ret < 0)
 			return;
-
-		ouvrt_tracker_get_radio_address(self->tracker, self->radio_id);
-		if (self->radio_id) {
-			ret = esp770u_setup_radio(self->devh,
-						  self->radio_id);
-			if (ret < 0)
-				return;
-		}
 	} else {
 		g_print("%s: Automatic exposure\n", dev->name);
 		ret = ar0134_set_ae(self->devh, true);
@@ -483,10 +847,39 @@ static void rift_sensor_thread(OuvrtDevice *dev)
 static void rift_sensor_stop(OuvrtDevice *dev)
 {
 	OuvrtRiftSensor *self = OUVRT_RIFT_SENSOR(dev);
+	gint64 end_time;
 
 	g_print("%s: Stop\n", dev->name);
 
+	/*
+	 * The device thread cancels a pending exposure update and calls its
+	 * done callback before it exits. Make sure that has happened before
+	 * the device handle is closed.
+	 */
+	end_time = g_get_monotonic_time() + 5 * G_TIME_SPAN_SECOND;
+	g_mutex_lock(&self->exposure_lock);
+	while (self->exposure_pending) {
+		if (!g_cond_wait_until(&self->exposure_cond,
+				       &self->exposure_lock, end_time)) {
+			g_print("%s: Timeout waiting for exposure update\n",
+				dev->name);
+			break;
+		}
+	}
+	g_mutex_unlock(&self->exposure_lock);
+
+	if (self->skipped_frames) {
+		g_print("%s: Skipped %u frames\n", dev->name,
+			self->skipped_frames);
+	}
+
 	debug_stream_unref(self->debug);
+	recorder_free(self->recorder);
+	self->recorder = NULL;
+	frame_unref(self->frame);
+	self->frame = NULL;
+	frame_pool_unref(self->pool);
+	self->pool = NULL;
 	libusb_release_interface(self->devh, UVC_INTERFACE_CONTROL);
 }
 
@@ -498,8 +891,12 @@ static void ouvrt_rift_sensor_finalize(GObject *object)
 {
 	OuvrtRiftSensor *self = OUVRT_RIFT_SENSOR(object);
 
-	if (self->tracker)
-		g_object_unref(self->tracker);
+	g_clear_object(&self->tracker);
+	g_mutex_clear(&self->tracker_lock);
+	g_cond_clear(&self->exposure_cond);
+	g_mutex_clear(&self->exposure_lock);
+	blobwatch_free(self->bw);
+	G_OBJECT_CLASS(ouvrt_rift_sensor_parent_class)->finalize(object);
 }
 
 static void ouvrt_rift_sensor_class_init(OuvrtRiftSensorClass *klass)
@@ -517,6 +914,13 @@ static void ouvrt_rift_sensor_init(OuvrtRiftSensor *self)
 	ouvrt_usb_device_set_vid_pid(OUVRT_USB_DEVICE(self), VID_OCULUSVR,
 				     PID_RIFT_SENSOR);
 	self->sync = false;
+	g_mutex_init(&self->tracker_lock);
+	g_mutex_init(&self->exposure_lock);
+	g_cond_init(&self->exposure_cond);
+	tracker_poses_reset(self->poses);
+	self->dev.config = tracking_config_new();
+	if (!self->dev.config)
+		g_print("Rift Sensor: Failed to allocate tracking parameters, using defaults\n");
 }
 
 /*
@@ -568,6 +972,7 @@ void ouvrt_rift_sensor_set_sync_exposure(OuvrtRiftSensor *self, gboolean sync)
 
 void ouvrt_rift_sensor_set_tracker(OuvrtRiftSensor *self, OuvrtTracker *tracker)
 {
+	OuvrtTracker *old;
 	int ret;
 
 	if (self->devh) {
@@ -575,17 +980,59 @@ void ouvrt_rift_sensor_set_tracker(OuvrtRiftSensor *self, OuvrtTracker *tracker)
 			g_print("%s: Synchronised exposure\n", self->dev.name);
 			ouvrt_rift_sensor_set_sync_exposure(self, true);
 
-			ouvrt_tracker_get_radio_address(tracker, self->radio_id);
-			if (self->radio_id) {
-				ret = esp770u_setup_radio(self->devh,
-							  self->radio_id);
-				if (ret < 0)
-					return;
-			}
+			ret = rift_sensor_setup_radio(self, tracker);
+			if (ret < 0)
+				return;
 		} else if (!tracker && self->tracker) {
 			g_print("%s: Automatic exposure\n", self->dev.name);
 			ouvrt_rift_sensor_set_sync_exposure(self, false);
 		}
 	}
-	g_set_object(&self->tracker, tracker);
+
+	/*
+	 * Swap the tracker under the lock. Frames being processed keep their
+	 * own reference to the old tracker until they are done with it.
+	 */
+	g_mutex_lock(&self->tracker_lock);
+	old = self->tracker;
+	self->tracker = tracker ? g_object_ref(tracker) : NULL;
+	g_mutex_unlock(&self->tracker_lock);
+
+	if (old)
+		g_object_unref(old);
+}
+
+OuvrtTracker *ouvrt_rift_sensor_get_tracker(OuvrtRiftSensor *self)
+{
+	return self->tracker;
+}
+
+/*
+ * Reads the radio address this sensor was last synchronised to from the
+ * cache. Returns TRUE if a valid address was found.
+ */
+gboolean ouvrt_rift_sensor_get_last_radio_address(OuvrtRiftSensor *self,
+						  uint8_t address[5])
+{
+	unsigned int a[5];
+	char *filename, *contents;
+	gboolean ret = FALSE;
+	int i;
+
+	filename = rift_sensor_radio_cache_filename(self);
+	if (!filename)
+		return FALSE;
+
+	if (g_file_get_contents(filename, &contents, NULL, NULL)) {
+		if (sscanf(contents, "%02x:%02x:%02x:%02x:%02x", &a[0], &a[1],
+			   &a[2], &a[3], &a[4]) == 5) {
+			for (i = 0; i < 5; i++)
+				address[i] = a[i];
+			ret = TRUE;
+		}
+		g_free(contents);
+	}
+	g_free(filename);
+
+	return ret;
 }
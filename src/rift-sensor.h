@@ -21,6 +21,9 @@ G_DECLARE_FINAL_TYPE(OuvrtRiftSensor, ouvrt_rift_sensor, OUVRT, RIFT_SENSOR, \
 OuvrtDevice *rift_sensor_new(const char *devnode);
 
 void ouvrt_rift_sensor_set_tracker(OuvrtRiftSensor *self, OuvrtTracker *tracker);
+OuvrtTracker *ouvrt_rift_sensor_get_tracker(OuvrtRiftSensor *self);
+gboolean ouvrt_rift_sensor_get_last_radio_address(OuvrtRiftSensor *self,
+						  uint8_t address[5]);
 
 G_END_DECLS
 
@@ -16,18 +16,25 @@
 #include "rift.h"
 #include "rift-hid-reports.h"
 #include "rift-radio.h"
+#include "clock-recovery.h"
 #include "debug.h"
 #include "device.h"
 #include "hidraw.h"
 #include "imu.h"
 #include "maths.h"
 #include "leds.h"
+#include "shm.h"
 #include "telemetry.h"
 #include "tracker.h"
+#include "unpack.h"
+#include "vsync.h"
 
 /* 44 LEDs + 1 IMU on CV1 */
 #define MAX_POSITIONS	45
 
+/* The IMU clock fit is updated from the earliest message every 100 ms */
+#define RIFT_CLOCK_INTERVAL_NS	100000000
+
 enum rift_type {
 	RIFT_DK2,
 	RIFT_CV1,
@@ -49,6 +56,9 @@ struct _OuvrtRift {
 	uint64_t last_sample_timestamp;
 	uint32_t last_exposure_timestamp;
 	int32_t last_exposure_count;
+	uint16_t last_frame_count;
+	struct clock_recovery clock;
+	struct vsync_fit vsync;
 	struct rift_radio radio;
 	struct imu_state imu;
 };
@@ -61,11 +71,13 @@ G_DEFINE_TYPE(OuvrtRift, ouvrt_rift, OUVRT_TYPE_DEVICE)
  */
 static inline void unpack_3x21bit(float scale, __be64 buf, vec3 *v)
 {
-	uint64_t xyz = __be64_to_cpu(buf);
+	int32_t xyz[3];
+
+	unpack_3x21bit_be(buf, xyz);
 
-	v->x = scale * ((int64_t)xyz >> 43);
-	v->y = scale * ((int64_t)(xyz << 21) >> 43);
-	v->z = scale * ((int64_t)(xyz << 42) >> 43);
+	v->x = scale * xyz[0];
+	v->y = scale * xyz[1];
+	v->z = scale * xyz[2];
 }
 
 /*
@@ -596,6 +608,8 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 		pose_update(1e-6 / num_samples * dt, &rift->imu.pose, &sample);
 
 		telemetry_send_pose(rift->dev.id, &rift->imu.pose);
+		shm_publish_pose(rift->dev.id, sample.time, &rift->imu.pose,
+				 &sample.angular_velocity);
 
 		debug_imu_fifo_in(&rift->imu, 1);
 	}
@@ -616,9 +630,24 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 
 	rift->last_message_time = message_time;
 
-	(void)frame_id;
-	(void)frame_timestamp;
-	(void)frame_count;
+	/*
+	 * The HDMI vsync timestamp uses the IMU sample clock, which is
+	 * mapped to host time from the message arrival times.
+	 */
+	clock_recovery_add_sample(&rift->clock, sample_timestamp, message_time);
+	if (frame_count != rift->last_frame_count) {
+		uint64_t vsync_time;
+
+		rift->last_frame_count = frame_count;
+		if (clock_recovery_to_host(&rift->clock, frame_timestamp,
+					   &vsync_time) == 0 &&
+		    vsync_fit_add(&rift->vsync, vsync_time)) {
+			shm_publish_vsync(rift->dev.id, rift->vsync.count,
+					  rift->vsync.time, rift->vsync.period,
+					  rift->vsync.jitter, frame_id);
+		}
+	}
+
 	(void)sample_count;
 }
 
@@ -760,6 +789,10 @@ static int rift_start(OuvrtDevice *dev)
 	if (ret < 0)
 		return ret;
 
+	/* The DK2 display refreshes at 75 Hz, the CV1 display at 90 Hz */
+	clock_recovery_init(&rift->clock, 1000000, RIFT_CLOCK_INTERVAL_NS);
+	vsync_fit_init(&rift->vsync, 1e9 / (rift->type == RIFT_CV1 ? 90 : 75));
+
 	ret = rift_send_tracking(rift, TRUE);
 	if (ret < 0)
 		return ret;
@@ -792,6 +825,7 @@ static void rift_thread(OuvrtDevice *dev)
 	struct timespec ts;
 	int count;
 	int ret;
+	int i;
 
 	g_print("Rift: Sending keepalive\n");
 	rift_send_keepalive(rift);
@@ -858,14 +892,23 @@ static void rift_thread(OuvrtDevice *dev)
 			struct rift_wireless_device *c;
 
 			c = &rift->radio.remote.base;
-			if (c->active && !c->dev_id)
-				c->dev_id = ouvrt_device_claim_id(dev, c->serial);
-			c = &rift->radio.touch[0].base;
-			if (c->active && !c->dev_id)
-				c->dev_id = ouvrt_device_claim_id(dev, c->serial);
-			c = &rift->radio.touch[1].base;
-			if (c->active && !c->dev_id)
+			if (c->active && !c->dev_id_valid) {
 				c->dev_id = ouvrt_device_claim_id(dev, c->serial);
+				c->dev_id_valid = true;
+			}
+			/*
+			 * The Touch LED models are not registered with the
+			 * tracker, as their blinking patterns are not known,
+			 * see rift-radio.c.
+			 */
+			for (i = 0; i < 2; i++) {
+				c = &rift->radio.touch[i].base;
+				if (c->active && !c->dev_id_valid) {
+					c->dev_id = ouvrt_device_claim_id(dev,
+								c->serial);
+					c->dev_id_valid = true;
+				}
+			}
 		}
 	}
 }
@@ -885,6 +928,8 @@ static void rift_stop(OuvrtDevice *dev)
 	ouvrt_tracker_unregister_leds(rift->tracker, &rift->leds);
 	g_clear_object(&rift->tracker);
 
+	rift_radio_stop(&rift->radio);
+
 	if (rift->type == RIFT_CV1) {
 		rift_cv1_power_down(rift, RIFT_CV1_POWER_DISPLAY |
 					  RIFT_CV1_POWER_AUDIO |
@@ -906,6 +951,8 @@ static void ouvrt_rift_finalize(GObject *object)
 	OuvrtRift *rift = OUVRT_RIFT(object);
 
 	g_clear_object(&rift->tracker);
+	leds_fini(&rift->radio.touch[0].leds);
+	leds_fini(&rift->radio.touch[1].leds);
 	G_OBJECT_CLASS(ouvrt_rift_parent_class)->finalize(object);
 }
 
@@ -0,0 +1,376 @@
+/*
+ * Shared memory output
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+/* Longest haptics command accepted from clients, in seconds */
+#define SHM_HAPTICS_MAX_DURATION	10.0f
+
+/* Group whose members may send haptics commands, or NULL */
+const char *shm_haptics_group;
+
+static struct ouvrt_shm *shm;
+static struct ouvrt_shm_haptics *haptics;
+
+/*
+ * Returns the shared memory slot for the given device id, or NULL if the
+ * shared memory output is not available.
+ */
+struct ouvrt_shm_device *shm_get_device(unsigned long dev_id)
+{
+	if (!shm || dev_id >= OUVRT_SHM_MAX_DEVICES)
+		return NULL;
+
+	return &shm->device[dev_id];
+}
+
+/*
+ * Updates the device's latest pose.
+ */
+void shm_publish_pose(uint8_t dev_id, double time, const struct dpose *pose,
+		      const vec3 *angular_velocity)
+{
+	struct ouvrt_shm_device *dev = shm_get_device(dev_id);
+	struct ouvrt_shm_pose *p;
+
+	if (!dev)
+		return;
+
+	p = &dev->pose;
+	shm_seq_write_begin(&p->seq);
+	p->time = time;
+	p->pose = *pose;
+	p->angular_velocity = *angular_velocity;
+	shm_seq_write_end(&p->seq);
+}
+
+/*
+ * Updates the device's input state with the button bitmask and the first
+ * num_axes axis values, decoded from a single report. If anything changed,
+ * a single event describing all changes is appended to the input queue.
+ */
+void shm_update_input(uint8_t dev_id, uint32_t buttons, const float *axes,
+		      unsigned int num_axes)
+{
+	struct ouvrt_shm_device *dev = shm_get_device(dev_id);
+	struct ouvrt_shm_input_state *state;
+	struct ouvrt_shm_input_queue *queue;
+	struct ouvrt_shm_input_event *event;
+	uint32_t changed_buttons;
+	uint32_t changed_axes = 0;
+	struct timespec ts;
+	unsigned int i;
+
+	if (!dev)
+		return;
+
+	if (num_axes > OUVRT_SHM_MAX_AXES)
+		num_axes = OUVRT_SHM_MAX_AXES;
+
+	state = &dev->input;
+	changed_buttons = state->buttons ^ buttons;
+	for (i = 0; i < num_axes; i++) {
+		if (state->axes[i] != axes[i])
+			changed_axes |= 1 << i;
+	}
+	if (!changed_buttons && !changed_axes)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	shm_seq_write_begin(&state->seq);
+	state->time = ts.tv_sec + 1e-9 * ts.tv_nsec;
+	state->buttons = buttons;
+	if (num_axes)
+		memcpy(state->axes, axes, num_axes * sizeof(float));
+	shm_seq_write_end(&state->seq);
+
+	queue = &dev->input_events;
+	event = &queue->events[queue->head % OUVRT_SHM_INPUT_EVENTS];
+	event->time = state->time;
+	event->buttons = buttons;
+	event->changed_buttons = changed_buttons;
+	event->changed_axes = changed_axes;
+	memcpy(event->axes, state->axes, sizeof(event->axes));
+	__sync_synchronize();
+	queue->head++;
+}
+
+/*
+ * Appends gyro samples to the device's high-rate gyro ring.
+ */
+void shm_push_gyro_samples(uint8_t dev_id, uint32_t rate,
+			   const struct ouvrt_shm_gyro_sample *samples,
+			   unsigned int num_samples)
+{
+	struct ouvrt_shm_device *dev = shm_get_device(dev_id);
+	struct ouvrt_shm_gyro_ring *ring;
+	uint64_t head;
+	unsigned int i;
+
+	if (!dev)
+		return;
+
+	ring = &dev->gyro;
+	ring->rate = rate;
+	head = ring->head;
+	for (i = 0; i < num_samples; i++) {
+		ring->samples[(head + i) % OUVRT_SHM_GYRO_RING_SIZE] =
+			samples[i];
+	}
+	__sync_synchronize();
+	ring->head = head + num_samples;
+}
+
+/*
+ * Appends the blobs observed in a camera frame, started at sof_time in
+ * nanoseconds, to the camera's blob ring. Frames without observation are
+ * recorded with zero blobs, so that consumers can tell them from dropped
+ * frames.
+ */
+void shm_push_blobs(uint8_t camera_id, uint64_t sof_time,
+		    uint8_t led_pattern_phase, const struct blobservation *ob)
+{
+	struct ouvrt_shm_device *dev = shm_get_device(camera_id);
+	struct ouvrt_shm_blob_frame *frame;
+	struct ouvrt_shm_blob_ring *ring;
+	int i, n;
+
+	if (!dev)
+		return;
+
+	ring = &dev->blobs;
+	frame = &ring->frames[ring->head % OUVRT_SHM_BLOB_FRAMES];
+	n = ob ? ob->num_blobs : 0;
+	if (n > MAX_BLOBS_PER_FRAME)
+		n = MAX_BLOBS_PER_FRAME;
+
+	frame->time = 1e-9 * sof_time;
+	frame->camera_id = camera_id;
+	frame->led_pattern_phase = led_pattern_phase;
+	frame->num_blobs = n;
+	for (i = 0; i < n; i++) {
+		const struct blob *b = &ob->blobs[i];
+		struct ouvrt_shm_blob *s = &frame->blobs[i];
+
+		s->x = b->x;
+		s->y = b->y;
+		s->vx = b->vx;
+		s->vy = b->vy;
+		s->width = b->width;
+		s->height = b->height;
+		s->led_id = b->led_id;
+		s->area = b->area > UINT16_MAX ? UINT16_MAX : b->area;
+	}
+	__sync_synchronize();
+	ring->head++;
+}
+
+/*
+ * Updates the display timing of a headset with the fitted time of the
+ * latest vsync and the refresh period in nanoseconds.
+ */
+void shm_publish_vsync(uint8_t dev_id, uint64_t count, uint64_t time,
+		       double period, double jitter, uint32_t frame_id)
+{
+	struct ouvrt_shm_device *dev = shm_get_device(dev_id);
+	struct ouvrt_shm_vsync *vsync;
+
+	if (!dev)
+		return;
+
+	vsync = &dev->vsync;
+	shm_seq_write_begin(&vsync->seq);
+	vsync->frame_id = frame_id;
+	vsync->count = count;
+	vsync->time = 1e-9 * time;
+	vsync->period = 1e-9 * period;
+	vsync->jitter = 1e-9 * jitter;
+	shm_seq_write_end(&vsync->seq);
+}
+
+/*
+ * Drains the device's haptics command ring. Since every command supersedes
+ * the earlier ones, only the most recent command is returned. Values written
+ * by clients are clamped to sane ranges.
+ *
+ * Returns 1 if a command was returned, or 0 if there was none.
+ */
+int shm_pop_haptics(uint8_t dev_id, struct ouvrt_shm_haptics_command *command)
+{
+	struct ouvrt_shm_haptics_command *slot;
+	struct ouvrt_shm_haptics_ring *ring;
+	uint64_t head, tail, seq;
+	int ret = 0;
+
+	if (!haptics || dev_id >= OUVRT_SHM_MAX_DEVICES)
+		return 0;
+
+	ring = &haptics->device[dev_id];
+	head = ring->head;
+	tail = ring->tail;
+	if (tail == head)
+		return 0;
+
+	/* Commands that were overwritten before we got to them are lost */
+	if (head - tail > OUVRT_SHM_HAPTICS_COMMANDS)
+		tail = head - OUVRT_SHM_HAPTICS_COMMANDS;
+
+	while (tail != head) {
+		slot = &ring->commands[tail % OUVRT_SHM_HAPTICS_COMMANDS];
+		seq = slot->seq;
+		/* Stop at the first reserved command that is not written yet */
+		if (seq != tail + 1)
+			break;
+		__sync_synchronize();
+		command->frequency = slot->frequency;
+		command->amplitude = slot->amplitude;
+		command->duration = slot->duration;
+		__sync_synchronize();
+		if (slot->seq != seq)
+			break;
+		command->seq = seq;
+		ret = 1;
+		tail++;
+	}
+	ring->tail = tail;
+
+	if (ret) {
+		if (!(command->frequency > 0.0f))
+			command->frequency = 0.0f;
+		if (!(command->amplitude > 0.0f))
+			command->amplitude = 0.0f;
+		else if (command->amplitude > 1.0f)
+			command->amplitude = 1.0f;
+		if (!(command->duration > 0.0f))
+			command->duration = 0.0f;
+		else if (command->duration > SHM_HAPTICS_MAX_DURATION)
+			command->duration = SHM_HAPTICS_MAX_DURATION;
+	}
+
+	return ret;
+}
+
+/*
+ * Creates and maps a shared memory segment with the given access mode and
+ * group, unless gid is (gid_t)-1.
+ */
+static int shm_create(const char *name, size_t size, mode_t mode, gid_t gid,
+		      void **addr)
+{
+	int fd;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, mode);
+	if (fd < 0)
+		return -errno;
+
+	/* Override the umask, the group must be able to write haptics commands */
+	if (fchown(fd, (uid_t)-1, gid) < 0 || fchmod(fd, mode) < 0 ||
+	    ftruncate(fd, size) < 0) {
+		close(fd);
+		shm_unlink(name);
+		return -errno;
+	}
+
+	*addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (*addr == MAP_FAILED) {
+		shm_unlink(name);
+		return -errno;
+	}
+
+	memset(*addr, 0, size);
+
+	return 0;
+}
+
+/*
+ * Creates and maps the shared memory output and haptics command segments.
+ * The haptics segment is only writable by the daemon's group, or by the
+ * group set in shm_haptics_group.
+ */
+int shm_init(int *argc, char **argv[])
+{
+	const size_t size = sizeof(struct ouvrt_shm);
+	const size_t haptics_size = sizeof(struct ouvrt_shm_haptics);
+	gid_t gid = (gid_t)-1;
+	struct group *group;
+	void *addr;
+	int ret;
+
+	(void)argc;
+	(void)argv;
+
+	if (shm)
+		return -EBUSY;
+
+	if (shm_haptics_group) {
+		errno = 0;
+		group = getgrnam(shm_haptics_group);
+		if (!group)
+			return errno ? -errno : -ENOENT;
+		gid = group->gr_gid;
+	}
+
+	ret = shm_create(OUVRT_SHM_NAME, size, 0644, (gid_t)-1, &addr);
+	if (ret < 0)
+		return ret;
+
+	shm = addr;
+	shm->size = size;
+	shm->num_devices = OUVRT_SHM_MAX_DEVICES;
+	shm->version = OUVRT_SHM_VERSION;
+	__sync_synchronize();
+	shm->magic = OUVRT_SHM_MAGIC;
+
+	ret = shm_create(OUVRT_SHM_HAPTICS_NAME, haptics_size, 0660, gid,
+			 &addr);
+	if (ret < 0) {
+		shm->magic = 0;
+		munmap(shm, size);
+		shm_unlink(OUVRT_SHM_NAME);
+		shm = NULL;
+		return ret;
+	}
+
+	haptics = addr;
+	haptics->size = haptics_size;
+	haptics->num_devices = OUVRT_SHM_MAX_DEVICES;
+	haptics->version = OUVRT_SHM_HAPTICS_VERSION;
+	__sync_synchronize();
+	haptics->magic = OUVRT_SHM_HAPTICS_MAGIC;
+
+	return 0;
+}
+
+/*
+ * Unmaps and removes the shared memory segments.
+ */
+void shm_deinit(void)
+{
+	if (haptics) {
+		haptics->magic = 0;
+		munmap(haptics, sizeof(struct ouvrt_shm_haptics));
+		shm_unlink(OUVRT_SHM_HAPTICS_NAME);
+		haptics = NULL;
+	}
+
+	if (!shm)
+		return;
+
+	shm->magic = 0;
+	munmap(shm, sizeof(struct ouvrt_shm));
+	shm_unlink(OUVRT_SHM_NAME);
+	shm = NULL;
+}
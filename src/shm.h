@@ -0,0 +1,279 @@
+/*
+ * Shared memory output
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include <stdint.h>
+
+#include "blobwatch.h"
+#include "imu.h"
+#include "maths.h"
+
+/*
+ * The shared memory segment is created with shm_open(3) under this name
+ * and consists of a struct ouvrt_shm header followed by one fixed size
+ * struct ouvrt_shm_device slot per device id. Consumers map it read-only.
+ */
+#define OUVRT_SHM_NAME			"/ouvrt"
+#define OUVRT_SHM_MAGIC			0x7476756f /* "ouvt" */
+#define OUVRT_SHM_VERSION		5
+#define OUVRT_SHM_MAX_DEVICES		16
+
+/*
+ * Haptics commands flow the other way, from clients to the device threads,
+ * through a separate segment under this name that is writable by the
+ * daemon's group, or the group given with --haptics-group.
+ * It consists of a struct ouvrt_shm_haptics header followed by one command
+ * ring per device id. Currently only Vive controllers apply the commands,
+ * the Rift Touch vibration protocol is not known yet.
+ */
+#define OUVRT_SHM_HAPTICS_NAME		"/ouvrt-haptics"
+#define OUVRT_SHM_HAPTICS_MAGIC		0x7068756f /* "ouhp" */
+#define OUVRT_SHM_HAPTICS_VERSION	1
+/* Must be a power of two */
+#define OUVRT_SHM_HAPTICS_COMMANDS	16
+
+/* 64 ms of history at 8 kHz, must be a power of two */
+#define OUVRT_SHM_GYRO_RING_SIZE	512
+
+#define OUVRT_SHM_MAX_AXES		12
+/* Must be a power of two */
+#define OUVRT_SHM_INPUT_EVENTS		64
+
+/* Frames of blob history, must be a power of two */
+#define OUVRT_SHM_BLOB_FRAMES		16
+
+/*
+ * High-rate gyro sample - angular velocity in rad/s in the common coordinate
+ * system and the interpolated sample time in seconds.
+ */
+struct ouvrt_shm_gyro_sample {
+	double time;
+	vec3 angular_velocity;
+	uint32_t reserved;
+};
+
+/*
+ * Single producer ring of gyro samples. The producer writes the sample at
+ * index head % OUVRT_SHM_GYRO_RING_SIZE before incrementing head. Consumers
+ * read head, copy samples, and read head again to detect overwritten
+ * entries.
+ */
+struct ouvrt_shm_gyro_ring {
+	uint64_t head;
+	uint32_t rate;
+	uint32_t reserved;
+	struct ouvrt_shm_gyro_sample samples[OUVRT_SHM_GYRO_RING_SIZE];
+};
+
+/*
+ * Latest pose and angular velocity of a device, with the sample time in
+ * seconds. The producer increments seq before and after each update, so
+ * consumers must retry while seq is odd or changed during the read.
+ */
+struct ouvrt_shm_pose {
+	uint32_t seq;
+	uint32_t reserved;
+	double time;
+	struct dpose pose;
+	vec3 angular_velocity;
+	uint32_t reserved2;
+};
+
+/*
+ * Current input state of a device. Buttons are a bitmask indexed by the
+ * OUVRT_BUTTON_* codes, axes are indexed by the OUVRT_AXIS_* codes. The
+ * block is updated in place, protected by seq like struct ouvrt_shm_pose.
+ */
+struct ouvrt_shm_input_state {
+	uint32_t seq;
+	uint32_t buttons;
+	double time;
+	float axes[OUVRT_SHM_MAX_AXES];
+};
+
+/*
+ * Input event - all changes decoded from a single device report, coalesced
+ * into one event with the resulting state and masks of changed buttons and
+ * axes.
+ */
+struct ouvrt_shm_input_event {
+	double time;
+	uint32_t buttons;
+	uint32_t changed_buttons;
+	uint32_t changed_axes;
+	uint32_t reserved;
+	float axes[OUVRT_SHM_MAX_AXES];
+};
+
+/*
+ * Single producer event queue with the same head semantics as the gyro ring.
+ */
+struct ouvrt_shm_input_queue {
+	uint64_t head;
+	struct ouvrt_shm_input_event events[OUVRT_SHM_INPUT_EVENTS];
+};
+
+/*
+ * Blob observed in a camera frame. Position and size are in pixels, velocity
+ * in pixels per frame. led_id is the index into the LED table of the tracker
+ * the camera belongs to, or -1 if the blob has not been identified yet.
+ */
+struct ouvrt_shm_blob {
+	uint16_t x;
+	uint16_t y;
+	int16_t vx;
+	int16_t vy;
+	uint16_t width;
+	uint16_t height;
+	int8_t led_id;
+	uint8_t reserved;
+	uint16_t area;
+};
+
+/*
+ * All blobs detected in a single camera frame, with the start of frame time
+ * in seconds, the LED pattern phase used to identify them, and the camera's
+ * device id.
+ */
+struct ouvrt_shm_blob_frame {
+	double time;
+	uint8_t camera_id;
+	uint8_t led_pattern_phase;
+	uint8_t num_blobs;
+	uint8_t reserved;
+	uint32_t reserved2;
+	struct ouvrt_shm_blob blobs[MAX_BLOBS_PER_FRAME];
+};
+
+/*
+ * Single producer ring of blob observations with the same head semantics as
+ * the gyro ring, filled by camera devices.
+ */
+struct ouvrt_shm_blob_ring {
+	uint64_t head;
+	struct ouvrt_shm_blob_frame frames[OUVRT_SHM_BLOB_FRAMES];
+};
+
+/*
+ * Display timing of a headset, fitted to the vsync events it reports. The
+ * latest vsync occurred at time, and the n-th vsync after it is expected at
+ * time + n * period, both in seconds. jitter is the RMS deviation of the
+ * reported events from the fit. count increments with every vsync, and
+ * frame_id is the id pixel read back from the frame scanned out at the
+ * latest vsync, if the headset reports it. The block is protected by seq
+ * like struct ouvrt_shm_pose.
+ */
+struct ouvrt_shm_vsync {
+	uint32_t seq;
+	uint32_t frame_id;
+	uint64_t count;
+	double time;
+	double period;
+	double jitter;
+};
+
+struct ouvrt_shm_device {
+	struct ouvrt_shm_pose pose;
+	struct ouvrt_shm_input_state input;
+	struct ouvrt_shm_input_queue input_events;
+	struct ouvrt_shm_gyro_ring gyro;
+	struct ouvrt_shm_blob_ring blobs;
+	struct ouvrt_shm_vsync vsync;
+};
+
+struct ouvrt_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t num_devices;
+	struct ouvrt_shm_device device[OUVRT_SHM_MAX_DEVICES];
+};
+
+/*
+ * Haptic feedback command - vibrate at the given frequency in Hz, with an
+ * amplitude between 0 and 1, for the given duration in seconds. A zero
+ * frequency selects the device default, a zero amplitude or duration stops
+ * the vibration. Every command supersedes all earlier ones. seq is set to
+ * the command's index in the ring plus one after the command is written.
+ */
+struct ouvrt_shm_haptics_command {
+	uint64_t seq;
+	float frequency;
+	float amplitude;
+	float duration;
+	uint32_t reserved;
+};
+
+/*
+ * Multiple producer command ring. Clients reserve a slot by atomically
+ * incrementing head, write the command, and then publish it by setting its
+ * seq. The device thread advances tail over published commands.
+ */
+struct ouvrt_shm_haptics_ring {
+	uint64_t head;
+	uint64_t tail;
+	struct ouvrt_shm_haptics_command commands[OUVRT_SHM_HAPTICS_COMMANDS];
+};
+
+struct ouvrt_shm_haptics {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t num_devices;
+	struct ouvrt_shm_haptics_ring device[OUVRT_SHM_MAX_DEVICES];
+};
+
+static inline void shm_seq_write_begin(uint32_t *seq)
+{
+	(*seq)++;
+	__sync_synchronize();
+}
+
+static inline void shm_seq_write_end(uint32_t *seq)
+{
+	__sync_synchronize();
+	(*seq)++;
+}
+
+/*
+ * Queues a haptics command from a client.
+ */
+static inline void shm_haptics_submit(struct ouvrt_shm_haptics_ring *ring,
+				      float frequency, float amplitude,
+				      float duration)
+{
+	uint64_t index = __sync_fetch_and_add(&ring->head, 1);
+	struct ouvrt_shm_haptics_command *command =
+		&ring->commands[index % OUVRT_SHM_HAPTICS_COMMANDS];
+
+	command->frequency = frequency;
+	command->amplitude = amplitude;
+	command->duration = duration;
+	__sync_synchronize();
+	command->seq = index + 1;
+}
+
+extern const char *shm_haptics_group;
+
+struct ouvrt_shm_device *shm_get_device(unsigned long dev_id);
+void shm_publish_pose(uint8_t dev_id, double time, const struct dpose *pose,
+		      const vec3 *angular_velocity);
+void shm_update_input(uint8_t dev_id, uint32_t buttons, const float *axes,
+		      unsigned int num_axes);
+void shm_push_gyro_samples(uint8_t dev_id, uint32_t rate,
+			   const struct ouvrt_shm_gyro_sample *samples,
+			   unsigned int num_samples);
+void shm_push_blobs(uint8_t camera_id, uint64_t sof_time,
+		    uint8_t led_pattern_phase,
+		    const struct blobservation *ob);
+void shm_publish_vsync(uint8_t dev_id, uint64_t count, uint64_t time,
+		       double period, double jitter, uint32_t frame_id);
+int shm_pop_haptics(uint8_t dev_id, struct ouvrt_shm_haptics_command *command);
+int shm_init(int *argc, char **argv[]);
+void shm_deinit(void);
+
+#endif /* __SHM_H__ */
@@ -0,0 +1,206 @@
+/*
+ * Sparse IR frame codec
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "sparse.h"
+
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+
+/*
+ * Returns the maximum encoded size of a frame with the given dimensions,
+ * reached if every other pixel is bright.
+ */
+size_t sparse_encode_bound(int width, int height)
+{
+	return sizeof(struct sparse_frame_header) +
+	       DIV_ROUND_UP(width, SPARSE_DECIMATION) *
+	       DIV_ROUND_UP(height, SPARSE_DECIMATION) +
+	       DIV_ROUND_UP(width, 2) * height *
+	       (sizeof(struct sparse_run) + 2);
+}
+
+/*
+ * Stores the background of each block row as sampled from the center row of
+ * the blocks, averaged horizontally over each block and clamped to the
+ * threshold.
+ */
+static void sparse_encode_background(const uint8_t *frame, int width,
+				     int height, uint8_t threshold,
+				     uint8_t *out)
+{
+	const int d = SPARSE_DECIMATION;
+	int bx, by, x;
+
+	for (by = 0; by < DIV_ROUND_UP(height, d); by++) {
+		int y = by * d + d / 2;
+		const uint8_t *line;
+
+		if (y >= height)
+			y = height - 1;
+		line = frame + y * width;
+
+		for (bx = 0; bx < DIV_ROUND_UP(width, d); bx++) {
+			int x0 = bx * d;
+			int x1 = x0 + d < width ? x0 + d : width;
+			unsigned int sum = 0;
+
+			for (x = x0; x < x1; x++)
+				sum += line[x];
+			sum /= x1 - x0;
+			*out++ = sum > threshold ? threshold : sum;
+		}
+	}
+}
+
+/*
+ * Encodes a grayscale frame into the sparse format. Dark spans are skipped
+ * eight pixels at a time if the threshold allows checking only the most
+ * significant bits.
+ *
+ * Returns the encoded size or a negative error code if out is too small.
+ */
+int sparse_encode(const uint8_t *frame, int width, int height,
+		  uint8_t threshold, uint64_t timestamp, uint8_t *out,
+		  size_t size)
+{
+	struct sparse_frame_header *header = (struct sparse_frame_header *)out;
+	const bool fast = threshold >= 0x7f;
+	size_t bg_size = DIV_ROUND_UP(width, SPARSE_DECIMATION) *
+			 DIV_ROUND_UP(height, SPARSE_DECIMATION);
+	uint8_t *p = out + sizeof(*header) + bg_size;
+	uint8_t *end = out + size;
+	uint32_t num_runs = 0;
+	int x, y;
+
+	if (size < sizeof(*header) + bg_size)
+		return -ENOSPC;
+
+	sparse_encode_background(frame, width, height, threshold,
+				 out + sizeof(*header));
+
+	for (y = 0; y < height; y++) {
+		const uint8_t *line = frame + y * width;
+
+		x = 0;
+		while (x < width) {
+			struct sparse_run run;
+			uint64_t word;
+			int start;
+
+			if (fast && x + 8 <= width) {
+				memcpy(&word, line + x, 8);
+				if (!(word & 0x8080808080808080ULL)) {
+					x += 8;
+					continue;
+				}
+			}
+
+			if (line[x] <= threshold) {
+				x++;
+				continue;
+			}
+
+			start = x;
+			while (x < width && line[x] > threshold)
+				x++;
+
+			if (p + sizeof(run) + (x - start) > end)
+				return -ENOSPC;
+
+			run.x = __cpu_to_le16(start);
+			run.y = __cpu_to_le16(y);
+			run.len = __cpu_to_le16(x - start);
+			memcpy(p, &run, sizeof(run));
+			p += sizeof(run);
+			memcpy(p, line + start, x - start);
+			p += x - start;
+			num_runs++;
+		}
+	}
+
+	header->magic = __cpu_to_le32(SPARSE_MAGIC);
+	header->size = __cpu_to_le32(p - out);
+	header->timestamp = __cpu_to_le64(timestamp);
+	header->width = __cpu_to_le16(width);
+	header->height = __cpu_to_le16(height);
+	header->threshold = threshold;
+	header->decimation = SPARSE_DECIMATION;
+	header->reserved = 0;
+	header->num_runs = __cpu_to_le32(num_runs);
+
+	return p - out;
+}
+
+/*
+ * Decodes a sparse frame into a grayscale frame buffer of the given
+ * dimensions, as consumed by blobwatch_process(). The background is
+ * upsampled by pixel repetition.
+ *
+ * Returns 0 on success or a negative error code if the data is invalid.
+ */
+int sparse_decode(const uint8_t *in, size_t size, uint8_t *frame, int width,
+		  int height, uint64_t *timestamp)
+{
+	struct sparse_frame_header header;
+	const uint8_t *end = in + size;
+	const uint8_t *bg, *p;
+	uint32_t num_runs;
+	int d, bw, x, y;
+
+	if (size < sizeof(header))
+		return -EINVAL;
+	memcpy(&header, in, sizeof(header));
+
+	d = header.decimation;
+	if (__le32_to_cpu(header.magic) != SPARSE_MAGIC ||
+	    __le32_to_cpu(header.size) > size ||
+	    __le16_to_cpu(header.width) != width ||
+	    __le16_to_cpu(header.height) != height || d == 0)
+		return -EINVAL;
+	end = in + __le32_to_cpu(header.size);
+
+	bw = DIV_ROUND_UP(width, d);
+	bg = in + sizeof(header);
+	p = bg + bw * DIV_ROUND_UP(height, d);
+	if (p > end)
+		return -EINVAL;
+
+	for (y = 0; y < height; y++) {
+		const uint8_t *bg_line = bg + (y / d) * bw;
+		uint8_t *line = frame + y * width;
+
+		for (x = 0; x < width; x += d)
+			memset(line + x, bg_line[x / d],
+			       x + d < width ? d : width - x);
+	}
+
+	num_runs = __le32_to_cpu(header.num_runs);
+	while (num_runs--) {
+		struct sparse_run run;
+		int len;
+
+		if (p + sizeof(run) > end)
+			return -EINVAL;
+		memcpy(&run, p, sizeof(run));
+		p += sizeof(run);
+
+		x = __le16_to_cpu(run.x);
+		y = __le16_to_cpu(run.y);
+		len = __le16_to_cpu(run.len);
+		if (y >= height || x + len > width || p + len > end)
+			return -EINVAL;
+
+		memcpy(frame + y * width + x, p, len);
+		p += len;
+	}
+
+	if (timestamp)
+		*timestamp = __le64_to_cpu(header.timestamp);
+
+	return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Sparse IR frame codec
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __SPARSE_H__
+#define __SPARSE_H__
+
+#include <asm/byteorder.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPARSE_MAGIC		0x4650534f /* "OSPF" */
+
+/* Background block size in pixels */
+#define SPARSE_DECIMATION	16
+
+/*
+ * A sparse frame consists of this header, followed by the decimated
+ * background with one byte per SPARSE_DECIMATION² pixel block, followed by
+ * num_runs runs. All pixels brighter than threshold are stored losslessly in
+ * runs of consecutive bright pixels on a scanline. Background values are
+ * clamped to the threshold, so that blob detection on the decoded frame finds
+ * exactly the same blobs as on the original frame.
+ */
+struct sparse_frame_header {
+	__le32 magic;
+	__le32 size;
+	__le64 timestamp;
+	__le16 width;
+	__le16 height;
+	__u8 threshold;
+	__u8 decimation;
+	__le16 reserved;
+	__le32 num_runs;
+} __attribute__((packed));
+
+/* Each run header is followed by len pixel values */
+struct sparse_run {
+	__le16 x;
+	__le16 y;
+	__le16 len;
+} __attribute__((packed));
+
+size_t sparse_encode_bound(int width, int height);
+int sparse_encode(const uint8_t *frame, int width, int height,
+		  uint8_t threshold, uint64_t timestamp, uint8_t *out,
+		  size_t size);
+int sparse_decode(const uint8_t *in, size_t size, uint8_t *frame, int width,
+		  int height, uint64_t *timestamp);
+
+#endif /* __SPARSE_H__ */
@@ -4,112 +4,297 @@
  * SPDX-License-Identifier:	LGPL-2.0+
  */
 #include <errno.h>
+#include <math.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "imu.h"
 #include "lighthouse.h"
 #include "telemetry.h"
+#include "varint.h"
 
 #define TELEMETRY_ADDRESS			INADDR_LOOPBACK
+/* Pending records are sent at the latest after this time */
+#define TELEMETRY_MAX_DELAY			2000000 /* ns */
 
 static struct sockaddr_in telemetry_addr;
 static int telemetry_fd;
 
-int telemetry_send_raw_buffer(uint8_t dev_id, const char *buf, size_t len)
+static pthread_mutex_t telemetry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t telemetry_cond;
+static pthread_t telemetry_thread;
+static bool telemetry_running;
+static uint8_t telemetry_packet[TELEMETRY_MAX_PACKET];
+static size_t telemetry_len;
+static unsigned int telemetry_num_records;
+static uint32_t telemetry_seq;
+static uint64_t telemetry_batch_start;
+
+static uint64_t telemetry_now(void)
 {
-	char packet[256];
+	struct timespec ts;
 
-	if (telemetry_fd <= 0)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Sends all batched records in a single datagram. Must be called with the
+ * telemetry lock held.
+ */
+static int telemetry_flush_locked(void)
+{
+	struct telemetry_header *header = (void *)telemetry_packet;
+	int ret;
+
+	if (!telemetry_num_records)
 		return 0;
 
-	if (len > sizeof(buf) - 2)
+	header->magic = __cpu_to_le16(TELEMETRY_MAGIC);
+	header->version = TELEMETRY_VERSION;
+	header->num_records = telemetry_num_records;
+	header->seq = __cpu_to_le32(telemetry_seq++);
+
+	ret = sendto(telemetry_fd, telemetry_packet, telemetry_len, 0,
+		     (struct sockaddr *)&telemetry_addr,
+		     sizeof(telemetry_addr));
+
+	telemetry_len = 0;
+	telemetry_num_records = 0;
+
+	return ret < 0 ? -errno : 0;
+}
+
+/*
+ * Appends a record to the current batch. The batch is sent if it is full,
+ * if its oldest record is too old, or if flush is set by records that
+ * complete a sample, like poses.
+ */
+static int telemetry_add_record(uint8_t type, uint8_t dev_id,
+				const uint8_t *payload, size_t len, bool flush)
+{
+	struct telemetry_record_header record = {
+		.type = type,
+		.dev_id = dev_id,
+		.len = __cpu_to_le16(len),
+	};
+	uint64_t now = telemetry_now();
+	int ret = 0;
+
+	if (len > TELEMETRY_MAX_RECORD)
 		return -ENOSPC;
 
-	packet[0] = TELEMETRY_PACKET_RAW_BUFFER;
-	packet[1] = dev_id;
-	memcpy(packet + 2, buf, len);
+	pthread_mutex_lock(&telemetry_lock);
+
+	if (telemetry_len + sizeof(record) + len > TELEMETRY_MAX_PACKET ||
+	    telemetry_num_records == UINT8_MAX)
+		ret = telemetry_flush_locked();
+
+	if (!telemetry_num_records) {
+		telemetry_len = sizeof(struct telemetry_header);
+		telemetry_batch_start = now;
+		/* Wake up the flush thread to wait for this batch */
+		pthread_cond_signal(&telemetry_cond);
+	}
+
+	memcpy(telemetry_packet + telemetry_len, &record, sizeof(record));
+	memcpy(telemetry_packet + telemetry_len + sizeof(record), payload,
+	       len);
+	telemetry_len += sizeof(record) + len;
+	telemetry_num_records++;
+
+	if (flush || now - telemetry_batch_start > TELEMETRY_MAX_DELAY)
+		ret = telemetry_flush_locked();
+
+	pthread_mutex_unlock(&telemetry_lock);
+
+	return ret;
+}
+
+/*
+ * Sends batches that were not completed within TELEMETRY_MAX_DELAY, so that
+ * records from devices that rarely complete a batch are not held back.
+ */
+static void *telemetry_flush_thread(void *data)
+{
+	struct timespec ts;
+	uint64_t deadline;
+
+	(void)data;
+
+	pthread_mutex_lock(&telemetry_lock);
+	while (telemetry_running) {
+		if (!telemetry_num_records) {
+			pthread_cond_wait(&telemetry_cond, &telemetry_lock);
+			continue;
+		}
+
+		deadline = telemetry_batch_start + TELEMETRY_MAX_DELAY;
+		if (telemetry_now() >= deadline) {
+			telemetry_flush_locked();
+			continue;
+		}
+
+		ts.tv_sec = deadline / 1000000000ULL;
+		ts.tv_nsec = deadline % 1000000000ULL;
+		pthread_cond_timedwait(&telemetry_cond, &telemetry_lock, &ts);
+	}
+	pthread_mutex_unlock(&telemetry_lock);
+
+	return NULL;
+}
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+static inline void put_fixed(struct varint_cursor *c, double v, double scale)
+{
+	varint_put_signed(c, llrint(v * scale));
+}
+
+int telemetry_send_raw_buffer(uint8_t dev_id, const char *buf, size_t len)
+{
+	if (telemetry_fd <= 0)
+		return 0;
+
+	return telemetry_add_record(TELEMETRY_PACKET_RAW_BUFFER, dev_id,
+				    (const uint8_t *)buf, len, false);
 }
 
 int telemetry_send_raw_imu_sample(uint8_t dev_id, struct raw_imu_sample *raw)
 {
-	char packet[2 + sizeof(*raw)];
-	const size_t len = sizeof(packet);
+	uint8_t payload[64];
+	struct varint_cursor c = {
+		.p = payload,
+		.end = payload + sizeof(payload),
+	};
+	int i;
 
 	if (telemetry_fd <= 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_RAW_IMU_SAMPLE;
-	packet[1] = dev_id;
-	memcpy(packet + 2, raw, sizeof(*raw));
+	varint_put(&c, raw->time);
+	for (i = 0; i < 3; i++)
+		varint_put_signed(&c, raw->acc[i]);
+	for (i = 0; i < 3; i++)
+		varint_put_signed(&c, raw->gyro[i]);
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	return telemetry_add_record(TELEMETRY_PACKET_RAW_IMU_SAMPLE, dev_id,
+				    payload, c.p - payload, false);
 }
 
+/*
+ * Magnetic field and temperature are only sent if the device provides them.
+ */
 int telemetry_send_imu_sample(uint8_t dev_id, struct imu_sample *sample)
 {
-	char packet[2 + sizeof(*sample)];
-	const size_t len = sizeof(packet);
+	uint8_t payload[96];
+	struct varint_cursor c = {
+		.p = payload,
+		.end = payload + sizeof(payload),
+	};
+	const vec3 *mag = &sample->magnetic_field;
+	unsigned int flags = 0;
 
 	if (telemetry_fd <= 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_IMU_SAMPLE;
-	packet[1] = dev_id;
-	memcpy(packet + 2, sample, sizeof(*sample));
+	if (mag->x != 0.0f || mag->y != 0.0f || mag->z != 0.0f)
+		flags |= TELEMETRY_IMU_MAGNETIC_FIELD;
+	if (sample->temperature != 0.0f)
+		flags |= TELEMETRY_IMU_TEMPERATURE;
+
+	varint_put(&c, flags);
+	put_fixed(&c, sample->time, TELEMETRY_TIME_SCALE);
+	put_fixed(&c, sample->acceleration.x, TELEMETRY_ACCELERATION_SCALE);
+	put_fixed(&c, sample->acceleration.y, TELEMETRY_ACCELERATION_SCALE);
+	put_fixed(&c, sample->acceleration.z, TELEMETRY_ACCELERATION_SCALE);
+	put_fixed(&c, sample->angular_velocity.x,
+		  TELEMETRY_ANGULAR_VELOCITY_SCALE);
+	put_fixed(&c, sample->angular_velocity.y,
+		  TELEMETRY_ANGULAR_VELOCITY_SCALE);
+	put_fixed(&c, sample->angular_velocity.z,
+		  TELEMETRY_ANGULAR_VELOCITY_SCALE);
+	if (flags & TELEMETRY_IMU_MAGNETIC_FIELD) {
+		put_fixed(&c, mag->x, TELEMETRY_MAGNETIC_FIELD_SCALE);
+		put_fixed(&c, mag->y, TELEMETRY_MAGNETIC_FIELD_SCALE);
+		put_fixed(&c, mag->z, TELEMETRY_MAGNETIC_FIELD_SCALE);
+	}
+	if (flags & TELEMETRY_IMU_TEMPERATURE)
+		put_fixed(&c, sample->temperature, TELEMETRY_TEMPERATURE_SCALE);
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	return telemetry_add_record(TELEMETRY_PACKET_IMU_SAMPLE, dev_id,
+				    payload, c.p - payload, false);
 }
 
+/*
+ * Only the sweeps marked in sweep_ids are sent.
+ */
 int telemetry_send_lighthouse_frame(uint8_t dev_id,
 				    struct lighthouse_frame *frame)
 {
-	char packet[2 + sizeof(*frame)];
-	const size_t len = sizeof(packet);
+	uint8_t payload[48 + 32 * 8];
+	struct varint_cursor c = {
+		.p = payload,
+		.end = payload + sizeof(payload),
+	};
+	int i;
 
 	if (telemetry_fd <= 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_LIGHTHOUSE_FRAME;
-	packet[1] = dev_id;
-	memcpy(packet + 2, frame, sizeof(*frame));
+	varint_put(&c, frame->sync_timestamp);
+	varint_put(&c, frame->sync_duration);
+	varint_put(&c, frame->sync_ids);
+	varint_put(&c, frame->sweep_ids);
+	for (i = 0; i < 32; i++) {
+		if (!(frame->sweep_ids & (1U << i)))
+			continue;
+		varint_put(&c, frame->sweep_offset[i]);
+		varint_put(&c, frame->sweep_duration[i]);
+	}
+	varint_put(&c, frame->frame_duration);
+	varint_put(&c, frame->sync_aligned);
+	if (frame->sync_aligned)
+		varint_put(&c, frame->sync_common);
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	return telemetry_add_record(TELEMETRY_PACKET_LIGHTHOUSE_FRAME, dev_id,
+				    payload, c.p - payload, true);
 }
 
 int telemetry_send_pose(uint8_t dev_id, struct dpose *pose)
 {
-	char packet[2 + sizeof(*pose)];
-	const size_t len = sizeof(packet);
+	uint8_t payload[80];
+	struct varint_cursor c = {
+		.p = payload,
+		.end = payload + sizeof(payload),
+	};
 
 	if (telemetry_fd <= 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_POSE;
-	packet[1] = dev_id;
-	memcpy(packet + 2, pose, sizeof(*pose));
+	put_fixed(&c, pose->rotation.x, TELEMETRY_ROTATION_SCALE);
+	put_fixed(&c, pose->rotation.y, TELEMETRY_ROTATION_SCALE);
+	put_fixed(&c, pose->rotation.z, TELEMETRY_ROTATION_SCALE);
+	put_fixed(&c, pose->rotation.w, TELEMETRY_ROTATION_SCALE);
+	put_fixed(&c, pose->translation.x, TELEMETRY_TRANSLATION_SCALE);
+	put_fixed(&c, pose->translation.y, TELEMETRY_TRANSLATION_SCALE);
+	put_fixed(&c, pose->translation.z, TELEMETRY_TRANSLATION_SCALE);
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	return telemetry_add_record(TELEMETRY_PACKET_POSE, dev_id, payload,
+				    c.p - payload, true);
 }
 
 int telemetry_send_axis(uint8_t dev_id, int index, float *axis, int num_axis)
 {
-	char packet[2 + 1 + num_axis * sizeof(float)];
-	const size_t len = sizeof(packet);
+	uint8_t payload[16 + 8 * num_axis];
+	struct varint_cursor c = {
+		.p = payload,
+		.end = payload + sizeof(payload),
+	};
+	int i;
 
 	if (telemetry_fd <= 0)
 		return 0;
@@ -117,39 +302,30 @@ int telemetry_send_axis(uint8_t dev_id, int index, float *axis, int num_axis)
 	if (num_axis == 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_AXIS;
-	packet[1] = dev_id;
-	packet[2] = index;
-	memcpy(packet + 3, axis, num_axis * sizeof(float));
+	varint_put(&c, index);
+	varint_put(&c, num_axis);
+	for (i = 0; i < num_axis; i++)
+		put_fixed(&c, axis[i], TELEMETRY_AXIS_SCALE);
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	return telemetry_add_record(TELEMETRY_PACKET_AXIS, dev_id, payload,
+				    c.p - payload, false);
 }
 
-
 int telemetry_send_buttons(uint8_t dev_id, uint8_t *buttons, int num_buttons)
 {
-	char packet[2 + num_buttons];
-	const size_t len = sizeof(packet);
-
 	if (telemetry_fd <= 0)
 		return 0;
 
 	if (num_buttons == 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_BUTTONS;
-	packet[1] = dev_id;
-	memcpy(packet + 2, buttons, num_buttons);
-
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	return telemetry_add_record(TELEMETRY_PACKET_BUTTONS, dev_id, buttons,
+				    num_buttons, true);
 }
 
 /*
- * Initializes the telemetry UDP socket and target address.
+ * Initializes the telemetry UDP socket and target address, and starts the
+ * thread that sends delayed batches.
  */
 int telemetry_init(int *argc, char **argv[])
 {
@@ -158,6 +334,7 @@ int telemetry_init(int *argc, char **argv[])
 		.sin_port = htons(0),
 		.sin_addr.s_addr = htonl(INADDR_ANY),
 	};
+	pthread_condattr_t attr;
 	int fd, ret;
 
 	(void)argc;
@@ -180,17 +357,43 @@ int telemetry_init(int *argc, char **argv[])
 	telemetry_addr.sin_port = htons(TELEMETRY_DEFAULT_PORT);
 	telemetry_addr.sin_addr.s_addr = htonl(TELEMETRY_ADDRESS);
 
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&telemetry_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
 	telemetry_fd = fd;
+	telemetry_running = true;
+	ret = pthread_create(&telemetry_thread, NULL, telemetry_flush_thread,
+			     NULL);
+	if (ret) {
+		telemetry_running = false;
+		pthread_cond_destroy(&telemetry_cond);
+		telemetry_fd = 0;
+		close(fd);
+		return -ret;
+	}
 
 	return 0;
 }
 
 /*
- * Closes the telemetry UDP socket.
+ * Stops the flush thread, sends pending records, and closes the telemetry
+ * UDP socket.
  */
-void telemetry_deinit()
+void telemetry_deinit(void)
 {
 	if (telemetry_fd > 0) {
+		pthread_mutex_lock(&telemetry_lock);
+		telemetry_running = false;
+		pthread_cond_signal(&telemetry_cond);
+		pthread_mutex_unlock(&telemetry_lock);
+		pthread_join(telemetry_thread, NULL);
+
+		pthread_mutex_lock(&telemetry_lock);
+		telemetry_flush_locked();
+		pthread_mutex_unlock(&telemetry_lock);
+		pthread_cond_destroy(&telemetry_cond);
 		close(telemetry_fd);
 		telemetry_fd = 0;
 	}
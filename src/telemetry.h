@@ -3,11 +3,41 @@
  * Copyright 2017 Philipp Zabel
  * SPDX-License-Identifier:	LGPL-2.0+
  */
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <asm/byteorder.h>
 #include <stdint.h>
 #include <unistd.h>
 
 #define TELEMETRY_DEFAULT_PORT			28532
 
+/*
+ * Each datagram starts with a struct telemetry_header, followed by
+ * num_records records. Each record starts with a struct
+ * telemetry_record_header, followed by len bytes of payload, so consumers
+ * can skip unknown record types. Unless noted otherwise, payload fields are
+ * LEB128 varints, zigzag encoded if signed, and fixed-point values are
+ * stored multiplied by the given scale:
+ *
+ * RAW_BUFFER:       raw bytes
+ * RAW_IMU_SAMPLE:   time, acc[3], gyro[3]
+ * IMU_SAMPLE:       flags, time (ns), acceleration[3], angular_velocity[3],
+ *                   magnetic_field[3] if TELEMETRY_IMU_MAGNETIC_FIELD,
+ *                   temperature if TELEMETRY_IMU_TEMPERATURE
+ * POSE:             rotation[4] (x, y, z, w), translation[3]
+ * LIGHTHOUSE_FRAME: sync_timestamp, sync_duration, sync_ids, sweep_ids,
+ *                   sweep_offset and sweep_duration for each bit set in
+ *                   sweep_ids, frame_duration, sync_aligned,
+ *                   sync_common (common Lighthouse ticks) if sync_aligned
+ * BUTTONS:          raw button codes
+ * AXIS:             index, num_axis, axis[num_axis]
+ */
+#define TELEMETRY_MAGIC				0x6c74 /* "tl" */
+#define TELEMETRY_VERSION			3
+/* Records are batched into datagrams of up to this size */
+#define TELEMETRY_MAX_PACKET			1400
+
 #define TELEMETRY_PACKET_RAW_BUFFER		0
 #define TELEMETRY_PACKET_RAW_IMU_SAMPLE		1
 #define TELEMETRY_PACKET_IMU_SAMPLE		2
@@ -16,6 +46,38 @@
 #define TELEMETRY_PACKET_BUTTONS		5
 #define TELEMETRY_PACKET_AXIS			6
 
+#define TELEMETRY_IMU_MAGNETIC_FIELD		(1 << 0)
+#define TELEMETRY_IMU_TEMPERATURE		(1 << 1)
+
+#define TELEMETRY_TIME_SCALE			1e9
+/* 0.1 mm/s² */
+#define TELEMETRY_ACCELERATION_SCALE		1e4
+/* 1 µrad/s */
+#define TELEMETRY_ANGULAR_VELOCITY_SCALE	1e6
+#define TELEMETRY_MAGNETIC_FIELD_SCALE		1e6
+#define TELEMETRY_TEMPERATURE_SCALE		1e2
+#define TELEMETRY_ROTATION_SCALE		1073741824.0
+/* 1 µm */
+#define TELEMETRY_TRANSLATION_SCALE		1e6
+#define TELEMETRY_AXIS_SCALE			1e5
+
+struct telemetry_header {
+	__le16 magic;
+	__u8 version;
+	__u8 num_records;
+	__le32 seq;
+} __attribute__((packed));
+
+struct telemetry_record_header {
+	__u8 type;
+	__u8 dev_id;
+	__le16 len;
+} __attribute__((packed));
+
+#define TELEMETRY_MAX_RECORD	(TELEMETRY_MAX_PACKET - \
+				 sizeof(struct telemetry_header) - \
+				 sizeof(struct telemetry_record_header))
+
 struct imu_sample;
 struct raw_imu_sample;
 struct lighthouse_frame;
@@ -29,5 +91,7 @@ int telemetry_send_lighthouse_frame(uint8_t dev_id,
 int telemetry_send_pose(uint8_t dev_id, struct dpose *pose);
 int telemetry_send_buttons(uint8_t dev_id, uint8_t *buttons, int num_buttons);
 int telemetry_send_axis(uint8_t dev_id, int index, float *axis, int num_axis);
-int telemetry_init();
-void telemetry_deinit();
+int telemetry_init(int *argc, char **argv[]);
+void telemetry_deinit(void);
+
+#endif /* __TELEMETRY_H__ */
@@ -4,18 +4,53 @@
  * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
  */
 #include <stdlib.h>
+#include <string.h>
 
 #include "blobwatch.h"
+#include "budget.h"
 #include "debug.h"
 #include "leds.h"
 #include "maths.h"
 #include "opencv.h"
+#include "shm.h"
 #include "tracker.h"
 
+/* RANSAC iterations per object if there is no latency budget */
+#define DEFAULT_SOLVER_ITERATIONS	50
+
+/* Maximum number of hypotheses to acquire a lost object's pose */
+#define ACQUISITION_HYPOTHESES		512
+/* Fixed seed, so that acquisition is reproducible for the same blobs */
+#define ACQUISITION_SEED		0x6f757672
+/* Objects with a lower fraction of RANSAC inliers are considered lost */
+#define TRACKING_MIN_INLIER_RATIO	0.5
+
+/*
+ * A registered LED constellation and its index range in the combined LED
+ * table used for blob identification.
+ */
+struct tracked_object {
+	struct leds *leds;
+	int first;
+	int num;
+};
+
+/*
+ * The combined LED table of all registered objects. It is never modified
+ * after it is built, but replaced when objects are registered or removed,
+ * so cameras can use it without holding the tracker lock.
+ */
+struct led_table {
+	gint refcount;
+	struct leds leds;
+};
+
 struct _OuvrtTracker {
 	GObject parent_instance;
-	struct blobwatch *bw;
-	struct leds leds;
+	GMutex lock;
+	struct led_table *table;
+	int num_objects;
+	struct tracked_object objects[MAX_TRACKED_OBJECTS];
 	uint8_t radio_address[5];
 
 	uint64_t exposure_timestamp;
@@ -29,18 +64,125 @@ struct _OuvrtTracker {
 
 G_DEFINE_TYPE(OuvrtTracker, ouvrt_tracker, G_TYPE_OBJECT)
 
+static struct led_table *led_table_ref(struct led_table *table)
+{
+	if (table)
+		g_atomic_int_inc(&table->refcount);
+	return table;
+}
+
+static void led_table_unref(struct led_table *table)
+{
+	if (!table || !g_atomic_int_dec_and_test(&table->refcount))
+		return;
+
+	leds_fini(&table->leds);
+	g_free(table);
+}
+
+/*
+ * Rebuilds the combined LED table from all registered objects, so that the
+ * blinking pattern identification can assign LED ids across all objects
+ * seen by the same camera. Must be called with the lock held.
+ */
+static void ouvrt_tracker_rebuild_leds(OuvrtTracker *tracker)
+{
+	struct led_table *table;
+	struct leds *leds;
+	int num_leds = 0;
+	int i;
+
+	for (i = 0; i < tracker->num_objects; i++)
+		num_leds += tracker->objects[i].leds->model.num_points;
+
+	led_table_unref(tracker->table);
+	tracker->table = NULL;
+	if (!num_leds)
+		return;
+
+	table = g_new0(struct led_table, 1);
+	table->refcount = 1;
+	leds = &table->leds;
+	leds_init(leds, num_leds);
+
+	num_leds = 0;
+	for (i = 0; i < tracker->num_objects; i++) {
+		struct tracked_object *obj = &tracker->objects[i];
+		struct leds *src = obj->leds;
+		size_t n = src->model.num_points;
+
+		memcpy(leds->model.points + num_leds, src->model.points,
+		       n * sizeof(vec3));
+		memcpy(leds->model.normals + num_leds, src->model.normals,
+		       n * sizeof(vec3));
+		memcpy(leds->patterns + num_leds, src->patterns,
+		       n * sizeof(uint16_t));
+		obj->first = num_leds;
+		obj->num = n;
+		num_leds += n;
+	}
+
+	tracker->table = table;
+}
+
+/*
+ * Adds an LED constellation to the set of objects tracked by this tracker.
+ * The leds structure must stay valid until it is unregistered.
+ */
 void ouvrt_tracker_register_leds(OuvrtTracker *tracker, struct leds *leds)
 {
-	if (!tracker || tracker->leds.model.num_points)
+	struct tracked_object *obj;
+	int i;
+
+	if (!tracker || !leds->model.num_points)
 		return;
 
-	leds_copy(&tracker->leds, leds);
+	g_mutex_lock(&tracker->lock);
+
+	for (i = 0; i < tracker->num_objects; i++) {
+		if (tracker->objects[i].leds == leds)
+			goto out;
+	}
+
+	if (tracker->num_objects == MAX_TRACKED_OBJECTS ||
+	    (tracker->table ? tracker->table->leds.model.num_points : 0) +
+	    leds->model.num_points > INT8_MAX)
+		goto out;
+
+	obj = &tracker->objects[tracker->num_objects++];
+	memset(obj, 0, sizeof(*obj));
+	obj->leds = leds;
+
+	ouvrt_tracker_rebuild_leds(tracker);
+out:
+	g_mutex_unlock(&tracker->lock);
 }
 
-void ouvrt_tracker_unregister_leds(G_GNUC_UNUSED OuvrtTracker *tracker,
-				   G_GNUC_UNUSED struct leds *leds)
+/*
+ * Removes an LED constellation from the set of tracked objects.
+ */
+void ouvrt_tracker_unregister_leds(OuvrtTracker *tracker, struct leds *leds)
 {
-//	tracker->leds.gone = true;
+	int i;
+
+	if (!tracker)
+		return;
+
+	g_mutex_lock(&tracker->lock);
+
+	for (i = 0; i < tracker->num_objects; i++) {
+		if (tracker->objects[i].leds != leds)
+			continue;
+
+		tracker->num_objects--;
+		memmove(&tracker->objects[i], &tracker->objects[i + 1],
+			(tracker->num_objects - i) *
+			sizeof(struct tracked_object));
+		ouvrt_tracker_rebuild_leds(tracker);
+		break;
+	}
+
+	g_mutex_unlock(&tracker->lock);
 }
 
 void ouvrt_tracker_set_radio_address(OuvrtTracker *tracker,
@@ -66,50 +208,196 @@ void ouvrt_tracker_add_exposure(OuvrtTracker *tracker,
 	tracker->led_pattern_phase = led_pattern_phase;
 }
 
-void ouvrt_tracker_process_frame(OuvrtTracker *tracker, uint8_t *frame,
-				 int width, int height, uint64_t sof_time,
-				 struct blobservation **ob)
+/*
+ * Detects blobs in a camera frame and identifies them using the LED table of
+ * all registered objects. Each camera passes its own blob detector state, so
+ * that blob tracking history is not mixed between cameras. The tracker lock
+ * is only held to take a reference to the current LED table, detection runs
+ * without it.
+ * If the camera passes a latency budget, blob detection may be restricted
+ * to the region of interest chosen by it.
+ * The observation is published to shared memory under the camera's id.
+ */
+void ouvrt_tracker_process_frame(OuvrtTracker *tracker, uint8_t camera_id,
+				 struct blobwatch *bw,
+				 struct tracking_budget *budget,
+				 uint8_t *frame, int width, int height,
+				 uint64_t sof_time, struct blobservation **ob)
 {
+	static struct leds no_leds;
+	struct led_table *table;
 	uint8_t led_pattern_phase;
 
-	if (tracker->bw == NULL)
-		tracker->bw = blobwatch_new(width, height);
-
 	if (sof_time < tracker->exposure_time)
 		led_pattern_phase = tracker->last_led_pattern_phase;
 	else
 		led_pattern_phase = tracker->led_pattern_phase;
 
-	blobwatch_process(tracker->bw, frame, width, height, led_pattern_phase,
-			  &tracker->leds, ob);
+	if (budget) {
+		tracking_budget_begin_frame(budget);
+		blobwatch_set_roi(bw, budget->roi_top, budget->roi_bottom);
+	}
+
+	g_mutex_lock(&tracker->lock);
+	table = led_table_ref(tracker->table);
+	g_mutex_unlock(&tracker->lock);
+
+	blobwatch_process(bw, frame, width, height, led_pattern_phase,
+			  table ? &table->leds : &no_leds, ob);
+	led_table_unref(table);
+
+	shm_push_blobs(camera_id, sof_time, led_pattern_phase, *ob);
+
+	if (budget)
+		tracking_budget_end_detection(budget, *ob);
 }
 
+static void tracker_pose_reset(struct tracker_pose *pose,
+			       const struct leds *leds)
+{
+	memset(pose, 0, sizeof(*pose));
+	pose->leds = leds;
+	pose->rot.w = 1.0;
+}
+
+/*
+ * Resets a camera's poses of all tracked objects, so that they are acquired
+ * from scratch.
+ */
+void tracker_poses_reset(struct tracker_pose poses[MAX_TRACKED_OBJECTS])
+{
+	int i;
+
+	for (i = 0; i < MAX_TRACKED_OBJECTS; i++)
+		tracker_pose_reset(&poses[i], NULL);
+}
+
+/*
+ * Estimates the pose of each tracked object from the blobs identified as
+ * belonging to it. Each camera passes its own poses, which are refined from
+ * frame to frame, so that cameras looking at the same object from different
+ * directions do not overwrite each other's starting points. The first
+ * registered object is usually the HMD.
+ * The registered objects are copied under the tracker lock, and the solver
+ * runs without it. If the set of objects changed, poses whose object moved
+ * to a different index are acquired again.
+ * If the camera passes a latency budget, the solver effort is limited to fit
+ * the time remaining in the current frame. This includes pose acquisition,
+ * which tests at most as many hypotheses as the budget allows iterations.
+ * If no time is left, the previous poses are kept.
+ */
 void ouvrt_tracker_process_blobs(OuvrtTracker *tracker,
+				 struct tracking_budget *budget,
 				 struct blob *blobs, int num_blobs,
 				 dmat3 *camera_matrix, double dist_coeffs[5],
-				 dquat *rot, dvec3 *trans)
+				 struct tracker_pose poses[MAX_TRACKED_OBJECTS])
 {
-	struct leds *leds = &tracker->leds;
+	struct tracked_object objects[MAX_TRACKED_OBJECTS];
+	struct blob object_blobs[MAX_BLOBS_PER_FRAME];
+	int iterations = DEFAULT_SOLVER_ITERATIONS;
+	int max_hypotheses = ACQUISITION_HYPOTHESES;
+	struct led_table *table;
+	double inlier_ratio = 0.0;
+	double ratio;
+	int num_iterations = 0;
+	int num_objects;
+	int num_solved = 0;
+	int hypotheses;
+	int i, j, n;
 
-	if (leds == NULL)
-		return;
+	if (num_blobs > MAX_BLOBS_PER_FRAME)
+		num_blobs = MAX_BLOBS_PER_FRAME;
+
+	g_mutex_lock(&tracker->lock);
+	table = led_table_ref(tracker->table);
+	num_objects = tracker->num_objects;
+	memcpy(objects, tracker->objects,
+	       num_objects * sizeof(struct tracked_object));
+	g_mutex_unlock(&tracker->lock);
+
+	if (!table)
+		num_objects = 0;
+
+	if (budget) {
+		iterations = tracking_budget_solver_iterations(budget,
+							       num_objects);
+		if (max_hypotheses > iterations)
+			max_hypotheses = iterations;
+	}
+
+	for (i = 0; i < num_objects; i++) {
+		struct tracked_object *obj = &objects[i];
+		struct tracker_pose *pose = &poses[i];
+		vec3 *points = table->leds.model.points + obj->first;
+
+		if (pose->leds != obj->leds)
+			tracker_pose_reset(pose, obj->leds);
+
+		/* Collect blobs of this object, with object local LED ids */
+		for (j = 0, n = 0; j < num_blobs; j++) {
+			if (blobs[j].led_id < obj->first ||
+			    blobs[j].led_id >= obj->first + obj->num)
+				continue;
+			object_blobs[n] = blobs[j];
+			object_blobs[n].led_id -= obj->first;
+			n++;
+		}
+
+		/*
+		 * Refine the previous pose while the object is tracked. On
+		 * first sight or after it was lost, acquire the pose from
+		 * scratch, using all worker threads.
+		 */
+		if (n >= 4 && iterations > 0) {
+			if (pose->acquired) {
+				ratio = estimate_initial_pose(object_blobs, n,
+						points, obj->num,
+						camera_matrix, dist_coeffs,
+						&pose->rot, &pose->trans, true,
+						iterations);
+				num_iterations += iterations;
+			} else {
+				ratio = acquire_initial_pose(object_blobs, n,
+						points, obj->num,
+						camera_matrix, dist_coeffs,
+						&pose->rot, &pose->trans,
+						max_hypotheses,
+						ACQUISITION_SEED, &hypotheses);
+				num_iterations += hypotheses;
+			}
+			pose->acquired = ratio >= TRACKING_MIN_INLIER_RATIO;
+			inlier_ratio += ratio;
+			num_solved++;
+		} else if (n < 4) {
+			pose->acquired = false;
+		}
+	}
+
+	led_table_unref(table);
+
+	if (budget) {
+		tracking_budget_end_solver(budget, num_iterations,
+				num_solved ? inlier_ratio / num_solved : 0.0);
+	}
+}
+
+static void ouvrt_tracker_finalize(GObject *object)
+{
+	OuvrtTracker *self = OUVRT_TRACKER(object);
 
-	/*
-	 * Estimate initial pose without previously known [rot|trans].
-	 */
-	estimate_initial_pose(blobs, num_blobs, leds->model.points,
-			      leds->model.num_points,
-			      camera_matrix, dist_coeffs, rot, trans,
-			      true);
+	led_table_unref(self->table);
+	g_mutex_clear(&self->lock);
+	G_OBJECT_CLASS(ouvrt_tracker_parent_class)->finalize(object);
 }
 
-static void ouvrt_tracker_class_init(OuvrtTrackerClass *klass G_GNUC_UNUSED)
+static void ouvrt_tracker_class_init(OuvrtTrackerClass *klass)
 {
+	G_OBJECT_CLASS(klass)->finalize = ouvrt_tracker_finalize;
 }
 
 static void ouvrt_tracker_init(OuvrtTracker *self)
 {
-	leds_fini(&self->leds);
+	g_mutex_init(&self->lock);
 }
 
 OuvrtTracker *ouvrt_tracker_new(void)
@@ -7,6 +7,7 @@
 #define __TRACKER_H__
 
 #include <glib-object.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "maths.h"
@@ -14,9 +15,29 @@
 #define OUVRT_TYPE_TRACKER (ouvrt_tracker_get_type())
 G_DECLARE_FINAL_TYPE(OuvrtTracker, ouvrt_tracker, OUVRT, TRACKER, GObject)
 
+/* HMD and two controllers */
+#define MAX_TRACKED_OBJECTS	3
+
 struct leds;
 struct blob;
 struct blobservation;
+struct blobwatch;
+struct tracking_budget;
+
+/*
+ * Last pose of a tracked object estimated from a single camera's frames,
+ * and whether it can be used as a starting point for that camera's next
+ * frame. Each camera owns one per tracked object, indexed like the objects
+ * registered with the tracker.
+ */
+struct tracker_pose {
+	const struct leds *leds;
+	dquat rot;
+	dvec3 trans;
+	bool acquired;
+};
+
+void tracker_poses_reset(struct tracker_pose poses[MAX_TRACKED_OBJECTS]);
 
 void ouvrt_tracker_register_leds(OuvrtTracker *tracker, struct leds *leds);
 void ouvrt_tracker_unregister_leds(OuvrtTracker *tracker, struct leds *leds);
@@ -29,13 +50,16 @@ void ouvrt_tracker_add_exposure(OuvrtTracker *tracker,
 				uint64_t device_timestamp, uint64_t time,
 				uint8_t led_pattern_phase);
 
-void ouvrt_tracker_process_frame(OuvrtTracker *tracker, uint8_t *frame,
-				 int width, int height, uint64_t sof_time,
-				 struct blobservation **ob);
+void ouvrt_tracker_process_frame(OuvrtTracker *tracker, uint8_t camera_id,
+				 struct blobwatch *bw,
+				 struct tracking_budget *budget,
+				 uint8_t *frame, int width, int height,
+				 uint64_t sof_time, struct blobservation **ob);
 void ouvrt_tracker_process_blobs(OuvrtTracker *tracker,
+				 struct tracking_budget *budget,
 				 struct blob *blobs, int num_blobs,
 				 dmat3 *camera_matrix, double dist_coeffs[5],
-				 dquat *rot, dvec3 *trans);
+				 struct tracker_pose poses[MAX_TRACKED_OBJECTS]);
 
 OuvrtTracker *ouvrt_tracker_new();
 
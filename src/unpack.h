@@ -0,0 +1,83 @@
+/*
+ * Packed report field decoding helpers
+ * Copyright 2018 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __UNPACK_H__
+#define __UNPACK_H__
+
+#include <asm/byteorder.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Loads up to eight bytes as a little-endian unsigned integer. With a
+ * constant length, this compiles to a single unaligned load on little-endian
+ * machines instead of a chain of byte loads, shifts, and ors.
+ */
+static inline uint64_t unpack_le_bytes(const uint8_t *buf, unsigned int len)
+{
+	uint64_t v = 0;
+
+	memcpy(&v, buf, len);
+
+	return __le64_to_cpu(v);
+}
+
+/*
+ * Unpacks num consecutive unsigned bitfields of the given width, starting at
+ * bit 0 of the little-endian byte buffer. At most 64 bits may be unpacked.
+ */
+static inline void unpack_le_bitfields(const uint8_t *buf, unsigned int width,
+				       unsigned int num, uint16_t *out)
+{
+	const uint64_t v = unpack_le_bytes(buf, (width * num + 7) / 8);
+	const uint64_t mask = (1ULL << width) - 1;
+	unsigned int i;
+
+	for (i = 0; i < num; i++)
+		out[i] = (v >> (width * i)) & mask;
+}
+
+/*
+ * Unpacks three signed 24-bit little-endian values.
+ */
+static inline void unpack_3x24bit_le(const uint8_t *buf, int32_t out[3])
+{
+	const uint64_t lo = unpack_le_bytes(buf, 8);
+	const uint64_t hi = buf[8];
+
+	out[0] = (int32_t)(lo << 8) >> 8;
+	out[1] = (int32_t)(lo >> 16) >> 8;
+	out[2] = (int32_t)(((lo >> 48) | (hi << 16)) << 8) >> 8;
+}
+
+/*
+ * Unpacks three signed 21-bit values packed into a big-endian 64-bit value.
+ */
+static inline void unpack_3x21bit_be(__be64 buf, int32_t out[3])
+{
+	const uint64_t xyz = __be64_to_cpu(buf);
+
+	out[0] = (int64_t)xyz >> 43;
+	out[1] = (int64_t)(xyz << 21) >> 43;
+	out[2] = (int64_t)(xyz << 42) >> 43;
+}
+
+/*
+ * Returns the sum of eight consecutive signed 16-bit little-endian values.
+ * Written as a plain loop over a fixed count so that the compiler can turn
+ * it into a vector load and horizontal add.
+ */
+static inline int32_t unpack_sum_8x16bit_le(const __le16 *buf)
+{
+	int32_t sum = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		sum += (int16_t)__le16_to_cpu(buf[i]);
+
+	return sum;
+}
+
+#endif /* __UNPACK_H__ */
@@ -6,15 +6,48 @@
 #include <errno.h>
 #include <libusb.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "usb-device.h"
 
+#define USB_MAX_EVENT_THREADS	8
+
+/*
+ * Number of threads handling events on the shared libusb context. libusb
+ * serializes event handling, so additional threads only take over while
+ * another one is blocked, but completion callbacks are dispatched to the
+ * owning device's thread and never run on the event threads themselves.
+ */
+int usb_event_threads = 1;
+
+static GMutex usb_context_lock;
+static libusb_context *usb_context;
+static unsigned int usb_context_users;
+static GThread *usb_event_thread[USB_MAX_EVENT_THREADS];
+static unsigned int usb_num_event_threads;
+static int usb_context_stopping;
+
+/* Per-transfer state, kept for all transfers submitted through the device */
+struct usb_transfer_info {
+	libusb_transfer_cb_fn callback;
+	void *user_data;
+	uint64_t completion_time;
+	/* Resubmitted since the last completion was dispatched */
+	bool submitted;
+	/* Freed after dispatch instead of by libusb on the event thread */
+	bool free_transfer;
+};
+
 typedef struct {
 	uint16_t vid;
 	uint16_t pid;
 	libusb_context *context;
 	libusb_device_handle *devh;
-	int completed;
+	GMutex lock;
+	GHashTable *callbacks;
+	GAsyncQueue *completions;
+	unsigned int in_flight;
+	bool cancelling;
 } OuvrtUSBDevicePrivate;
 
 G_DEFINE_ABSTRACT_TYPE_WITH_PRIVATE(OuvrtUSBDevice, ouvrt_usb_device, \
@@ -27,6 +60,274 @@ libusb_device_handle *ouvrt_usb_device_get_handle(OuvrtUSBDevice *self)
 	return priv->devh;
 }
 
+/*
+ * Handles events on the shared libusb context until the last user releases
+ * it.
+ */
+static gpointer usb_event_thread_func(G_GNUC_UNUSED gpointer data)
+{
+	struct timeval tv = {
+		.tv_usec = 100000,
+	};
+	int ret;
+
+	while (!g_atomic_int_get(&usb_context_stopping)) {
+		ret = libusb_handle_events_timeout_completed(usb_context, &tv,
+							&usb_context_stopping);
+		if (ret != 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			g_print("libusb_handle_events failed with: %d\n", ret);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the process-wide libusb context, initializing it and starting the
+ * event threads for the first user.
+ */
+static libusb_context *usb_context_ref(void)
+{
+	libusb_context *context;
+	unsigned int i, n;
+	int ret;
+
+	g_mutex_lock(&usb_context_lock);
+	if (!usb_context_users) {
+		ret = libusb_init(&usb_context);
+		if (ret < 0) {
+			g_print("USB: failed to initialize libusb: %d\n", ret);
+			g_mutex_unlock(&usb_context_lock);
+			return NULL;
+		}
+
+		n = CLAMP(usb_event_threads, 1, USB_MAX_EVENT_THREADS);
+		usb_context_stopping = 0;
+		for (i = 0; i < n; i++) {
+			usb_event_thread[i] =
+				g_thread_new("usb-events",
+					     usb_event_thread_func, NULL);
+		}
+		usb_num_event_threads = n;
+	}
+	usb_context_users++;
+	context = usb_context;
+	g_mutex_unlock(&usb_context_lock);
+
+	return context;
+}
+
+/*
+ * Releases the process-wide libusb context. The last user stops the event
+ * threads and deinitializes libusb.
+ */
+static void usb_context_unref(void)
+{
+	unsigned int i;
+
+	g_mutex_lock(&usb_context_lock);
+	if (--usb_context_users == 0) {
+		g_atomic_int_set(&usb_context_stopping, 1);
+		for (i = 0; i < usb_num_event_threads; i++) {
+			g_thread_join(usb_event_thread[i]);
+			usb_event_thread[i] = NULL;
+		}
+		usb_num_event_threads = 0;
+		libusb_exit(usb_context);
+		usb_context = NULL;
+	}
+	g_mutex_unlock(&usb_context_lock);
+}
+
+/*
+ * Completion callback installed on all transfers submitted through
+ * ouvrt_usb_device_submit_transfer. Runs on an event thread and hands the
+ * transfer over to the owning device's thread. The transfer's user_data
+ * points to the device until its callback is dispatched.
+ */
+static void ouvrt_usb_device_transfer_cb(struct libusb_transfer *transfer)
+{
+	OuvrtUSBDevice *self = transfer->user_data;
+	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
+	struct usb_transfer_info *info;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	g_mutex_lock(&priv->lock);
+	info = g_hash_table_lookup(priv->callbacks, transfer);
+	if (info)
+		info->completion_time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	g_mutex_unlock(&priv->lock);
+
+	g_async_queue_push(priv->completions, transfer);
+}
+
+/*
+ * Submits a transfer. The transfer's callback is called from the device
+ * thread instead of the libusb event threads, with the transfer's user_data
+ * unchanged. Transfers flagged LIBUSB_TRANSFER_FREE_TRANSFER are freed after
+ * their callback returned. Transfers are not accepted anymore while the
+ * device is shutting down.
+ */
+int ouvrt_usb_device_submit_transfer(OuvrtUSBDevice *self,
+				     struct libusb_transfer *transfer)
+{
+	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
+	struct usb_transfer_info *info;
+	void *user_data;
+	int ret;
+
+	g_mutex_lock(&priv->lock);
+	if (priv->cancelling) {
+		g_mutex_unlock(&priv->lock);
+		return LIBUSB_ERROR_INTERRUPTED;
+	}
+	info = g_hash_table_lookup(priv->callbacks, transfer);
+	if (!info) {
+		info = g_new0(struct usb_transfer_info, 1);
+		g_hash_table_insert(priv->callbacks, transfer, info);
+	}
+	info->callback = transfer->callback;
+	info->free_transfer = transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER;
+	transfer->flags &= ~LIBUSB_TRANSFER_FREE_TRANSFER;
+	user_data = transfer->user_data;
+	info->user_data = user_data;
+	info->submitted = true;
+	transfer->callback = ouvrt_usb_device_transfer_cb;
+	transfer->user_data = self;
+	priv->in_flight++;
+	g_mutex_unlock(&priv->lock);
+
+	ret = libusb_submit_transfer(transfer);
+	if (ret < 0) {
+		g_mutex_lock(&priv->lock);
+		priv->in_flight--;
+		transfer->callback = info->callback;
+		transfer->user_data = user_data;
+		if (info->free_transfer)
+			transfer->flags |= LIBUSB_TRANSFER_FREE_TRANSFER;
+		g_hash_table_remove(priv->callbacks, transfer);
+		g_mutex_unlock(&priv->lock);
+	}
+
+	return ret;
+}
+
+/*
+ * Returns the CLOCK_MONOTONIC time in ns at which the transfer completed on
+ * the event thread, before it was handed over to the device thread. To be
+ * called from the transfer callback.
+ */
+uint64_t ouvrt_usb_device_get_completion_time(OuvrtUSBDevice *self,
+					      struct libusb_transfer *transfer)
+{
+	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
+	struct usb_transfer_info *info;
+	uint64_t time = 0;
+
+	g_mutex_lock(&priv->lock);
+	info = g_hash_table_lookup(priv->callbacks, transfer);
+	if (info)
+		time = info->completion_time;
+	g_mutex_unlock(&priv->lock);
+
+	return time;
+}
+
+/*
+ * Calls the device's completion callback for a transfer. While the device is
+ * shutting down, all transfers are reported as cancelled, so that callbacks
+ * only release their resources. The per-transfer state is dropped afterwards,
+ * unless the callback resubmitted the transfer.
+ */
+static void ouvrt_usb_device_dispatch(OuvrtUSBDevice *self,
+				      struct libusb_transfer *transfer)
+{
+	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
+	libusb_transfer_cb_fn callback = NULL;
+	struct usb_transfer_info *info;
+	bool free_transfer = false;
+	bool cancelling;
+
+	g_mutex_lock(&priv->lock);
+	priv->in_flight--;
+	info = g_hash_table_lookup(priv->callbacks, transfer);
+	if (info) {
+		callback = info->callback;
+		free_transfer = info->free_transfer;
+		info->submitted = false;
+		transfer->callback = callback;
+		transfer->user_data = info->user_data;
+	}
+	cancelling = priv->cancelling;
+	g_mutex_unlock(&priv->lock);
+
+	if (cancelling)
+		transfer->status = LIBUSB_TRANSFER_CANCELLED;
+	if (callback)
+		callback(transfer);
+
+	/*
+	 * The callback may have freed the transfer, only use the pointer as
+	 * a key from here on.
+	 */
+	g_mutex_lock(&priv->lock);
+	info = g_hash_table_lookup(priv->callbacks, transfer);
+	if (info && !info->submitted)
+		g_hash_table_remove(priv->callbacks, transfer);
+	g_mutex_unlock(&priv->lock);
+
+	if (free_transfer)
+		libusb_free_transfer(transfer);
+}
+
+/*
+ * Cancels all transfers in flight and waits for their completion, so that
+ * the transfers can be freed and the device closed afterwards. libusb
+ * completes every cancelled transfer while the event threads are running,
+ * so this keeps waiting instead of freeing state the event threads might
+ * still access.
+ */
+static void ouvrt_usb_device_cancel_transfers(OuvrtUSBDevice *self)
+{
+	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
+	struct libusb_transfer *transfer;
+	unsigned int timeouts = 0;
+	GHashTableIter iter;
+	gpointer key;
+
+	g_mutex_lock(&priv->lock);
+	priv->cancelling = true;
+	g_hash_table_iter_init(&iter, priv->callbacks);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		libusb_cancel_transfer(key);
+	g_mutex_unlock(&priv->lock);
+
+	for (;;) {
+		g_mutex_lock(&priv->lock);
+		if (!priv->in_flight) {
+			g_mutex_unlock(&priv->lock);
+			break;
+		}
+		g_mutex_unlock(&priv->lock);
+
+		transfer = g_async_queue_timeout_pop(priv->completions,
+						     G_USEC_PER_SEC);
+		if (!transfer) {
+			if (timeouts++ == 0) {
+				g_print("%s: Waiting for cancelled transfers\n",
+					OUVRT_DEVICE(self)->name);
+			}
+			continue;
+		}
+		ouvrt_usb_device_dispatch(self, transfer);
+	}
+
+	g_hash_table_remove_all(priv->callbacks);
+}
+
 /*
  * Sets the vendor id and product id to match in open.
  */
@@ -63,15 +364,21 @@ static int ouvrt_usb_device_open(OuvrtDevice *dev)
 
 	address = g_ascii_strtoull(endp + 1, NULL, 10);
 
-	libusb_init(&priv->context);
+	priv->context = usb_context_ref();
+	if (!priv->context)
+		return -ENODEV;
 
 	num = libusb_get_device_list(priv->context, &devices);
-	if (num < 0)
-		return num;
+	if (num < 0) {
+		ret = num;
+		goto err_unref;
+	}
 	for (i = 0; i < num; i++) {
 		ret = libusb_get_device_descriptor(devices[i], &desc);
-		if (ret < 0)
-			return ret;
+		if (ret < 0) {
+			libusb_free_device_list(devices, 1);
+			goto err_unref;
+		}
 
 		if (desc.idVendor == priv->vid && desc.idProduct == priv->pid &&
 		    bus == libusb_get_bus_number(devices[i]) &&
@@ -80,7 +387,8 @@ static int ouvrt_usb_device_open(OuvrtDevice *dev)
 	}
 	if (i == num) {
 		libusb_free_device_list(devices, 1);
-		return -ENODEV;
+		ret = -ENODEV;
+		goto err_unref;
 	}
 
 	int speed = libusb_get_device_speed(devices[i]);
@@ -102,34 +410,36 @@ static int ouvrt_usb_device_open(OuvrtDevice *dev)
 		} else {
 			g_print("%s: failed to open: %d\n", dev->name, ret);
 		}
-		return ret;
+		goto err_unref;
 	}
 
+	priv->cancelling = false;
+
 	return 0;
+
+err_unref:
+	usb_context_unref();
+	priv->context = NULL;
+	return ret;
 }
 
 /*
- * Handles USB transfers.
+ * Handles USB transfer completions dispatched from the event threads.
  */
 static void ouvrt_usb_device_thread(OuvrtDevice *dev)
 {
 	OuvrtUSBDevice *self = OUVRT_USB_DEVICE(dev);
 	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
-	struct timeval tv = {
-		.tv_sec = 1,
-	};
-	int ret;
+	struct libusb_transfer *transfer;
 
 	while (dev->active) {
-		ret = libusb_handle_events_timeout_completed(priv->context, &tv,
-							     &priv->completed);
-		if (ret != 0) {
-			g_print("libusb_handle_events failed with: %d\n", ret);
-			break;
-		}
-		if (priv->completed)
-			dev->active = false;
+		transfer = g_async_queue_timeout_pop(priv->completions,
+						     100000);
+		if (transfer)
+			ouvrt_usb_device_dispatch(self, transfer);
 	}
+
+	ouvrt_usb_device_cancel_transfers(self);
 }
 
 /*
@@ -140,8 +450,13 @@ static void ouvrt_usb_device_close(OuvrtDevice *dev)
 	OuvrtUSBDevice *self = OUVRT_USB_DEVICE(dev);
 	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
 
+	ouvrt_usb_device_cancel_transfers(self);
 	libusb_close(priv->devh);
 	priv->devh = NULL;
+	if (priv->context) {
+		usb_context_unref();
+		priv->context = NULL;
+	}
 }
 
 /*
@@ -149,6 +464,12 @@ static void ouvrt_usb_device_close(OuvrtDevice *dev)
  */
 static void ouvrt_usb_device_finalize(GObject *object)
 {
+	OuvrtUSBDevice *self = OUVRT_USB_DEVICE(object);
+	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
+
+	g_async_queue_unref(priv->completions);
+	g_hash_table_destroy(priv->callbacks);
+	g_mutex_clear(&priv->lock);
 	G_OBJECT_CLASS(ouvrt_usb_device_parent_class)->finalize(object);
 }
 
@@ -160,6 +481,12 @@ static void ouvrt_usb_device_class_init(OuvrtUSBDeviceClass *klass)
 	OUVRT_DEVICE_CLASS(klass)->close = ouvrt_usb_device_close;
 }
 
-static void ouvrt_usb_device_init(G_GNUC_UNUSED OuvrtUSBDevice *self)
+static void ouvrt_usb_device_init(OuvrtUSBDevice *self)
 {
+	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
+
+	g_mutex_init(&priv->lock);
+	priv->callbacks = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						NULL, g_free);
+	priv->completions = g_async_queue_new();
 }
@@ -23,9 +23,15 @@ struct _OuvrtUSBDeviceClass {
 	OuvrtDeviceClass parent_class;
 };
 
+extern int usb_event_threads;
+
 libusb_device_handle *ouvrt_usb_device_get_handle(OuvrtUSBDevice *self);
 void ouvrt_usb_device_set_vid_pid(OuvrtUSBDevice *self, uint16_t vid,
 				  uint16_t pid);
+int ouvrt_usb_device_submit_transfer(OuvrtUSBDevice *self,
+				     struct libusb_transfer *transfer);
+uint64_t ouvrt_usb_device_get_completion_time(OuvrtUSBDevice *self,
+					      struct libusb_transfer *transfer);
 
 G_END_DECLS
 
@@ -3,8 +3,11 @@
  * Copyright 2017 Philipp Zabel
  * SPDX-License-Identifier:	LGPL-2.0+
  */
+#include <asm/byteorder.h>
+#include <errno.h>
 #include <glib.h>
 #include <libusb.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #define SET_CUR			0x01
@@ -15,6 +18,9 @@
 #define VS_PROBE_CONTROL	1
 #define VS_COMMIT_CONTROL	2
 
+#define CS_INTERFACE		0x24
+#define VC_HEADER		0x01
+
 int uvc_set_cur(libusb_device_handle *dev, uint8_t interface, uint8_t entity,
 		uint8_t selector, void *data, uint16_t wLength)
 {
@@ -75,3 +81,68 @@ int uvc_get_len(libusb_device_handle *dev, uint8_t interface, uint8_t entity,
 	}
 	return ret;
 }
+
+/*
+ * Fills the setup packet for an asynchronous SET_CUR or GET_CUR control
+ * transfer.
+ */
+void uvc_fill_cur_setup(uint8_t *setup, bool get, uint8_t interface,
+			uint8_t entity, uint8_t selector, uint16_t wLength)
+{
+	uint8_t bmRequestType = (get ? LIBUSB_ENDPOINT_IN :
+				       LIBUSB_ENDPOINT_OUT) |
+				LIBUSB_REQUEST_TYPE_CLASS |
+				LIBUSB_RECIPIENT_INTERFACE;
+	uint8_t bRequest = get ? GET_CUR : SET_CUR;
+	uint16_t wValue = selector << 8;
+	uint16_t wIndex = entity << 8 | interface;
+
+	libusb_fill_control_setup(setup, bmRequestType, bRequest, wValue,
+				  wIndex, wLength);
+}
+
+/*
+ * Reads the device clock frequency used for PTS and SCR timestamps from the
+ * class-specific VideoControl interface header descriptor.
+ *
+ * Returns 0 on success, negative values on error.
+ */
+int uvc_get_clock_frequency(libusb_device *dev, uint8_t interface,
+			    uint32_t *frequency)
+{
+	const struct libusb_interface_descriptor *desc;
+	struct libusb_config_descriptor *config;
+	const unsigned char *extra;
+	int i;
+	int ret;
+
+	ret = libusb_get_active_config_descriptor(dev, &config);
+	if (ret < 0)
+		return ret;
+
+	ret = -ENOENT;
+	if (interface >= config->bNumInterfaces)
+		goto out;
+
+	desc = &config->interface[interface].altsetting[0];
+	extra = desc->extra;
+	for (i = 0; i + 3 <= desc->extra_length; i += extra[i]) {
+		const unsigned char *d = extra + i;
+
+		if (d[0] < 3 || i + d[0] > desc->extra_length)
+			break;
+		if (d[1] != CS_INTERFACE || d[2] != VC_HEADER)
+			continue;
+		if (d[0] < 11)
+			break;
+
+		/* bcdUVC, wTotalLength, dwClockFrequency */
+		*frequency = __le32_to_cpup((const __le32 *)(d + 7));
+		ret = *frequency ? 0 : -EINVAL;
+		break;
+	}
+
+out:
+	libusb_free_config_descriptor(config);
+	return ret;
+}
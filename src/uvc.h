@@ -30,6 +30,13 @@ struct uvc_probe_commit_control {
 	__u8 bMaxVersion;
 } __attribute__((packed));
 
+/* Payload header bmHeaderInfo bits */
+#define UVC_STREAM_FID		(1 << 0)
+#define UVC_STREAM_EOF		(1 << 1)
+#define UVC_STREAM_PTS		(1 << 2)
+#define UVC_STREAM_SCR		(1 << 3)
+#define UVC_STREAM_ERR		(1 << 6)
+
 struct uvc_payload_header {
 	__u8 bHeaderLength;
 	__u8 bmHeaderInfo;
@@ -50,3 +57,7 @@ int uvc_get_cur(libusb_device_handle *dev, uint8_t interface, uint8_t entity,
 		uint8_t selector, void *data, uint16_t wLength);
 int uvc_get_len(libusb_device_handle *dev, uint8_t interface, uint8_t entity,
 		uint8_t selector, uint16_t *wLength);
+int uvc_get_clock_frequency(libusb_device *dev, uint8_t interface,
+			    uint32_t *frequency);
+void uvc_fill_cur_setup(uint8_t *setup, bool get, uint8_t interface,
+			uint8_t entity, uint8_t selector, uint16_t wLength);
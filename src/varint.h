@@ -0,0 +1,100 @@
+/*
+ * Variable length integer encoding helpers
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __VARINT_H__
+#define __VARINT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Write or read position in a byte buffer. Accesses past the end set the
+ * overflow flag instead of touching memory, so that callers only have to
+ * check once after encoding or decoding a whole record.
+ */
+struct varint_cursor {
+	uint8_t *p;
+	const uint8_t *end;
+	bool overflow;
+};
+
+static inline uint64_t zigzag_encode(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/*
+ * Stores an unsigned LEB128 varint, seven bits per byte.
+ */
+static inline void varint_put(struct varint_cursor *c, uint64_t v)
+{
+	do {
+		if (c->p >= c->end) {
+			c->overflow = true;
+			return;
+		}
+		*c->p++ = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+		v >>= 7;
+	} while (v);
+}
+
+static inline uint64_t varint_get(struct varint_cursor *c)
+{
+	uint64_t v = 0;
+	int shift = 0;
+	uint8_t byte;
+
+	do {
+		if (c->p >= c->end || shift > 63) {
+			c->overflow = true;
+			return 0;
+		}
+		byte = *c->p++;
+		v |= (uint64_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+
+	return v;
+}
+
+static inline void varint_put_signed(struct varint_cursor *c, int64_t v)
+{
+	varint_put(c, zigzag_encode(v));
+}
+
+static inline int64_t varint_get_signed(struct varint_cursor *c)
+{
+	return zigzag_decode(varint_get(c));
+}
+
+static inline void varint_put_bytes(struct varint_cursor *c, const void *buf,
+				    size_t len)
+{
+	if (c->overflow || (size_t)(c->end - c->p) < len) {
+		c->overflow = true;
+		return;
+	}
+	memcpy(c->p, buf, len);
+	c->p += len;
+}
+
+static inline void varint_get_bytes(struct varint_cursor *c, void *buf,
+				    size_t len)
+{
+	if (c->overflow || (size_t)(c->end - c->p) < len) {
+		c->overflow = true;
+		return;
+	}
+	memcpy(buf, c->p, len);
+	c->p += len;
+}
+
+#endif /* __VARINT_H__ */
@@ -9,11 +9,13 @@
 #include <poll.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "vive-controller-usb.h"
 #include "vive-config.h"
 #include "vive-firmware.h"
+#include "vive-haptics.h"
 #include "vive-hid-reports.h"
 #include "vive-imu.h"
 #include "buttons.h"
@@ -24,6 +26,7 @@
 #include "lighthouse.h"
 #include "maths.h"
 #include "usb-ids.h"
+#include "shm.h"
 #include "telemetry.h"
 
 struct _OuvrtViveControllerUSB {
@@ -105,10 +108,10 @@ static int vive_controller_usb_get_config(OuvrtViveControllerUSB *self)
 
 /*
  * Decodes the periodic Lighthouse receiver message containing IR pulse
- * timing measurements.
+ * timing measurements, received at the given host time in ns.
  */
 static void vive_controller_decode_pulse_report(OuvrtViveControllerUSB *self,
-						const void *buf)
+						const void *buf, uint64_t time)
 {
 	const struct vive_controller_lighthouse_pulse_report *report = buf;
 	unsigned int i;
@@ -138,6 +141,8 @@ static void vive_controller_decode_pulse_report(OuvrtViveControllerUSB *self,
 		timestamp = __le32_to_cpu(pulse->timestamp);
 		duration = __le16_to_cpu(pulse->duration);
 
+		clock_recovery_add_sample(&self->watchman.clock, timestamp,
+					  time);
 		lighthouse_watchman_handle_pulse(&self->watchman, sensor_id,
 						 duration, timestamp);
 	}
@@ -168,6 +173,11 @@ void vive_controller_decode_button_message(OuvrtViveControllerUSB *self,
 				     6, vive_controller_usb_button_map);
 		self->buttons = buttons;
 	}
+
+	shm_update_input(self->dev.id,
+			 ouvrt_button_state(buttons, 6,
+					    vive_controller_usb_button_map),
+			 NULL, 0);
 }
 
 /*
@@ -201,6 +211,8 @@ static void vive_controller_usb_thread(OuvrtDevice *dev)
 	OuvrtViveControllerUSB *self = OUVRT_VIVE_CONTROLLER_USB(dev);
 	unsigned char buf[64];
 	struct pollfd fds[3];
+	struct timespec ts;
+	uint64_t time;
 	int ret;
 
 	self->watchman.id = dev->id;
@@ -263,9 +275,12 @@ static void vive_controller_usb_thread(OuvrtDevice *dev)
 				g_print("%s: Read error: %d\n", dev->name, errno);
 				continue;
 			}
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 			if (ret == 58 &&
 			    buf[0] == VIVE_CONTROLLER_LIGHTHOUSE_PULSE_REPORT_ID) {
-				vive_controller_decode_pulse_report(self, buf);
+				vive_controller_decode_pulse_report(self, buf,
+								    time);
 			} else {
 				g_print("%s: Error, invalid %d-byte report 0x%02x\n",
 					dev->name, ret, buf[0]);
@@ -285,6 +300,8 @@ static void vive_controller_usb_thread(OuvrtDevice *dev)
 					dev->name, ret, buf[0]);
 			}
 		}
+
+		vive_controller_handle_haptics(dev);
 	}
 }
 
@@ -301,6 +318,9 @@ static void vive_controller_usb_stop(OuvrtDevice *dev)
  */
 static void ouvrt_vive_controller_usb_finalize(GObject *object)
 {
+	OuvrtViveControllerUSB *self = OUVRT_VIVE_CONTROLLER_USB(object);
+
+	lighthouse_sync_unregister(&self->watchman);
 	G_OBJECT_CLASS(ouvrt_vive_controller_usb_parent_class)->finalize(object);
 }
 
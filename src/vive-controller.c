@@ -9,12 +9,14 @@
 #include <string.h>
 #include <stdint.h>
 #include <sys/fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <json-glib/json-glib.h>
 
 #include "vive-controller.h"
 #include "vive-config.h"
 #include "vive-firmware.h"
+#include "vive-haptics.h"
 #include "vive-hid-reports.h"
 #include "vive-imu.h"
 #include "lighthouse.h"
@@ -24,6 +26,7 @@
 #include "json.h"
 #include "maths.h"
 #include "usb-ids.h"
+#include "shm.h"
 #include "telemetry.h"
 
 struct _OuvrtViveController {
@@ -106,18 +109,6 @@ static int vive_controller_get_config(OuvrtViveController *self)
 	return 0;
 }
 
-static int vive_controller_haptic_pulse(OuvrtViveController *self)
-{
-	const struct vive_controller_haptic_pulse_report report = {
-		.id = VIVE_CONTROLLER_COMMAND_REPORT_ID,
-		.command = VIVE_CONTROLLER_HAPTIC_PULSE_COMMAND,
-		.len = 7,
-		.unknown = { 0x00, 0xf4, 0x01, 0xb5, 0xa2, 0x01, 0x00 },
-	};
-
-	return hid_send_feature_report(self->dev.fd, &report, sizeof(report));
-}
-
 static int vive_controller_poweroff(OuvrtViveController *self)
 {
 	const struct vive_controller_poweroff_report report = {
@@ -182,6 +173,23 @@ static void vive_controller_handle_analog_trigger(OuvrtViveController *self,
 		self->squeeze = squeeze;
 }
 
+/*
+ * Publishes the current button, touchpad, and trigger state.
+ */
+static void vive_controller_update_input(OuvrtViveController *self)
+{
+	const float axes[] = {
+		[OUVRT_AXIS_TRIGGER] = self->squeeze / 255.0f,
+		[OUVRT_AXIS_TOUCHPAD_X] = self->touch_pos[0] / 32768.0f,
+		[OUVRT_AXIS_TOUCHPAD_Y] = self->touch_pos[1] / 32768.0f,
+	};
+
+	shm_update_input(self->dev.id,
+			 ouvrt_button_state(self->buttons, 6,
+					    vive_controller_button_map),
+			 axes, G_N_ELEMENTS(axes));
+}
+
 static void vive_controller_handle_imu_sample(OuvrtViveController *self,
 					      uint8_t *buf)
 {
@@ -224,11 +232,13 @@ vive_controller_dump_message(OuvrtViveController *self,
 }
 
 /*
- * Decodes multiplexed Wireless Receiver messages.
+ * Decodes multiplexed Wireless Receiver messages, received at the given host
+ * time in ns.
  */
 static void
 vive_controller_decode_message(OuvrtViveController *self,
-			       struct vive_controller_message *message)
+			       struct vive_controller_message *message,
+			       uint64_t time)
 {
 	unsigned char *buf = message->payload;
 	unsigned char *end = message->payload + message->len - 1;
@@ -272,6 +282,8 @@ vive_controller_decode_message(OuvrtViveController *self,
 		}
 	}
 
+	vive_controller_update_input(self);
+
 	if (buf > end)
 		g_print("overshoot: %ld\n", buf - end);
 	if (!silent || buf > end)
@@ -359,6 +371,8 @@ vive_controller_decode_message(OuvrtViveController *self,
 		timestamp = (abs(dts1) < abs(dts2)) ? ts1 :
 			    (abs(dts2) < abs(dts3)) ? ts2 : ts3;
 
+		clock_recovery_add_sample(&self->watchman.clock, timestamp,
+					  time);
 		lighthouse_watchman_handle_pulse(&self->watchman,
 						 buf[i] >> 3, duration[i],
 						 timestamp);
@@ -389,6 +403,8 @@ static void vive_controller_thread(OuvrtDevice *dev)
 	OuvrtViveController *self = OUVRT_VIVE_CONTROLLER(dev);
 	unsigned char buf[64];
 	struct pollfd fds;
+	struct timespec ts;
+	uint64_t time;
 	int ret;
 
 	ret = vive_get_firmware_version(dev);
@@ -451,7 +467,7 @@ static void vive_controller_thread(OuvrtDevice *dev)
 			self->watchman.name = dev->name;
 			self->connected = TRUE;
 
-			vive_controller_haptic_pulse(self);
+			vive_controller_haptic_pulse(dev, 500, 41653, 1);
 		}
 
 		if (self->imu.gyro_range == 0.0) {
@@ -468,17 +484,22 @@ static void vive_controller_thread(OuvrtDevice *dev)
 			g_print("%s: Read error: %d\n", dev->name, errno);
 			continue;
 		}
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 		if (ret == 30 && buf[0] == VIVE_CONTROLLER_REPORT1_ID) {
 			struct vive_controller_report1 *report = (void *)buf;
 
-			vive_controller_decode_message(self, &report->message);
+			vive_controller_decode_message(self, &report->message,
+						       time);
 		} else if (ret == 59 && buf[0] == VIVE_CONTROLLER_REPORT2_ID) {
 			struct vive_controller_report2 *report = (void *)buf;
 
 			vive_controller_decode_message(self,
-						       &report->message[0]);
+						       &report->message[0],
+						       time);
 			vive_controller_decode_message(self,
-						       &report->message[1]);
+						       &report->message[1],
+						       time);
 		} else if (ret == 2 &&
 			   buf[0] == VIVE_CONTROLLER_DISCONNECT_REPORT_ID &&
 			   buf[1] == 0x01) {
@@ -493,6 +514,9 @@ static void vive_controller_thread(OuvrtDevice *dev)
 			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
 				dev->name, ret, buf[0]);
 		}
+
+		if (self->connected)
+			vive_controller_handle_haptics(dev);
 	}
 }
 
@@ -511,6 +535,9 @@ static void vive_controller_stop(OuvrtDevice *dev)
  */
 static void ouvrt_vive_controller_finalize(GObject *object)
 {
+	OuvrtViveController *self = OUVRT_VIVE_CONTROLLER(object);
+
+	lighthouse_sync_unregister(&self->watchman);
 	G_OBJECT_CLASS(ouvrt_vive_controller_parent_class)->finalize(object);
 }
 
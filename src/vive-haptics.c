@@ -0,0 +1,72 @@
+/*
+ * HTC Vive Controller haptic feedback
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#include <asm/byteorder.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "vive-haptics.h"
+#include "vive-hid-reports.h"
+#include "device.h"
+#include "hidraw.h"
+#include "shm.h"
+
+/* Pulse frequency used if the client does not ask for a specific one */
+#define VIVE_HAPTICS_DEFAULT_FREQUENCY	200.0f
+
+/*
+ * Starts a train of repeat_count pulses with high and low times in µs.
+ * A repeat count of zero stops the current pulse train.
+ */
+int vive_controller_haptic_pulse(OuvrtDevice *dev, uint16_t pulse_high,
+				 uint16_t pulse_low, uint16_t repeat_count)
+{
+	const struct vive_controller_haptic_pulse_report report = {
+		.id = VIVE_CONTROLLER_COMMAND_REPORT_ID,
+		.command = VIVE_CONTROLLER_HAPTIC_PULSE_COMMAND,
+		.len = 7,
+		.unknown = 0x00,
+		.pulse_high = __cpu_to_le16(pulse_high),
+		.pulse_low = __cpu_to_le16(pulse_low),
+		.repeat_count = __cpu_to_le16(repeat_count),
+	};
+
+	return hid_send_feature_report(dev->fd, &report, sizeof(report));
+}
+
+/*
+ * Turns the most recent haptics command queued by clients into a pulse
+ * train. The amplitude is approximated by the duty cycle.
+ */
+void vive_controller_handle_haptics(OuvrtDevice *dev)
+{
+	struct ouvrt_shm_haptics_command command;
+	float frequency;
+	long period, high, count;
+	int ret;
+
+	if (shm_pop_haptics(dev->id, &command) <= 0)
+		return;
+
+	frequency = command.frequency ? command.frequency :
+		    VIVE_HAPTICS_DEFAULT_FREQUENCY;
+	period = lroundf(1e6f / frequency);
+	if (period < 2)
+		period = 2;
+	if (period > UINT16_MAX)
+		period = UINT16_MAX;
+	high = lroundf(0.5f * command.amplitude * period);
+	count = lroundf(command.duration * 1e6f / period);
+	if (count > UINT16_MAX)
+		count = UINT16_MAX;
+	if (!high)
+		count = 0;
+
+	ret = vive_controller_haptic_pulse(dev, high, period - high, count);
+	if (ret < 0)
+		g_print("%s: Failed to send haptic pulse: %d\n", dev->name,
+			errno);
+}
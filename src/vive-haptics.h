@@ -0,0 +1,17 @@
+/*
+ * HTC Vive Controller haptic feedback
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#ifndef __VIVE_HAPTICS_H__
+#define __VIVE_HAPTICS_H__
+
+#include <stdint.h>
+
+#include "device.h"
+
+int vive_controller_haptic_pulse(OuvrtDevice *dev, uint16_t pulse_high,
+				 uint16_t pulse_low, uint16_t repeat_count);
+void vive_controller_handle_haptics(OuvrtDevice *dev);
+
+#endif /* __VIVE_HAPTICS_H__ */
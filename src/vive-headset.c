@@ -9,6 +9,7 @@
 #include <poll.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "vive-headset.h"
@@ -16,13 +17,18 @@
 #include "vive-config.h"
 #include "vive-firmware.h"
 #include "vive-imu.h"
+#include "clock-recovery.h"
 #include "device.h"
 #include "hidraw.h"
 #include "imu.h"
 #include "json.h"
 #include "lighthouse.h"
 #include "maths.h"
+#include "shm.h"
 #include "usb-ids.h"
+#include "vsync.h"
+
+#define VIVE_REFRESH_RATE		90
 
 struct _OuvrtViveHeadset {
 	OuvrtDevice dev;
@@ -30,6 +36,7 @@ struct _OuvrtViveHeadset {
 	JsonNode *config;
 	struct vive_imu imu;
 	struct lighthouse_watchman watchman;
+	struct vsync_fit vsync;
 };
 
 G_DEFINE_TYPE(OuvrtViveHeadset, ouvrt_vive_headset, OUVRT_TYPE_DEVICE)
@@ -120,12 +127,31 @@ static int vive_headset_enable_lighthouse(OuvrtViveHeadset *self,
 	return hid_send_feature_report(self->dev.fd, buf, sizeof(buf));
 }
 
+/*
+ * Converts a vsync timestamp to host time and updates the display timing.
+ */
+static void vive_headset_handle_vsync(OuvrtViveHeadset *self,
+				      uint32_t timestamp)
+{
+	struct vsync_fit *vsync = &self->vsync;
+	uint64_t time;
+
+	if (clock_recovery_to_host(&self->watchman.clock, timestamp, &time) < 0)
+		return;
+
+	if (vsync_fit_add(vsync, time)) {
+		shm_publish_vsync(self->dev.id, vsync->count, vsync->time,
+				  vsync->period, vsync->jitter, 0);
+	}
+}
+
 /*
  * Decodes the periodic Lighthouse receiver message containing IR pulse
- * timing measurements.
+ * timing measurements, received at the given host time in ns. The pulse
+ * timestamps are used to map the receiver clock to host time.
  */
 static void vive_headset_decode_pulse_report(OuvrtViveHeadset *self,
-					     const void *buf)
+					     const void *buf, uint64_t time)
 {
 	const struct vive_headset_lighthouse_pulse_report *report = buf;
 	unsigned int i;
@@ -144,8 +170,10 @@ static void vive_headset_decode_pulse_report(OuvrtViveHeadset *self,
 			continue;
 
 		timestamp = __le32_to_cpu(pulse->timestamp);
+		clock_recovery_add_sample(&self->watchman.clock, timestamp,
+					  time);
 		if (sensor_id == 0xfe) {
-			/* TODO: handle vsync timestamp */
+			vive_headset_handle_vsync(self, timestamp);
 			continue;
 		}
 
@@ -192,6 +220,9 @@ static int vive_headset_start(OuvrtDevice *dev)
 	}
 
 	self->watchman.name = dev->name;
+	clock_recovery_init(&self->watchman.clock, LIGHTHOUSE_CLOCK_HZ,
+			    LIGHTHOUSE_CLOCK_INTERVAL_NS);
+	vsync_fit_init(&self->vsync, 1e9 / VIVE_REFRESH_RATE);
 
 	return 0;
 }
@@ -204,6 +235,8 @@ static void vive_headset_thread(OuvrtDevice *dev)
 	OuvrtViveHeadset *self = OUVRT_VIVE_HEADSET(dev);
 	unsigned char buf[64];
 	struct pollfd fds[2];
+	struct timespec ts;
+	uint64_t time;
 	int ret;
 
 	while (dev->active) {
@@ -263,9 +296,12 @@ static void vive_headset_thread(OuvrtDevice *dev)
 					errno);
 				continue;
 			}
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 			if (ret == 64 &&
 			    buf[0] == VIVE_HEADSET_LIGHTHOUSE_PULSE_REPORT_ID) {
-				vive_headset_decode_pulse_report(self, buf);
+				vive_headset_decode_pulse_report(self, buf,
+								 time);
 			} else {
 				g_print("%s: Error, invalid %d-byte report 0x%02x\n",
 					dev->name, ret, buf[0]);
@@ -287,6 +323,9 @@ static void vive_headset_stop(G_GNUC_UNUSED OuvrtDevice *dev)
  */
 static void ouvrt_vive_headset_finalize(GObject *object)
 {
+	OuvrtViveHeadset *self = OUVRT_VIVE_HEADSET(object);
+
+	lighthouse_sync_unregister(&self->watchman);
 	G_OBJECT_CLASS(ouvrt_vive_headset_parent_class)->finalize(object);
 }
 
@@ -206,11 +206,15 @@ struct vive_headset_lighthouse_pulse_report {
 
 #define VIVE_CONTROLLER_HAPTIC_PULSE_COMMAND		0x8f
 
+/* Pulse train with high and low times in µs */
 struct vive_controller_haptic_pulse_report {
 	__u8 id;
 	__u8 command;
 	__u8 len;
-	__u8 unknown[7];
+	__u8 unknown;
+	__le16 pulse_high;
+	__le16 pulse_low;
+	__le16 repeat_count;
 } __attribute__((packed));
 
 #define VIVE_CONTROLLER_POWEROFF_COMMAND		0x9f
@@ -12,6 +12,7 @@
 #include "vive-hid-reports.h"
 #include "hidraw.h"
 #include "imu.h"
+#include "shm.h"
 #include "telemetry.h"
 
 static inline int oldest_sequence_index(uint8_t a, uint8_t b, uint8_t c)
@@ -143,6 +144,8 @@ void vive_imu_decode_message(OuvrtDevice *dev, struct vive_imu *imu,
 			pose_update(dt / 48e6, &imu->state.pose, &s);
 
 			telemetry_send_pose(dev->id, &imu->state.pose);
+			shm_publish_pose(dev->id, s.time, &imu->state.pose,
+					 &s.angular_velocity);
 		}
 
 		imu->sequence = seq;
@@ -0,0 +1,130 @@
+/*
+ * Display vsync period and phase estimation
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <math.h>
+#include <string.h>
+
+#include "vsync.h"
+
+/* Events needed before the fit is published */
+#define VSYNC_FIT_MIN_SAMPLES	8
+
+/*
+ * Initializes the fit with the nominal refresh period in ns, which is used
+ * to count vsyncs until enough events are collected.
+ */
+void vsync_fit_init(struct vsync_fit *fit, double nominal_period)
+{
+	memset(fit, 0, sizeof(*fit));
+	fit->nominal_period = nominal_period;
+	fit->period = nominal_period;
+}
+
+/*
+ * Fits time over count with a least squares regression, relative to the
+ * oldest event to keep the sums well conditioned.
+ */
+static void vsync_fit_update(struct vsync_fit *fit)
+{
+	unsigned int n = fit->num_samples;
+	unsigned int first = (fit->next_sample + VSYNC_FIT_SAMPLES - n) %
+			     VSYNC_FIT_SAMPLES;
+	uint64_t count0 = fit->counts[first];
+	uint64_t time0 = fit->times[first];
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	double slope, intercept, d, x, y, r, sum = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < n; i++) {
+		j = (first + i) % VSYNC_FIT_SAMPLES;
+		x = fit->counts[j] - count0;
+		y = (int64_t)(fit->times[j] - time0);
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	d = n * sxx - sx * sx;
+	if (n < VSYNC_FIT_MIN_SAMPLES || d <= 0)
+		return;
+
+	slope = (n * sxy - sx * sy) / d;
+	intercept = (sy - slope * sx) / n;
+
+	for (i = 0; i < n; i++) {
+		j = (first + i) % VSYNC_FIT_SAMPLES;
+		r = (int64_t)(fit->times[j] - time0) -
+		    (intercept + slope * (fit->counts[j] - count0));
+		sum += r * r;
+	}
+
+	fit->period = slope;
+	fit->time = time0 + llround(intercept + slope *
+				    (fit->count - count0));
+	fit->jitter = sqrt(sum / n);
+	fit->valid = true;
+}
+
+/*
+ * Drops all events, starting over with the next one. The refresh rate may
+ * have changed, so the period is measured from the first interval instead
+ * of assuming the nominal period.
+ */
+static void vsync_fit_restart(struct vsync_fit *fit)
+{
+	vsync_fit_init(fit, fit->nominal_period);
+	fit->measure_period = true;
+}
+
+/*
+ * Adds the host time in ns of a vsync event. Repeated reports of an event
+ * are ignored. Events that do not fall onto the refresh grid restart the
+ * fit, for example after a display mode change.
+ *
+ * Returns true if the fitted period and phase are valid.
+ */
+bool vsync_fit_add(struct vsync_fit *fit, uint64_t time)
+{
+	double elapsed;
+	int64_t n;
+
+	if (fit->num_samples && fit->measure_period) {
+		elapsed = (int64_t)(time - fit->last_time);
+		/* The same event may be reported more than once */
+		if (fabs(elapsed) < 0.25 * fit->nominal_period)
+			return fit->valid;
+		/* Accept periods from a quarter to four times the nominal one */
+		if (elapsed < 0 || elapsed > 4 * fit->nominal_period) {
+			vsync_fit_restart(fit);
+		} else {
+			fit->period = elapsed;
+			fit->measure_period = false;
+			fit->count++;
+		}
+	} else if (fit->num_samples) {
+		elapsed = (int64_t)(time - fit->last_time);
+		n = llround(elapsed / fit->period);
+		/* The same event may be reported more than once */
+		if (n == 0 && fabs(elapsed) < 0.25 * fit->period)
+			return fit->valid;
+		if (n < 1 || fabs(elapsed - n * fit->period) >
+			     0.25 * fit->period)
+			vsync_fit_restart(fit);
+		else
+			fit->count += n;
+	}
+
+	fit->last_time = time;
+	fit->times[fit->next_sample] = time;
+	fit->counts[fit->next_sample] = fit->count;
+	fit->next_sample = (fit->next_sample + 1) % VSYNC_FIT_SAMPLES;
+	if (fit->num_samples < VSYNC_FIT_SAMPLES)
+		fit->num_samples++;
+
+	vsync_fit_update(fit);
+
+	return fit->valid;
+}
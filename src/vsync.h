@@ -0,0 +1,43 @@
+/*
+ * Display vsync period and phase estimation
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __VSYNC_H__
+#define __VSYNC_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Number of vsync events the display timing is fitted to */
+#define VSYNC_FIT_SAMPLES	64
+
+/*
+ * Fits a line through the host times of the most recent vsync events over
+ * their vsync count, to obtain the display refresh period and the phase
+ * of the refresh cycle. Missed events are detected from the gap to the
+ * previous event and skipped in the count.
+ */
+struct vsync_fit {
+	double nominal_period;
+	uint64_t times[VSYNC_FIT_SAMPLES];
+	uint64_t counts[VSYNC_FIT_SAMPLES];
+	unsigned int num_samples;
+	unsigned int next_sample;
+	/* Count and host time in ns of the latest event */
+	uint64_t count;
+	uint64_t last_time;
+	/* Fitted period and time of the latest vsync, in ns */
+	double period;
+	uint64_t time;
+	/* RMS deviation of the events from the fit, in ns */
+	double jitter;
+	bool valid;
+	/* Set after a restart, until the next interval gives the period */
+	bool measure_period;
+};
+
+void vsync_fit_init(struct vsync_fit *fit, double nominal_period);
+bool vsync_fit_add(struct vsync_fit *fit, uint64_t time);
+
+#endif /* __VSYNC_H__ */
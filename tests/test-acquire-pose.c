@@ -0,0 +1,145 @@
+/*
+ * Tests pose acquisition from identified blobs without a prior pose
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blobwatch.h"
+#include "maths.h"
+#include "opencv.h"
+
+#define NUM_LEDS	16
+/* Only half of the LEDs are identified correctly */
+#define NUM_INLIERS	8
+#define MAX_HYPOTHESES	512
+#define NUM_SEEDS	8
+
+#define WIDTH		1280
+#define HEIGHT		960
+#define FOCAL_LENGTH	715.0
+
+/* Pose of the constellation, a rotation around the y axis and a translation */
+#define ANGLE		0.3
+#define TRANS_X		0.05
+#define TRANS_Y		-0.02
+#define TRANS_Z		0.6
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+		       #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/*
+ * Places the LEDs on an elliptic ring with varying depth, so that they are
+ * not coplanar.
+ */
+static void make_leds(vec3 *leds)
+{
+	int i;
+
+	for (i = 0; i < NUM_LEDS; i++) {
+		double phi = 2 * M_PI * i / NUM_LEDS;
+
+		leds[i].x = 0.08 * cos(phi);
+		leds[i].y = 0.05 * sin(phi);
+		leds[i].z = 0.02 * (i % 3);
+	}
+}
+
+/*
+ * Projects the LEDs into the camera. The first NUM_INLIERS blobs are at the
+ * projected LED positions, the others are misidentified and placed randomly.
+ */
+static void make_blobs(const vec3 *leds, struct blob *blobs)
+{
+	const double c = cos(ANGLE);
+	const double s = sin(ANGLE);
+	int i;
+
+	memset(blobs, 0, NUM_LEDS * sizeof(*blobs));
+	for (i = 0; i < NUM_LEDS; i++) {
+		double x = c * leds[i].x + s * leds[i].z + TRANS_X;
+		double y = leds[i].y + TRANS_Y;
+		double z = -s * leds[i].x + c * leds[i].z + TRANS_Z;
+
+		blobs[i].led_id = i;
+		if (i < NUM_INLIERS) {
+			blobs[i].x = lround(FOCAL_LENGTH * x / z + WIDTH / 2);
+			blobs[i].y = lround(FOCAL_LENGTH * y / z + HEIGHT / 2);
+		} else {
+			blobs[i].x = rand() % WIDTH;
+			blobs[i].y = rand() % HEIGHT;
+		}
+	}
+}
+
+/*
+ * With half of the identified LEDs being outliers, acquisition has to run
+ * several batches of hypotheses before it is confident to have found the
+ * pose. The best hypothesis of an earlier batch must survive the later
+ * ones, and the result must be reproducible for the same seed.
+ */
+static void test_multi_batch(void)
+{
+	dmat3 camera_matrix = { .m = {
+		FOCAL_LENGTH, 0.0, WIDTH / 2,
+		0.0, FOCAL_LENGTH, HEIGHT / 2,
+		0.0, 0.0, 1.0,
+	} };
+	double dist_coeffs[5] = { 0 };
+	struct blob blobs[NUM_LEDS];
+	vec3 leds[NUM_LEDS];
+	dquat rot, rot2;
+	dvec3 trans, trans2;
+	int hypotheses, hypotheses2;
+	double ratio, ratio2;
+	uint64_t seed;
+
+	make_leds(leds);
+	make_blobs(leds, blobs);
+
+	for (seed = 1; seed <= NUM_SEEDS; seed++) {
+		ratio = acquire_initial_pose(blobs, NUM_LEDS, leds, NUM_LEDS,
+					     &camera_matrix, dist_coeffs,
+					     &rot, &trans, MAX_HYPOTHESES,
+					     seed, &hypotheses);
+		CHECK(ratio >= (double)NUM_INLIERS / NUM_LEDS);
+		/* More than a single batch of 32 hypotheses */
+		CHECK(hypotheses > 32 && hypotheses <= MAX_HYPOTHESES);
+
+		CHECK(fabs(trans.x - TRANS_X) < 0.005);
+		CHECK(fabs(trans.y - TRANS_Y) < 0.005);
+		CHECK(fabs(trans.z - TRANS_Z) < 0.01);
+		CHECK(fabs(rot.x) < 0.01 && fabs(rot.z) < 0.01);
+		CHECK(fabs(fabs(rot.y) - sin(ANGLE / 2)) < 0.01);
+
+		ratio2 = acquire_initial_pose(blobs, NUM_LEDS, leds, NUM_LEDS,
+					      &camera_matrix, dist_coeffs,
+					      &rot2, &trans2, MAX_HYPOTHESES,
+					      seed, &hypotheses2);
+		CHECK(ratio2 == ratio);
+		CHECK(hypotheses2 == hypotheses);
+		CHECK(memcmp(&rot2, &rot, sizeof(rot)) == 0);
+		CHECK(memcmp(&trans2, &trans, sizeof(trans)) == 0);
+	}
+}
+
+int main(void)
+{
+	srand(1);
+
+	test_multi_batch();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,195 @@
+/*
+ * Tests device to host clock recovery with simulated timestamps
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "clock-recovery.h"
+
+#define FREQUENCY	48000000
+#define INTERVAL	100000000 /* ns */
+#define HOST_START	1000000000000ULL /* ns */
+/* Minimum transport delay, the lower envelope of all samples */
+#define MIN_DELAY	200000 /* ns */
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+		       #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/*
+ * Simulated device clock, running at rate ticks per second and starting at
+ * ticks0 at host time HOST_START.
+ */
+struct sim {
+	double rate;
+	uint64_t ticks0;
+	double t;
+};
+
+static uint32_t sim_ticks(const struct sim *sim, double t)
+{
+	return (uint32_t)(sim->ticks0 + (uint64_t)llround(t * sim->rate));
+}
+
+static uint64_t sim_host(double t)
+{
+	return HOST_START + (uint64_t)llround(t * 1e9);
+}
+
+/*
+ * Feeds samples every 125 µs for the given duration. Each sample arrives
+ * after the minimum delay plus an exponentially distributed extra delay
+ * with a mean of 1 ms.
+ */
+static void sim_run(struct sim *sim, struct clock_recovery *clock,
+		    double duration)
+{
+	double end = sim->t + duration;
+
+	for (; sim->t < end; sim->t += 125e-6) {
+		double delay = MIN_DELAY * 1e-9 -
+			       1e-3 * log((rand() + 1.0) / (RAND_MAX + 1.0));
+
+		clock_recovery_add_sample(clock, sim_ticks(sim, sim->t),
+					  sim_host(sim->t + delay));
+	}
+}
+
+/*
+ * Returns the error in ns of the host time recovered for a device timestamp
+ * taken 10 ms ago, relative to its true time plus the minimum delay.
+ */
+static double sim_error(const struct sim *sim, struct clock_recovery *clock)
+{
+	double t = sim->t - 0.01;
+	uint64_t host;
+
+	if (clock_recovery_to_host(clock, sim_ticks(sim, t), &host) < 0)
+		return INFINITY;
+
+	return (int64_t)(host - sim_host(t)) - MIN_DELAY;
+}
+
+static double sim_max_error(struct sim *sim, struct clock_recovery *clock,
+			    double duration)
+{
+	double err, max_err = 0;
+	double end = sim->t + duration;
+
+	while (sim->t < end) {
+		sim_run(sim, clock, 0.02);
+		err = fabs(sim_error(sim, clock));
+		if (err > max_err)
+			max_err = err;
+	}
+
+	return max_err;
+}
+
+/*
+ * The device clock wraps around a few seconds in, and runs 80 ppm fast.
+ * The fit must follow through the wraparound and sit on the lower envelope
+ * of the delayed samples, not on their mean.
+ */
+static void test_wraparound(void)
+{
+	struct sim sim = {
+		.rate = FREQUENCY * (1 + 80e-6),
+		.ticks0 = UINT32_MAX - 3ULL * FREQUENCY,
+	};
+	struct clock_recovery clock;
+	uint64_t host;
+	double err;
+
+	clock_recovery_init(&clock, FREQUENCY, INTERVAL);
+	CHECK(clock_recovery_to_host(&clock, 0, &host) == -EAGAIN);
+
+	sim_run(&sim, &clock, 2.0);
+	CHECK(clock.valid);
+
+	/* Across the wraparound, after ~3 s */
+	err = sim_max_error(&sim, &clock, 6.0);
+	printf("wraparound: max error %.1f us, rate error %.2f ppm\n",
+	       err * 1e-3, (1e9 / sim.rate / clock.ns_per_tick - 1) * 1e6);
+	CHECK(err < 20000);
+	CHECK(fabs(1e9 / sim.rate / clock.ns_per_tick - 1) < 5e-6);
+}
+
+/*
+ * The device clock resets to zero. Clock recovery must drop the old fit
+ * instead of extending timestamps across the jump, and converge again.
+ */
+static void test_reset(void)
+{
+	struct sim sim = {
+		.rate = FREQUENCY * (1 - 30e-6),
+		.ticks0 = 123456789,
+	};
+	struct clock_recovery clock;
+	double err;
+
+	clock_recovery_init(&clock, FREQUENCY, INTERVAL);
+	sim_run(&sim, &clock, 5.0);
+	CHECK(fabs(sim_error(&sim, &clock)) < 20000);
+
+	/* Restart the device clock from zero at the current time */
+	sim.ticks0 = (uint64_t)-llround(sim.t * sim.rate);
+	sim_run(&sim, &clock, 125e-6);
+	CHECK(!clock.valid);
+
+	sim_run(&sim, &clock, 2.0);
+	CHECK(clock.valid);
+	err = sim_max_error(&sim, &clock, 3.0);
+	printf("reset: max error after reset %.1f us\n", err * 1e-3);
+	CHECK(err < 20000);
+}
+
+/*
+ * With a fixed delay and no jitter, the fit must recover the host times
+ * exactly up to rounding, and the lower envelope is the delay itself.
+ */
+static void test_lower_envelope(void)
+{
+	struct clock_recovery clock;
+	uint64_t host;
+	double t;
+	int i;
+
+	clock_recovery_init(&clock, FREQUENCY, INTERVAL);
+	for (i = 0; i < 40000; i++) {
+		t = i * 125e-6;
+		/* Every other sample is 3 ms late */
+		clock_recovery_add_sample(&clock,
+					  (uint32_t)llround(t * FREQUENCY),
+					  sim_host(t) + MIN_DELAY +
+					  (i & 1) * 3000000);
+	}
+
+	CHECK(clock_recovery_to_host(&clock,
+				     (uint32_t)llround(t * FREQUENCY),
+				     &host) == 0);
+	CHECK(llabs((int64_t)(host - sim_host(t)) - MIN_DELAY) < 1000);
+	CHECK(fabs(clock.ns_per_tick * FREQUENCY / 1e9 - 1) < 1e-6);
+}
+
+int main(void)
+{
+	srand(1);
+
+	test_wraparound();
+	test_reset();
+	test_lower_envelope();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
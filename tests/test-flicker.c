@@ -0,0 +1,139 @@
+/*
+ * Tests LED identification from blob blinking patterns
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blobwatch.h"
+#include "flicker.h"
+#include "leds.h"
+
+#define NUM_LEDS	3
+#define AREA_OFF	100
+#define AREA_ON		200
+
+static uint16_t patterns[NUM_LEDS] = { 0x3a5, 0x0f3, 0x156 };
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+		       #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/*
+ * A single blob of the given LED, tracked across frames. The LED pattern bit
+ * for frame f is bit f % 10.
+ */
+struct sim {
+	struct leds leds;
+	struct blob blob;
+};
+
+static void sim_init(struct sim *sim)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->leds.model.num_points = NUM_LEDS;
+	sim->leds.patterns = patterns;
+	sim->blob.area = AREA_OFF;
+	sim->blob.led_id = -1;
+}
+
+static void sim_frame(struct sim *sim, int led, unsigned int frame,
+		      unsigned int skipped_frames)
+{
+	struct blob *b = &sim->blob;
+
+	b->last_area = b->area;
+	b->area = (patterns[led] >> (frame % 10)) & 1 ? AREA_ON : AREA_OFF;
+	flicker_process(b, 1, frame % 10, skipped_frames,
+			BLOBWATCH_FLICKER_HYSTERESIS, &sim->leds);
+	b->age++;
+}
+
+/* Returns the frame at which the LED was identified, or -1 */
+static int sim_run(struct sim *sim, int led, unsigned int start,
+		   unsigned int end, unsigned int skip_every)
+{
+	unsigned int frame, skipped = 0;
+
+	for (frame = start; frame < end; frame++) {
+		if (skip_every && frame % skip_every == 0) {
+			skipped++;
+			continue;
+		}
+		sim_frame(sim, led, frame, skipped);
+		skipped = 0;
+		if (sim->blob.led_id >= 0)
+			return frame;
+	}
+
+	return -1;
+}
+
+/* Without dropped frames, each LED is identified from a full pattern */
+static void test_continuous(void)
+{
+	struct sim sim;
+	int led;
+
+	for (led = 0; led < NUM_LEDS; led++) {
+		sim_init(&sim);
+		CHECK(sim_run(&sim, led, 0, 30, 0) >= 0);
+		CHECK(sim.blob.led_id == led);
+	}
+}
+
+/*
+ * Dropping every fourth frame must neither prevent identification nor
+ * lead to a wrong LED ID.
+ */
+static void test_dropped_frames(void)
+{
+	struct sim sim;
+	int led;
+
+	for (led = 0; led < NUM_LEDS; led++) {
+		sim_init(&sim);
+		CHECK(sim_run(&sim, led, 1, 60, 4) >= 0);
+		CHECK(sim.blob.led_id == led);
+	}
+}
+
+/*
+ * A single dropped frame after a full pattern was recorded keeps the
+ * history: the LED is identified again in the next frame.
+ */
+static void test_single_gap(void)
+{
+	struct sim sim;
+	unsigned int frame;
+	int led;
+
+	for (led = 0; led < NUM_LEDS; led++) {
+		sim_init(&sim);
+		for (frame = 0; frame < 30; frame++)
+			sim_frame(&sim, led, frame, 0);
+		CHECK(sim.blob.led_id == led);
+		sim.blob.led_id = -1;
+		sim_frame(&sim, led, 31, 1);
+		CHECK(sim.blob.pattern_valid != 0x3ff);
+		CHECK(sim.blob.led_id == led);
+	}
+}
+
+int main(void)
+{
+	test_continuous();
+	test_dropped_frames();
+	test_single_gap();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,149 @@
+/*
+ * Tests the vector kernels against scalar reference implementations
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ *
+ * The kernel table only contains the variants selected for this CPU. Run
+ * with OUVRT_CPU set to each level to test all variants.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+
+/* Lengths up to this cover all vector widths and tails */
+#define MAX_SHORT	300
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+		       #cond); \
+		failures++; \
+	} \
+} while (0)
+
+static int find_bright_ref(const uint8_t *p, int n, uint8_t threshold)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (p[i] > threshold)
+			break;
+	}
+
+	return i;
+}
+
+/*
+ * Calls find_bright on a copy of the row at the end of an exactly sized
+ * allocation, so that reads past the end are caught by memory checkers.
+ */
+static void check_find_bright(const struct kernels *k, const uint8_t *row,
+			      int n, uint8_t threshold)
+{
+	uint8_t *p = calloc(n ? n : 1, 1);
+	int ret;
+
+	memcpy(p, row, n);
+	ret = k->find_bright(p, n, threshold);
+	if (ret != find_bright_ref(p, n, threshold)) {
+		printf("find_bright(n = %d, threshold = %u): %d, expected %d\n",
+		       n, threshold, ret, find_bright_ref(p, n, threshold));
+		failures++;
+	}
+	free(p);
+}
+
+static void test_find_bright(const struct kernels *k)
+{
+	static const uint8_t thresholds[] = { 0, 1, 0x7f, 0x80, 0xfe, 0xff };
+	static const int widths[] = { 640, 752, 1280, 1296, 4095 };
+	uint8_t row[4096];
+	unsigned int t;
+	int n, i;
+
+	/* Dark rows, and single bright pixels at every position */
+	for (n = 0; n <= MAX_SHORT; n++) {
+		memset(row, 0x20, n);
+		check_find_bright(k, row, n, 0x40);
+		for (i = 0; i < n; i++) {
+			row[i] = 0xc0;
+			check_find_bright(k, row, n, 0x40);
+			row[i] = 0x20;
+		}
+	}
+
+	/*
+	 * Values around the signed and unsigned limits, to catch signed byte
+	 * comparisons.
+	 */
+	for (n = 0; n <= MAX_SHORT; n++) {
+		for (i = 0; i < n; i++)
+			row[i] = i & 1 ? 0x7f + i % 3 : 0xfe + i % 2;
+		for (t = 0; t < sizeof(thresholds); t++)
+			check_find_bright(k, row, n, thresholds[t]);
+	}
+
+	/* Random rows at short lengths and camera widths */
+	for (i = 0; i < 1000; i++) {
+		int j;
+
+		n = i < 500 ? rand() % (MAX_SHORT + 1) :
+			      widths[i % (sizeof(widths) / sizeof(widths[0]))];
+		for (j = 0; j < n; j++)
+			row[j] = rand() % 64 + (rand() % 512 == 0 ? 192 : 0);
+		check_find_bright(k, row, n, 0x40 + rand() % 0x80);
+	}
+}
+
+static void test_yuyv_to_gray(const struct kernels *k)
+{
+	uint8_t src[2 * 1300];
+	uint8_t *dst, *buf;
+	int n, i;
+
+	for (n = 0; n <= 1300; n = n < MAX_SHORT ? n + 1 : n + 97) {
+		for (i = 0; i < 2 * n; i++)
+			src[i] = rand();
+
+		/* Separate buffers, exactly sized */
+		buf = malloc(2 * n + 1);
+		dst = malloc(n + 1);
+		memcpy(buf, src, 2 * n);
+		k->yuyv_to_gray(dst, buf, n);
+		for (i = 0; i < n; i++) {
+			if (dst[i] != src[2 * i])
+				break;
+		}
+		CHECK(i == n);
+
+		/* In place */
+		k->yuyv_to_gray(buf, buf, n);
+		for (i = 0; i < n; i++) {
+			if (buf[i] != src[2 * i])
+				break;
+		}
+		CHECK(i == n);
+
+		free(dst);
+		free(buf);
+	}
+}
+
+int main(void)
+{
+	const struct kernels *k = kernels_get();
+	const char *level = getenv("OUVRT_CPU");
+
+	srand(1);
+
+	printf("Testing kernels for OUVRT_CPU=%s\n", level ? level : "(best)");
+	test_find_bright(k);
+	test_yuyv_to_gray(k);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
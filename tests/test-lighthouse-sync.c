@@ -0,0 +1,184 @@
+/*
+ * Tests the Lighthouse sync based clock alignment between watchmen
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lighthouse.h"
+
+/* Two base stations flash their sync pulses alternately at 120 Hz each */
+#define SYNC_PERIOD		(1.0 / 240)
+/* Aligned receivers must agree to within 1 µs */
+#define MAX_ERROR		(LIGHTHOUSE_CLOCK_HZ / 1000000)
+/* USB transfers arrive up to this late */
+#define MAX_DELAY_US		4000
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+		       #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/*
+ * A simulated watchman whose receiver clock runs at an offset and with a
+ * drift relative to true time.
+ */
+struct receiver {
+	struct lighthouse_watchman watchman;
+	double offset;
+	double drift;
+};
+
+static void receiver_init(struct receiver *rx, const char *name,
+			  double offset, double drift)
+{
+	memset(rx, 0, sizeof(*rx));
+	rx->watchman.name = name;
+	rx->offset = offset;
+	rx->drift = drift;
+	clock_recovery_init(&rx->watchman.clock, LIGHTHOUSE_CLOCK_HZ,
+			    LIGHTHOUSE_CLOCK_INTERVAL_NS);
+}
+
+static uint32_t receiver_ticks(struct receiver *rx, double t)
+{
+	return (uint64_t)llround(rx->offset +
+				 t * LIGHTHOUSE_CLOCK_HZ * (1 + rx->drift));
+}
+
+/* Reports the sync event of the given base station at true time t */
+static uint32_t receiver_sync(struct receiver *rx, int base, double t)
+{
+	uint32_t ticks = receiver_ticks(rx, t);
+	uint64_t host = llround(t * 1e9) + (rand() % MAX_DELAY_US) * 1000;
+
+	clock_recovery_add_sample(&rx->watchman.clock, ticks, host);
+	lighthouse_sync_add(&rx->watchman, &rx->watchman.base[base], ticks);
+
+	return ticks;
+}
+
+/*
+ * Feeds all receivers the sync events between start and end, in changing
+ * order, since the receivers report them with different delays.
+ */
+static double run(struct receiver **rxs, int n, double start, double end)
+{
+	double t;
+	int k, i;
+
+	for (t = start, k = 0; t < end; t += SYNC_PERIOD, k++) {
+		for (i = 0; i < n; i++)
+			receiver_sync(rxs[(i + k) % n], k & 1, t);
+	}
+
+	return t;
+}
+
+/*
+ * Returns the deviation of the common ticks of a receiver at true time t
+ * from the given linear common timebase.
+ */
+static int64_t common_error(struct receiver *rx, double t, double common0,
+			    double t0)
+{
+	uint64_t common;
+
+	if (lighthouse_sync_to_common(&rx->watchman, receiver_ticks(rx, t),
+				      &common) < 0)
+		return INT64_MAX;
+
+	return llround((double)common - common0 -
+		       (t - t0) * LIGHTHOUSE_CLOCK_HZ);
+}
+
+/*
+ * A second and third receiver drift against the first, which becomes the
+ * reference. Once aligned, all receivers must agree on the common time of
+ * an event. When the reference stops receiving, another receiver takes
+ * over without a jump in the common timebase.
+ */
+static void test_handover(void)
+{
+	struct receiver a, b, c;
+	struct receiver *rxs[3] = { &a, &b, &c };
+	uint64_t common;
+	double t, t0;
+
+	receiver_init(&a, "A", 1000, 0);
+	receiver_init(&b, "B", 123456789, 30e-6);
+	receiver_init(&c, "C", 4000000000.0, -20e-6);
+
+	t0 = t = run(rxs, 3, 1.0, 10.0);
+	CHECK(b.watchman.sync.valid);
+	CHECK(c.watchman.sync.valid);
+	CHECK(fabs(b.watchman.sync.drift * (1 + b.drift) + b.drift) < 1e-6);
+	CHECK(fabs(c.watchman.sync.drift * (1 + c.drift) + c.drift) < 1e-6);
+
+	CHECK(lighthouse_sync_to_common(&a.watchman, receiver_ticks(&a, t),
+					&common) == 0);
+	CHECK(llabs(common_error(&b, t, common, t)) <= MAX_ERROR);
+	CHECK(llabs(common_error(&c, t, common, t)) <= MAX_ERROR);
+
+	/* A stops receiving, B takes over after the timeout */
+	t = run(rxs + 1, 2, t, 20.0);
+	CHECK(b.watchman.sync.valid);
+	CHECK(c.watchman.sync.valid);
+	CHECK(llabs(common_error(&b, t, common, t0)) <= 2 * MAX_ERROR);
+	CHECK(llabs(common_error(&c, t, common, t0)) <= 2 * MAX_ERROR);
+
+	/* B is removed, C takes over */
+	lighthouse_sync_unregister(&b.watchman);
+	t = run(rxs + 2, 1, t, 22.0);
+	CHECK(c.watchman.sync.valid);
+	CHECK(llabs(common_error(&c, t, common, t0)) <= 2 * MAX_ERROR);
+
+	lighthouse_sync_unregister(&a.watchman);
+	lighthouse_sync_unregister(&c.watchman);
+}
+
+/*
+ * If the new reference was never aligned to the previous one, the common
+ * timebase continues via host time, to within the transport delays.
+ */
+static void test_unaligned_handover(void)
+{
+	struct receiver a, b;
+	struct receiver *rxs[2] = { &a, &b };
+	uint64_t common;
+	double t, t0;
+
+	receiver_init(&a, "A", 5000, 0);
+	receiver_init(&b, "B", 987654321, 50e-6);
+
+	t0 = t = run(rxs, 1, 1.0, 5.0);
+	CHECK(lighthouse_sync_to_common(&a.watchman, receiver_ticks(&a, t),
+					&common) == 0);
+	lighthouse_sync_unregister(&a.watchman);
+
+	t = run(rxs + 1, 1, t0 + 2.0, 10.0);
+	CHECK(b.watchman.sync.valid);
+	CHECK(llabs(common_error(&b, t0 + 2.5, common, t0)) <
+	      LIGHTHOUSE_CLOCK_HZ / 1000000 * MAX_DELAY_US * 2);
+
+	lighthouse_sync_unregister(&b.watchman);
+}
+
+int main(void)
+{
+	srand(1);
+
+	test_handover();
+	test_unaligned_handover();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
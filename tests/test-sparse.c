@@ -0,0 +1,146 @@
+/*
+ * Tests the sparse IR frame codec
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sparse.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+		       #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/*
+ * Fills the frame with a noisy dark background and a number of bright
+ * square blobs, some of which touch the frame borders.
+ */
+static void make_frame(uint8_t *frame, int width, int height,
+		       unsigned int seed)
+{
+	int i, x, y;
+
+	srand(seed);
+	for (i = 0; i < width * height; i++)
+		frame[i] = rand() % 0x60;
+
+	for (i = 0; i < 24; i++) {
+		int bx = rand() % width - 2;
+		int by = rand() % height - 2;
+		int size = 1 + rand() % 7;
+
+		for (y = by; y < by + size; y++) {
+			for (x = bx; x < bx + size; x++) {
+				if (x < 0 || y < 0 || x >= width || y >= height)
+					continue;
+				frame[y * width + x] = 0xa0 + rand() % 0x60;
+			}
+		}
+	}
+
+	/* Bright pixels in all corners and a fully bright last row */
+	frame[0] = 0xff;
+	frame[width - 1] = 0xff;
+	frame[(height - 1) * width] = 0xff;
+	memset(frame + (height - 1) * width, 0xff, width);
+}
+
+/*
+ * Encodes and decodes a frame and checks that all bright pixels are kept
+ * and that no background pixel is decoded above the threshold.
+ */
+static void test_round_trip(int width, int height, uint8_t threshold,
+			    unsigned int seed)
+{
+	size_t size = sparse_encode_bound(width, height);
+	uint8_t *frame = malloc(width * height);
+	uint8_t *decoded = malloc(width * height);
+	uint8_t *buf = malloc(size);
+	uint64_t timestamp = 0;
+	int ret, i;
+
+	make_frame(frame, width, height, seed);
+
+	ret = sparse_encode(frame, width, height, threshold,
+			    0x0123456789abcdefULL, buf, size);
+	CHECK(ret > 0 && (size_t)ret <= size);
+	if (ret <= 0)
+		goto out;
+
+	memset(decoded, 0xaa, width * height);
+	CHECK(sparse_decode(buf, ret, decoded, width, height,
+			    &timestamp) == 0);
+	CHECK(timestamp == 0x0123456789abcdefULL);
+
+	for (i = 0; i < width * height; i++) {
+		if (frame[i] > threshold)
+			CHECK(decoded[i] == frame[i]);
+		else
+			CHECK(decoded[i] <= threshold);
+	}
+
+	/* Truncated or mismatched input must be rejected */
+	CHECK(sparse_decode(buf, ret - 1, decoded, width, height,
+			    &timestamp) == -EINVAL);
+	CHECK(sparse_decode(buf, sizeof(struct sparse_frame_header) - 1,
+			    decoded, width, height, &timestamp) == -EINVAL);
+	CHECK(sparse_decode(buf, ret, decoded, width + 1, height,
+			    &timestamp) == -EINVAL);
+
+	/* Encoding into a buffer that is too small must fail */
+	CHECK(sparse_encode(frame, width, height, threshold, 0, buf,
+			    ret - 1) == -ENOSPC);
+
+out:
+	free(buf);
+	free(decoded);
+	free(frame);
+}
+
+/*
+ * Checks the worst case bound, with every other pixel bright.
+ */
+static void test_bound(int width, int height)
+{
+	size_t size = sparse_encode_bound(width, height);
+	uint8_t *frame = malloc(width * height);
+	uint8_t *buf = malloc(size);
+	int i;
+
+	for (i = 0; i < width * height; i++)
+		frame[i] = (i % width) % 2 ? 0x00 : 0xff;
+
+	CHECK(sparse_encode(frame, width, height, 0x9f, 0, buf, size) > 0);
+
+	free(buf);
+	free(frame);
+}
+
+int main(void)
+{
+	unsigned int seed;
+
+	for (seed = 1; seed <= 8; seed++) {
+		/* Widths with and without partial blocks and fast spans */
+		test_round_trip(1280, 960, 0x9f, seed);
+		test_round_trip(752, 480, 0x9f, seed);
+		test_round_trip(37, 23, 0x9f, seed);
+		/* Threshold below 0x7f disables the fast path */
+		test_round_trip(61, 45, 0x40, seed);
+	}
+
+	test_bound(1280, 960);
+	test_bound(17, 3);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
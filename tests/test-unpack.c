@@ -0,0 +1,316 @@
+/*
+ * Tests the packed report field decoding helpers
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unpack.h"
+
+/* Size of the HID reports fed to the decoders */
+#define REPORT_SIZE	64
+/* Number of pseudo-random reports checked in addition to captured ones */
+#define NUM_REPORTS	10000
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+		       #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/*
+ * Packs three signed 21-bit values into a big-endian 64-bit value the way
+ * the Rift DK2/CV1 reports them, for comparison with the decoder.
+ */
+static __be64 pack_3x21bit_be(int32_t x, int32_t y, int32_t z)
+{
+	const uint64_t mask = (1ULL << 21) - 1;
+
+	return __cpu_to_be64(((uint64_t)(x & mask) << 43) |
+			     ((uint64_t)(y & mask) << 22) |
+			     ((uint64_t)(z & mask) << 1));
+}
+
+static void test_3x21bit(void)
+{
+	static const int32_t values[] = {
+		0, 1, -1, 2, -2, 0x0fffff, -0x100000, 0x0ffffe, -0x0fffff,
+		12345, -54321,
+	};
+	const unsigned int n = sizeof(values) / sizeof(values[0]);
+	unsigned int i, j, k;
+	int32_t xyz[3];
+	__be64 packed;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n; j++) {
+			for (k = 0; k < n; k++) {
+				packed = pack_3x21bit_be(values[i], values[j],
+							 values[k]);
+				unpack_3x21bit_be(packed, xyz);
+				CHECK(xyz[0] == values[i]);
+				CHECK(xyz[1] == values[j]);
+				CHECK(xyz[2] == values[k]);
+			}
+		}
+	}
+
+	/* The lowest bit is padding and must not leak into z */
+	unpack_3x21bit_be(__cpu_to_be64(1), xyz);
+	CHECK(xyz[0] == 0 && xyz[1] == 0 && xyz[2] == 0);
+
+	/* All ones is -1 in each field */
+	unpack_3x21bit_be(__cpu_to_be64(~0ULL), xyz);
+	CHECK(xyz[0] == -1 && xyz[1] == -1 && xyz[2] == -1);
+
+	/* Field boundaries: only the sign bit of each field set */
+	unpack_3x21bit_be(__cpu_to_be64(1ULL << 63), xyz);
+	CHECK(xyz[0] == -0x100000 && xyz[1] == 0 && xyz[2] == 0);
+	unpack_3x21bit_be(__cpu_to_be64(1ULL << 42), xyz);
+	CHECK(xyz[0] == 0 && xyz[1] == -0x100000 && xyz[2] == 0);
+	unpack_3x21bit_be(__cpu_to_be64(1ULL << 21), xyz);
+	CHECK(xyz[0] == 0 && xyz[1] == 0 && xyz[2] == -0x100000);
+}
+
+/*
+ * Places the two 12-bit fields of a WMR motion controller thumbstick in the
+ * last three bytes of an exactly sized heap buffer, so that reads past the
+ * end are caught by memory checkers.
+ */
+static void test_2x12bit_at_end(void)
+{
+	static const uint16_t values[][2] = {
+		{ 0x000, 0x000 }, { 0xfff, 0x000 }, { 0x000, 0xfff },
+		{ 0xfff, 0xfff }, { 0x800, 0x7ff }, { 0x123, 0xabc },
+	};
+	const unsigned int n = sizeof(values) / sizeof(values[0]);
+	const size_t len = 16;
+	uint8_t *buf = malloc(len);
+	uint16_t stick[2];
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		uint8_t *p = buf + len - 3;
+
+		memset(buf, 0xa5, len);
+		p[0] = values[i][0] & 0xff;
+		p[1] = (values[i][0] >> 8) | ((values[i][1] & 0xf) << 4);
+		p[2] = values[i][1] >> 4;
+
+		unpack_le_bitfields(p, 12, 2, stick);
+		CHECK(stick[0] == values[i][0]);
+		CHECK(stick[1] == values[i][1]);
+	}
+
+	/* Neighbouring bytes must not leak into the fields */
+	memset(buf, 0xff, len);
+	buf[len - 3] = 0;
+	buf[len - 2] = 0;
+	buf[len - 1] = 0;
+	unpack_le_bitfields(buf + len - 3, 12, 2, stick);
+	CHECK(stick[0] == 0 && stick[1] == 0);
+
+	free(buf);
+}
+
+/*
+ * Places the 10-bit Touch trigger/grip/stick fields in the last five bytes
+ * of an exactly sized heap buffer.
+ */
+static void test_4x10bit_at_end(void)
+{
+	const size_t len = 5;
+	uint8_t *buf = malloc(len);
+	uint16_t tgs[4];
+
+	/* 0x3ff, 0x000, 0x155, 0x2aa */
+	buf[0] = 0xff;
+	buf[1] = 0x03;
+	buf[2] = 0x50;
+	buf[3] = 0x95;
+	buf[4] = 0xaa;
+	unpack_le_bitfields(buf, 10, 4, tgs);
+	CHECK(tgs[0] == 0x3ff);
+	CHECK(tgs[1] == 0x000);
+	CHECK(tgs[2] == 0x155);
+	CHECK(tgs[3] == 0x2aa);
+
+	free(buf);
+}
+
+/*
+ * Places three signed 24-bit values in the last nine bytes of an exactly
+ * sized heap buffer.
+ */
+static void test_3x24bit_at_end(void)
+{
+	const size_t len = 9;
+	uint8_t *buf = malloc(len);
+	int32_t out[3];
+
+	/* 0x7fffff, -0x800000, -1 */
+	memcpy(buf, "\xff\xff\x7f\x00\x00\x80\xff\xff\xff", len);
+	unpack_3x24bit_le(buf, out);
+	CHECK(out[0] == 0x7fffff);
+	CHECK(out[1] == -0x800000);
+	CHECK(out[2] == -1);
+
+	free(buf);
+}
+
+/*
+ * Decodes the packed fields of a report both with the open-coded expressions
+ * the device drivers used before the unpack helpers were introduced, and
+ * with the helpers, at the offsets the drivers use them.
+ */
+static void check_report(const uint8_t *buf)
+{
+	__le16 gyro[REPORT_SIZE / 2];
+	uint16_t fields[4];
+	int32_t xyz[3];
+	__be64 be;
+	int i, j;
+
+	/* WMR motion controller thumbstick */
+	unpack_le_bitfields(buf + 2, 12, 2, fields);
+	CHECK(fields[0] == (buf[2] | ((buf[3] & 0xf) << 8)));
+	CHECK(fields[1] == (((buf[3] & 0xf0) >> 4) | (buf[4] << 4)));
+
+	/*
+	 * WMR motion controller accelerometer and gyroscope. The drivers
+	 * shifted the sign extended high byte, which is undefined for
+	 * negative values, so it is multiplied here.
+	 */
+	unpack_3x24bit_le(buf + 9, xyz);
+	CHECK(xyz[0] == (buf[9] | (buf[10] << 8) | (int8_t)buf[11] * 65536));
+	CHECK(xyz[1] == (buf[12] | (buf[13] << 8) | (int8_t)buf[14] * 65536));
+	CHECK(xyz[2] == (buf[15] | (buf[16] << 8) | (int8_t)buf[17] * 65536));
+	unpack_3x24bit_le(buf + 20, xyz);
+	CHECK(xyz[0] == (buf[20] | (buf[21] << 8) | (int8_t)buf[22] * 65536));
+	CHECK(xyz[1] == (buf[23] | (buf[24] << 8) | (int8_t)buf[25] * 65536));
+	CHECK(xyz[2] == (buf[26] | (buf[27] << 8) | (int8_t)buf[28] * 65536));
+
+	/* WMR motion controller timestamp, without the signed overflow */
+	CHECK(unpack_le_bytes(buf + 29, 4) ==
+	      (buf[29] | (buf[30] << 8) | (buf[31] << 16) |
+	       ((uint32_t)buf[32] << 24)));
+
+	/* Touch trigger, grip, and stick */
+	for (i = 0; i + 5 <= REPORT_SIZE; i += 5) {
+		const uint8_t *tgs = buf + i;
+
+		unpack_le_bitfields(tgs, 10, 4, fields);
+		CHECK(fields[0] == (tgs[0] | ((tgs[1] & 0x03) << 8)));
+		CHECK(fields[1] ==
+		      (((tgs[1] & 0xfc) >> 2) | ((tgs[2] & 0x0f) << 6)));
+		CHECK(fields[2] ==
+		      (((tgs[2] & 0xf0) >> 4) | ((tgs[3] & 0x3f) << 4)));
+		CHECK(fields[3] ==
+		      (((tgs[3] & 0xc0) >> 6) | ((tgs[4] & 0xff) << 2)));
+	}
+
+	/* Rift DK2/CV1 accelerometer and gyroscope samples */
+	for (i = 0; i + 8 <= REPORT_SIZE; i += 8) {
+		uint64_t v;
+
+		memcpy(&be, buf + i, sizeof(be));
+		v = __be64_to_cpu(be);
+		unpack_3x21bit_be(be, xyz);
+		CHECK(xyz[0] == (int64_t)v >> 43);
+		CHECK(xyz[1] == (int64_t)(v << 21) >> 43);
+		CHECK(xyz[2] == (int64_t)(v << 42) >> 43);
+	}
+
+	/* HoloLens 8x oversampled gyroscope */
+	memcpy(gyro, buf, sizeof(gyro));
+	for (i = 0; i < REPORT_SIZE / 2; i += 8) {
+		int32_t sum = 0;
+
+		for (j = 0; j < 8; j++)
+			sum += (int16_t)__le16_to_cpu(gyro[i + j]);
+		CHECK(unpack_sum_8x16bit_le(gyro + i) == sum);
+	}
+}
+
+/*
+ * Checks the decoders on reports captured from a hidraw device, for example
+ * with "cat /dev/hidrawN > reports.bin". Since the reports are only used as
+ * packed bytes, captures of any device can be used.
+ *
+ * Returns the number of reports checked, or -1 on error.
+ */
+static int test_capture(const char *path)
+{
+	uint8_t buf[REPORT_SIZE];
+	int count = 0;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		printf("%s: failed to open\n", path);
+		return -1;
+	}
+
+	while (fread(buf, REPORT_SIZE, 1, f) == 1) {
+		check_report(buf);
+		count++;
+	}
+
+	fclose(f);
+
+	return count;
+}
+
+/*
+ * Checks the decoders on pseudo-random reports, and on reports with all
+ * bits cleared, all bits set, and every field's sign bit set.
+ */
+static void test_reports(void)
+{
+	uint8_t buf[REPORT_SIZE];
+	int i, j;
+
+	memset(buf, 0x00, sizeof(buf));
+	check_report(buf);
+	memset(buf, 0xff, sizeof(buf));
+	check_report(buf);
+	memset(buf, 0x80, sizeof(buf));
+	check_report(buf);
+	memset(buf, 0x7f, sizeof(buf));
+	check_report(buf);
+
+	srand(1);
+	for (i = 0; i < NUM_REPORTS; i++) {
+		for (j = 0; j < REPORT_SIZE; j++)
+			buf[j] = rand();
+		check_report(buf);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int i, ret;
+
+	test_3x21bit();
+	test_2x12bit_at_end();
+	test_4x10bit_at_end();
+	test_3x24bit_at_end();
+	test_reports();
+
+	for (i = 1; i < argc; i++) {
+		ret = test_capture(argv[i]);
+		if (ret < 0)
+			failures++;
+		else
+			printf("%s: checked %d reports\n", argv[i], ret);
+	}
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/*
+ * Tests the varint and zigzag encoding helpers
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "varint.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+		       #cond); \
+		failures++; \
+	} \
+} while (0)
+
+static void test_zigzag(void)
+{
+	static const int64_t values[] = {
+		0, 1, -1, 2, -2, 63, -64, 64, -65,
+		INT32_MAX, INT32_MIN, INT64_MAX, INT64_MIN,
+		INT64_MAX - 1, INT64_MIN + 1,
+	};
+	unsigned int i;
+
+	/* Small magnitudes map to small codes, alternating in sign */
+	CHECK(zigzag_encode(0) == 0);
+	CHECK(zigzag_encode(-1) == 1);
+	CHECK(zigzag_encode(1) == 2);
+	CHECK(zigzag_encode(-2) == 3);
+	CHECK(zigzag_encode(INT64_MAX) == UINT64_MAX - 1);
+	CHECK(zigzag_encode(INT64_MIN) == UINT64_MAX);
+
+	for (i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+		CHECK(zigzag_decode(zigzag_encode(values[i])) == values[i]);
+}
+
+static void test_varint(void)
+{
+	static const uint64_t values[] = {
+		0, 1, 0x7f, 0x80, 0x3fff, 0x4000, UINT32_MAX,
+		(1ULL << 63) - 1, 1ULL << 63, UINT64_MAX,
+	};
+	static const int64_t signed_values[] = {
+		0, -1, 1, INT64_MIN, INT64_MAX,
+	};
+	struct varint_cursor c;
+	uint8_t buf[16];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		c = (struct varint_cursor){ buf, buf + sizeof(buf), false };
+		varint_put(&c, values[i]);
+		CHECK(!c.overflow);
+
+		c.end = c.p;
+		c.p = buf;
+		CHECK(varint_get(&c) == values[i]);
+		CHECK(!c.overflow);
+		CHECK(c.p == c.end);
+	}
+
+	/* 64-bit values take ten bytes */
+	c = (struct varint_cursor){ buf, buf + sizeof(buf), false };
+	varint_put(&c, UINT64_MAX);
+	CHECK(c.p - buf == 10);
+
+	for (i = 0; i < sizeof(signed_values) / sizeof(signed_values[0]); i++) {
+		c = (struct varint_cursor){ buf, buf + sizeof(buf), false };
+		varint_put_signed(&c, signed_values[i]);
+		CHECK(!c.overflow);
+
+		c.end = c.p;
+		c.p = buf;
+		CHECK(varint_get_signed(&c) == signed_values[i]);
+		CHECK(!c.overflow);
+	}
+}
+
+static void test_overflow(void)
+{
+	struct varint_cursor c;
+	uint8_t buf[16];
+	unsigned int i;
+
+	/* Encoding into a buffer one byte too short */
+	c = (struct varint_cursor){ buf, buf + 9, false };
+	varint_put(&c, UINT64_MAX);
+	CHECK(c.overflow);
+
+	/* Truncated input */
+	buf[0] = 0x80;
+	c = (struct varint_cursor){ buf, buf + 1, false };
+	varint_get(&c);
+	CHECK(c.overflow);
+
+	/* Continuation bits beyond 64 bits of payload */
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = 0xff;
+	c = (struct varint_cursor){ buf, buf + sizeof(buf), false };
+	CHECK(varint_get(&c) == 0);
+	CHECK(c.overflow);
+
+	/* Byte arrays must fit completely */
+	c = (struct varint_cursor){ buf, buf + 3, false };
+	varint_put_bytes(&c, "abcd", 4);
+	CHECK(c.overflow);
+	CHECK(c.p == buf);
+}
+
+int main(void)
+{
+	test_zigzag();
+	test_varint();
+	test_overflow();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+/*
+ * Tests the display vsync period and phase fit
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vsync.h"
+
+#define TIME_START	5000000000ULL /* ns */
+/* Event times are reported up to this late */
+#define MAX_JITTER	200000 /* ns */
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+		       #cond); \
+		failures++; \
+	} \
+} while (0)
+
+static uint64_t vsync_time(uint64_t start, double period, int i)
+{
+	return start + (uint64_t)llround(i * period);
+}
+
+/*
+ * The display runs slightly slower than the nominal 90 Hz. Every 37th event
+ * is missed, as are three events in a row once. The count must include the
+ * missed events, and the fit must recover period and phase.
+ */
+static void test_missed(void)
+{
+	const double period = 1e9 / 89.53;
+	struct vsync_fit fit;
+	uint64_t expected;
+	int added = 0;
+	int i;
+
+	vsync_fit_init(&fit, 1e9 / 90);
+	for (i = 0; i < 500; i++) {
+		if (i % 37 == 5 || (i >= 300 && i < 303))
+			continue;
+		vsync_fit_add(&fit, vsync_time(TIME_START, period, i) +
+				    rand() % MAX_JITTER);
+		if (++added < 8)
+			CHECK(!fit.valid);
+	}
+	i--;
+
+	CHECK(fit.valid);
+	CHECK(fit.count == (uint64_t)i);
+	CHECK(fabs(fit.period - period) < 1e-4 * period);
+
+	/* The fit passes through the middle of the jitter */
+	expected = vsync_time(TIME_START, period, i) + MAX_JITTER / 2;
+	CHECK(llabs((int64_t)(fit.time - expected)) < MAX_JITTER / 4);
+	CHECK(fit.jitter > 0 && fit.jitter < MAX_JITTER);
+}
+
+/*
+ * Repeated reports of the same event must neither advance the count nor
+ * enter the fit.
+ */
+static void test_duplicates(void)
+{
+	const double period = 1e9 / 90;
+	struct vsync_fit fit;
+	unsigned int num_samples;
+	uint64_t t;
+	int i;
+
+	vsync_fit_init(&fit, period);
+	for (i = 0; i < 100; i++) {
+		t = vsync_time(TIME_START, period, i);
+		vsync_fit_add(&fit, t);
+		num_samples = fit.num_samples;
+		CHECK(vsync_fit_add(&fit, t) == fit.valid);
+		CHECK(vsync_fit_add(&fit, t + period / 10) == fit.valid);
+		CHECK(fit.num_samples == num_samples);
+		CHECK(fit.count == (uint64_t)i);
+	}
+
+	CHECK(fit.valid);
+	CHECK(fabs(fit.period - period) < 1.0);
+	CHECK(fit.jitter < 1.0);
+}
+
+/*
+ * A display mode change from 90 Hz to 60 Hz puts events off the refresh
+ * grid. The fit must restart and converge to the new rate.
+ */
+static void test_rate_change(void)
+{
+	const double period90 = 1e9 / 90;
+	const double period60 = 1e9 / 60;
+	struct vsync_fit fit;
+	uint64_t start;
+	int i;
+
+	vsync_fit_init(&fit, period90);
+	for (i = 0; i < 100; i++)
+		vsync_fit_add(&fit, vsync_time(TIME_START, period90, i));
+	CHECK(fit.valid);
+	CHECK(fabs(fit.period - period90) < 1.0);
+
+	start = vsync_time(TIME_START, period90, 99);
+	for (i = 1; i <= 100; i++) {
+		vsync_fit_add(&fit, vsync_time(start, period60, i));
+		/* Not published until enough events at the new rate */
+		if (i < 8)
+			CHECK(!fit.valid);
+	}
+
+	CHECK(fit.valid);
+	CHECK(fabs(fit.period - period60) < 1.0);
+	CHECK(llabs((int64_t)(fit.time - vsync_time(start, period60, 100))) <
+	      1000);
+}
+
+int main(void)
+{
+	srand(1);
+
+	test_missed();
+	test_duplicates();
+	test_rate_change();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
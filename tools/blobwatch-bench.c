@@ -0,0 +1,124 @@
+/*
+ * Measures blob detection throughput on synthetic frames
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blobwatch.h"
+
+#define NUM_FRAMES	16
+#define MAX_INSTANCES	8
+
+/*
+ * Fills a frame with dark noise and num_blobs bright discs of varying size,
+ * shifted by a few pixels per frame index.
+ */
+static void fill_frame(uint8_t *frame, int width, int height, int num_blobs,
+		       int index)
+{
+	int i, x, y;
+
+	for (i = 0; i < width * height; i++)
+		frame[i] = rand() % 32;
+
+	for (i = 0; i < num_blobs; i++) {
+		int r = 2 + i % 5;
+		int cx = r + (i * 97 + index * 3) % (width - 2 * r);
+		int cy = r + (i * 61 + index * 2) % (height - 2 * r);
+
+		for (y = -r; y <= r; y++) {
+			for (x = -r; x <= r; x++) {
+				if (x * x + y * y <= r * r)
+					frame[(cy + y) * width + cx + x] = 255;
+			}
+		}
+	}
+}
+
+static double timespec_diff(const struct timespec *a,
+			    const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + 1e-9 * (b->tv_nsec - a->tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+	int width = argc > 1 ? atoi(argv[1]) : 1280;
+	int height = argc > 2 ? atoi(argv[2]) : 960;
+	int num_blobs = argc > 3 ? atoi(argv[3]) : 30;
+	int iterations = argc > 4 ? atoi(argv[4]) : 2000;
+	int instances = argc > 5 ? atoi(argv[5]) : 1;
+	struct blobwatch *bw[MAX_INSTANCES];
+	struct blobservation *ob;
+	struct timespec start, end;
+	unsigned long checksum = 0;
+	unsigned long found = 0;
+	uint8_t *frames;
+	double elapsed;
+	int i, j;
+
+	if (width < 64 || height < 64 || num_blobs < 0 || iterations <= 0 ||
+	    instances < 1 || instances > MAX_INSTANCES) {
+		fprintf(stderr, "usage: %s [WIDTH HEIGHT [BLOBS [ITERATIONS "
+			"[INSTANCES]]]]\n", argv[0]);
+		return 1;
+	}
+
+	/*
+	 * Multiple detector instances are run round-robin, like for multiple
+	 * cameras, so that their state competes for the caches.
+	 */
+	frames = malloc((size_t)NUM_FRAMES * width * height);
+	for (i = 0; i < instances; i++) {
+		bw[i] = blobwatch_new(width, height);
+		if (!bw[i])
+			break;
+	}
+	if (!frames || i < instances) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	srand(1);
+	for (i = 0; i < NUM_FRAMES; i++)
+		fill_frame(frames + (size_t)i * width * height, width, height,
+			   num_blobs, i);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		uint8_t *frame = frames +
+				 (size_t)(i % NUM_FRAMES) * width * height;
+
+		blobwatch_process(bw[i % instances], frame, width, height, 0,
+				  NULL, &ob);
+		if (!ob)
+			continue;
+
+		found += ob->num_blobs;
+		for (j = 0; j < ob->num_blobs; j++) {
+			checksum = checksum * 31 + ob->blobs[j].x;
+			checksum = checksum * 31 + ob->blobs[j].y;
+			checksum = checksum * 31 + ob->blobs[j].area;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = timespec_diff(&start, &end);
+	printf("%dx%d, %d blobs, %d instances: %.1f us/frame, "
+	       "%.1f Mpixel/s\n", width, height, num_blobs, instances,
+	       1e6 * elapsed / iterations,
+	       1e-6 * width * height * iterations / elapsed);
+	printf("%.1f blobs/frame, checksum %08lx\n",
+	       (double)found / iterations, checksum & 0xffffffff);
+
+	for (i = 0; i < instances; i++)
+		blobwatch_free(bw[i]);
+	free(frames);
+
+	return 0;
+}
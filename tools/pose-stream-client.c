@@ -0,0 +1,215 @@
+/*
+ * Receives and prints poses from the ouvrtd pose streaming server
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "pose-stream-proto.h"
+
+static struct pose_stream_state history[POSE_STREAM_HISTORY];
+static uint32_t newest;
+static uint64_t cookie;
+
+static void subscribe(int fd, struct sockaddr_in *addr, int rate,
+		      int redundancy)
+{
+	struct pose_stream_subscribe msg = {
+		.type = POSE_STREAM_SUBSCRIBE,
+		.version = POSE_STREAM_VERSION,
+		.rate = __cpu_to_le16(rate),
+		.redundancy = redundancy,
+		.ack = __cpu_to_le32(newest),
+		.cookie = __cpu_to_le64(cookie),
+	};
+
+	sendto(fd, &msg, sizeof(msg), 0, (struct sockaddr *)addr,
+	       sizeof(*addr));
+}
+
+static void print_state(uint32_t seq, const struct pose_stream_state *state)
+{
+	int i;
+
+	for (i = 0; i < POSE_STREAM_MAX_DEVICES; i++) {
+		const struct pose_stream_device *d = &state->device[i];
+
+		if (!(state->present & (1 << i)))
+			continue;
+
+		printf("%u dev %d t %.6f p [ %.4f %.4f %.4f ] "
+		       "q [ %.4f %.4f %.4f %.4f ] buttons 0x%08x\n", seq, i,
+		       1e-6 * d->time,
+		       d->position[0] / POSE_STREAM_POSITION_SCALE,
+		       d->position[1] / POSE_STREAM_POSITION_SCALE,
+		       d->position[2] / POSE_STREAM_POSITION_SCALE,
+		       d->orientation[0] / POSE_STREAM_ORIENTATION_SCALE,
+		       d->orientation[1] / POSE_STREAM_ORIENTATION_SCALE,
+		       d->orientation[2] / POSE_STREAM_ORIENTATION_SCALE,
+		       d->orientation[3] / POSE_STREAM_ORIENTATION_SCALE,
+		       d->buttons);
+	}
+}
+
+/*
+ * Forgets all received states, so that the next state packet is accepted
+ * regardless of its sequence number.
+ */
+static void reset_history(void)
+{
+	memset(history, 0, sizeof(history));
+	newest = 0;
+}
+
+/*
+ * Stores the cookie from a server challenge, to be echoed with the next
+ * subscription. A new cookie means a new subscription, possibly with a
+ * restarted server, which starts counting states from the beginning.
+ */
+static int receive_challenge(const uint8_t *packet, size_t len)
+{
+	struct pose_stream_challenge challenge;
+	uint64_t new_cookie;
+
+	if (len < sizeof(challenge))
+		return -1;
+	memcpy(&challenge, packet, sizeof(challenge));
+	if (challenge.version != POSE_STREAM_VERSION)
+		return -1;
+
+	new_cookie = __le64_to_cpu(challenge.cookie);
+	if (new_cookie != cookie) {
+		reset_history();
+		cookie = new_cookie;
+	}
+
+	return 0;
+}
+
+/*
+ * Decodes all states in the packet that are newer than the newest known one,
+ * oldest first, and stores them in the history.
+ */
+static int receive(const uint8_t *packet, size_t len)
+{
+	struct pose_stream_state_header header;
+	const struct pose_stream_state *baseline = NULL;
+	struct pose_stream_state states[POSE_STREAM_MAX_REDUNDANCY + 1];
+	const uint8_t *p = packet + sizeof(header);
+	uint32_t seq, base;
+	int i, n, ret;
+
+	if (len > 0 && packet[0] == POSE_STREAM_CHALLENGE)
+		return receive_challenge(packet, len);
+
+	if (len < sizeof(header))
+		return -1;
+	memcpy(&header, packet, sizeof(header));
+	if (header.type != POSE_STREAM_STATE ||
+	    header.version != POSE_STREAM_VERSION)
+		return -1;
+
+	seq = __le32_to_cpu(header.seq);
+	base = __le32_to_cpu(header.baseline);
+	/*
+	 * A server that lost our acknowledged state encodes against the zero
+	 * state. If it also restarted its sequence numbers, start over.
+	 */
+	if (!base && seq < newest)
+		reset_history();
+	if (base) {
+		if (base > newest || newest - base >= POSE_STREAM_HISTORY)
+			return -1;
+		baseline = &history[base % POSE_STREAM_HISTORY];
+	}
+
+	n = header.num_updates;
+	if (n > POSE_STREAM_MAX_REDUNDANCY + 1)
+		n = POSE_STREAM_MAX_REDUNDANCY + 1;
+	for (i = 0; i < n; i++) {
+		ret = pose_stream_decode_state(p, packet + len - p, baseline,
+					       &states[i]);
+		if (ret < 0)
+			return -1;
+		p += ret;
+	}
+
+	for (i = n - 1; i >= 0; i--) {
+		if (seq - i <= newest)
+			continue;
+		if (seq - i != newest + 1 && newest)
+			printf("lost %u states\n", seq - i - newest - 1);
+		history[(seq - i) % POSE_STREAM_HISTORY] = states[i];
+		newest = seq - i;
+		print_state(newest, &states[i]);
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(POSE_STREAM_DEFAULT_PORT),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	uint8_t packet[POSE_STREAM_MAX_PACKET];
+	struct pollfd pfd;
+	int rate = POSE_STREAM_DEFAULT_RATE;
+	int redundancy = 2;
+	ssize_t len;
+	int fd;
+
+	if (argc > 5 || (argc > 1 && argv[1][0] == '-')) {
+		fprintf(stderr, "usage: pose-stream-client [host [port [rate "
+			"[redundancy]]]]\n");
+		return -1;
+	}
+	if (argc > 1 && inet_pton(AF_INET, argv[1], &addr.sin_addr) != 1) {
+		fprintf(stderr, "invalid address '%s'\n", argv[1]);
+		return -1;
+	}
+	if (argc > 2)
+		addr.sin_port = htons(atoi(argv[2]));
+	if (argc > 3)
+		rate = atoi(argv[3]);
+	if (argc > 4)
+		redundancy = atoi(argv[4]);
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "failed to create socket\n");
+		return -1;
+	}
+
+	/* Only receive packets from the server */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "failed to connect socket\n");
+		return -1;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		subscribe(fd, &addr, rate, redundancy);
+
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+
+		len = recv(fd, packet, sizeof(packet), 0);
+		if (len > 0)
+			receive(packet, len);
+	}
+
+	return 0;
+}
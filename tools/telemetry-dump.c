@@ -0,0 +1,210 @@
+/*
+ * Receives and prints ouvrtd UDP telemetry
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "telemetry.h"
+#include "varint.h"
+
+static double get_fixed(struct varint_cursor *c, double scale)
+{
+	return varint_get_signed(c) / scale;
+}
+
+static void print_imu_sample(struct varint_cursor *c)
+{
+	unsigned int flags = varint_get(c);
+	double t, v[3];
+	int i;
+
+	t = get_fixed(c, TELEMETRY_TIME_SCALE);
+	printf(" t %.9f", t);
+	for (i = 0; i < 3; i++)
+		v[i] = get_fixed(c, TELEMETRY_ACCELERATION_SCALE);
+	printf(" acc [ %.4f %.4f %.4f ]", v[0], v[1], v[2]);
+	for (i = 0; i < 3; i++)
+		v[i] = get_fixed(c, TELEMETRY_ANGULAR_VELOCITY_SCALE);
+	printf(" gyro [ %.6f %.6f %.6f ]", v[0], v[1], v[2]);
+	if (flags & TELEMETRY_IMU_MAGNETIC_FIELD) {
+		for (i = 0; i < 3; i++)
+			v[i] = get_fixed(c, TELEMETRY_MAGNETIC_FIELD_SCALE);
+		printf(" mag [ %.6f %.6f %.6f ]", v[0], v[1], v[2]);
+	}
+	if (flags & TELEMETRY_IMU_TEMPERATURE)
+		printf(" temp %.2f", get_fixed(c, TELEMETRY_TEMPERATURE_SCALE));
+}
+
+static void print_lighthouse_frame(struct varint_cursor *c)
+{
+	uint32_t sync_timestamp, sync_duration, sync_ids, sweep_ids;
+	int i;
+
+	sync_timestamp = varint_get(c);
+	sync_duration = varint_get(c);
+	sync_ids = varint_get(c);
+	sweep_ids = varint_get(c);
+	printf(" sync %u +%u ids 0x%08x sweeps 0x%08x", sync_timestamp,
+	       sync_duration, sync_ids, sweep_ids);
+	for (i = 0; i < 32; i++) {
+		uint32_t offset, duration;
+
+		if (!(sweep_ids & (1U << i)))
+			continue;
+		offset = varint_get(c);
+		duration = varint_get(c);
+		printf(" %d:%u+%u", i, offset, duration);
+	}
+	printf(" frame %u", (uint32_t)varint_get(c));
+	if (varint_get(c))
+		printf(" common %llu", (unsigned long long)varint_get(c));
+}
+
+static void print_record(uint8_t type, uint8_t dev_id, uint8_t *payload,
+			 size_t len)
+{
+	struct varint_cursor c = { .p = payload, .end = payload + len };
+	unsigned int index, num;
+	size_t i;
+
+	printf("dev %u ", dev_id);
+
+	switch (type) {
+	case TELEMETRY_PACKET_RAW_BUFFER:
+		printf("raw");
+		for (i = 0; i < len; i++)
+			printf(" %02x", payload[i]);
+		break;
+	case TELEMETRY_PACKET_RAW_IMU_SAMPLE:
+		printf("raw imu t %lu", (unsigned long)varint_get(&c));
+		printf(" acc [ %ld", (long)varint_get_signed(&c));
+		printf(" %ld", (long)varint_get_signed(&c));
+		printf(" %ld ]", (long)varint_get_signed(&c));
+		printf(" gyro [ %ld", (long)varint_get_signed(&c));
+		printf(" %ld", (long)varint_get_signed(&c));
+		printf(" %ld ]", (long)varint_get_signed(&c));
+		break;
+	case TELEMETRY_PACKET_IMU_SAMPLE:
+		printf("imu");
+		print_imu_sample(&c);
+		break;
+	case TELEMETRY_PACKET_POSE:
+		printf("pose q [ %.6f",
+		       get_fixed(&c, TELEMETRY_ROTATION_SCALE));
+		printf(" %.6f", get_fixed(&c, TELEMETRY_ROTATION_SCALE));
+		printf(" %.6f", get_fixed(&c, TELEMETRY_ROTATION_SCALE));
+		printf(" %.6f ]", get_fixed(&c, TELEMETRY_ROTATION_SCALE));
+		printf(" t [ %.6f",
+		       get_fixed(&c, TELEMETRY_TRANSLATION_SCALE));
+		printf(" %.6f", get_fixed(&c, TELEMETRY_TRANSLATION_SCALE));
+		printf(" %.6f ]", get_fixed(&c, TELEMETRY_TRANSLATION_SCALE));
+		break;
+	case TELEMETRY_PACKET_LIGHTHOUSE_FRAME:
+		printf("lighthouse");
+		print_lighthouse_frame(&c);
+		break;
+	case TELEMETRY_PACKET_BUTTONS:
+		printf("buttons");
+		for (i = 0; i < len; i++)
+			printf(" %u", payload[i]);
+		break;
+	case TELEMETRY_PACKET_AXIS:
+		index = varint_get(&c);
+		num = varint_get(&c);
+		printf("axis %u", index);
+		for (i = 0; i < num && !c.overflow; i++)
+			printf(" %.5f", get_fixed(&c, TELEMETRY_AXIS_SCALE));
+		break;
+	default:
+		printf("unknown record type %u, %zu bytes", type, len);
+		break;
+	}
+
+	if (c.overflow)
+		printf(" (truncated)");
+	printf("\n");
+}
+
+/*
+ * Prints all records contained in a telemetry datagram.
+ */
+static int print_packet(uint8_t *packet, size_t len)
+{
+	struct telemetry_record_header record;
+	struct telemetry_header header;
+	uint8_t *p = packet + sizeof(header);
+	uint8_t *end = packet + len;
+	unsigned int i;
+	size_t record_len;
+
+	if (len < sizeof(header))
+		return -1;
+	memcpy(&header, packet, sizeof(header));
+	if (__le16_to_cpu(header.magic) != TELEMETRY_MAGIC ||
+	    header.version != TELEMETRY_VERSION) {
+		fprintf(stderr, "unsupported telemetry packet\n");
+		return -1;
+	}
+
+	for (i = 0; i < header.num_records; i++) {
+		if (end - p < (ssize_t)sizeof(record))
+			return -1;
+		memcpy(&record, p, sizeof(record));
+		p += sizeof(record);
+		record_len = __le16_to_cpu(record.len);
+		if ((size_t)(end - p) < record_len)
+			return -1;
+
+		printf("%u ", __le32_to_cpu(header.seq));
+		print_record(record.type, record.dev_id, p, record_len);
+		p += record_len;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(TELEMETRY_DEFAULT_PORT),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	uint8_t packet[TELEMETRY_MAX_PACKET];
+	ssize_t len;
+	int fd;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: telemetry-dump [port]\n");
+		return -1;
+	}
+	if (argc == 2)
+		addr.sin_port = htons(atoi(argv[1]));
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "failed to create socket\n");
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "failed to bind to port %u\n",
+			ntohs(addr.sin_port));
+		return -1;
+	}
+
+	for (;;) {
+		len = recv(fd, packet, sizeof(packet), 0);
+		if (len > 0)
+			print_packet(packet, len);
+	}
+
+	return 0;
+}